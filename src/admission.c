@@ -0,0 +1,68 @@
+/* Admission control for new connections
+ *
+ * A token bucket: tokens refill at `rate` per second up to `burst`, and every
+ * admitted connection takes one. A burst of joins is let in at once up to the
+ * bucket size, and after that at the steady rate. When the bucket is empty the
+ * caller is told when to come back instead of the connection just being dropped.
+ *
+ * Turned-away clients are each given their own retry slot, spaced 1/rate
+ * apart, so a burst that overflows the bucket comes back spread out at the
+ * rate it can be admitted, instead of all at once when the next token is due.
+ *
+ * Times are passed in by the caller (in milliseconds from any fixed point), so
+ * the bucket doesn't depend on a particular clock.
+ */
+#include "admission.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Make a bucket that starts full.
+ *
+ * Returned pointer should be freed with admission_free.
+ */
+Admission *admission_new(double rate, double burst, int64_t now_ms) {
+  Admission *adm = malloc(sizeof(Admission));
+  adm->rate = rate;
+  adm->burst = burst < 1 ? 1 : burst;
+  adm->tokens = adm->burst;
+  adm->last_ms = now_ms;
+  adm->promised_ms = now_ms;
+  adm->admitted = 0;
+  adm->rejected = 0;
+  return adm;
+}
+
+/* Try to admit a connection at time now_ms.
+ *
+ * Returns: 0 if admitted, otherwise the milliseconds until one would be
+ */
+int admission_take(Admission *adm, int64_t now_ms) {
+  if (adm->rate <= 0) {
+    adm->admitted++;
+    return 0;
+  }
+  if (now_ms > adm->last_ms) {
+    adm->tokens += (now_ms - adm->last_ms) * adm->rate / 1000;
+    if (adm->tokens > adm->burst) {
+      adm->tokens = adm->burst;
+    }
+    adm->last_ms = now_ms;
+  }
+  if (adm->tokens >= 1) {
+    adm->tokens -= 1;
+    adm->admitted++;
+    return 0;
+  }
+  adm->rejected++;
+  // the next free slot after both the next token and the last promised slot
+  int64_t slot = now_ms + (int64_t)((1 - adm->tokens) * 1000 / adm->rate);
+  if (slot < adm->promised_ms + 1000 / adm->rate) {
+    slot = adm->promised_ms + 1000 / adm->rate;
+  }
+  adm->promised_ms = slot;
+  // round up so a client retrying on time finds its token
+  return slot - now_ms + 1;
+}
+
+void admission_free(Admission *adm) { free(adm); }
@@ -0,0 +1,19 @@
+#ifndef admission_h
+#define admission_h
+
+#include <stdint.h>
+
+typedef struct {
+  double rate;       // connections admitted per second (0 for no limit)
+  double burst;      // most connections admitted at once
+  double tokens;     // connections that can be admitted right now
+  int64_t last_ms;   // time tokens were last refilled
+  int64_t promised_ms;  // latest retry time given to a rejected connection
+  long admitted, rejected;
+} Admission;
+
+Admission *admission_new(double rate, double burst, int64_t now_ms);
+int admission_take(Admission *adm, int64_t now_ms);
+void admission_free(Admission *adm);
+
+#endif
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "admission.h"
+#include "lib/minunit.h"
+
+static Admission *adm;
+
+void test_setup(void) { adm = admission_new(10, 5, 1000); }
+
+void test_teardown(void) { admission_free(adm); }
+
+MU_TEST(test_admission_burst) {
+  // a full bucket lets a burst in at once
+  for (int i = 0; i < 5; i++) {
+    mu_assert_int_eq(0, admission_take(adm, 1000));
+  }
+  // then one token every 100ms
+  mu_assert_int_eq(101, admission_take(adm, 1000));
+  mu_assert(admission_take(adm, 1050) > 0, "Should still be empty");
+  mu_assert_int_eq(0, admission_take(adm, 1100));
+  mu_assert_int_eq(6, adm->admitted);
+  mu_assert_int_eq(2, adm->rejected);
+}
+
+MU_TEST(test_admission_refill_cap) {
+  for (int i = 0; i < 5; i++) {
+    admission_take(adm, 1000);
+  }
+  // a long quiet period only refills up to the burst size
+  for (int i = 0; i < 5; i++) {
+    mu_assert_int_eq(0, admission_take(adm, 100000));
+  }
+  mu_assert(admission_take(adm, 100000) > 0, "Should be capped at burst");
+}
+
+MU_TEST(test_admission_retry_after) {
+  for (int i = 0; i < 5; i++) {
+    admission_take(adm, 1000);
+  }
+  // waiting as long as asked is always enough
+  int wait = admission_take(adm, 1000);
+  mu_assert_int_eq(0, admission_take(adm, 1000 + wait));
+}
+
+MU_TEST(test_admission_retry_spread) {
+  for (int i = 0; i < 5; i++) {
+    admission_take(adm, 1000);
+  }
+  // clients turned away together are told to come back one token apart
+  mu_assert_int_eq(101, admission_take(adm, 1000));
+  mu_assert_int_eq(201, admission_take(adm, 1000));
+  mu_assert_int_eq(301, admission_take(adm, 1000));
+  // and each finds a token when it does
+  mu_assert_int_eq(0, admission_take(adm, 1101));
+  mu_assert_int_eq(0, admission_take(adm, 1201));
+  mu_assert_int_eq(0, admission_take(adm, 1301));
+}
+
+MU_TEST(test_admission_unlimited) {
+  Admission *open = admission_new(0, 0, 0);
+  for (int i = 0; i < 1000; i++) {
+    mu_assert_int_eq(0, admission_take(open, 0));
+  }
+  admission_free(open);
+}
+
+MU_TEST_SUITE(admission_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_admission_burst);
+  MU_RUN_TEST(test_admission_refill_cap);
+  MU_RUN_TEST(test_admission_retry_after);
+  MU_RUN_TEST(test_admission_retry_spread);
+  MU_RUN_TEST(test_admission_unlimited);
+}
+
+int main(int argc, char const *argv[]) {
+  MU_RUN_SUITE(admission_main);
+  MU_REPORT();
+  return minunit_status;
+}
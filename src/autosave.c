@@ -0,0 +1,197 @@
+/* Periodic autosave to a sidecar file
+ *
+ * The sidecar ("FILE.autosave") holds the canvas in a fixed-width layout: every
+ * row is `num_cols` characters followed by a newline, so row y always starts at
+ * byte y * (num_cols + 1). Saving only has to `pwrite` the rows that are dirty
+ * since the last save, instead of rewriting the whole file.
+ *
+ * The layout is the same as `canvas_fprint`, so a sidecar left behind by a
+ * crash can be opened like any other file.
+ *
+ * The sidecar only exists while the canvas has changes the savefile doesn't:
+ * it's made on the first save after an edit, and removed once the canvas is
+ * saved to the savefile (compacted into its trimmed text format). Exiting
+ * leaves both alone, so unsaved changes are recovered from the sidecar next
+ * time instead of being written over the savefile unasked.
+ */
+#include "autosave.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "canvas.h"
+#include "util.h"
+
+/* Get the path of the sidecar file for a savefile.
+ *
+ * Returned pointer should be freed.
+ */
+char *autosave_path(const char *filepath) {
+  const char suffix[] = ".autosave";
+  char *path = malloc(strlen(filepath) + sizeof(suffix));
+  strcpy(path, filepath);
+  strcat(path, suffix);
+  return path;
+}
+
+/* Start autosaving a savefile every interval seconds, into the sidecar left
+ * behind for it if there is one.
+ *
+ * Returned pointer should be freed with autosave_free. Returns NULL if the
+ * sidecar can't be opened.
+ */
+Autosave *autosave_new(const char *filepath, int interval) {
+  Autosave *autosave = malloc(sizeof(Autosave));
+  autosave->path = autosave_path(filepath);
+  autosave->target = strdup(filepath);
+  autosave->fd = open(autosave->path, O_WRONLY);
+  if (autosave->fd < 0 && errno != ENOENT) {
+    perror("autosave open");
+    autosave_free(autosave);
+    return NULL;
+  }
+  autosave->interval = interval;
+  autosave->last_save = time(NULL);
+  autosave->num_rows = -1;
+  autosave->num_cols = -1;
+  autosave->canvas = NULL;
+  return autosave;
+}
+
+/* Rewrite the whole sidecar for the layout of canvas.
+ *
+ * Returns: the number of bytes written, or -1 on error
+ */
+static int autosave_layout(Autosave *autosave, Canvas *canvas) {
+  const int width = canvas->num_cols + 1;
+  if (ftruncate(autosave->fd, (off_t)width * canvas->num_rows) < 0) {
+    perror("autosave ftruncate");
+    return -1;
+  }
+  char *line = malloc(width);
+  line[width - 1] = '\n';
+  int total = 0;
+  for (int y = 0; y < canvas->num_rows; y++) {
+    memcpy(line, canvas->rows[y], canvas->num_cols);
+    if (pwrite(autosave->fd, line, width, (off_t)width * y) != width) {
+      perror("autosave pwrite");
+      free(line);
+      return -1;
+    }
+    total += width;
+  }
+  free(line);
+  autosave->num_rows = canvas->num_rows;
+  autosave->num_cols = canvas->num_cols;
+  autosave->canvas = canvas;
+  return total;
+}
+
+/* Write the dirty rows of canvas to the sidecar and mark them clean, once
+ * they're on disk.
+ *
+ * The whole sidecar is written if there wasn't one yet, or if the canvas has
+ * been replaced or resized since the last save.
+ *
+ * Returns: the number of bytes written, or -1 on error (the rows stay dirty)
+ */
+int autosave_sync(Autosave *autosave, Canvas *canvas) {
+  autosave->last_save = time(NULL);
+  if (autosave->fd < 0) {
+    if (canvas->num_dirty == 0) {
+      return 0;
+    }
+    if ((autosave->fd = open(autosave->path, O_WRONLY | O_CREAT, 0644)) < 0) {
+      perror("autosave open");
+      return -1;
+    }
+    autosave->canvas = NULL;
+  }
+  int total = 0;
+  if (canvas != autosave->canvas || canvas->num_rows != autosave->num_rows ||
+      canvas->num_cols != autosave->num_cols) {
+    total = autosave_layout(autosave, canvas);
+  } else if (canvas->num_dirty > 0) {
+    const int width = canvas->num_cols + 1;
+    for (int y = 0; y < canvas->num_rows; y++) {
+      if (!canvas_isdirty_y(canvas, y)) {
+        continue;
+      }
+      // newlines are already in place
+      if (pwrite(autosave->fd, canvas->rows[y], canvas->num_cols,
+                 (off_t)width * y) != canvas->num_cols) {
+        perror("autosave pwrite");
+        return -1;
+      }
+      total += canvas->num_cols;
+    }
+  } else {
+    return 0;
+  }
+  if (total < 0) {
+    return total;
+  }
+  if (fdatasync(autosave->fd) < 0) {
+    perror("autosave fdatasync");
+    return -1;
+  }
+  canvas_clear_dirty(canvas);
+  logd("Autosaved %d bytes to '%s'\n", total, autosave->path);
+  return total;
+}
+
+/* Sync the sidecar if the autosave interval has passed.
+ *
+ * Meant to be called on every pass of the main loop.
+ *
+ * Returns: the number of bytes written, or -1 on error
+ */
+int autosave_tick(Autosave *autosave, Canvas *canvas) {
+  if (time(NULL) - autosave->last_save < autosave->interval) {
+    return 0;
+  }
+  return autosave_sync(autosave, canvas);
+}
+
+/* Save canvas to the savefile, in its trimmed text format, and remove the
+ * sidecar: there's nothing unsaved left to recover.
+ *
+ * Returns: the number of characters written, or a negative value on error (the
+ * sidecar is kept in that case)
+ */
+int autosave_finish(Autosave *autosave, Canvas *canvas) {
+  FILE *f = fopen(autosave->target, "w");
+  if (f == NULL) {
+    perror("autosave_finish");
+    return -1;
+  }
+  int res = canvas_fprint_trim(f, canvas);
+  if (fclose(f) != 0 || res < 0) {
+    return -1;
+  }
+  if (autosave->fd >= 0) {
+    close(autosave->fd);
+    autosave->fd = -1;
+    unlink(autosave->path);
+  }
+  canvas_clear_dirty(canvas);
+  return res;
+}
+
+/* Free an autosave object, closing the sidecar.
+ *
+ */
+void autosave_free(Autosave *autosave) {
+  if (autosave->fd >= 0) {
+    close(autosave->fd);
+  }
+  free(autosave->path);
+  free(autosave->target);
+  free(autosave);
+}
@@ -0,0 +1,25 @@
+#ifndef autosave_h
+#define autosave_h
+
+#include <time.h>
+
+#include "canvas.h"
+
+typedef struct {
+  char *path;    // path of the sidecar file
+  char *target;  // path of the savefile it is compacted into
+  int fd;
+  int interval;  // seconds between saves
+  time_t last_save;
+  int num_rows, num_cols;  // layout of the sidecar file
+  Canvas *canvas;          // canvas the sidecar was last laid out for
+} Autosave;
+
+Autosave *autosave_new(const char *filepath, int interval);
+char *autosave_path(const char *filepath);
+int autosave_sync(Autosave *autosave, Canvas *canvas);
+int autosave_tick(Autosave *autosave, Canvas *canvas);
+int autosave_finish(Autosave *autosave, Canvas *canvas);
+void autosave_free(Autosave *autosave);
+
+#endif
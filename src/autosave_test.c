@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "autosave.h"
+#include "canvas.h"
+#include "lib/minunit.h"
+#include "util.h"
+
+static char filepath[] = "/tmp/collascii_autosave_test.txt";
+static Autosave *as;
+static Canvas *c1;
+
+void test_setup(void) {
+  c1 = canvas_new(100, 200);
+  as = autosave_new(filepath, 0);
+}
+
+void test_teardown(void) {
+  unlink(as->path);
+  unlink(filepath);
+  autosave_free(as);
+  canvas_free(c1);
+}
+
+/* Check that the sidecar can be read back as the canvas.
+ */
+static int sidecar_eq(Canvas *canvas) {
+  FILE *f = fopen(as->path, "r");
+  Canvas *read = canvas_readf(f);
+  fclose(f);
+  int res = canvas_eq(canvas, read);
+  canvas_free(read);
+  return res;
+}
+
+MU_TEST(test_autosave_sync_layout) {
+  // the first save lays out the whole canvas
+  mu_assert_int_eq(100 * 201, autosave_sync(as, c1));
+  mu_assert_int_eq(0, c1->num_dirty);
+  mu_check(sidecar_eq(c1));
+
+  // nothing to do if nothing changed
+  mu_assert_int_eq(0, autosave_sync(as, c1));
+}
+
+MU_TEST(test_autosave_sync_dirty) {
+  autosave_sync(as, c1);
+  canvas_scharyx(c1, 3, 10, 'a');
+  canvas_scharyx(c1, 3, 11, 'b');
+  canvas_scharyx(c1, 99, 199, 'c');
+
+  // only the two dirty rows are written
+  mu_assert_int_eq(2 * 200, autosave_sync(as, c1));
+  mu_check(sidecar_eq(c1));
+}
+
+MU_TEST(test_autosave_sync_resize) {
+  autosave_sync(as, c1);
+  canvas_resize(&c1, 10, 20);
+  canvas_scharyx(c1, 0, 0, 'a');
+  mu_assert_int_eq(10 * 21, autosave_sync(as, c1));
+  mu_check(sidecar_eq(c1));
+}
+
+MU_TEST(test_autosave_sync_clean) {
+  // nothing to save: no sidecar
+  canvas_clear_dirty(c1);
+  mu_assert_int_eq(0, autosave_sync(as, c1));
+  mu_assert(access(as->path, F_OK) != 0, "Sidecar shouldn't be made");
+  // until there is
+  canvas_scharyx(c1, 3, 3, 'a');
+  mu_assert_int_eq(100 * 201, autosave_sync(as, c1));
+  mu_check(sidecar_eq(c1));
+}
+
+MU_TEST(test_autosave_finish) {
+  canvas_ldstryx(c1, "hello", 1, 1);
+  autosave_sync(as, c1);
+  mu_assert(autosave_finish(as, c1) > 0, "Should write to savefile");
+  mu_assert(access(as->path, F_OK) != 0, "Sidecar should be removed");
+  mu_assert_int_eq(0, c1->num_dirty);
+  // and made again for the next edit
+  canvas_scharyx(c1, 0, 0, 'b');
+  mu_assert_int_eq(100 * 201, autosave_sync(as, c1));
+  mu_check(sidecar_eq(c1));
+
+  // savefile has trailing spaces trimmed
+  FILE *f = fopen(filepath, "r");
+  Canvas *read = canvas_readf(f);
+  fclose(f);
+  mu_assert_int_eq(100, read->num_rows);
+  mu_assert_int_eq(6, read->num_cols);
+  canvas_free(read);
+}
+
+MU_TEST_SUITE(autosave_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_autosave_sync_layout);
+  MU_RUN_TEST(test_autosave_sync_dirty);
+  MU_RUN_TEST(test_autosave_sync_resize);
+  MU_RUN_TEST(test_autosave_sync_clean);
+  MU_RUN_TEST(test_autosave_finish);
+}
+
+int main(int argc, char const *argv[]) {
+  MU_RUN_SUITE(autosave_main);
+  MU_REPORT();
+  return minunit_status;
+}
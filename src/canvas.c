@@ -18,11 +18,14 @@
  */
 void canvas_fill(Canvas *canvas, char fill) {
   for (int i = 0; i < canvas->num_rows; i++) {
-    memset(canvas->rows[i], ' ', canvas->num_cols);
+    memset(canvas->rows[i], fill, canvas->num_cols);
+    canvas_mark_dirty_y(canvas, i);
   }
 }
 
 /* Create a canvas object
+ *
+ * Every row of a new canvas starts out dirty.
  *
  * Returned pointer should be freed with free_canvas
  */
@@ -34,16 +37,15 @@ Canvas *canvas_new(int rows, int cols) {
   for (int i = 0; i < rows; i++) {
     canvas->rows[i] = malloc(cols * sizeof(char));
   }
+  canvas->dirty = calloc(rows, sizeof(bool));
+  canvas->num_dirty = 0;
   canvas_fill(canvas, ' ');
   return canvas;
 }
 
 Canvas *canvas_new_blank(int rows, int cols) {
-  Canvas *canvas = canvas_new(rows, cols);
-  for (int i = 0; i < (rows * cols); i++) {
-    canvas_schari(canvas, i, ' ');
-  }
-  return canvas;
+  // canvas_new already fills with ' '
+  return canvas_new(rows, cols);
 }
 
 /* Create and return a deep copy of a canvas
@@ -109,6 +111,7 @@ void canvas_free(Canvas *canvas) {
   }
   // free array of rows
   free(canvas->rows);
+  free(canvas->dirty);
   // free struct itself
   free(canvas);
 }
@@ -137,6 +140,46 @@ int canvas_isin_i(Canvas *canvas, int i) {
   return (i >= 0 && i < canvas->num_rows * canvas->num_cols);
 }
 
+/* Test if row y has been written since the last canvas_clear_dirty.
+ */
+int canvas_isdirty_y(Canvas *canvas, int y) {
+  return canvas->dirty[y];
+}
+
+/* Mark every row as clean, e.g. after the canvas has been saved.
+ */
+void canvas_clear_dirty(Canvas *canvas) {
+  memset(canvas->dirty, false, canvas->num_rows * sizeof(bool));
+  canvas->num_dirty = 0;
+}
+
+/* Copy len chars from src to dest, skipping chars equal to transparent.
+ *
+ * Uses GCC vector extensions to compare and blend 16 chars at a time, which
+ * compile down to SIMD compare/and/or on targets that have them.
+ */
+static void blend_span(char *dest, const char *src, int len, char transparent) {
+  typedef char vchar __attribute__((vector_size(16)));
+  const vchar t = {transparent, transparent, transparent, transparent,
+                   transparent, transparent, transparent, transparent,
+                   transparent, transparent, transparent, transparent,
+                   transparent, transparent, transparent, transparent};
+  int i = 0;
+  for (; i + (int)sizeof(vchar) <= len; i += sizeof(vchar)) {
+    vchar s, d;
+    memcpy(&s, src + i, sizeof(vchar));
+    memcpy(&d, dest + i, sizeof(vchar));
+    const vchar mask = (s == t);  // all ones where src is transparent
+    d = (d & mask) | (s & ~mask);
+    memcpy(dest + i, &d, sizeof(vchar));
+  }
+  for (; i < len; i++) {
+    if (src[i] != transparent) {
+      dest[i] = src[i];
+    }
+  }
+}
+
 /* Load canvas source into dest at point (x, y).
  *
  * Any parts of source that fall outside of dest will not be copied.
@@ -158,6 +201,7 @@ int canvas_ldcanvasyx(Canvas *dest, Canvas *source, int y, int x) {
   // copy range over
   for (int i = 0; i < copy_height; i++) {
     memcpy(dest->rows[y + i] + x, source->rows[i], sizeof(char) * copy_width);
+    canvas_mark_dirty_y(dest, y + i);
   }
 
   // figure out if source canvas was truncated
@@ -187,16 +231,10 @@ int canvas_ldcanvasyxc(Canvas *dest, Canvas *source, int y, int x,
   const int copy_width = min(max_width, source->num_cols);
 
   logd("Copying %dx%d from to (%d, %d)\n", copy_height, copy_width, x, y);
-  // copy range over
-  char c;
+  // copy range over, skipping transparent chars
   for (int i = 0; i < copy_height; i++) {
-    for (int j = 0; j < copy_width; j++) {
-      c = source->rows[i][j];
-      if (c != transparent) {
-        // copy only if not transparent
-        dest->rows[y + i][x + j] = c;
-      }
-    }
+    blend_span(dest->rows[y + i] + x, source->rows[i], copy_width, transparent);
+    canvas_mark_dirty_y(dest, y + i);
   }
 
   // figure out if source canvas was truncated
@@ -357,80 +395,65 @@ inline Canvas *canvas_trim(Canvas *orig, int right, int bottom, int left,
                            int top) {
 }
 
-/* Set a single character at position (x, y)
- *
- * Top left of canvas is (0, 0).
- */
-void canvas_scharyx(Canvas *canvas, int y, int x, char c) {
-  assert(canvas_isin_yx(canvas, y, x));
-  canvas->rows[y][x] = c;
-}
-
-/* Set a single character with single index i
- *
- * Index starts at 0 at position (0, 0) and increments first horizontally.
- */
-void canvas_schari(Canvas *canvas, int i, char c) {
-  assert(canvas_isin_i(canvas, i));
-  int row = i / canvas->num_cols;
-  int col = i % canvas->num_cols;
-  canvas->rows[row][col] = c;
-}
-
-/* Get the character at position (x, y)
- *
- */
-char canvas_gcharyx(Canvas *canvas, int y, int x) {
-  assert(canvas_isin_yx(canvas, y, x));
-  return canvas->rows[y][x];
-}
-
-/* Get the character at index i
- *
- */
-char canvas_gchari(Canvas *canvas, int i) {
-  assert(canvas_isin_i(canvas, i));
-  int row = i / canvas->num_cols;
-  int col = i % canvas->num_cols;
-  return canvas->rows[row][col];
-}
-
 /* Load str into canvas as point (x, y), ignoring char transparent.
  *
  * Newlines ('\n') cause the canvas to wrap to the beginning of the next line
- * (like in normal text).
+ * (like in normal text). Lines that run past the right edge of the canvas also
+ * wrap to x on the next line.
  *
  * Stops when the canvas is full or it reaches the null character ('\0').
  *
- * Returns: the number of characters written
+ * Works a span at a time: each line is found with `memchr`, clipped to the
+ * canvas once, and copied in (or blended, if there is a transparent char).
  *
- * TODO: write test_canvas_ldstryxc
+ * Returns: the number of characters written, or 0 if (x, y) is off the canvas
  */
 int canvas_ldstryxc(Canvas *canvas, char *str, int y, int x, char transparent) {
-  int col = x;
+  if (!canvas_isin_yx(canvas, y, x)) {
+    return 0;
+  }
+  const char *end = str + strlen(str);
+  const char *line_end = NULL;  // next '\n' (or end) at or after p
+  const char *p = str;
   int row = y;
-  int i;
-  for (i = 0; str[i] != '\0'; i++) {
+  int col = x;
+  while (p < end) {
+    // skip newline chars
+    if (*p == '\n') {
+      row++;
+      col = x;
+      p++;
+      continue;
+    }
     // wrap to start col if at end
-    if (col >= canvas->num_cols || str[i] == '\n') {
+    if (col >= canvas->num_cols) {
       row++;
       col = x;
-      // skip newline chars
-      if (str[i] == '\n') {
-        continue;
-      }
     }
     // finish if at end of canvas
     if (row >= canvas->num_rows) {
       break;
     }
-    // update pixel value
-    if (str[i] != transparent) {
-      canvas_scharyx(canvas, row, col, str[i]);
+    // find the rest of the line, reusing it while a long line wraps
+    if (line_end == NULL || line_end < p) {
+      line_end = memchr(p, '\n', end - p);
+      if (line_end == NULL) {
+        line_end = end;
+      }
+    }
+    const int len = min(line_end - p, canvas->num_cols - col);
+    assert(canvas_isin_yx(canvas, row, col));
+    char *dest = canvas->rows[row] + col;
+    if (transparent == '\0') {
+      memcpy(dest, p, len);
+    } else {
+      blend_span(dest, p, len, transparent);
     }
-    col++;
+    canvas_mark_dirty_y(canvas, row);
+    p += len;
+    col += len;
   }
-  return i;
+  return p - str;
 }
 
 /* Load str into canvas at (0, 0), ignoring no characters
@@ -705,11 +728,10 @@ Canvas *canvas_readf_norewind(FILE *f) {
  * Returns: the number of bytes written to buf
  */
 int canvas_serialize(Canvas *canvas, char *buf) {
-  int i;
-  for (i = 0; i < canvas->num_cols * canvas->num_rows; i++) {
-    buf[i] = canvas_gchari(canvas, i);
+  for (int y = 0; y < canvas->num_rows; y++) {
+    memcpy(buf + y * canvas->num_cols, canvas->rows[y], canvas->num_cols);
   }
-  return i;
+  return canvas->num_cols * canvas->num_rows;
 }
 
 /* Load a serialized canvas into a canvas object
@@ -732,9 +754,8 @@ int canvas_eq(Canvas *a, Canvas *b) {
     return 0;
   }
   // compare values
-  int size = a->num_cols * a->num_rows;
-  for (int i = 0; i < size; i++) {
-    if (canvas_gchari(a, i) != canvas_gchari(b, i)) {
+  for (int y = 0; y < a->num_rows; y++) {
+    if (memcmp(a->rows[y], b->rows[y], a->num_cols) != 0) {
       return 0;
     }
   }
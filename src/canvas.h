@@ -1,12 +1,15 @@
 #ifndef canvas_h
 #define canvas_h
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
 
 typedef struct {
   int num_cols, num_rows;
   char **rows;
+  bool *dirty;    // rows written since the last canvas_clear_dirty
+  int num_dirty;  // number of dirty rows
 } Canvas;
 
 Canvas *canvas_new(int rows, int cols);
@@ -21,10 +24,9 @@ int canvas_isin_yx(Canvas *canvas, int y, int x);
 int canvas_isin_i(Canvas *canvas, int i);
 int canvas_eq(Canvas *a, Canvas *b);
 
-void canvas_scharyx(Canvas *canvas, int y, int x, char c);
-void canvas_schari(Canvas *canvas, int i, char c);
-char canvas_gcharyx(Canvas *canvas, int y, int x);
-char canvas_gchari(Canvas *canvas, int i);
+int canvas_isdirty_y(Canvas *canvas, int y);
+void canvas_clear_dirty(Canvas *canvas);
+
 void canvas_fill(Canvas *canvas, char fill);
 
 int canvas_ldcanvasyx(Canvas *dest, Canvas *source, int y, int x);
@@ -34,6 +36,7 @@ int canvas_resize(Canvas **orig, int newrows, int newcols);
 Canvas *canvas_trimc(Canvas *orig, char ignore, bool right, bool bottom,
                      bool left, bool top);
 
+int canvas_ldstryxc(Canvas *canvas, char *str, int y, int x, char transparent);
 int canvas_ldstryx(Canvas *canvas, char *str, int y, int x);
 int canvas_ldstr(Canvas *canvas, char *str);
 int canvas_load_str(Canvas *canvas, char *str);
@@ -47,4 +50,66 @@ int canvas_print(Canvas *canvas);
 int canvas_serialize(Canvas *canvas, char *buf);
 void canvas_deserialize(char *bytes, Canvas *canvas);
 
+/* Cell accessors
+ *
+ * These are called for nearly every cell the editor and server touch, so they
+ * are inlined into callers. Bounds are only asserted in DEBUG builds: check
+ * positions with canvas_isin_yx/canvas_isin_i before using untrusted values.
+ */
+
+/* Mark row y as written.
+ *
+ * Canvas functions that write cells do this themselves; it only needs to be
+ * called after writing to `canvas->rows` directly.
+ */
+static inline void canvas_mark_dirty_y(Canvas *canvas, int y) {
+  if (!canvas->dirty[y]) {
+    canvas->dirty[y] = true;
+    canvas->num_dirty++;
+  }
+}
+
+/* Set a single character at position (x, y)
+ *
+ * Top left of canvas is (0, 0).
+ */
+static inline void canvas_scharyx(Canvas *canvas, int y, int x, char c) {
+#ifdef DEBUG
+  assert(canvas_isin_yx(canvas, y, x));
+#endif
+  canvas->rows[y][x] = c;
+  canvas_mark_dirty_y(canvas, y);
+}
+
+/* Set a single character with single index i
+ *
+ * Index starts at 0 at position (0, 0) and increments first horizontally.
+ */
+static inline void canvas_schari(Canvas *canvas, int i, char c) {
+#ifdef DEBUG
+  assert(canvas_isin_i(canvas, i));
+#endif
+  canvas_scharyx(canvas, i / canvas->num_cols, i % canvas->num_cols, c);
+}
+
+/* Get the character at position (x, y)
+ *
+ */
+static inline char canvas_gcharyx(Canvas *canvas, int y, int x) {
+#ifdef DEBUG
+  assert(canvas_isin_yx(canvas, y, x));
+#endif
+  return canvas->rows[y][x];
+}
+
+/* Get the character at index i
+ *
+ */
+static inline char canvas_gchari(Canvas *canvas, int i) {
+#ifdef DEBUG
+  assert(canvas_isin_i(canvas, i));
+#endif
+  return canvas_gcharyx(canvas, i / canvas->num_cols, i % canvas->num_cols);
+}
+
 #endif
@@ -1,3 +1,5 @@
+#include <stdlib.h>
+
 #include "canvas.h"
 #include "lib/minunit.h"
 #include "util.h"
@@ -245,6 +247,123 @@ MU_TEST(test_canvas_trimc) {
   canvas_free(c4);
 }
 
+/* Reference char-by-char version of canvas_ldstryxc, to check that the span
+ * version keeps the same wrapping semantics.
+ */
+static int ref_ldstryxc(Canvas *canvas, char *str, int y, int x,
+                        char transparent) {
+  int col = x;
+  int row = y;
+  int i;
+  for (i = 0; str[i] != '\0'; i++) {
+    if (col >= canvas->num_cols || str[i] == '\n') {
+      row++;
+      col = x;
+      if (str[i] == '\n') {
+        continue;
+      }
+    }
+    if (row >= canvas->num_rows) {
+      break;
+    }
+    if (str[i] != transparent) {
+      canvas->rows[row][col] = str[i];
+    }
+    col++;
+  }
+  return i;
+}
+
+MU_TEST(test_canvas_ldstryxc) {
+  c2 = canvas_new(3, 4);
+  canvas_fill(c2, '.');
+
+  // lines wrap at newlines and the right edge, back to x
+  int numset = canvas_ldstryxc(c2, "ab\ncdefg", 0, 1, '\0');
+  mu_assert_int_eq(8, numset);
+  mu_check(c2->rows[0][0] == '.');
+  mu_check(c2->rows[0][1] == 'a');
+  mu_check(c2->rows[0][2] == 'b');
+  mu_check(c2->rows[0][3] == '.');
+  mu_check(c2->rows[1][1] == 'c');
+  mu_check(c2->rows[1][3] == 'e');
+  mu_check(c2->rows[2][1] == 'f');
+  mu_check(c2->rows[2][2] == 'g');
+
+  // transparent chars are skipped but still take up space
+  numset = canvas_ldstryxc(c2, "xy x", 2, 0, ' ');
+  mu_assert_int_eq(4, numset);
+  mu_check(c2->rows[2][0] == 'x');
+  mu_check(c2->rows[2][1] == 'y');
+  mu_check(c2->rows[2][2] == 'g');
+  mu_check(c2->rows[2][3] == 'x');
+
+  // stops at the end of the canvas, but consumes trailing newlines
+  numset = canvas_ldstryxc(c2, "12345", 2, 2, '\0');
+  mu_assert_int_eq(2, numset);
+  numset = canvas_ldstryxc(c2, "12\n\n", 2, 2, '\0');
+  mu_assert_int_eq(4, numset);
+
+  // nothing is written from off the canvas
+  Canvas *c3 = canvas_cpy(c2);
+  mu_assert_int_eq(0, canvas_ldstryxc(c2, "ab", 0, 4, '\0'));
+  mu_assert_int_eq(0, canvas_ldstryxc(c2, "ab", 0, -1, '\0'));
+  mu_assert_int_eq(0, canvas_ldstryxc(c2, "ab", 3, 0, '\0'));
+  mu_assert_int_eq(0, canvas_ldstryxc(c2, "\nab", -1, 0, '\0'));
+  mu_check(canvas_eq(c2, c3));
+  canvas_free(c3);
+
+  canvas_free(c2);
+}
+
+MU_TEST(test_canvas_ldstryxc_reference) {
+  // compare against the reference version with random strings
+  const char alphabet[] = "ab \n..\nxyzxyzxyzxyzxyz";
+  char str[200];
+  srand(1);
+  for (int trial = 0; trial < 500; trial++) {
+    const int h = 1 + rand() % 6;
+    const int w = 1 + rand() % 40;
+    const int y = rand() % h;
+    const int x = rand() % w;
+    const char transparent = (rand() % 2) ? ' ' : '\0';
+    const int len = rand() % (sizeof(str) - 1);
+    for (int i = 0; i < len; i++) {
+      str[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+    }
+    str[len] = '\0';
+
+    c2 = canvas_new(h, w);
+    Canvas *c3 = canvas_new(h, w);
+    canvas_fill(c2, '.');
+    canvas_fill(c3, '.');
+    int expected = ref_ldstryxc(c2, str, y, x, transparent);
+    int numset = canvas_ldstryxc(c3, str, y, x, transparent);
+    mu_assert_int_eq(expected, numset);
+    mu_assert(canvas_eq(c2, c3), "Canvases should match reference");
+    canvas_free(c2);
+    canvas_free(c3);
+  }
+}
+
+MU_TEST(test_canvas_dirty) {
+  // new canvases start dirty
+  mu_assert_int_eq(rows, c1->num_dirty);
+  canvas_clear_dirty(c1);
+  mu_assert_int_eq(0, c1->num_dirty);
+  mu_check(!canvas_isdirty_y(c1, 1));
+
+  canvas_scharyx(c1, 1, 0, 'X');
+  canvas_scharyx(c1, 1, 1, 'X');
+  mu_assert_int_eq(1, c1->num_dirty);
+  mu_check(canvas_isdirty_y(c1, 1));
+  mu_check(!canvas_isdirty_y(c1, 0));
+
+  canvas_schari(c1, 5, 'X');
+  mu_assert_int_eq(2, c1->num_dirty);
+  mu_check(canvas_isdirty_y(c1, 2));
+}
+
 MU_TEST(test_canvas_serialize_deserialize) {
   char buf[c1->num_rows * c1->num_cols];
   int numwritten = canvas_serialize(c1, buf);
@@ -269,12 +388,16 @@ MU_TEST_SUITE(canvas_main) {
 
   MU_RUN_TEST(test_canvas_ldcanvasyx);
   MU_RUN_TEST(test_canvas_ldcanvasyxc);
+  MU_RUN_TEST(test_canvas_ldstryxc);
+  MU_RUN_TEST(test_canvas_ldstryxc_reference);
 
   MU_RUN_TEST(test_canvas_cpy);
   MU_RUN_TEST(test_canvas_cpy_p1p2);
 
   MU_RUN_TEST(test_canvas_trimc);
 
+  MU_RUN_TEST(test_canvas_dirty);
+
   MU_RUN_TEST(test_canvas_serialize_deserialize);
 }
 
@@ -0,0 +1,237 @@
+/* Diffs and patches between canvases
+ *
+ * A diff is a list of horizontal spans of cells that differ between an old and
+ * a new canvas. Spans are found row by row: rows that are identical are skipped
+ * with a single `memcmp` (which libc vectorizes), and the rest are scanned a
+ * word at a time until a change is found.
+ *
+ * Nearby spans in the same row are merged whenever the unchanged cells between
+ * them are cheaper to resend than a new span header, so the printed patch is as
+ * small as the format allows.
+ *
+ * Patch format (text, one span per line):
+ *
+ *   patch <rows> <cols>
+ *   <y> <x> <len> <len characters>
+ *
+ * The header holds the dimensions of the new canvas. Cells outside of the old
+ * canvas are compared against ' ', which is what `canvas_resize` fills them
+ * with.
+ */
+#include "diff.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "canvas.h"
+#include "util.h"
+
+#define DIFF_INITIAL_SPANS 16
+
+/* Number of bytes used by the header of a span in the printed patch.
+ *
+ * Includes the trailing newline.
+ */
+static int span_header_len(int y, int x, int len) {
+  return snprintf(NULL, 0, "%d %d %d ", y, x, len) + 1;
+}
+
+/* Check if the cell at x differs between an old and new row.
+ *
+ * old_row is only valid up to overlap; cells past it are treated as ' '.
+ */
+static inline int cell_differs(char *old_row, char *new_row, int overlap,
+                               int x) {
+  if (x < overlap) {
+    return old_row[x] != new_row[x];
+  }
+  return new_row[x] != ' ';
+}
+
+/* Find the first changed cell in a row at or after x.
+ *
+ * Returns: the index of the cell, or len if there is none.
+ */
+static int next_change(char *old_row, char *new_row, int overlap, int len,
+                       int x) {
+  // skip equal words; a constant-size memcmp compiles to a single compare
+  while (x + 8 <= overlap && memcmp(old_row + x, new_row + x, 8) == 0) {
+    x += 8;
+  }
+  while (x < len && !cell_differs(old_row, new_row, overlap, x)) {
+    x++;
+  }
+  return x;
+}
+
+static void diff_add_span(Diff *diff, int y, int x, int len) {
+  if (diff->num_spans > 0) {
+    Diff_span *last = &diff->spans[diff->num_spans - 1];
+    const int gap = x - (last->x + last->len);
+    if (last->y == y && gap < span_header_len(y, x, len)) {
+      // cheaper to resend the unchanged cells than to start a new span
+      last->len = x + len - last->x;
+      return;
+    }
+  }
+  if (diff->num_spans >= diff->max_spans) {
+    diff->max_spans *= 2;
+    diff->spans = realloc(diff->spans, diff->max_spans * sizeof(Diff_span));
+    if (diff->spans == NULL) {
+      perror("diff_add_span realloc");
+      exit(1);
+    }
+  }
+  diff->spans[diff->num_spans++] = (Diff_span){.y = y, .x = x, .len = len};
+}
+
+/* Find the spans of cells that differ between old and new.
+ *
+ * The canvases don't need to be the same size.
+ *
+ * Returned pointer should be freed with diff_free.
+ */
+Diff *diff_canvas(Canvas *old, Canvas *new) {
+  Diff *diff = malloc(sizeof(Diff));
+  diff->num_rows = new->num_rows;
+  diff->num_cols = new->num_cols;
+  diff->num_spans = 0;
+  diff->max_spans = DIFF_INITIAL_SPANS;
+  diff->spans = malloc(diff->max_spans * sizeof(Diff_span));
+
+  const int len = new->num_cols;
+  for (int y = 0; y < new->num_rows; y++) {
+    char *new_row = new->rows[y];
+    char *old_row = NULL;
+    int overlap = 0;
+    if (y < old->num_rows) {
+      old_row = old->rows[y];
+      overlap = min(old->num_cols, len);
+    }
+    // fast path for unchanged rows
+    if (overlap == len && memcmp(old_row, new_row, len) == 0) {
+      continue;
+    }
+    int x = 0;
+    while ((x = next_change(old_row, new_row, overlap, len, x)) < len) {
+      int end = x + 1;
+      while (end < len && cell_differs(old_row, new_row, overlap, end)) {
+        end++;
+      }
+      diff_add_span(diff, y, x, end - x);
+      x = end;
+    }
+  }
+  logd("Diffed %dx%d canvas: %d spans\n", len, new->num_rows, diff->num_spans);
+  return diff;
+}
+
+/* Free a diff object
+ *
+ */
+void diff_free(Diff *diff) {
+  free(diff->spans);
+  free(diff);
+}
+
+/* Apply a diff of new to a canvas.
+ *
+ * The canvas is resized to the dimensions of new if they differ, so this
+ * requires a pointer to a canvas pointer (see canvas_resize).
+ *
+ * Returns: the number of cells written
+ */
+int diff_apply(Canvas **canvas_pointer, Diff *diff, Canvas *new) {
+  if ((*canvas_pointer)->num_rows != diff->num_rows ||
+      (*canvas_pointer)->num_cols != diff->num_cols) {
+    canvas_resize(canvas_pointer, diff->num_rows, diff->num_cols);
+  }
+  Canvas *canvas = *canvas_pointer;
+  int total = 0;
+  for (int i = 0; i < diff->num_spans; i++) {
+    Diff_span *s = &diff->spans[i];
+    memcpy(canvas->rows[s->y] + s->x, new->rows[s->y] + s->x, s->len);
+    canvas_mark_dirty_y(canvas, s->y);
+    total += s->len;
+  }
+  return total;
+}
+
+/* Print a diff of new to a file stream in the patch format.
+ *
+ * Returns: the number of characters printed if successful, or a negative value
+ * on output error
+ */
+int diff_fprint(FILE *stream, Diff *diff, Canvas *new) {
+  int res;
+  int total = 0;
+  if ((res = fprintf(stream, "patch %d %d\n", diff->num_rows,
+                     diff->num_cols)) < 0) {
+    return res;
+  }
+  total += res;
+  for (int i = 0; i < diff->num_spans; i++) {
+    Diff_span *s = &diff->spans[i];
+    if ((res = fprintf(stream, "%d %d %d ", s->y, s->x, s->len)) < 0) {
+      return res;
+    }
+    total += res;
+    if (fwrite(new->rows[s->y] + s->x, sizeof(char), s->len, stream) !=
+        (size_t)s->len) {
+      return -1;
+    }
+    total += s->len;
+    if ((res = fprintf(stream, "\n")) < 0) {
+      return res;
+    }
+    total += res;
+  }
+  return total;
+}
+
+/* Read a patch from a file stream and apply it to a canvas.
+ *
+ * The canvas is resized to the dimensions in the patch header if they differ,
+ * so this requires a pointer to a canvas pointer (see canvas_resize). Each span
+ * is written with canvas_ldstryx.
+ *
+ * Returns: the number of spans applied, or -1 if the patch is malformed (spans
+ * before the error are still applied)
+ */
+int diff_fpatch(FILE *stream, Canvas **canvas_pointer) {
+  int rows, cols;
+  if (fscanf(stream, "patch %d %d", &rows, &cols) != 2 || rows < 0 ||
+      cols < 0 || getc(stream) != '\n') {
+    logd("Bad patch header\n");
+    return -1;
+  }
+  if ((*canvas_pointer)->num_rows != rows ||
+      (*canvas_pointer)->num_cols != cols) {
+    canvas_resize(canvas_pointer, rows, cols);
+  }
+  Canvas *canvas = *canvas_pointer;
+
+  char *span = malloc(cols + 1);
+  int num_spans = 0;
+  int y, x, len, res;
+  while ((res = fscanf(stream, "%d %d %d", &y, &x, &len)) == 3) {
+    if (!canvas_isin_y(canvas, y) || x < 0 || len < 0 || x + len > cols ||
+        getc(stream) != ' ' || fread(span, sizeof(char), len, stream) !=
+                                   (size_t)len ||
+        getc(stream) != '\n') {
+      logd("Bad patch span %d\n", num_spans);
+      free(span);
+      return -1;
+    }
+    span[len] = '\0';
+    canvas_ldstryx(canvas, span, y, x);
+    num_spans++;
+  }
+  free(span);
+  if (res != EOF) {
+    logd("Bad patch span %d\n", num_spans);
+    return -1;
+  }
+  return num_spans;
+}
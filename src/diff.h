@@ -0,0 +1,33 @@
+#ifndef diff_h
+#define diff_h
+
+#include <stdio.h>
+
+#include "canvas.h"
+
+/* A horizontal run of changed cells, starting at (y, x).
+ */
+typedef struct {
+  int y, x, len;
+} Diff_span;
+
+/* The changes needed to turn one canvas into another.
+ *
+ * Spans index into the "new" canvas, which must be kept around to read their
+ * contents (see diff_fprint).
+ */
+typedef struct {
+  int num_rows, num_cols;  // dimensions of the new canvas
+  int num_spans;
+  int max_spans;  // allocated length of spans
+  Diff_span *spans;
+} Diff;
+
+Diff *diff_canvas(Canvas *old, Canvas *new);
+void diff_free(Diff *diff);
+
+int diff_apply(Canvas **canvas_pointer, Diff *diff, Canvas *new);
+int diff_fprint(FILE *stream, Diff *diff, Canvas *new);
+int diff_fpatch(FILE *stream, Canvas **canvas_pointer);
+
+#endif
@@ -0,0 +1,150 @@
+#include <stdio.h>
+
+#include "canvas.h"
+#include "diff.h"
+#include "lib/minunit.h"
+#include "util.h"
+
+static Canvas *c1, *c2;
+
+/*
+ * c1 is loaded as a 3x10:
+ *   0123456789
+ *  +----------
+ * 0|abcdefghij
+ * 1|klmnopqrst
+ * 2|uvwxyz0123
+ */
+static char load_str[] = "abcdefghijklmnopqrstuvwxyz0123";
+
+void test_setup(void) {
+  c1 = canvas_new(3, 10);
+  canvas_ldstr(c1, load_str);
+  c2 = canvas_cpy(c1);
+}
+
+void test_teardown(void) {
+  canvas_free(c1);
+  canvas_free(c2);
+}
+
+MU_TEST(test_diff_canvas_same) {
+  Diff *diff = diff_canvas(c1, c2);
+  mu_assert_int_eq(0, diff->num_spans);
+  mu_assert_int_eq(3, diff->num_rows);
+  mu_assert_int_eq(10, diff->num_cols);
+  diff_free(diff);
+}
+
+MU_TEST(test_diff_canvas_spans) {
+  canvas_ldstryx(c2, "XY", 0, 1);
+  canvas_ldstryx(c2, "Z", 2, 9);
+  Diff *diff = diff_canvas(c1, c2);
+  mu_assert_int_eq(2, diff->num_spans);
+
+  mu_assert_int_eq(0, diff->spans[0].y);
+  mu_assert_int_eq(1, diff->spans[0].x);
+  mu_assert_int_eq(2, diff->spans[0].len);
+
+  mu_assert_int_eq(2, diff->spans[1].y);
+  mu_assert_int_eq(9, diff->spans[1].x);
+  mu_assert_int_eq(1, diff->spans[1].len);
+  diff_free(diff);
+}
+
+MU_TEST(test_diff_canvas_merge) {
+  // a gap smaller than a span header is merged into one span
+  canvas_scharyx(c2, 1, 0, 'X');
+  canvas_scharyx(c2, 1, 2, 'X');
+  Diff *diff = diff_canvas(c1, c2);
+  mu_assert_int_eq(1, diff->num_spans);
+  mu_assert_int_eq(0, diff->spans[0].x);
+  mu_assert_int_eq(3, diff->spans[0].len);
+  diff_free(diff);
+
+  // spans in different rows are never merged
+  canvas_scharyx(c2, 2, 0, 'X');
+  diff = diff_canvas(c1, c2);
+  mu_assert_int_eq(2, diff->num_spans);
+  diff_free(diff);
+}
+
+MU_TEST(test_diff_apply) {
+  canvas_ldstryx(c2, "hello", 1, 3);
+  canvas_scharyx(c2, 0, 9, ' ');
+  Diff *diff = diff_canvas(c1, c2);
+  diff_apply(&c1, diff, c2);
+  mu_assert(canvas_eq(c1, c2), "Canvases should be equal after apply");
+  diff_free(diff);
+}
+
+MU_TEST(test_diff_apply_resize) {
+  // growing: new cells that are ' ' don't need to be sent
+  Canvas *big = canvas_new(4, 12);
+  canvas_ldcanvasyx(big, c1, 0, 0);
+  canvas_scharyx(big, 3, 11, '!');
+  Diff *diff = diff_canvas(c1, big);
+  mu_assert_int_eq(1, diff->num_spans);
+  diff_apply(&c1, diff, big);
+  mu_assert(canvas_eq(c1, big), "Canvases should be equal after growing");
+  diff_free(diff);
+
+  // shrinking
+  diff = diff_canvas(c1, c2);
+  diff_apply(&c1, diff, c2);
+  mu_assert(canvas_eq(c1, c2), "Canvases should be equal after shrinking");
+  diff_free(diff);
+  canvas_free(big);
+}
+
+MU_TEST(test_diff_fprint_fpatch) {
+  canvas_ldstryx(c2, "a b", 0, 6);
+  canvas_ldstryx(c2, "   ", 2, 0);
+  Diff *diff = diff_canvas(c1, c2);
+
+  FILE *f = tmpfile();
+  int numprinted = diff_fprint(f, diff, c2);
+  mu_assert(numprinted > 0, "Patch should be printed");
+  mu_assert_int_eq(numprinted, ftell(f));
+  rewind(f);
+
+  int numapplied = diff_fpatch(f, &c1);
+  mu_assert_int_eq(diff->num_spans, numapplied);
+  mu_assert(canvas_eq(c1, c2), "Canvases should be equal after patch");
+
+  fclose(f);
+  diff_free(diff);
+}
+
+MU_TEST(test_diff_fpatch_malformed) {
+  FILE *f = tmpfile();
+  // span runs off the end of the canvas
+  fprintf(f, "patch 3 10\n0 8 3 abc\n");
+  rewind(f);
+  mu_assert_int_eq(-1, diff_fpatch(f, &c1));
+  fclose(f);
+
+  f = tmpfile();
+  fprintf(f, "not a patch\n");
+  rewind(f);
+  mu_assert_int_eq(-1, diff_fpatch(f, &c1));
+  fclose(f);
+}
+
+MU_TEST_SUITE(diff_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_diff_canvas_same);
+  MU_RUN_TEST(test_diff_canvas_spans);
+  MU_RUN_TEST(test_diff_canvas_merge);
+  MU_RUN_TEST(test_diff_apply);
+  MU_RUN_TEST(test_diff_apply_resize);
+  MU_RUN_TEST(test_diff_fprint_fpatch);
+  MU_RUN_TEST(test_diff_fpatch_malformed);
+}
+
+int main(int argc, char const *argv[]) {
+  MU_RUN_SUITE(diff_main);
+  MU_REPORT();
+  return minunit_status;
+}
@@ -75,6 +75,14 @@ void cmd_read_from_file(State *state) {
 }
 
 void cmd_write_to_file(State *state) {
+  if (autosave != NULL) {
+    // (and drop the sidecar, which has nothing unsaved left)
+    if (autosave_finish(autosave, state->view->canvas) < 0) {
+      autosave_sync(autosave, state->view->canvas);
+      exit(1);
+    }
+    return;
+  }
   FILE *f = fopen(state->filepath, "w");
   if (f == NULL) {
     perror("write_to_file");
@@ -150,6 +158,10 @@ Mode_ID previous_canvas_mode(Mode_ID mode) {
 int master_handler(State *state, WINDOW *canvas_win, WINDOW *status_win) {
   // catching keypresses
   int c = wgetch(canvas_win);  // grab from window
+  if (c == ERR) {
+    // no input before the window timeout
+    return 0;
+  }
 #ifdef LOG_KEY_EVENTS
   logd("New key: '%c' (%d)\n", c, c);
 #endif
@@ -36,6 +36,7 @@
 
 #include "frontend.h"
 
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -46,8 +47,10 @@
 
 #include "lib/argtable3.h"
 
+#include "autosave.h"
 #include "canvas.h"
 #include "cursor.h"
+#include "diff.h"
 #include "fe_modes.h"
 #include "mode_id.h"
 #include "network.h"
@@ -60,6 +63,12 @@ Cursor *cursor;
 View *view;
 bool networked = false;
 Net_cfg *net_cfg = NULL;
+Autosave *autosave = NULL;
+char *recovered_from = NULL;  // sidecar the canvas was recovered from, if any
+// set by <CTRL-C> while autosaving or connected, for the main loop to exit
+// (saving to the sidecar, or sending the edits still waiting) outside of the
+// signal handler
+volatile sig_atomic_t quitting = 0;
 
 int INFO_WIDTH = 24;  // max width of the info window
 
@@ -112,7 +121,10 @@ const char *program_doc =
     "- <CTRL-R> to read from the file\n"
     "- <CTRL-S> to write to the file\n"
     "- <PGUP>/<PGDOWN> move up/down a screen height\n"
-    "- <SHIFT-LEFT>/<SHIFT-RIGHT> move left/right a screen width\n";
+    "- <SHIFT-LEFT>/<SHIFT-RIGHT> move left/right a screen width\n\n"
+    "Other commands:\n"
+    "- `collascii diff OLD NEW` prints a patch from file OLD to file NEW\n"
+    "- `collascii patch FILE PATCH` prints FILE with PATCH applied\n";
 
 // representation of desired state from the cmdline interface
 // see the creatively-named "arguments" struct in `main` for the defaults
@@ -125,6 +137,8 @@ typedef struct {
   bool connect_remote;  // connect to a remote server
   char *remote_host;
   char *remote_port;
+  char *room;    // room to join on the server ("" for the main one)
+  int autosave;  // seconds between autosaves (0 to disable)
 } arguments_t;
 
 /* Make sure the arguments struct is valid and in a non-conflicting state.
@@ -136,9 +150,21 @@ void validate_arguments(arguments_t *arguments) {
   if (arguments->width < 0 || arguments->height < 0) {
     errmsg = "width and height settings must be positive";
   }
+  if (arguments->autosave < 0) {
+    errmsg = "autosave interval must be positive";
+  }
+  if (arguments->connect_remote && arguments->autosave > 0) {
+    errmsg = "cannot connect to server and autosave";
+  }
   if (arguments->remote_port[0] != '\0' && arguments->remote_host[0] == '\0') {
     errmsg = "server address must be specified";
   }
+  if (arguments->room[0] != '\0' && !arguments->connect_remote) {
+    errmsg = "server address must be specified to join a room";
+  }
+  if (strlen(arguments->room) > 31) {
+    errmsg = "room names can be at most 31 characters";
+  }
   if (arguments->connect_remote && arguments->load_file) {
     errmsg = "cannot connect to server and read from file";
   }
@@ -155,9 +181,9 @@ void validate_arguments(arguments_t *arguments) {
 
 void parse_args(int argc, char *argv[], arguments_t *arguments) {
   struct arg_lit *help, *version, *usage;
-  struct arg_int *width, *height;
+  struct arg_int *width, *height, *autosave;
   struct arg_file *file;
-  struct arg_str *server, *port;
+  struct arg_str *server, *port, *room;
   struct arg_end *end;
 
   void *argtable[] = {
@@ -171,9 +197,15 @@ void parse_args(int argc, char *argv[], arguments_t *arguments) {
       height = arg_intn("h", "height", "<n>", 0, 1,
                         "initial height of canvas (default 100)"),
       server = arg_strn("s", "server", "<SERVER>", 0, 1,
-                        "address of server to connect to"),
+                        "address of server to connect to, or the path of "
+                        "its local socket"),
       port = arg_strn("p", "port", "<PORT>", 0, 1,
                       "port of server to connect to (default 45011)"),
+      room = arg_strn("r", "room", "<NAME>", 0, 1,
+                      "room to join on the server (default the main one)"),
+      autosave = arg_intn("a", "autosave", "<n>", 0, 1,
+                          "autosave every n seconds to FILE.autosave, until "
+                          "saved to FILE with <CTRL+S>"),
       file = arg_filen(NULL, NULL, "[FILE]", 0, 1,
                        "filepath for read/write ('-' to read from stdin)"),
       end = arg_end(20),
@@ -222,6 +254,12 @@ void parse_args(int argc, char *argv[], arguments_t *arguments) {
     if (port->count > 0) {
       arguments->remote_port = strdup(port->sval[0]);
     }
+    if (room->count > 0) {
+      arguments->room = strdup(room->sval[0]);
+    }
+    if (autosave->count > 0) {
+      arguments->autosave = autosave->ival[0];
+    }
     if (file->count > 0) {
       const char *arg = file->filename[0];
       if (strcmp(arg, "-") == 0) {
@@ -237,6 +275,19 @@ void parse_args(int argc, char *argv[], arguments_t *arguments) {
   arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
 }
 
+/* Open and read a canvas from a file, exiting on errors.
+ */
+Canvas *read_canvas_file(const char *filename) {
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) {
+    eprintf("Cannot read file %s\n", filename);
+    exit(1);
+  }
+  Canvas *canvas = canvas_readf(f);
+  fclose(f);
+  return canvas;
+}
+
 /* Initialize state based on arguments.
  *
  * In the process it also initializes the following global values:
@@ -245,16 +296,24 @@ void parse_args(int argc, char *argv[], arguments_t *arguments) {
  * - cursor
  * - networked
  * - net_cfg
+ * - autosave
  *
  * This should be run before ncurses init so stdin can be read correctly.
  */
 void init_state(State *state, const arguments_t *const arguments) {
-  // load canvas from network, file, or blank
+  // load canvas from network, autosave sidecar, file, or blank
   Canvas *canvas;
+  char *sidecar = autosave_path(arguments->filename);
   if (arguments->connect_remote) {
     networked = true;
-    canvas = net_init(arguments->remote_host, arguments->remote_port);
+    canvas = net_init(arguments->remote_host, arguments->remote_port,
+                      arguments->room);
     net_cfg = net_getcfg();
+  } else if (arguments->autosave > 0 && access(sidecar, F_OK) == 0) {
+    // a sidecar is only left behind if the last session didn't exit cleanly
+    logd("Recovering from '%s'\n", sidecar);
+    canvas = read_canvas_file(sidecar);
+    recovered_from = sidecar;
   } else if (arguments->use_stdin) {
     // read from stdin if specified
     logd("Reading from stdin\n");
@@ -264,15 +323,8 @@ void init_state(State *state, const arguments_t *const arguments) {
     // note that this is NOT portable
     freopen("/dev/tty", "rw", stdin);
   } else if (arguments->load_file) {
-    char *in_filename = arguments->filename;
-    FILE *f = fopen(in_filename, "r");
-    logd("Reading from '%s'\n", in_filename);
-    if (f == NULL) {
-      eprintf("Cannot read file %s\n", in_filename);
-      exit(1);
-    }
-    canvas = canvas_readf(f);
-    fclose(f);
+    logd("Reading from '%s'\n", arguments->filename);
+    canvas = read_canvas_file(arguments->filename);
     // resize if arguments were given
     if (arguments->height != 0 || arguments->width != 0) {
       int res = canvas_resize(
@@ -292,6 +344,20 @@ void init_state(State *state, const arguments_t *const arguments) {
   // init globals
   view = view_new_startpos(canvas, 0, 0);
   cursor = cursor_new();
+  if (arguments->autosave > 0) {
+    autosave = autosave_new(arguments->filename, arguments->autosave);
+    if (autosave == NULL) {
+      eprintf("Cannot autosave to %s\n", sidecar);
+      exit(1);
+    }
+    if (recovered_from == NULL && !arguments->use_stdin) {
+      // nothing to save until it's edited: it's what the file already has
+      canvas_clear_dirty(canvas);
+    }
+  }
+  if (recovered_from == NULL) {
+    free(sidecar);
+  }
 
   // init state
   State new_state = {
@@ -311,13 +377,67 @@ void init_state(State *state, const arguments_t *const arguments) {
   *state = new_state;
 }
 
+/* `collascii diff OLD NEW`: print a patch from OLD to NEW to stdout.
+ */
+int cmd_diff(int argc, char *argv[]) {
+  if (argc != 3) {
+    eprintf("Usage: %s diff OLD NEW\n", program_name);
+    return 1;
+  }
+  Canvas *old = read_canvas_file(argv[1]);
+  Canvas *new = read_canvas_file(argv[2]);
+  Diff *diff = diff_canvas(old, new);
+  int res = diff_fprint(stdout, diff, new);
+  diff_free(diff);
+  canvas_free(old);
+  canvas_free(new);
+  return res < 0 ? 1 : 0;
+}
+
+/* `collascii patch FILE PATCH`: print FILE with PATCH applied to stdout.
+ */
+int cmd_patch(int argc, char *argv[]) {
+  if (argc != 3) {
+    eprintf("Usage: %s patch FILE PATCH\n", program_name);
+    return 1;
+  }
+  Canvas *canvas = read_canvas_file(argv[1]);
+  FILE *f = fopen(argv[2], "r");
+  if (f == NULL) {
+    eprintf("Cannot read file %s\n", argv[2]);
+    exit(1);
+  }
+  int res = diff_fpatch(f, &canvas);
+  fclose(f);
+  if (res < 0) {
+    eprintf("%s: malformed patch '%s'\n", program_name, argv[2]);
+  } else {
+    canvas_fprint_trim(stdout, canvas);
+  }
+  canvas_free(canvas);
+  return res < 0 ? 1 : 0;
+}
+
 int main(int argc, char *argv[]) {
+  // run subcommands that don't start the editor
+  if (argc > 1 && strcmp(argv[1], "diff") == 0) {
+    return cmd_diff(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "patch") == 0) {
+    return cmd_patch(argc - 1, argv + 1);
+  }
+
   // initialize non-ncurses data structures here
 
   // setup finish() signal handler
   for (int i = 0; i < sizeof(caught_signals) / sizeof(int); i++) {
     signal(caught_signals[i], finish);
   }
+  // without SA_RESTART, so <CTRL-C> interrupts waiting for a key
+  struct sigaction quit_action = {.sa_handler = finish};
+  sigaction(SIGINT, &quit_action, NULL);
+  // a server that's gone shows up as write errors instead
+  signal(SIGPIPE, SIG_IGN);
 
 #ifdef LOG_TO_FILE
   logfile = fopen(logfile_path, "a");
@@ -330,6 +450,10 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 #endif
+#if LOG_LEVEL <= LOG_DEBUG
+  // logd lines are written out (to stderr) by a background thread
+  log_start(stderr);
+#endif
 
   // struct of arg state, set with defaults
   arguments_t arguments = {
@@ -343,6 +467,8 @@ int main(int argc, char *argv[]) {
       .connect_remote = false,
       .remote_host = "",
       .remote_port = "",
+      .room = "",
+      .autosave = 0,
   };
 
   // parse arguments, init state
@@ -419,6 +545,9 @@ int main(int argc, char *argv[]) {
 
   char welcome_msg[] = "COLLASCII: <TAB> to switch modes, <CTRL-C> to quit";
   print_msg_win(welcome_msg);
+  if (recovered_from != NULL) {
+    print_msg_win("Recovered unsaved changes from '%s'", recovered_from);
+  }
 
   // bootstrap initial UI
   call_mode(state->current_mode, START, state);
@@ -430,37 +559,80 @@ int main(int argc, char *argv[]) {
   // If connected to server, check both network and keyboard streams
   if (networked) {
     logd("Running networked loop\n");
-    int fd;
-    fd_set testfds;
-    while (1) {
-      testfds = net_cfg->clientfds;
-      select(FD_SETSIZE, &testfds, NULL, NULL, NULL);
-
-      for (fd = 0; fd < FD_SETSIZE; fd++) {
-        if (FD_ISSET(fd, &testfds)) {
-          if (networked &&
-              fd == net_cfg->sockfd) {  // Accept data from open socket
-            logd("recv network\n");
-            // If server disconnects
-            if (net_handler(view) != 0) {
-              networked = false;
-              print_msg_win("Server Disconnect!");
-            };
-            redraw_canvas_win();  // TODO: draw single char update
-            refresh_screen();
-          } else if (fd == 0) {  // process keyboard activity
-            master_handler(state, canvas_win, status_interface->info_win);
-            refresh_screen();
-          }
+    net_send_view(view);
+    while (!quitting) {
+      struct pollfd fds[] = {
+          {.fd = 0, .events = POLLIN},  // stdin
+          {.fd = networked ? net_cfg->sockfd : -1, .events = POLLIN},
+          {.fd = networked ? net_cfg->presence_fd : -1, .events = POLLIN},
+      };
+      // wake up for edits and cursors to send, or cursors to forget, too
+      int wait_ms = -1;
+      if (networked) {
+        const int flush_ms = net_flush_wait();
+        wait_ms = net_presence_wait();
+        if (flush_ms >= 0 && (wait_ms < 0 || flush_ms < wait_ms)) {
+          wait_ms = flush_ms;
         }
       }
+      if (poll(fds, sizeof(fds) / sizeof(fds[0]), wait_ms) < 0) {
+        fds[0].revents = fds[1].revents = 0;
+      }
+
+      // redraw and refresh once for all that happened since the last wakeup
+      bool changed = false;
+      if (fds[0].revents != 0) {  // process keyboard activity
+        master_handler(state, canvas_win, status_interface->info_win);
+        changed = true;
+      }
+      if (fds[1].revents != 0) {  // Accept data from open socket
+        logd("recv network\n");
+        // If server disconnects
+        if (net_handler(view) != 0) {
+          networked = false;
+          print_msg_win("Server Disconnect!");
+          changed = true;
+        }
+        Rect damage;
+        if (net_take_damage(&damage)) {
+          redraw_canvas_rect(damage);
+          changed = true;
+        }
+      }
+      // the view may have moved (or we may have reconnected)
+      if (networked) {
+        net_send_view(view);
+        net_send_presence(cursor->y + view->y, cursor->x + view->x,
+                          state->current_mode);
+        // just the cells others' cursors moved from and to
+        const Rect *cells;
+        const int n = net_presence_handler(&cells);
+        for (int i = 0; i < n; i++) {
+          redraw_canvas_rect(cells[i]);
+        }
+        changed = changed || n > 0;
+        // edits made since the last wakeup, in one write
+        if (net_flush_wait() == 0) {
+          net_flush();
+        }
+      }
+      if (changed) {
+        refresh_screen();
+      }
     }
     // If local, process keyboard stream
   } else {
     logd("Running local loop\n");
-    while (1) {
+    if (autosave != NULL) {
+      // wake up periodically so autosave runs without keypresses
+      wtimeout(canvas_win, 1000);
+    }
+    while (!quitting) {
       master_handler(state, canvas_win, status_interface->info_win);
       refresh_screen();
+      if (autosave != NULL) {
+        autosave_tick(autosave, view->canvas);
+      }
     }
   }
   // Cleanup
@@ -488,10 +660,13 @@ void setup_colors() {
  *
  * Changes the canvas and updates the ncurses `canvas_win` with the change.
  *
- * This will assert the cursor is within canvas bounds in DEBUG mode ONLY, so
- * bounds checking should be done before calling this.
+ * Does nothing if the cursor is outside of the canvas (e.g. painting with the
+ * mouse past the edge of a small canvas).
  */
 void front_setcharcursor(char ch) {
+  if (!canvas_isin_yx(view->canvas, cursor->y + view->y, cursor->x + view->x)) {
+    return;
+  }
   canvas_scharyx(view->canvas, cursor->y + view->y, cursor->x + view->x, ch);
   mvwaddch(canvas_win, cursor_y_to_canvas(cursor), cursor_x_to_canvas(cursor),
            ch);
@@ -500,7 +675,12 @@ void front_setcharcursor(char ch) {
   }
 }
 
-void redraw_canvas_win() {
+/* Redraw the cells of the canvas in a rectangle (of canvas coordinates), as
+ * far as it's in view, with others' cursors over them.
+ *
+ * Cells of the window past the edges of the canvas are filled in.
+ */
+void redraw_canvas_rect(Rect rect) {
   // find max ranges to draw canvas
   int max_x = view_max_x;
   int max_y = view_max_y;
@@ -510,27 +690,52 @@ void redraw_canvas_win() {
   if (max_y >= view->canvas->num_rows - view->y)
     (max_y = view->canvas->num_rows - view->y);
 
-  // draw canvas onto window
-  for (int x = 0; x < max_x; x++) {
-    for (int y = 0; y < max_y; y++) {
-      mvwaddch(canvas_win, y + 1, x + 1,
-               canvas_gcharyx(view->canvas, y + view->y, x + view->x));
-    }
+  // the part of the window to draw
+  int top = rect.y - view->y, left = rect.x - view->x;
+  int bottom = top + rect.h, right = left + rect.w;
+  if (top < 0) {
+    top = 0;
+  }
+  if (left < 0) {
+    left = 0;
+  }
+  if (bottom > view_max_y) {
+    bottom = view_max_y;
+  }
+  if (right > view_max_x) {
+    right = view_max_x;
   }
 
-  // draw fill in rest of window
-  for (int x = max_x; x < view_max_x; x++) {
-    for (int y = 0; y < view_max_y; y++) {
-      mvwaddch(canvas_win, y + 1, x + 1, ACS_CKBOARD);
+  // draw canvas onto window, and fill in the rest of it
+  for (int y = top; y < bottom; y++) {
+    for (int x = left; x < right; x++) {
+      mvwaddch(canvas_win, y + 1, x + 1,
+               y < max_y && x < max_x
+                   ? canvas_gcharyx(view->canvas, y + view->y, x + view->x)
+                   : ACS_CKBOARD);
     }
   }
-  for (int y = max_y; y < view_max_y; y++) {
-    for (int x = 0; x < max_x; x++) {
-      mvwaddch(canvas_win, y + 1, x + 1, ACS_CKBOARD);
+
+  // others' cursors, over the canvas without changing it, colored by mode
+  if (networked) {
+    const Presence_cursor *cursors;
+    const int n = net_get_cursors(&cursors);
+    for (int i = 0; i < n; i++) {
+      const int y = cursors[i].y - view->y, x = cursors[i].x - view->x;
+      if (y >= top && y < bottom && x >= left && x < right && y < max_y &&
+          x < max_x) {
+        mvwchgat(canvas_win, y + 1, x + 1, 1, A_REVERSE,
+                 has_colors() ? 1 + cursors[i].mode % 6 : 0, NULL);
+      }
     }
   }
 }
 
+void redraw_canvas_win() {
+  redraw_canvas_rect((Rect){
+      .y = view->y, .x = view->x, .h = view_max_y, .w = view_max_x});
+}
+
 void refresh_screen() {
   update_screen_size();
   wmove(canvas_win, cursor_y_to_canvas(cursor), cursor_x_to_canvas(cursor));
@@ -738,10 +943,22 @@ void update_info_win(const Mode_ID current_mode, const int x, const int y,
  *
  * Turns of ncurses, disables mouse moves commands, closes the logfile.
  *
- * If sig is 0 or SIGINT, exits normally, otherwise prints the signal
- * information to stderr and exits with sig.
+ * If sig is 0 or SIGINT, exits normally, keeping unsaved changes in the
+ * autosave sidecar if there is one, otherwise prints the signal information to
+ * stderr and exits with sig.
  */
 void finish(int sig) {
+  if (sig == SIGINT && (autosave != NULL || networked)) {
+    // the main loop saves to the sidecar or sends what's waiting, and exits
+    quitting = 1;
+    return;
+  }
+  if (sig == 0 && networked) {
+    // edits still waiting to be sent (never from the handler, which could be
+    // interrupting a flush)
+    net_flush();
+    net_log_stats();
+  }
   endwin();
 // Disable mouse events charcode
 #ifdef ENABLE_MOUSE_MOVEMENT
@@ -753,6 +970,9 @@ void finish(int sig) {
 #endif
 
 /* do your non-curses wrapup here */
+#if LOG_LEVEL <= LOG_DEBUG
+  log_stop();
+#endif
 #ifdef LOG_TO_FILE
   if (logfile != NULL) {
     fclose(logfile);
@@ -762,10 +982,19 @@ void finish(int sig) {
   switch (sig) {
     case 0:       // normal
     case SIGINT:  // user CTRL-C
+      // unsaved changes go to the sidecar, not over the file
+      if (autosave != NULL && autosave_sync(autosave, view->canvas) >= 0 &&
+          autosave->fd >= 0) {
+        eprintf("Unsaved changes are kept in '%s' (<CTRL+S> saves to '%s')\n",
+                autosave->path, autosave->target);
+      }
       eprintf("Exiting\n");
       exit(0);
       break;
     default:  // problems
+      if (autosave != NULL) {
+        eprintf("Unsaved changes are kept in '%s'\n", autosave->path);
+      }
       eprintf("Exited with signal %d (%s)\n", sig, strsignal(sig));
       exit(sig);
       break;
@@ -2,10 +2,15 @@
 #define frontend_h
 
 #include <ncurses.h>
+#include "autosave.h"
 #include "cursor.h"
+#include "interest.h"
 #include "mode_id.h"
 #include "view.h"
 
+// autosaving to a sidecar, or NULL
+extern Autosave *autosave;
+
 #define KEY_TAB '\t'
 #define KEY_SHIFT_TAB KEY_BTAB
 // TODO: Understand delete/backspace on mac
@@ -15,6 +20,7 @@ void setup_colors();
 void update_screen_size();
 void refresh_screen();
 void redraw_canvas_win();
+void redraw_canvas_rect(Rect rect);
 void front_setcharcursor(char ch);
 
 WINDOW *create_canvas_win();
@@ -0,0 +1,167 @@
+/* Spatial index of who is interested in which part of a canvas
+ *
+ * The canvas is split into a grid of square buckets, and each bucket keeps a
+ * list of the subscribers whose region covers it. Finding everyone who should
+ * hear about an edit is then a lookup of the bucket it's in, however big the
+ * canvas and however many subscribers look at other parts of it.
+ *
+ * Regions are rounded out to whole buckets, so a subscriber is told about
+ * every cell of the buckets it's in (a little more than it asked for).
+ */
+#include "interest.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Make an empty index for a canvas, with buckets of bucket_sz x bucket_sz
+ * cells.
+ *
+ * Returned pointer should be freed with interest_free.
+ */
+Interest *interest_new(int num_rows, int num_cols, int bucket_sz) {
+  Interest *in = malloc(sizeof(Interest));
+  in->bucket_sz = bucket_sz;
+  in->num_rows = num_rows;
+  in->num_cols = num_cols;
+  in->rows = (num_rows + bucket_sz - 1) / bucket_sz;
+  in->cols = (num_cols + bucket_sz - 1) / bucket_sz;
+  in->buckets = calloc((size_t)in->rows * in->cols, sizeof(Interest_bucket));
+  if (in->buckets == NULL) {
+    perror("interest malloc");
+    exit(1);
+  }
+  return in;
+}
+
+/* Clip a rectangle to the canvas and round it out to whole buckets.
+ *
+ * Returns: the region, with h and w 0 if it's off the canvas
+ */
+Rect interest_region(const Interest *in, Rect rect) {
+  const int sz = in->bucket_sz;
+  // in longs, so far-off rectangles from clients can't overflow
+  const long bottom = (long)rect.y + rect.h, right = (long)rect.x + rect.w;
+  int y0 = rect.y < 0 ? 0 : rect.y;
+  int x0 = rect.x < 0 ? 0 : rect.x;
+  int y1 = bottom > in->num_rows ? in->num_rows : bottom;
+  int x1 = right > in->num_cols ? in->num_cols : right;
+  if (y0 >= y1 || x0 >= x1) {
+    return (Rect){0};
+  }
+  y0 = y0 / sz * sz;
+  x0 = x0 / sz * sz;
+  y1 = (y1 + sz - 1) / sz * sz;
+  x1 = (x1 + sz - 1) / sz * sz;
+  if (y1 > in->num_rows) {
+    y1 = in->num_rows;
+  }
+  if (x1 > in->num_cols) {
+    x1 = in->num_cols;
+  }
+  return (Rect){.y = y0, .x = x0, .h = y1 - y0, .w = x1 - x0};
+}
+
+/* Subscribe to every bucket of a region (from interest_region).
+ */
+void interest_add(Interest *in, void *sub, Rect region) {
+  const int sz = in->bucket_sz;
+  for (int by = region.y / sz; by * sz < region.y + region.h; by++) {
+    for (int bx = region.x / sz; bx * sz < region.x + region.w; bx++) {
+      Interest_bucket *b = &in->buckets[by * in->cols + bx];
+      if (b->len == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 4;
+        b->subs = realloc(b->subs, b->cap * sizeof(void *));
+        if (b->subs == NULL) {
+          perror("interest malloc");
+          exit(1);
+        }
+      }
+      b->subs[b->len++] = sub;
+    }
+  }
+}
+
+/* Unsubscribe from every bucket of a region it was added with.
+ */
+void interest_remove(Interest *in, void *sub, Rect region) {
+  const int sz = in->bucket_sz;
+  for (int by = region.y / sz; by * sz < region.y + region.h; by++) {
+    for (int bx = region.x / sz; bx * sz < region.x + region.w; bx++) {
+      Interest_bucket *b = &in->buckets[by * in->cols + bx];
+      for (int i = 0; i < b->len; i++) {
+        if (b->subs[i] == sub) {
+          b->subs[i] = b->subs[--b->len];
+          break;
+        }
+      }
+    }
+  }
+}
+
+/* Get the index of the bucket a cell is in.
+ */
+int interest_bucket(const Interest *in, int y, int x) {
+  return y / in->bucket_sz * in->cols + x / in->bucket_sz;
+}
+
+/* Check whether a bucket is part of a region (from interest_region).
+ */
+bool interest_covers(const Interest *in, Rect region, int bucket) {
+  const int y = bucket / in->cols * in->bucket_sz;
+  const int x = bucket % in->cols * in->bucket_sz;
+  return y >= region.y && y < region.y + region.h && x >= region.x &&
+         x < region.x + region.w;
+}
+
+/* Get the subscribers of a bucket, in no particular order.
+ *
+ * Returns: n of them, valid until the bucket is next changed
+ */
+void *const *interest_subscribers(const Interest *in, int bucket, int *n) {
+  *n = in->buckets[bucket].len;
+  return in->buckets[bucket].subs;
+}
+
+/* Split the part of rectangle a that's outside of b into rectangles.
+ *
+ * Returns: how many were written to out (up to 4: above, below, left, right)
+ */
+int interest_subtract(Rect a, Rect b, Rect out[4]) {
+  const int ay1 = a.y + a.h, ax1 = a.x + a.w;
+  const int by1 = b.y + b.h, bx1 = b.x + b.w;
+  if (a.h <= 0 || a.w <= 0) {
+    return 0;
+  }
+  if (b.h <= 0 || b.w <= 0 || by1 <= a.y || b.y >= ay1 || bx1 <= a.x ||
+      b.x >= ax1) {
+    out[0] = a;
+    return 1;
+  }
+  int n = 0;
+  // rows above and below b, full width
+  if (b.y > a.y) {
+    out[n++] = (Rect){.y = a.y, .x = a.x, .h = b.y - a.y, .w = a.w};
+  }
+  if (by1 < ay1) {
+    out[n++] = (Rect){.y = by1, .x = a.x, .h = ay1 - by1, .w = a.w};
+  }
+  // and left and right of it, in the rows between
+  const int y0 = b.y > a.y ? b.y : a.y;
+  const int y1 = by1 < ay1 ? by1 : ay1;
+  if (b.x > a.x) {
+    out[n++] = (Rect){.y = y0, .x = a.x, .h = y1 - y0, .w = b.x - a.x};
+  }
+  if (bx1 < ax1) {
+    out[n++] = (Rect){.y = y0, .x = bx1, .h = y1 - y0, .w = ax1 - bx1};
+  }
+  return n;
+}
+
+void interest_free(Interest *in) {
+  for (int i = 0; i < in->rows * in->cols; i++) {
+    free(in->buckets[i].subs);
+  }
+  free(in->buckets);
+  free(in);
+}
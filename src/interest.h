@@ -0,0 +1,35 @@
+#ifndef interest_h
+#define interest_h
+
+#include <stdbool.h>
+
+/* Rectangle of cells */
+typedef struct {
+  int y, x;
+  int h, w;
+} Rect;
+
+/* Subscribers of one bucket */
+typedef struct {
+  void **subs;
+  int len, cap;
+} Interest_bucket;
+
+typedef struct {
+  int bucket_sz;           // rows and columns of cells in a bucket
+  int rows, cols;          // buckets down and across
+  int num_rows, num_cols;  // cells down and across
+  Interest_bucket *buckets;
+} Interest;
+
+Interest *interest_new(int num_rows, int num_cols, int bucket_sz);
+Rect interest_region(const Interest *in, Rect rect);
+void interest_add(Interest *in, void *sub, Rect region);
+void interest_remove(Interest *in, void *sub, Rect region);
+int interest_bucket(const Interest *in, int y, int x);
+bool interest_covers(const Interest *in, Rect region, int bucket);
+void *const *interest_subscribers(const Interest *in, int bucket, int *n);
+int interest_subtract(Rect a, Rect b, Rect out[4]);
+void interest_free(Interest *in);
+
+#endif
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "interest.h"
+#include "lib/minunit.h"
+
+static Interest *interest;
+static int subs[3];
+
+void test_setup(void) { interest = interest_new(100, 250, 32); }
+
+void test_teardown(void) { interest_free(interest); }
+
+static int has_sub(int bucket, void *sub) {
+  int n;
+  void *const *s = interest_subscribers(interest, bucket, &n);
+  int found = 0;
+  for (int i = 0; i < n; i++) {
+    found += s[i] == sub;
+  }
+  return found;
+}
+
+MU_TEST(test_interest_region) {
+  mu_assert_int_eq(4, interest->rows);
+  mu_assert_int_eq(8, interest->cols);
+
+  Rect r = interest_region(interest, (Rect){.y = 40, .x = 70, .h = 10, .w = 5});
+  mu_assert_int_eq(32, r.y);
+  mu_assert_int_eq(64, r.x);
+  mu_assert_int_eq(32, r.h);
+  mu_assert_int_eq(32, r.w);
+
+  // clipped to the canvas, whose last buckets are partial
+  r = interest_region(interest, (Rect){.y = -20, .x = 200, .h = 500, .w = 500});
+  mu_assert_int_eq(0, r.y);
+  mu_assert_int_eq(192, r.x);
+  mu_assert_int_eq(100, r.h);
+  mu_assert_int_eq(58, r.w);
+
+  r = interest_region(interest, (Rect){.y = 100, .x = 0, .h = 10, .w = 10});
+  mu_assert_int_eq(0, r.h);
+  mu_assert_int_eq(0, r.w);
+}
+
+MU_TEST(test_interest_subscribe) {
+  Rect a = interest_region(interest, (Rect){.y = 0, .x = 0, .h = 40, .w = 40});
+  Rect b = interest_region(interest, (Rect){.y = 50, .x = 50, .h = 50, .w = 200});
+  interest_add(interest, &subs[0], a);
+  interest_add(interest, &subs[1], b);
+
+  mu_assert_int_eq(1, has_sub(interest_bucket(interest, 0, 0), &subs[0]));
+  mu_assert_int_eq(1, has_sub(interest_bucket(interest, 63, 63), &subs[0]));
+  mu_assert_int_eq(0, has_sub(interest_bucket(interest, 64, 0), &subs[0]));
+  mu_assert_int_eq(1, has_sub(interest_bucket(interest, 99, 249), &subs[1]));
+  mu_assert_int_eq(0, has_sub(interest_bucket(interest, 0, 0), &subs[1]));
+  // both in the overlap
+  mu_assert_int_eq(1, has_sub(interest_bucket(interest, 40, 40), &subs[0]));
+  mu_assert_int_eq(1, has_sub(interest_bucket(interest, 40, 40), &subs[1]));
+  mu_check(interest_covers(interest, b, interest_bucket(interest, 99, 249)));
+  mu_check(!interest_covers(interest, b, interest_bucket(interest, 0, 249)));
+
+  interest_remove(interest, &subs[0], a);
+  int total = 0;
+  for (int i = 0; i < interest->rows * interest->cols; i++) {
+    total += has_sub(i, &subs[0]);
+  }
+  mu_assert_int_eq(0, total);
+  mu_assert_int_eq(1, has_sub(interest_bucket(interest, 40, 40), &subs[1]));
+}
+
+/* Every cell of a outside of b is in exactly one of the parts, and no other
+ * cells are.
+ */
+static int check_subtract(Rect a, Rect b) {
+  Rect parts[4];
+  const int n = interest_subtract(a, b, parts);
+  for (int y = -5; y < 60; y++) {
+    for (int x = -5; x < 60; x++) {
+      const int in_a = y >= a.y && y < a.y + a.h && x >= a.x && x < a.x + a.w;
+      const int in_b = y >= b.y && y < b.y + b.h && x >= b.x && x < b.x + b.w;
+      int count = 0;
+      for (int i = 0; i < n; i++) {
+        const Rect p = parts[i];
+        count += y >= p.y && y < p.y + p.h && x >= p.x && x < p.x + p.w;
+      }
+      if (count != (in_a && !in_b)) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+MU_TEST(test_interest_subtract) {
+  const Rect a = {.y = 10, .x = 10, .h = 30, .w = 30};
+  mu_check(check_subtract(a, (Rect){.y = 20, .x = 20, .h = 5, .w = 5}));
+  mu_check(check_subtract(a, (Rect){.y = 0, .x = 25, .h = 50, .w = 50}));
+  mu_check(check_subtract(a, (Rect){.y = 30, .x = 0, .h = 5, .w = 60}));
+  mu_check(check_subtract(a, (Rect){.y = 45, .x = 45, .h = 5, .w = 5}));
+  mu_check(check_subtract(a, (Rect){0}));
+  mu_check(check_subtract(a, a));
+  Rect parts[4];
+  mu_assert_int_eq(0, interest_subtract(a, (Rect){.y = 0, .x = 0, .h = 50,
+                                                  .w = 50}, parts));
+  mu_assert_int_eq(4, interest_subtract(a, (Rect){.y = 20, .x = 20, .h = 5,
+                                                  .w = 5}, parts));
+}
+
+MU_TEST_SUITE(interest_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_interest_region);
+  MU_RUN_TEST(test_interest_subscribe);
+  MU_RUN_TEST(test_interest_subtract);
+}
+
+int main(int argc, char const *argv[]) {
+  MU_RUN_SUITE(interest_main);
+  MU_REPORT();
+  return minunit_status;
+}
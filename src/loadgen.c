@@ -0,0 +1,739 @@
+/* Load generator: many clients drawing on a server at once, to see how it
+ * holds up
+ *
+ * Opens --clients connections to a server on this machine, each joining the
+ * way the client does (`v 2.0`, or `v 2.0 #room`, then waiting for the
+ * snapshot), and has each send --rate edits a second for --duration seconds,
+ * in one of these patterns:
+ *
+ * - cells: single cells at random
+ * - strokes: runs of STROKE_LEN cells next to each other, like a brush dragged
+ *   around
+ * - pastes: blocks of up to PASTE_H x PASTE_W random characters
+ * - mix: mostly strokes, with some cells and pastes
+ *
+ * The first cell of every edit is stamped with when it was sent, and the first
+ * time another connection is sent that cell with the same character, the time
+ * since is counted as an echo latency (the server doesn't send writers their
+ * own cells, so this takes at least two clients). Every other connection that
+ * is sent it counts as a relay delivered. The server only sends the last write
+ * of a cell in a tick, so relays that don't arrive before the cell is written
+ * again, or that lose to a write to the cell sent just before (which the
+ * server can take in either order), are counted as overwritten. At the end, a
+ * JSON report is printed with the percentiles of those latencies and of join
+ * times (connecting until the snapshot is in), and how much went each way:
+ *
+ *   {"clients": 50, "duration": 10.0, "pattern": "mix", "rate": 100,
+ *    "joins": {"busy": 0, "failed": 0, "ms": {"count": 50, "p50": 1.2, ...}},
+ *    "latency_ms": {"count": 49012, "p50": 10.4, "p90": ..., "max": ...},
+ *    "sent": {"ops": 50000, "cells": ..., "bytes": ..., "ops_per_s": ...,
+ *             "stalled": 0},
+ *    "received": {"ops": ..., "cells": ..., "bytes": ..., "cells_per_s": ...,
+ *                 "snapshots": 0},
+ *    "relays": {"expected": ..., "delivered": ..., "overwritten": ...,
+ *               "missing": 0}}
+ *
+ * where a relay is an edit reaching one of the other connections. Missing
+ * ones were neither delivered nor overwritten, so were lost, or sent in a
+ * snapshot to a connection that fell behind.
+ *
+ * Edits that come due while a connection has more than MAX_PENDING bytes it
+ * couldn't write yet are skipped and counted as stalled, which is the server
+ * pushing back.
+ *
+ * It only connects to localhost, so the network doesn't get in the way of
+ * what's measured. Run with something like
+ *
+ *   ./server.out -p 45011 & ./loadgen -p 45011 -c 50 -d 10
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lib/argtable3.h"
+
+#include "canvas.h"
+#include "proto.h"
+#include "stream.h"
+
+#ifndef VERSION
+#define VERSION "unknown"
+#endif
+
+#define STROKE_LEN 20          // cells in a brush stroke
+#define PASTE_H 8              // most rows in a paste
+#define PASTE_W 32             // most columns in a paste
+#define MAX_PENDING (1 << 20)  // unwritten bytes before edits are skipped
+#define MAX_JOIN_TRIES 10      // times to try joining a busy server
+#define JOIN_TIMEOUT_S 5       // longest to wait for the handshake
+#define DRAIN_MS 500           // time to wait for echoes after the last edit
+
+const char *program_name = "loadgen";
+const char *program_version = VERSION;
+
+enum { PATTERN_CELLS, PATTERN_STROKES, PATTERN_PASTES, PATTERN_MIX };
+const char *pattern_names[] = {"cells", "strokes", "pastes", "mix"};
+
+typedef struct {
+  int port;
+  char *room;
+  int clients;
+  double duration;
+  double rate;
+  int pattern;
+  unsigned seed;
+} arguments_t;
+
+/* A connection drawing on the server */
+typedef struct {
+  int fd;
+  int id;
+  Frame_buf out;       /* frames waiting to be written */
+  size_t out_off;      /* bytes of out already written */
+  Stream in;           /* bytes read but not yet parsed into frames */
+  int64_t next_send;   /* when its next edit is due (ns) */
+  int y, x;            /* brush position, for strokes */
+  int stroke_left;     /* cells left in the current stroke */
+  bool closed;
+} conn_t;
+
+/* When a cell was last written and with what, to time its echo and count
+ * its relays */
+typedef struct {
+  int64_t sent;     /* 0 once echoed */
+  int writer;       /* 0 if never written */
+  bool counted;     /* the first cell of an edit, whose relays are counted */
+  int relays;       /* other connections it's reached */
+  int beaten;       /* others sent the write before last, and not it yet */
+  char ch;
+  int prev_writer;  /* the write before */
+  char prev_ch;
+} probe_t;
+
+/* Growable list of samples (ns) */
+typedef struct {
+  int64_t *v;
+  size_t len, cap;
+} samples_t;
+
+conn_t *conns;
+int num_conns;
+struct sockaddr_in address;
+const char *room = "";
+int pattern;
+int num_rows, num_cols;  // of the canvas, from the first snapshot
+probe_t *probes;         // one for each cell
+uint64_t *probes_got;    // for each cell, a bit for each connection it reached
+uint64_t *probes_beaten; // and for each that was sent the write before after it
+int probe_words;         // words of those bits for a cell
+int num_joined;          // connections that joined, to relay each edit to
+
+samples_t join_times, latencies;
+long joins_busy, joins_failed;
+long ops_sent, cells_sent, bytes_sent, stalled;
+long ops_received, cells_received, bytes_received, snapshots_received;
+long relays_delivered, relays_overwritten;
+
+static int64_t now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void samples_add(samples_t *s, int64_t v) {
+  if (s->len == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    if ((s->v = realloc(s->v, s->cap * sizeof(int64_t))) == NULL) {
+      perror("samples realloc");
+      exit(1);
+    }
+  }
+  s->v[s->len++] = v;
+}
+
+/* Time the echo of each cell of an op sent to a connection.
+ */
+static void receive_op(conn_t *c, const Op *op, int64_t now) {
+  ops_received++;
+  for (int r = 0; r < op->h; r++) {
+    for (int col = 0; col < op->w; col++) {
+      const int y = op->y + r, x = op->x + col;
+      if (y >= num_rows || x >= num_cols) {
+        continue;
+      }
+      cells_received++;
+      const char ch = op->data ? op->data[r * op->stride + col] : op->ch;
+      probe_t *p = &probes[y * num_cols + x];
+      if (!p->counted || p->writer == c->id) {
+        continue;
+      }
+      if (p->sent != 0 && p->ch == ch) {
+        samples_add(&latencies, now - p->sent);
+        p->sent = 0;
+      }
+      const size_t word = (size_t)(y * num_cols + x) * probe_words + c->id / 64;
+      const uint64_t bit = 1ULL << c->id % 64;
+      if (p->ch == ch && !(probes_got[word] & bit)) {
+        probes_got[word] |= bit;
+        p->relays++;
+        relays_delivered++;
+        if (probes_beaten[word] & bit) {
+          p->beaten--;
+        }
+      } else if (p->ch != ch && p->prev_writer != 0 &&
+                 p->prev_writer != c->id && p->prev_ch == ch &&
+                 !(probes_got[word] & bit) && !(probes_beaten[word] & bit)) {
+        probes_beaten[word] |= bit;
+        p->beaten++;
+      }
+    }
+  }
+}
+
+/* Handle the frames read from a connection so far.
+ *
+ * Returns: 0, or -1 if the server sent something malformed or quit
+ */
+static int receive_frames(conn_t *c) {
+  const int64_t now = now_ns();
+  char type;
+  const char *payload;
+  size_t len;
+  int res;
+  while ((res = stream_next_frame(&c->in, &type, &payload, &len)) == 1) {
+    if (type == FRAME_QUIT) {
+      return -1;
+    }
+    if (type == FRAME_OPS) {
+      const char *p = payload;
+      Op op;
+      while (proto_next_op(&p, payload + len, &op) == 1) {
+        receive_op(c, &op, now);
+      }
+    } else if (type == FRAME_SNAPSHOT) {
+      // sent instead of updates when it fell behind
+      snapshots_received++;
+    }
+  }
+  return res;
+}
+
+/* Read everything waiting on a connection.
+ *
+ * Returns: 0, or -1 if it closed
+ */
+static int conn_read(conn_t *c) {
+  while (1) {
+    const ssize_t n = stream_read(&c->in, c->fd);
+    if (n == 0) {
+      return -1;
+    }
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    bytes_received += n;
+    if (receive_frames(c) < 0) {
+      return -1;
+    }
+  }
+}
+
+/* Write as much of a connection's pending frames as the socket takes.
+ *
+ * Returns: 0, or -1 if it closed
+ */
+static int conn_flush(conn_t *c) {
+  while (c->out_off < c->out.len) {
+    const ssize_t n =
+        write(c->fd, c->out.data + c->out_off, c->out.len - c->out_off);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    c->out_off += n;
+    bytes_sent += n;
+  }
+  c->out.len = c->out_off = 0;
+  return 0;
+}
+
+static char random_char() { return '!' + rand() % ('~' - '!' + 1); }
+
+/* Make the next edit of a connection's pattern, with data (if any) in buf.
+ */
+static Op next_edit(conn_t *c, char *buf) {
+  int kind = pattern;
+  if (kind == PATTERN_MIX) {
+    const int r = rand() % 100;
+    kind = r < 80 ? PATTERN_STROKES : r < 95 ? PATTERN_CELLS : PATTERN_PASTES;
+  }
+  if (kind == PATTERN_STROKES) {
+    if (c->stroke_left-- <= 0) {
+      c->y = rand() % num_rows;
+      c->x = rand() % num_cols;
+      c->stroke_left = STROKE_LEN - 1;
+    } else {
+      c->y += rand() % 3 - 1;
+      c->x += rand() % 3 - 1;
+      c->y = c->y < 0 ? 0 : c->y >= num_rows ? num_rows - 1 : c->y;
+      c->x = c->x < 0 ? 0 : c->x >= num_cols ? num_cols - 1 : c->x;
+    }
+    return (Op){.type = OP_CELL, .y = c->y, .x = c->x, .h = 1, .w = 1,
+                .ch = random_char()};
+  }
+  if (kind == PATTERN_PASTES) {
+    const int h = 1 + rand() % (PASTE_H < num_rows ? PASTE_H : num_rows);
+    const int w = 1 + rand() % (PASTE_W < num_cols ? PASTE_W : num_cols);
+    for (int i = 0; i < h * w; i++) {
+      buf[i] = random_char();
+    }
+    return (Op){.type = OP_BLIT, .y = rand() % (num_rows - h + 1),
+                .x = rand() % (num_cols - w + 1), .h = h, .w = w, .data = buf,
+                .stride = w};
+  }
+  return (Op){.type = OP_CELL, .y = rand() % num_rows, .x = rand() % num_cols,
+              .h = 1, .w = 1, .ch = random_char()};
+}
+
+/* Queue a connection's next edit, stamping its first cell.
+ */
+static void send_edit(conn_t *c, int64_t now) {
+  if (c->out.len - c->out_off > MAX_PENDING) {
+    stalled++;
+    return;
+  }
+  char buf[PASTE_H * PASTE_W];
+  const Op op = next_edit(c, buf);
+  proto_begin(&c->out, FRAME_OPS);
+  proto_put_op(&c->out, &op);
+  proto_end(&c->out);
+  // every cell written is noted, so the edits it overwrites are known, but
+  // only the first counts relays
+  for (int r = 0; r < op.h; r++) {
+    for (int col = 0; col < op.w; col++) {
+      const int cell = (op.y + r) * num_cols + op.x + col;
+      probe_t *p = &probes[cell];
+      if (p->counted) {
+        relays_overwritten += num_joined - 1 - p->relays;
+      }
+      const bool first = r == 0 && col == 0;
+      *p = (probe_t){.sent = first ? now : 0,
+                     .writer = c->id,
+                     .counted = first,
+                     .ch = op.data ? op.data[r * op.stride + col] : op.ch,
+                     .prev_writer = p->writer,
+                     .prev_ch = p->ch};
+      memset(&probes_got[(size_t)cell * probe_words], 0,
+             probe_words * sizeof(uint64_t));
+      memset(&probes_beaten[(size_t)cell * probe_words], 0,
+             probe_words * sizeof(uint64_t));
+    }
+  }
+  ops_sent++;
+  cells_sent += op.h * op.w;
+}
+
+/* Read the answer to a version request from a connection being joined.
+ *
+ * Returns: 0 once it's been let in, the milliseconds to wait if the server is
+ * busy, or -1 on errors
+ */
+static int read_handshake(conn_t *c) {
+  char *line;
+  while (!stream_next_line(&c->in, &line)) {
+    const ssize_t n = stream_read(&c->in, c->fd);
+    if (n <= 0) {
+      return -1;
+    }
+    bytes_received += n;
+  }
+  int retry_ms;
+  if (sscanf(line, "busy %d", &retry_ms) == 1 && retry_ms > 0) {
+    return retry_ms;
+  }
+  if (strcmp(line, "vok") != 0) {
+    fprintf(stderr, "failed to join: the server says '%s'\n", line);
+    return -1;
+  }
+  return 0;
+}
+
+/* Read frames from a connection being joined until the snapshot.
+ *
+ * Returns: 0, or -1 on errors
+ */
+static int read_snapshot(conn_t *c) {
+  while (1) {
+    char type;
+    const char *payload;
+    size_t len;
+    const int res = stream_next_frame(&c->in, &type, &payload, &len);
+    if (res < 0) {
+      return -1;
+    }
+    if (res > 0 && type == FRAME_SNAPSHOT) {
+      if (num_rows == 0) {
+        Canvas *canvas = proto_read_snapshot(payload, len);
+        if (canvas == NULL) {
+          return -1;
+        }
+        num_rows = canvas->num_rows;
+        num_cols = canvas->num_cols;
+        canvas_free(canvas);
+      }
+      return 0;
+    }
+    if (res > 0) {
+      continue;
+    }
+    const ssize_t r = stream_read(&c->in, c->fd);
+    if (r <= 0) {
+      return -1;
+    }
+    bytes_received += r;
+  }
+}
+
+/* Connect and join the server, the way the client's net_init does, retrying
+ * while the server says it's busy.
+ *
+ * Returns: 0 on success, -1 on errors
+ */
+static int conn_join(conn_t *c) {
+  for (int tries = 1; tries <= MAX_JOIN_TRIES; tries++) {
+    const int64_t start = now_ns();
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    const struct timeval timeout = {.tv_sec = JOIN_TIMEOUT_S};
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(c->fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+      perror("connect");
+      close(c->fd);
+      return -1;
+    }
+    char hello[64];
+    const int len = snprintf(hello, sizeof(hello), "v 2.0%s%s\n",
+                             room[0] ? " #" : "", room);
+    stream_free(&c->in);
+    int res = write(c->fd, hello, len) == len ? read_handshake(c) : -1;
+    if (res == 0 && (res = read_snapshot(c)) == 0) {
+      samples_add(&join_times, now_ns() - start);
+      const int one = 1;
+      setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      const struct timeval none = {0};
+      setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+      return 0;
+    }
+    close(c->fd);
+    if (res < 0) {
+      return -1;
+    }
+    joins_busy++;
+    usleep(res * 1000);
+  }
+  return -1;
+}
+
+static int cmp_samples(const void *a, const void *b) {
+  const int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Print the count and percentiles of samples, in ms.
+ */
+static void print_percentiles(samples_t *s) {
+  printf("{\"count\": %zu", s->len);
+  if (s->len > 0) {
+    qsort(s->v, s->len, sizeof(int64_t), cmp_samples);
+    const double ps[] = {50, 90, 99, 99.9};
+    const char *names[] = {"p50", "p90", "p99", "p999"};
+    for (int i = 0; i < 4; i++) {
+      printf(", \"%s\": %.3f", names[i],
+             s->v[(size_t)(s->len * ps[i] / 100)] / 1e6);
+    }
+    printf(", \"max\": %.3f", s->v[s->len - 1] / 1e6);
+  }
+  printf("}");
+}
+
+static void print_report(arguments_t *args, double seconds) {
+  printf("{\"clients\": %d, \"duration\": %.1f, \"pattern\": \"%s\", "
+         "\"rate\": %g,\n",
+         args->clients, seconds, pattern_names[args->pattern], args->rate);
+  printf(" \"joins\": {\"busy\": %ld, \"failed\": %ld, \"ms\": ", joins_busy,
+         joins_failed);
+  print_percentiles(&join_times);
+  printf("},\n \"latency_ms\": ");
+  print_percentiles(&latencies);
+  printf(",\n \"sent\": {\"ops\": %ld, \"cells\": %ld, \"bytes\": %ld, "
+         "\"ops_per_s\": %.1f, \"stalled\": %ld},\n",
+         ops_sent, cells_sent, bytes_sent, ops_sent / seconds, stalled);
+  printf(" \"received\": {\"ops\": %ld, \"cells\": %ld, \"bytes\": %ld, "
+         "\"cells_per_s\": %.1f, \"snapshots\": %ld},\n",
+         ops_received, cells_received, bytes_received,
+         cells_received / seconds, snapshots_received);
+  for (int i = 0; i < num_rows * num_cols; i++) {
+    // where the write before was taken last, its writer isn't sent the cell
+    const probe_t *p = &probes[i];
+    if (!p->counted) {
+      continue;
+    }
+    const int w = p->prev_writer;
+    const bool got_it = probes_got[(size_t)i * probe_words + w / 64] &
+                        1ULL << w % 64;
+    relays_overwritten += p->beaten + (p->beaten > 0 && !got_it);
+  }
+  const long expected = ops_sent * (num_joined - 1);
+  printf(" \"relays\": {\"expected\": %ld, \"delivered\": %ld, "
+         "\"overwritten\": %ld, \"missing\": %ld}}\n",
+         expected, relays_delivered, relays_overwritten,
+         expected - relays_delivered - relays_overwritten);
+}
+
+/* Watch a connection for reads, and for writes if it has frames pending.
+ */
+static void conn_watch(int epfd, conn_t *c, int op) {
+  struct epoll_event ev = {
+      .events = EPOLLIN | (c->out_off < c->out.len ? EPOLLOUT : 0),
+      .data.ptr = c,
+  };
+  epoll_ctl(epfd, op, c->fd, &ev);
+}
+
+/* Handle events on connections for up to timeout_ms.
+ */
+static void poll_conns(int epfd, int timeout_ms) {
+  struct epoll_event events[64];
+  const int n = epoll_wait(epfd, events, 64, timeout_ms);
+  for (int i = 0; i < n; i++) {
+    conn_t *c = events[i].data.ptr;
+    if (c->closed) {
+      continue;
+    }
+    int res = 0;
+    if (events[i].events & EPOLLIN) {
+      res = conn_read(c);
+    }
+    if (res == 0 && (events[i].events & EPOLLOUT) &&
+        (res = conn_flush(c)) == 0 && c->out_off == c->out.len) {
+      conn_watch(epfd, c, EPOLL_CTL_MOD);
+    }
+    if (res < 0 || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+      fprintf(stderr, "connection %d closed\n", c->id);
+      c->closed = true;
+      epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    }
+  }
+}
+
+/* Join every connection, then have them draw for the duration, and wait a
+ * little for the last echoes.
+ *
+ * Returns: the seconds spent drawing
+ */
+static double run(arguments_t *args) {
+  const int epfd = epoll_create1(0);
+  for (int i = 0; i < num_conns; i++) {
+    conn_t *c = &conns[i];
+    c->id = i + 1;
+    if (conn_join(c) < 0) {
+      joins_failed++;
+      c->closed = true;
+      continue;
+    }
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    conn_watch(epfd, c, EPOLL_CTL_ADD);
+    num_joined++;
+  }
+  if (num_rows == 0) {
+    fprintf(stderr, "no connections joined\n");
+    exit(1);
+  }
+  probes = calloc((size_t)num_rows * num_cols, sizeof(probe_t));
+  probe_words = num_conns / 64 + 1;
+  probes_got = calloc((size_t)num_rows * num_cols * probe_words,
+                      sizeof(uint64_t));
+  probes_beaten = calloc((size_t)num_rows * num_cols * probe_words,
+                         sizeof(uint64_t));
+  if (probes == NULL || probes_got == NULL || probes_beaten == NULL) {
+    perror("probes calloc");
+    exit(1);
+  }
+
+  // spread the connections' edits over the interval between them
+  const int64_t interval = (int64_t)(1e9 / args->rate);
+  const int64_t start = now_ns();
+  const int64_t end = start + (int64_t)(args->duration * 1e9);
+  for (int i = 0; i < num_conns; i++) {
+    conns[i].next_send = start + interval * i / num_conns;
+  }
+  int64_t now;
+  while ((now = now_ns()) < end) {
+    for (int i = 0; i < num_conns; i++) {
+      conn_t *c = &conns[i];
+      if (c->closed || c->next_send > now) {
+        continue;
+      }
+      const bool was_empty = c->out_off == c->out.len;
+      while (c->next_send <= now) {
+        send_edit(c, now);
+        c->next_send += interval;
+      }
+      if (conn_flush(c) < 0) {
+        c->closed = true;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+      } else if (was_empty != (c->out_off == c->out.len)) {
+        conn_watch(epfd, c, EPOLL_CTL_MOD);
+      }
+    }
+    poll_conns(epfd, 1);
+  }
+  const double seconds = (now - start) / 1e9;
+  while (now_ns() < end + DRAIN_MS * 1000000LL) {
+    poll_conns(epfd, 10);
+  }
+  for (int i = 0; i < num_conns; i++) {
+    if (!conns[i].closed) {
+      close(conns[i].fd);
+    }
+  }
+  close(epfd);
+  return seconds;
+}
+
+void parse_args(int argc, char *argv[], arguments_t *arguments) {
+  struct arg_lit *help, *version;
+  struct arg_int *port, *clients, *seed;
+  struct arg_dbl *duration, *rate;
+  struct arg_str *room_name, *pattern_name;
+  struct arg_end *end;
+
+  void *argtable[] = {
+      help = arg_litn(NULL, "help", 0, 1, "display this help and exit"),
+      version =
+          arg_litn(NULL, "version", 0, 1, "display version info and exit"),
+      port = arg_intn("p", "port", "<PORT>", 0, 1,
+                      "port of the server on localhost (default 45011)"),
+      room_name = arg_strn(NULL, "room", "<NAME>", 0, 1,
+                           "room to join (default the main one)"),
+      clients = arg_intn("c", "clients", "<n>", 0, 1,
+                         "connections to open (default 10)"),
+      duration = arg_dbln("d", "duration", "<s>", 0, 1,
+                          "seconds to draw for (default 10)"),
+      rate = arg_dbln("r", "rate", "<n>", 0, 1,
+                      "edits each connection sends a second (default 100)"),
+      pattern_name = arg_strn(NULL, "pattern", "<PATTERN>", 0, 1,
+                              "cells, strokes, pastes or mix (default mix)"),
+      seed = arg_intn(NULL, "seed", "<n>", 0, 1,
+                      "seed for the random edits (default 1)"),
+      end = arg_end(20),
+  };
+
+  int nerrors = arg_parse(argc, argv, argtable);
+
+  if (help->count > 0) {
+    printf("Usage: %s", program_name);
+    arg_print_syntax(stdout, argtable, "\n");
+    arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+    exit(0);
+  }
+
+  if (version->count > 0) {
+    printf("%s-%s\n", program_name, program_version);
+    exit(0);
+  }
+
+  if (nerrors > 0) {
+    arg_print_errors(stdout, end, program_name);
+    printf("Try '%s --help' for more information.\n", program_name);
+    exit(1);
+  }
+
+  if (port->count > 0) {
+    arguments->port = port->ival[0];
+  }
+  if (room_name->count > 0) {
+    arguments->room = strdup(room_name->sval[0]);
+  }
+  if (clients->count > 0) {
+    arguments->clients = clients->ival[0];
+  }
+  if (duration->count > 0) {
+    arguments->duration = duration->dval[0];
+  }
+  if (rate->count > 0) {
+    arguments->rate = rate->dval[0];
+  }
+  if (pattern_name->count > 0) {
+    arguments->pattern = -1;
+    for (int i = 0; i < 4; i++) {
+      if (strcmp(pattern_name->sval[0], pattern_names[i]) == 0) {
+        arguments->pattern = i;
+      }
+    }
+  }
+  if (seed->count > 0) {
+    arguments->seed = seed->ival[0];
+  }
+
+  arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+
+  if (arguments->clients < 1 || arguments->rate <= 0 ||
+      arguments->duration <= 0) {
+    fprintf(stderr, "clients, rate and duration must be positive\n");
+    exit(1);
+  }
+  if (arguments->pattern < 0) {
+    fprintf(stderr, "unknown pattern: try cells, strokes, pastes or mix\n");
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  arguments_t arguments = {
+      .port = 45011,
+      .room = "",
+      .clients = 10,
+      .duration = 10,
+      .rate = 100,
+      .pattern = PATTERN_MIX,
+      .seed = 1,
+  };
+  parse_args(argc, argv, &arguments);
+
+  signal(SIGPIPE, SIG_IGN);
+
+  /* Allow as many connections as the hard file limit */
+  struct rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+
+  srand(arguments.seed);
+  room = arguments.room;
+  pattern = arguments.pattern;
+  address = (struct sockaddr_in){
+      .sin_family = AF_INET,
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+      .sin_port = htons(arguments.port),
+  };
+  num_conns = arguments.clients;
+  conns = calloc(num_conns, sizeof(conn_t));
+
+  const double seconds = run(&arguments);
+  print_report(&arguments, seconds);
+  return 0;
+}
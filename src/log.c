@@ -0,0 +1,267 @@
+/* Logging that never waits on the disk
+ *
+ * Each thread that logs gets its own ring buffer of fixed-size records, which
+ * only it writes and only the flusher reads, so writing a line is formatting it
+ * into the next free record and publishing it with one atomic store: no locks,
+ * no system calls. A background thread wakes every LOG_FLUSH_MS, merges what
+ * every ring has by time, and writes it out. A thread that logs faster than
+ * that drains drops lines instead of blocking, and the next flush says how
+ * many were lost.
+ *
+ * Levels are filtered twice: at compile time by LOG_LEVEL (calls below it
+ * compile to nothing), and at run time by log_level (calls below it cost a
+ * load and a compare).
+ *
+ * Lines longer than a record are cut short.
+ */
+#include "log.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_RECORD_SZ 256   // bytes of a record, with its header
+#define LOG_RING_SZ 1024    // records a thread can have waiting
+#define LOG_FLUSH_MS 20     // time between flushes
+
+int log_level = LOG_LEVEL;
+
+typedef struct {
+  struct timespec time;  // when it was logged (wall clock)
+  int level;
+  int len;
+  char text[LOG_RECORD_SZ - sizeof(struct timespec) - 2 * sizeof(int)];
+} Log_record;
+
+/* Records of one thread, oldest first from tail up to head */
+typedef struct log_ring {
+  Log_record records[LOG_RING_SZ];
+  uint64_t head;     // next record to write (owner, released to the flusher)
+  uint64_t tail;     // next record to read (flusher, released to the owner)
+  uint64_t dropped;  // lines lost to a full ring since the last flush
+  int in_use;        // has an owner, or can be taken by a new thread
+  uint64_t pos, end; // of the flush in progress (flusher)
+  struct log_ring *next;
+} Log_ring;
+
+// every ring made, newest first; never shrinks, since the rings of exited
+// threads are reused
+static Log_ring *rings;
+
+static __thread Log_ring *this_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+// the flusher, and what it writes to
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher;
+static FILE *log_out;
+static bool started, stopping;
+
+static uint64_t total_dropped;
+
+/* Give the ring of an exiting thread back, for the next new one. */
+static void log_ring_release(void *ring) {
+  __atomic_store_n(&((Log_ring *)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void log_make_key() { pthread_key_create(&ring_key, log_ring_release); }
+
+/* Take a ring for this thread: one an exited thread left, or a new one.
+ *
+ * Returns: the ring, or NULL if there's no memory for one
+ */
+static Log_ring *log_ring_take() {
+  pthread_once(&ring_key_once, log_make_key);
+  Log_ring *ring;
+  for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL;
+       ring = ring->next) {
+    int free = 0;
+    if (__atomic_compare_exchange_n(&ring->in_use, &free, 1, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  if (ring == NULL) {
+    if ((ring = calloc(1, sizeof(Log_ring))) == NULL) {
+      return NULL;
+    }
+    ring->in_use = 1;
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+  }
+  pthread_setspecific(ring_key, ring);
+  return this_ring = ring;
+}
+
+/* Log a line (printf style) at a level, without waiting for it to be written.
+ *
+ * A newline at the end of it is left off, since each line gets one anyway.
+ * Use the log_* macros instead of calling this, so levels that are off cost
+ * next to nothing.
+ */
+void log_write(int level, const char *fmt, ...) {
+  Log_ring *ring = this_ring != NULL ? this_ring : log_ring_take();
+  if (ring == NULL) {
+    return;
+  }
+  const uint64_t head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SZ) {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  Log_record *r = &ring->records[head % LOG_RING_SZ];
+  clock_gettime(CLOCK_REALTIME, &r->time);
+  r->level = level;
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(r->text, sizeof(r->text), fmt, args);
+  va_end(args);
+  if (len < 0) {
+    len = 0;
+  } else if (len >= (int)sizeof(r->text)) {
+    len = sizeof(r->text) - 1;
+  }
+  if (len > 0 && r->text[len - 1] == '\n') {
+    len--;
+  }
+  r->len = len;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static const char LEVEL_NAMES[][6] = {"debug", "info", "warn", "error", "off"};
+
+/* Find a level by name, like "warn".
+ *
+ * Returns: the level, or -1 if there's none by that name
+ */
+int log_parse_level(const char *name) {
+  for (int i = LOG_DEBUG; i <= LOG_OFF; i++) {
+    if (strcmp(name, LEVEL_NAMES[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Write out everything logged so far, oldest first. Call with flush_mutex.
+ */
+static void log_drain() {
+  for (Log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+       ring != NULL; ring = ring->next) {
+    ring->pos = ring->tail;
+    ring->end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  }
+  while (1) {
+    Log_ring *oldest = NULL;
+    const Log_record *r = NULL;
+    for (Log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+         ring != NULL; ring = ring->next) {
+      const Log_record *next = &ring->records[ring->pos % LOG_RING_SZ];
+      if (ring->pos < ring->end &&
+          (r == NULL || next->time.tv_sec < r->time.tv_sec ||
+           (next->time.tv_sec == r->time.tv_sec &&
+            next->time.tv_nsec < r->time.tv_nsec))) {
+        oldest = ring;
+        r = next;
+      }
+    }
+    if (oldest == NULL) {
+      break;
+    }
+    if (log_out != NULL) {
+      struct tm tm;
+      char stamp[16];
+      localtime_r(&r->time.tv_sec, &tm);
+      strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+      fprintf(log_out, "%s.%06ld %c %.*s\n", stamp, r->time.tv_nsec / 1000,
+              "DIWE"[r->level], r->len, r->text);
+    }
+    oldest->pos++;
+  }
+  uint64_t dropped = 0;
+  for (Log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+       ring != NULL; ring = ring->next) {
+    __atomic_store_n(&ring->tail, ring->pos, __ATOMIC_RELEASE);
+    dropped += __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+  }
+  if (dropped > 0) {
+    __atomic_fetch_add(&total_dropped, dropped, __ATOMIC_RELAXED);
+    if (log_out != NULL) {
+      fprintf(log_out, "(%" PRIu64 " log lines dropped)\n", dropped);
+    }
+  }
+  if (log_out != NULL) {
+    fflush(log_out);
+  }
+}
+
+/* Flusher thread: write out what's been logged every LOG_FLUSH_MS, until
+ * log_stop.
+ */
+static void *log_run(void *arg) {
+  pthread_mutex_lock(&flush_mutex);
+  while (!stopping) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += LOG_FLUSH_MS * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&flush_cond, &flush_mutex, &until);
+    log_drain();
+  }
+  pthread_mutex_unlock(&flush_mutex);
+  return NULL;
+}
+
+/* Start writing logged lines to out, from a background thread.
+ *
+ * Lines logged before this are kept (as many as fit) and written once it's
+ * called.
+ */
+void log_start(FILE *out) {
+  pthread_mutex_lock(&flush_mutex);
+  log_out = out;
+  stopping = false;
+  pthread_mutex_unlock(&flush_mutex);
+  started = pthread_create(&flusher, NULL, log_run, NULL) == 0;
+}
+
+/* Write out everything logged so far, now (like before exiting). */
+void log_flush() {
+  pthread_mutex_lock(&flush_mutex);
+  log_drain();
+  pthread_mutex_unlock(&flush_mutex);
+}
+
+/* Write out what's left and stop the flusher. */
+void log_stop() {
+  if (started) {
+    pthread_mutex_lock(&flush_mutex);
+    stopping = true;
+    pthread_cond_signal(&flush_cond);
+    pthread_mutex_unlock(&flush_mutex);
+    pthread_join(flusher, NULL);
+    started = false;
+  }
+  log_flush();
+  log_out = NULL;
+}
+
+/* Returns: the number of lines lost to full rings so far (up to the last
+ * flush)
+ */
+uint64_t log_dropped() {
+  return __atomic_load_n(&total_dropped, __ATOMIC_RELAXED);
+}
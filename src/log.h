@@ -0,0 +1,81 @@
+#ifndef log_h
+#define log_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+// levels, least to most severe
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+#define LOG_OFF 4
+
+// least severe level compiled in: calls below it cost nothing, not even a
+// check of log_level (`-DLOG_LEVEL=...` to change it)
+#ifndef LOG_LEVEL
+#ifdef DEBUG
+#define LOG_LEVEL LOG_DEBUG
+#else
+#define LOG_LEVEL LOG_INFO
+#endif
+#endif
+
+// least severe level written, of the ones compiled in (LOG_LEVEL by default)
+extern int log_level;
+
+void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Dummy function that does nothing with variadic args, so the arguments to a
+ * call that's compiled out still count as used.
+ *
+ * Static b/c it shouldn't be used directly anywhere outside of this header.
+ * Inline b/c it fixes the "defined but not used" warning, and it will be called
+ * many times to do nothing.
+ * techniques for preventing unused variables/function warnings based on zf_log:
+ * https://github.com/wonder-mice/zf_log/
+ */
+static inline void _log_unused(const int dummy, ...) { (void)dummy; }
+
+#define _LOG_UNUSED(...)         \
+  do {                           \
+    _log_unused(0, __VA_ARGS__); \
+  } while (0)
+
+// write a line at a level, if it's on right now
+#define LOG_AT(level, ...)                                           \
+  do {                                                               \
+    if ((level) >= __atomic_load_n(&log_level, __ATOMIC_RELAXED)) { \
+      log_write((level), __VA_ARGS__);                               \
+    }                                                                \
+  } while (0)
+
+#if LOG_LEVEL <= LOG_DEBUG
+#define log_debug(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) _LOG_UNUSED(__VA_ARGS__)
+#endif
+#if LOG_LEVEL <= LOG_INFO
+#define log_info(...) LOG_AT(LOG_INFO, __VA_ARGS__)
+#else
+#define log_info(...) _LOG_UNUSED(__VA_ARGS__)
+#endif
+#if LOG_LEVEL <= LOG_WARN
+#define log_warn(...) LOG_AT(LOG_WARN, __VA_ARGS__)
+#else
+#define log_warn(...) _LOG_UNUSED(__VA_ARGS__)
+#endif
+#if LOG_LEVEL <= LOG_ERROR
+#define log_error(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
+#else
+#define log_error(...) _LOG_UNUSED(__VA_ARGS__)
+#endif
+
+int log_parse_level(const char *name);
+void log_start(FILE *out);
+void log_flush();
+void log_stop();
+uint64_t log_dropped();
+
+#endif
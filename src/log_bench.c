@@ -0,0 +1,70 @@
+/* Benchmark of what a log call costs the thread making it
+ *
+ * Times a million calls of each kind, with the flusher writing to /dev/null:
+ *
+ * - compiled out: a log_debug in a build without DEBUG
+ * - off: a log_info with log_level at LOG_WARN
+ * - on: a log_info that's written, with a couple of arguments to format
+ * - printf: the same line with fprintf to /dev/null, like the server used to
+ *
+ * and prints the time per call.
+ *
+ * Run with `make .run-log_bench.c`, or `make bench` for all benchmarks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "log.h"
+
+#define CALLS 1000000
+#define BATCH 512  // calls between pauses, so the flusher keeps up
+
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char const *argv[]) {
+  FILE *devnull = fopen("/dev/null", "w");
+  log_start(devnull);
+
+  double start = now();
+  for (int i = 0; i < CALLS; i++) {
+    log_debug("set %d %d", i, i);
+  }
+  printf("compiled out: %6.2f ns per call\n", (now() - start) / CALLS * 1e9);
+
+  log_level = LOG_WARN;
+  start = now();
+  for (int i = 0; i < CALLS; i++) {
+    log_info("set %d %d", i, i);
+  }
+  printf("off:          %6.2f ns per call\n", (now() - start) / CALLS * 1e9);
+
+  // only time the calls, not waiting for the flusher to make room
+  log_level = LOG_INFO;
+  double taken = 0;
+  for (int i = 0; i < CALLS; i += BATCH) {
+    start = now();
+    for (int j = i; j < i + BATCH; j++) {
+      log_info("client %d set (%d,%d)", j, j % 100, j / 100);
+    }
+    taken += now() - start;
+    log_flush();
+  }
+  printf("on:           %6.2f ns per call (%llu dropped)\n",
+         taken / CALLS * 1e9, (unsigned long long)log_dropped());
+
+  start = now();
+  for (int i = 0; i < CALLS; i++) {
+    fprintf(devnull, "client %d set (%d,%d)\n", i, i % 100, i / 100);
+    fflush(devnull);
+  }
+  printf("printf:       %6.2f ns per call\n", (now() - start) / CALLS * 1e9);
+
+  log_stop();
+  fclose(devnull);
+  return 0;
+}
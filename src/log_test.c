@@ -0,0 +1,123 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/minunit.h"
+#include "log.h"
+
+static FILE *out;
+static char *text;
+static size_t text_len;
+
+void test_setup(void) {
+  out = open_memstream(&text, &text_len);
+  log_level = LOG_INFO;
+  log_start(out);
+}
+
+void test_teardown(void) {
+  log_stop();
+  fclose(out);
+  free(text);
+}
+
+/* Count the lines written, once everything's flushed */
+static int count_lines() {
+  log_stop();
+  int n = 0;
+  for (size_t i = 0; i < text_len; i++) {
+    n += text[i] == '\n';
+  }
+  return n;
+}
+
+MU_TEST(test_log_levels) {
+  log_info("info %d", 1);
+  log_level = LOG_WARN;
+  log_info("info %d", 2);
+  log_warn("warn %d", 3);
+  log_error("error %s", "4");
+  log_level = LOG_OFF;
+  log_error("error 5");
+  mu_assert_int_eq(3, count_lines());
+  mu_check(strstr(text, " I info 1\n") != NULL);
+  mu_check(strstr(text, "info 2") == NULL);
+  mu_check(strstr(text, " W warn 3\n") != NULL);
+  mu_check(strstr(text, " E error 4\n") != NULL);
+  mu_check(strstr(text, "error 5") == NULL);
+}
+
+MU_TEST(test_log_newlines) {
+  // one line each, with or without a newline
+  log_info("with\n");
+  log_info("without");
+  char longer[1000];
+  memset(longer, 'x', sizeof(longer) - 1);
+  longer[sizeof(longer) - 1] = '\0';
+  log_info("%s", longer);
+  mu_assert_int_eq(3, count_lines());
+  mu_check(strstr(text, " I with\n") != NULL);
+  // cut short
+  mu_check(strstr(text, longer) == NULL);
+  mu_check(strstr(text, "xxxxxxxx\n") != NULL);
+}
+
+static void *log_lines(void *arg) {
+  for (int i = 0; i < 200; i++) {
+    log_info("thread %ld line %d", (long)arg, i);
+  }
+  return NULL;
+}
+
+MU_TEST(test_log_threads) {
+  pthread_t threads[4];
+  for (long i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, log_lines, (void *)i);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  mu_assert_int_eq(800, count_lines());
+  // merged oldest first, and each thread's lines in order
+  int next[4] = {0};
+  for (char *line = text, *prev = NULL; *line != '\0';
+       prev = line, line = strchr(line, '\n') + 1) {
+    mu_check(prev == NULL || strncmp(prev, line, 15) <= 0);
+    long thread;
+    int i;
+    mu_check(sscanf(line + 18, "thread %ld line %d", &thread, &i) == 2);
+    mu_assert_int_eq(next[thread]++, i);
+  }
+}
+
+MU_TEST(test_log_full) {
+  // with no one flushing, lines past what fits are dropped, not waited on
+  log_stop();
+  const uint64_t dropped = log_dropped();
+  for (int i = 0; i < 5000; i++) {
+    log_info("line %d", i);
+  }
+  log_start(out);
+  const int lines = count_lines();
+  mu_check(lines > 1 && lines < 5000);
+  // and counted
+  mu_check(log_dropped() - dropped == 5000 - (uint64_t)(lines - 1));
+  mu_check(strstr(text, " log lines dropped)\n") != NULL);
+  mu_check(strstr(text, " I line 0\n") != NULL);
+}
+
+MU_TEST_SUITE(log_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_log_levels);
+  MU_RUN_TEST(test_log_newlines);
+  MU_RUN_TEST(test_log_threads);
+  MU_RUN_TEST(test_log_full);
+}
+
+int main(int argc, char const *argv[]) {
+  MU_RUN_SUITE(log_main);
+  MU_REPORT();
+  return minunit_status;
+}
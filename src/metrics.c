@@ -0,0 +1,119 @@
+/* Counters, gauges and histograms, and reports of them
+ *
+ * Metrics are updated with relaxed atomics from whatever thread does the
+ * work, so keeping them costs an add, and are read by whoever reports them.
+ * A report is either in the Prometheus text format:
+ *
+ *   # HELP collascii_ops_in_total Ops applied to canvases
+ *   # TYPE collascii_ops_in_total counter
+ *   collascii_ops_in_total 1234
+ *
+ * with histograms as cumulative `_bucket{le="..."}` lines and their `_sum` and
+ * `_count`, or a JSON object of the same, with counters' rates per second:
+ *
+ *   {"counters": {"collascii_ops_in_total": {"value": 1234, "rate": 56.0}},
+ *    "gauges": {...}, "histograms": {"name": {"count": 3, "sum": 0.02,
+ *    "buckets": [{"le": 1e-05, "count": 1}, ..., {"le": "+Inf", ...}]}}}
+ *
+ * Rates are over the time between the last two calls to metrics_sample.
+ */
+#include "metrics.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Count a value in a histogram. Safe to call from any thread.
+ */
+void metrics_observe(Histogram *h, uint64_t value) {
+  int i = 0;
+  while (i < METRICS_BUCKETS && value > h->first << i) {
+    i++;
+  }
+  atomic_fetch_add_explicit(&h->buckets[i], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+}
+
+/* Work out counters' rates since the last sample, seconds ago.
+ *
+ * Call from one thread at a time.
+ */
+void metrics_sample(Metrics *m, double seconds) {
+  for (int i = 0; i < m->num_counters; i++) {
+    Counter *c = m->counters[i];
+    const uint64_t value = atomic_load(&c->value);
+    c->rate = seconds > 0 ? (value - c->sampled) / seconds : 0;
+    c->sampled = value;
+  }
+}
+
+/* Write a report in the Prometheus text format.
+ */
+void metrics_prometheus(FILE *f, Metrics *m) {
+  for (int i = 0; i < m->num_counters; i++) {
+    const Counter *c = m->counters[i];
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", c->name, c->help,
+            c->name, c->name, (unsigned long)atomic_load(&c->value));
+  }
+  for (int i = 0; i < m->num_gauges; i++) {
+    const Gauge *g = m->gauges[i];
+    fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n%s %ld\n", g->name, g->help,
+            g->name, g->name, (long)atomic_load(&g->value));
+  }
+  for (int i = 0; i < m->num_histograms; i++) {
+    Histogram *h = m->histograms[i];
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", h->name, h->help,
+            h->name);
+    uint64_t total = 0;
+    for (int b = 0; b <= METRICS_BUCKETS; b++) {
+      total += atomic_load(&h->buckets[b]);
+      if (b < METRICS_BUCKETS) {
+        fprintf(f, "%s_bucket{le=\"%g\"} %lu\n", h->name,
+                (double)(h->first << b) * h->scale, (unsigned long)total);
+      } else {
+        fprintf(f, "%s_bucket{le=\"+Inf\"} %lu\n", h->name,
+                (unsigned long)total);
+      }
+    }
+    fprintf(f, "%s_sum %g\n%s_count %lu\n", h->name,
+            atomic_load(&h->sum) * h->scale, h->name, (unsigned long)total);
+  }
+}
+
+/* Write a report as a JSON object.
+ */
+void metrics_json(FILE *f, Metrics *m) {
+  fprintf(f, "{\"counters\": {");
+  for (int i = 0; i < m->num_counters; i++) {
+    const Counter *c = m->counters[i];
+    fprintf(f, "%s\n  \"%s\": {\"value\": %lu, \"rate\": %.1f}",
+            i ? "," : "", c->name, (unsigned long)atomic_load(&c->value),
+            c->rate);
+  }
+  fprintf(f, "},\n\"gauges\": {");
+  for (int i = 0; i < m->num_gauges; i++) {
+    const Gauge *g = m->gauges[i];
+    fprintf(f, "%s\n  \"%s\": %ld", i ? "," : "", g->name,
+            (long)atomic_load(&g->value));
+  }
+  fprintf(f, "},\n\"histograms\": {");
+  for (int i = 0; i < m->num_histograms; i++) {
+    Histogram *h = m->histograms[i];
+    fprintf(f, "%s\n  \"%s\": {\"count\": %lu, \"sum\": %g, \"buckets\": [",
+            i ? "," : "", h->name, (unsigned long)atomic_load(&h->count),
+            atomic_load(&h->sum) * h->scale);
+    uint64_t total = 0;
+    for (int b = 0; b <= METRICS_BUCKETS; b++) {
+      total += atomic_load(&h->buckets[b]);
+      if (b < METRICS_BUCKETS) {
+        fprintf(f, "%s{\"le\": %g, \"count\": %lu}", b ? ", " : "",
+                (double)(h->first << b) * h->scale, (unsigned long)total);
+      } else {
+        fprintf(f, ", {\"le\": \"+Inf\", \"count\": %lu}]}",
+                (unsigned long)total);
+      }
+    }
+  }
+  fprintf(f, "}}\n");
+}
@@ -0,0 +1,65 @@
+#ifndef metrics_h
+#define metrics_h
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define METRICS_BUCKETS 16  // buckets of a histogram, besides +Inf
+
+/* A count that only goes up, with its rate over the last sample */
+typedef struct {
+  const char *name, *help;
+  _Atomic uint64_t value;
+  uint64_t sampled;  // value at the last sample
+  double rate;       // per second between the last two samples
+} Counter;
+
+/* A value that goes up and down */
+typedef struct {
+  const char *name, *help;
+  _Atomic int64_t value;
+} Gauge;
+
+/* Counts of values in buckets that double in size: bucket i holds values up
+ * to first << i, and the last values bigger than all of them.
+ */
+typedef struct {
+  const char *name, *help;
+  uint64_t first;  // upper bound of the first bucket
+  double scale;    // what a value is in the unit shown, like 1e-9 for ns
+  _Atomic uint64_t buckets[METRICS_BUCKETS + 1];
+  _Atomic uint64_t count, sum;
+} Histogram;
+
+/* Everything a server reports */
+typedef struct {
+  Counter **counters;
+  int num_counters;
+  Gauge **gauges;
+  int num_gauges;
+  Histogram **histograms;
+  int num_histograms;
+} Metrics;
+
+/* Add n to a counter. Safe to call from any thread. */
+static inline void metrics_add(Counter *c, uint64_t n) {
+  atomic_fetch_add_explicit(&c->value, n, memory_order_relaxed);
+}
+
+/* Set a gauge. Safe to call from any thread. */
+static inline void metrics_set(Gauge *g, int64_t value) {
+  atomic_store_explicit(&g->value, value, memory_order_relaxed);
+}
+
+/* Add n (which can be negative) to a gauge. Safe to call from any thread. */
+static inline void metrics_add_gauge(Gauge *g, int64_t n) {
+  atomic_fetch_add_explicit(&g->value, n, memory_order_relaxed);
+}
+
+void metrics_observe(Histogram *h, uint64_t value);
+void metrics_sample(Metrics *m, double seconds);
+void metrics_prometheus(FILE *f, Metrics *m);
+void metrics_json(FILE *f, Metrics *m);
+
+#endif
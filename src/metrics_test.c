@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/minunit.h"
+#include "metrics.h"
+
+static Counter ops = {"test_ops_total", "Ops done"};
+static Gauge clients = {"test_clients", "Clients connected"};
+static Histogram latency = {"test_latency_seconds", "Time taken", 1000, 1e-9};
+static Counter *counters[] = {&ops};
+static Gauge *gauges[] = {&clients};
+static Histogram *histograms[] = {&latency};
+static Metrics metrics = {counters, 1, gauges, 1, histograms, 1};
+
+static char *report;
+static size_t report_len;
+
+void test_setup(void) {
+  ops = (Counter){"test_ops_total", "Ops done"};
+  clients = (Gauge){"test_clients", "Clients connected"};
+  latency = (Histogram){"test_latency_seconds", "Time taken", 1000, 1e-9};
+  report = NULL;
+}
+
+void test_teardown(void) { free(report); }
+
+static void write_report(void (*write)(FILE *, Metrics *)) {
+  free(report);
+  FILE *f = open_memstream(&report, &report_len);
+  write(f, &metrics);
+  fclose(f);
+}
+
+MU_TEST(test_metrics_observe) {
+  metrics_observe(&latency, 0);
+  metrics_observe(&latency, 1000);  // edges go in the lower bucket
+  metrics_observe(&latency, 1001);
+  metrics_observe(&latency, 5000);
+  metrics_observe(&latency, 1000ULL << 40);
+  mu_assert_int_eq(2, latency.buckets[0]);
+  mu_assert_int_eq(1, latency.buckets[1]);
+  mu_assert_int_eq(1, latency.buckets[3]);
+  mu_assert_int_eq(1, latency.buckets[METRICS_BUCKETS]);
+  mu_assert_int_eq(5, latency.count);
+}
+
+MU_TEST(test_metrics_sample) {
+  metrics_add(&ops, 10);
+  metrics_sample(&metrics, 1);
+  mu_assert_double_eq(10, ops.rate);
+  metrics_add(&ops, 50);
+  metrics_sample(&metrics, 2);
+  mu_assert_double_eq(25, ops.rate);
+  mu_assert_int_eq(60, ops.value);
+}
+
+MU_TEST(test_metrics_prometheus) {
+  metrics_add(&ops, 7);
+  metrics_set(&clients, 3);
+  metrics_observe(&latency, 500);
+  metrics_observe(&latency, 3000);
+  write_report(metrics_prometheus);
+  mu_check(strstr(report, "# TYPE test_ops_total counter\ntest_ops_total 7\n"));
+  mu_check(strstr(report, "# TYPE test_clients gauge\ntest_clients 3\n"));
+  mu_check(strstr(report, "# TYPE test_latency_seconds histogram\n"));
+  // buckets are cumulative
+  mu_check(strstr(report, "test_latency_seconds_bucket{le=\"1e-06\"} 1\n"));
+  mu_check(strstr(report, "test_latency_seconds_bucket{le=\"2e-06\"} 1\n"));
+  mu_check(strstr(report, "test_latency_seconds_bucket{le=\"4e-06\"} 2\n"));
+  mu_check(strstr(report, "test_latency_seconds_bucket{le=\"+Inf\"} 2\n"));
+  mu_check(strstr(report, "test_latency_seconds_sum 3.5e-06\n"));
+  mu_check(strstr(report, "test_latency_seconds_count 2\n"));
+}
+
+MU_TEST(test_metrics_json) {
+  metrics_add(&ops, 7);
+  metrics_sample(&metrics, 0.5);
+  metrics_set(&clients, 3);
+  metrics_observe(&latency, 3000);
+  write_report(metrics_json);
+  mu_check(strstr(report, "\"test_ops_total\": {\"value\": 7, \"rate\": 14.0}"));
+  mu_check(strstr(report, "\"test_clients\": 3"));
+  mu_check(strstr(report, "\"test_latency_seconds\": {\"count\": 1"));
+  mu_check(strstr(report, "{\"le\": 2e-06, \"count\": 0}, "
+                          "{\"le\": 4e-06, \"count\": 1}"));
+  mu_check(strstr(report, "{\"le\": \"+Inf\", \"count\": 1}]}"));
+  // balanced, and nothing after the object
+  int depth = 0, min_depth = 0;
+  for (char *p = report; *p; p++) {
+    depth += (*p == '{' || *p == '[') - (*p == '}' || *p == ']');
+    min_depth = depth < min_depth ? depth : min_depth;
+  }
+  mu_assert_int_eq(0, depth);
+  mu_assert_int_eq(0, min_depth);
+  mu_assert_string_eq("}}\n", report + report_len - 3);
+}
+
+MU_TEST_SUITE(metrics_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_metrics_observe);
+  MU_RUN_TEST(test_metrics_sample);
+  MU_RUN_TEST(test_metrics_prometheus);
+  MU_RUN_TEST(test_metrics_json);
+}
+
+int main(int argc, char const *argv[]) {
+  MU_RUN_SUITE(metrics_main);
+  MU_REPORT();
+  return minunit_status;
+}
@@ -0,0 +1,69 @@
+/* Lock-free multi-producer, single-consumer queue
+ *
+ * An intrusive linked list (after Dmitry Vyukov's): a producer swaps its node
+ * in as the new head with a single atomic exchange and then links the old
+ * head to it, so pushes never block or retry, however many threads push at
+ * once. The consumer owns the tail and follows the links. Nodes come out in
+ * the order their exchanges happened, so each producer's nodes stay in the
+ * order it pushed them.
+ *
+ * Items embed an Mpsc_node and are owned by whoever popped them.
+ */
+#include "mpsc.h"
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+void mpsc_init(Mpsc *q) {
+  atomic_store(&q->stub.next, NULL);
+  atomic_store(&q->head, &q->stub);
+  q->tail = &q->stub;
+}
+
+/* Add a node. Safe to call from any thread.
+ */
+void mpsc_push(Mpsc *q, Mpsc_node *node) {
+  atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+  Mpsc_node *prev = atomic_exchange_explicit(&q->head, node,
+                                             memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/* Wait for the producer that swapped in the node after n to link it.
+ *
+ * It's between two instructions, so this is short.
+ */
+static Mpsc_node *next_of(Mpsc *q, Mpsc_node *n) {
+  Mpsc_node *next;
+  while ((next = atomic_load_explicit(&n->next, memory_order_acquire)) ==
+             NULL &&
+         atomic_load_explicit(&q->head, memory_order_acquire) != n) {
+    sched_yield();
+  }
+  return next;
+}
+
+/* Take the oldest node. Only call from the consumer thread.
+ *
+ * Returns: the node, or NULL if the queue is empty
+ */
+Mpsc_node *mpsc_pop(Mpsc *q) {
+  Mpsc_node *tail = q->tail;
+  Mpsc_node *next = next_of(q, tail);
+  if (tail == &q->stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    q->tail = tail = next;
+    next = next_of(q, tail);
+  }
+  if (next != NULL) {
+    q->tail = next;
+    return tail;
+  }
+  // tail is the last node: put the stub behind it so it can be taken
+  mpsc_push(q, &q->stub);
+  q->tail = next_of(q, tail);
+  return tail;
+}
@@ -0,0 +1,23 @@
+#ifndef mpsc_h
+#define mpsc_h
+
+#include <stdatomic.h>
+
+/* Link embedded in each item of a queue */
+typedef struct mpsc_node {
+  struct mpsc_node *_Atomic next;
+} Mpsc_node;
+
+/* Queue that any number of threads push to and one thread pops from.
+ */
+typedef struct {
+  Mpsc_node *_Atomic head;  // newest node, where producers push
+  Mpsc_node *tail;          // oldest node, only touched by the consumer
+  Mpsc_node stub;           // kept in the queue so it's never really empty
+} Mpsc;
+
+void mpsc_init(Mpsc *q);
+void mpsc_push(Mpsc *q, Mpsc_node *node);
+Mpsc_node *mpsc_pop(Mpsc *q);
+
+#endif
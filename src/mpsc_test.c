@@ -0,0 +1,142 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "canvas.h"
+#include "lib/minunit.h"
+#include "mpsc.h"
+
+#define NUM_WRITERS 64
+#define NUM_EDITS 2000  // per writer
+#define SHARED_ROW NUM_WRITERS
+
+/* A cell written by one of the writers */
+typedef struct {
+  Mpsc_node node;
+  int writer, seq;
+  int y, x;
+  char ch;
+} edit_t;
+
+static Mpsc queue;
+static Canvas *canvas;
+static edit_t *applied[NUM_WRITERS * NUM_EDITS];
+
+void test_setup(void) {
+  mpsc_init(&queue);
+  canvas = canvas_new_blank(NUM_WRITERS + 1, 64);
+}
+
+void test_teardown(void) { canvas_free(canvas); }
+
+static char edit_ch(int writer, int seq) {
+  return '!' + (writer * 7 + seq) % 90;
+}
+
+/* Write cells in the writer's own row and in the row all writers share.
+ */
+static void *writer_run(void *arg) {
+  const int writer = (long)arg;
+  for (int seq = 0; seq < NUM_EDITS; seq++) {
+    edit_t *e = malloc(sizeof(edit_t));
+    e->writer = writer;
+    e->seq = seq;
+    e->y = seq % 2 ? SHARED_ROW : writer;
+    e->x = (seq * 13) % 64;
+    e->ch = edit_ch(writer, seq);
+    mpsc_push(&queue, &e->node);
+  }
+  return NULL;
+}
+
+MU_TEST(test_mpsc_empty) {
+  mu_check(mpsc_pop(&queue) == NULL);
+  edit_t e = {.seq = 1};
+  mpsc_push(&queue, &e.node);
+  mu_check(mpsc_pop(&queue) == &e.node);
+  mu_check(mpsc_pop(&queue) == NULL);
+  mpsc_push(&queue, &e.node);
+  mu_check(mpsc_pop(&queue) == &e.node);
+}
+
+MU_TEST(test_mpsc_order) {
+  edit_t e[3];
+  for (int i = 0; i < 3; i++) {
+    mpsc_push(&queue, &e[i].node);
+  }
+  for (int i = 0; i < 3; i++) {
+    mu_check(mpsc_pop(&queue) == &e[i].node);
+  }
+  mu_check(mpsc_pop(&queue) == NULL);
+}
+
+/* 64 writers push edits while this thread applies them to the canvas, like the
+ * server's canvas thread. The canvas must come out the same as applying the
+ * edits one by one in the order they were popped, and each writer's edits
+ * must be popped in the order it pushed them.
+ */
+MU_TEST(test_mpsc_stress) {
+  pthread_t writers[NUM_WRITERS];
+  for (long i = 0; i < NUM_WRITERS; i++) {
+    pthread_create(&writers[i], NULL, writer_run, (void *)i);
+  }
+  int num_applied = 0;
+  while (num_applied < NUM_WRITERS * NUM_EDITS) {
+    Mpsc_node *n = mpsc_pop(&queue);
+    if (n == NULL) {
+      continue;
+    }
+    edit_t *e = (edit_t *)n;
+    canvas_scharyx(canvas, e->y, e->x, e->ch);
+    applied[num_applied++] = e;
+  }
+  for (int i = 0; i < NUM_WRITERS; i++) {
+    pthread_join(writers[i], NULL);
+  }
+  mu_check(mpsc_pop(&queue) == NULL);
+
+  int next_seq[NUM_WRITERS] = {0};
+  int out_of_order = 0;
+  Canvas *replay = canvas_new_blank(NUM_WRITERS + 1, 64);
+  for (int i = 0; i < num_applied; i++) {
+    edit_t *e = applied[i];
+    out_of_order += e->seq != next_seq[e->writer]++;
+    canvas_scharyx(replay, e->y, e->x, e->ch);
+  }
+  mu_assert_int_eq(0, out_of_order);
+  mu_check(canvas_eq(canvas, replay));
+
+  // each writer's own row only depends on its own order
+  Canvas *own = canvas_new_blank(NUM_WRITERS + 1, 64);
+  for (int w = 0; w < NUM_WRITERS; w++) {
+    for (int seq = 0; seq < NUM_EDITS; seq += 2) {
+      canvas_scharyx(own, w, (seq * 13) % 64, edit_ch(w, seq));
+    }
+  }
+  int differ = 0;
+  for (int w = 0; w < NUM_WRITERS; w++) {
+    for (int x = 0; x < 64; x++) {
+      differ += canvas_gcharyx(own, w, x) != canvas_gcharyx(canvas, w, x);
+    }
+  }
+  mu_assert_int_eq(0, differ);
+  canvas_free(own);
+  canvas_free(replay);
+  for (int i = 0; i < num_applied; i++) {
+    free(applied[i]);
+  }
+}
+
+MU_TEST_SUITE(mpsc_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_mpsc_empty);
+  MU_RUN_TEST(test_mpsc_order);
+  MU_RUN_TEST(test_mpsc_stress);
+}
+
+int main(int argc, char const *argv[]) {
+  MU_RUN_SUITE(mpsc_main);
+  MU_REPORT();
+  return minunit_status;
+}
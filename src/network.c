@@ -1,163 +1,1103 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "canvas.h"
 #include "network.h"
+#include "presence.h"
+#include "proto.h"
+#include "shm.h"
+#include "stream.h"
+#include "tiles.h"
 #include "util.h"
 #include "view.h"
 
 /* Network Client Variables */
-fd_set testfds, clientfds;
-char *msg_buf;
-size_t msg_size;
 int port = 45011;
 int fd;
 int sockfd;
-FILE *sockstream;
+Stream in;              // what's been read from the server but not handled
+char server_reply[80];  // what it said to our version request
 int result;
 char *hostname;
 struct hostent *hostinfo;
 struct sockaddr_in address;
+struct sockaddr_un local_address;  // the server's local socket, if local
+bool local = false;
 struct addrinfo hints, *servinfo;
 
-const char *PROTOCOL_VERSION = "1.0";
+// protocol versions to ask for, newest first
+const char *PROTOCOL_VERSIONS[] = {"2.0", "1.0"};
+#define NUM_PROTOCOL_VERSIONS 2
+int protocol = 0;  // major version agreed on with the server
+const char *protocol_version;  // and its full name
 
-/* Connects to server and returns its canvas
+// room to join on the server, or "" for its main room
+char *room = "";
+
+// version of the canvas, if the server has told us
+uint64_t canvas_version;
+bool have_version = false;
+
+// edits and views waiting to be sent (frames for 2.0, lines for 1.0), so a
+// burst of them, like a paste or a brush stroke, goes out in one write: see
+// net_flush
+#define NET_FLUSH_MS 10        // least time between writes, unless...
+#define NET_FLUSH_BYTES 16384  // ...this much is waiting
+Frame_buf send_frames;
+bool ops_open = false;  // an ops frame is being written at the end of it
+Op_run send_run;        // cells of that frame not put in it yet
+int64_t flushed_ms;     // when it was last written out
+int queued_ops;         // edits in it (cells for 1.0)
+
+// how well they went out together, for net_log_stats
+long flushes, flush_writes, flush_bytes, flush_ops;
+
+// part of the canvas the server sends us updates for, once we've told it
+bool view_sent = false;
+int view_sent_y, view_sent_x, view_sent_h, view_sent_w;
+
+// times to try joining a server that says it's busy
+#define MAX_JOIN_TRIES 10
+
+// for 1.0, the size of a resynced canvas whose line hasn't been read yet
+bool resyncing = false;
+int resync_rows, resync_cols;
+
+// the server's shared copy of the canvas, once a local server has named it
+Shm_canvas shm;
+
+// the canvas as it's sent in tiles, until they've all arrived (see tiles.c)
+Tiles *tiles = NULL;
+
+// cells of the canvas changed by the server since the frontend last asked (see
+// net_take_damage)
+bool damaged = false;
+Rect damage;
+
+// most read from the socket in one net_handler, so a server sending nonstop
+// can't keep keys from being handled
+#define MAX_HANDLER_READ (1 << 20)
+
+// sharing cursors with the rest of the room over UDP (see presence.c), once the
+// server has told us how
+#define PRESENCE_SEND_MS 33      // shortest time between sending our cursor
+#define PRESENCE_RESEND_MS 1000  // time our cursor is sent again if unchanged
+#define PRESENCE_EXPIRE_MS 3000  // others' cursors not heard of in this long
+                                 // are forgotten
+#define MAX_CURSORS 64           // others' cursors kept
+int presence_fd = -1;
+int presence_uid;
+uint64_t presence_token;
+uint32_t presence_seq;
+Presence_cursor presence_sent;  // our cursor as last sent
+int64_t presence_sent_ms;
+bool presence_waiting = false;  // it moved since, too soon to send again
+Presence_cursor cursors[MAX_CURSORS];  // others' cursors
+int64_t cursors_heard_ms[MAX_CURSORS];
+int num_cursors = 0;
+// cells where cursors were or now are, to redraw after net_presence_handler
+Rect cursor_damage[2 * MAX_CURSORS];
+int num_cursor_damage = 0;
+
+/* Milliseconds on the monotonic clock */
+static int64_t net_now_ms() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/* Wait for more from the server.
  *
+ * Returns: 0, or -1 if the connection closed
  */
-Canvas *net_init(char *in_hostname, char *in_port) {
-  Canvas *canvas;
+static int net_fill() {
+  ssize_t n;
+  while ((n = stream_read(&in, sockfd)) < 0 && errno == EINTR) {
+  }
+  return n > 0 ? 0 : -1;
+}
 
-  // Set port and hostname
-  if (strcmp(in_port, "")) {
-    logd("setting port to %s\n", in_port);
-    sscanf(in_port, "%i", &port);
+/* Read a whole line from the server, waiting for it.
+ *
+ * Returns: the line without its newline (valid until the next read), or NULL
+ * if the connection closed
+ */
+static char *net_read_line() {
+  char *line;
+  while (!stream_next_line(&in, &line)) {
+    if (net_fill() < 0) {
+      return NULL;
+    }
   }
-  hostname = strdup(in_hostname);
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  hostinfo = gethostbyname(hostname);
-  address.sin_addr = *(struct in_addr *)*hostinfo->h_addr_list;
-  address.sin_family = AF_INET;
-  address.sin_port = htons(port);
+  return line;
+}
 
-  logd("Trying to connect to %s:%i\n", in_hostname, port);
+/* Read a whole 2.0 frame from the server, waiting for it.
+ *
+ * Returns: the payload (valid until the next read), or NULL if the connection
+ * closed or sent something malformed
+ */
+static const char *net_read_frame(char *type, size_t *len) {
+  const char *payload;
+  int res;
+  while ((res = stream_next_frame(&in, type, &payload, len)) == 0) {
+    if (net_fill() < 0) {
+      return NULL;
+    }
+  }
+  return res < 0 ? NULL : payload;
+}
 
-  if (connect(sockfd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+/* Connect to the server and ask for a protocol version, exiting on errors.
+ *
+ * When reconnecting, the new connection takes the place of the old socket
+ * (keeping its descriptor), and the server is told the last canvas version we
+ * saw so it can send just what we missed.
+ *
+ * Returns: 0 on success, -1 if the server doesn't speak that version, -2 if
+ * reconnecting failed, or the milliseconds the server asked to wait before
+ * trying again if it's too busy to take the connection
+ */
+static int net_connect(const char *version, bool reconnect) {
+  int s = socket(local ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+  const int res =
+      local ? connect(s, (struct sockaddr *)&local_address,
+                      sizeof(local_address))
+            : connect(s, (struct sockaddr *)&address, sizeof(address));
+  if (res < 0) {
+    if (reconnect) {
+      close(s);
+      return -2;
+    }
     perror("Failed connecting to server");
     exit(1);
   }
   logd("Connected to server successfully\n");
-
-  FD_ZERO(&clientfds);
-  FD_SET(sockfd, &clientfds);
-  FD_SET(0, &clientfds);  // stdin
-
-  sockstream = fdopen(sockfd, "r+");
+  if (!local) {
+    // edits are held back to go out together already (see net_flush), so
+    // don't hold them back any more
+    const int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  if (reconnect && s != sockfd) {
+    dup2(s, sockfd);
+    close(s);
+  } else {
+    sockfd = s;
+  }
+  // nothing from an old connection carries over
+  stream_free(&in);
+  resyncing = false;
 
   // "negotiate" protocol version
-  char version_request_msg[16];
-  snprintf(version_request_msg, 16, "v %s\n", PROTOCOL_VERSION);
+  // 1.0 servers only send versions to clients that give one, so start with 0
+  // (older than any server's canvas) to get the whole canvas and then versions
+  char version_request_msg[80];
+  int len;
+  if (have_version || !strcmp(version, "1.0")) {
+    len = snprintf(version_request_msg, sizeof(version_request_msg),
+                   "v %s %" PRIu64, version, canvas_version);
+  } else {
+    len = snprintf(version_request_msg, sizeof(version_request_msg), "v %s",
+                   version);
+  }
+  if (room[0] != '\0') {
+    len += snprintf(version_request_msg + len,
+                    sizeof(version_request_msg) - len, " #%s", room);
+  }
+  // on the same host, the canvas can come through shared memory instead
+  if (local && !strcmp(version, "2.0")) {
+    len += snprintf(version_request_msg + len,
+                    sizeof(version_request_msg) - len, " shm");
+  }
+  if (!strcmp(version, "2.0")) {
+    len += snprintf(version_request_msg + len,
+                    sizeof(version_request_msg) - len, " presence");
+  }
+  // elsewhere, it comes in tiles, starting with the ones in view: the last
+  // view sent, or else the top left corner of the terminal's size
+  if (!local && !strcmp(version, "2.0")) {
+    int y = 0, x = 0, h = 24, w = 80;
+    struct winsize ws;
+    if (view_sent) {
+      y = view_sent_y;
+      x = view_sent_x;
+      h = view_sent_h;
+      w = view_sent_w;
+    } else if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0) {
+      h = ws.ws_row;
+      w = ws.ws_col;
+    }
+    len += snprintf(version_request_msg + len,
+                    sizeof(version_request_msg) - len, " tiles=%d,%d,%d,%d",
+                    y, x, h, w);
+  }
+  snprintf(version_request_msg + len, sizeof(version_request_msg) - len,
+           "\n");
   if (write(sockfd, version_request_msg, strlen(version_request_msg)) < 0) {
+    if (reconnect) {
+      close(sockfd);
+      return -2;
+    }
     perror("version negotiation: write error");
     exit(1);
   }
 
-  if (getline(&msg_buf, &msg_size, sockstream) == -1) {
+  char *reply = net_read_line();
+  if (reply == NULL) {
+    if (reconnect) {
+      close(sockfd);
+      return -2;
+    }
     perror("version negotiation: read error");
     exit(1);
   }
-  if (!(msg_buf[0] == 'v' && msg_buf[1] == 'o' && msg_buf[2] == 'k')) {
+  snprintf(server_reply, sizeof(server_reply), "%s", reply);
+  int retry_ms;
+  if (sscanf(reply, "busy %d", &retry_ms) == 1 && retry_ms > 0) {
+    close(sockfd);
+    return retry_ms;
+  }
+  if (strncmp(reply, "unknown protocol", 16) == 0) {
+    close(sockfd);
+    return -1;
+  }
+  if (!(reply[0] == 'v' && reply[1] == 'o' && reply[2] == 'k')) {
+    if (reconnect) {
+      close(sockfd);
+      return -2;
+    }
     eprintf("Failed to negotiate protocol version: the server says '%s'\n",
-            msg_buf);
+            reply);
     exit(1);
   }
+  // a new connection gets every update until it's told the view again
+  view_sent = false;
+  return 0;
+}
 
-  // receive canvas from server
-  getline(&msg_buf, &msg_size, sockstream);
-  char *command = strtok(msg_buf, " ");
+/* Connect to the server again after losing the connection, picking up from
+ * the last canvas version we saw.
+ *
+ * Returns: 0 if reconnected, 1 if we couldn't
+ */
+static int net_reconnect() {
+  close(sockfd);
+  for (int tries = 1; tries <= MAX_JOIN_TRIES; tries++) {
+    const int res = net_connect(protocol_version, true);
+    if (res == 0) {
+      logd("reconnected\n");
+      return 0;
+    }
+    if (res == -1) {
+      break;
+    }
+    logd("reconnecting failed, retrying\n");
+    usleep((res > 0 ? res : 100 * tries) * 1000);
+  }
+  return 1;
+}
+
+/* Copy the canvas out of the segment named in a shared memory frame, into
+ * *canvas (resizing it to fit), or a new canvas if *canvas is NULL.
+ *
+ * The copy may be a little newer than the version frame after it says, which
+ * is fine: the updates after that version only set cells to what they are by
+ * the time of the copy.
+ *
+ * Returns: 0 on success, -1 if the segment couldn't be read
+ */
+static int net_read_shm(Canvas **canvas, const char *payload, size_t len) {
+  char name[SHM_NAME_SZ];
+  if (!proto_read_shm(payload, len, name, sizeof(name))) {
+    return -1;
+  }
+  // stay attached, so resyncs only have to copy
+  if (shm.header == NULL || strcmp(shm.name, name) != 0) {
+    if (shm.header != NULL) {
+      shm_canvas_detach(&shm);
+    }
+    if (shm_canvas_attach(&shm, name) < 0) {
+      return -1;
+    }
+  }
+  if (*canvas == NULL) {
+    *canvas = canvas_new_blank(shm.num_rows, shm.num_cols);
+  } else if ((*canvas)->num_rows != shm.num_rows ||
+             (*canvas)->num_cols != shm.num_cols) {
+    canvas_resize(canvas, shm.num_rows, shm.num_cols);
+  }
+  uint64_t version;
+  return shm_canvas_read(&shm, *canvas, &version) ? 0 : -1;
+}
+
+/* Start sharing cursors as a presence frame says, with a UDP socket to the
+ * server's port for them (made the first time).
+ *
+ * A reconnected client is told a new uid and token, so it sends its cursor
+ * again right away.
+ */
+static void net_read_presence(const char *payload, size_t len) {
+  int udp_port;
+  if (!proto_read_presence(payload, len, &presence_uid, &presence_token,
+                           &udp_port)) {
+    return;
+  }
+  presence_seq = 0;
+  presence_sent_ms = net_now_ms() - PRESENCE_RESEND_MS;
+  if (presence_fd >= 0) {
+    return;
+  }
+  struct sockaddr_in to = {
+      .sin_family = AF_INET,
+      .sin_addr.s_addr = local ? htonl(INADDR_LOOPBACK) : address.sin_addr.s_addr,
+      .sin_port = htons(udp_port),
+  };
+  int s = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (s < 0 || connect(s, (struct sockaddr *)&to, sizeof(to)) < 0) {
+    logd("can't share cursors: %s\n", strerror(errno));
+    if (s >= 0) {
+      close(s);
+    }
+    return;
+  }
+  presence_fd = s;
+}
+
+/* Stop waiting for tiles, once they've all arrived or the canvas came some
+ * other way.
+ */
+static void net_tiles_done() {
+  if (tiles != NULL) {
+    tiles_free(tiles);
+    tiles = NULL;
+  }
+}
+
+/* Mark cells the server changed, to be redrawn. */
+static void net_damage(int y, int x, int h, int w) {
+  if (!damaged) {
+    damage = (Rect){.y = y, .x = x, .h = h, .w = w};
+    damaged = true;
+    return;
+  }
+  const int bottom = y + h > damage.y + damage.h ? y + h : damage.y + damage.h;
+  const int right = x + w > damage.x + damage.w ? x + w : damage.x + damage.w;
+  damage.y = y < damage.y ? y : damage.y;
+  damage.x = x < damage.x ? x : damage.x;
+  damage.h = bottom - damage.y;
+  damage.w = right - damage.x;
+}
+
+/* Mark the whole canvas changed, like when it's replaced or resized.
+ *
+ * (And past its edges, where a canvas that shrank left cells behind.)
+ */
+static void net_damage_all() {
+  damage = (Rect){.y = 0, .x = 0, .h = INT_MAX / 2, .w = INT_MAX / 2};
+  damaged = true;
+}
+
+/* Start taking the canvas in tiles as a tiles frame says, resizing *canvas to
+ * fit (or making it, if it's NULL). Until a tile arrives, its cells keep what
+ * they had (blank, for a new canvas).
+ *
+ * Returns: 0 on success, -1 if the frame is malformed
+ */
+static int net_read_tiles(Canvas **canvas, const char *payload, size_t len) {
+  int rows, cols, tile_sz;
+  if (!proto_read_tiles(payload, len, &rows, &cols, &tile_sz)) {
+    return -1;
+  }
+  logd("reading %d x %d canvas in tiles\n", rows, cols);
+  if (*canvas == NULL) {
+    *canvas = canvas_new_blank(rows, cols);
+  } else if ((*canvas)->num_rows != rows || (*canvas)->num_cols != cols) {
+    canvas_resize(canvas, rows, cols);
+  }
+  net_tiles_done();
+  tiles = tiles_new(rows, cols, tile_sz);
+  return 0;
+}
+
+/* Apply a 2.0 frame from the server to the canvas.
+ *
+ * Returns: 1 if the server is closing the connection, 0 otherwise
+ */
+static int net_handle_frame(Canvas **canvas, char type, const char *payload,
+                            size_t len) {
+  if (type == FRAME_OPS) {
+    const char *p = payload;
+    Op op;
+    while (proto_next_op(&p, payload + len, &op) == 1) {
+      if (proto_clip_op(&op, (*canvas)->num_rows, (*canvas)->num_cols)) {
+        proto_apply_op(*canvas, &op);
+        net_damage(op.y, op.x, op.h, op.w);
+        if (tiles != NULL) {
+          // again over its tile, if that's still to come
+          tiles_op(tiles, &op);
+        }
+      }
+    }
+  } else if (type == FRAME_TILE) {
+    Op tile;
+    if (tiles != NULL && proto_read_tile(payload, len, &tile)) {
+      const int left = tiles_receive(tiles, *canvas, &tile);
+      if (left >= 0) {
+        net_damage(tile.y, tile.x, tile.h, tile.w);
+      }
+      if (left == 0) {
+        logd("read all tiles\n");
+        net_tiles_done();
+      }
+    }
+  } else if (type == FRAME_TILES) {
+    if (net_read_tiles(canvas, payload, len) < 0) {
+      logd("malformed tiles frame\n");
+    }
+    net_damage_all();
+  } else if (type == FRAME_SNAPSHOT) {
+    // a fresh copy of the canvas, sent if we fell too far behind
+    Canvas *snapshot = proto_read_snapshot(payload, len);
+    if (snapshot != NULL) {
+      logd("resyncing %d x %d canvas\n", snapshot->num_rows,
+           snapshot->num_cols);
+      canvas_free(*canvas);
+      *canvas = snapshot;
+      net_tiles_done();
+      net_damage_all();
+    }
+  } else if (type == FRAME_SHM) {
+    // the same, through the server's shared copy of the canvas
+    if (net_read_shm(canvas, payload, len) < 0) {
+      logd("failed to read shared canvas\n");
+    }
+    net_tiles_done();
+    net_damage_all();
+  } else if (type == FRAME_VERSION) {
+    // the canvas isn't at any version until it's all arrived
+    have_version = tiles == NULL &&
+                   proto_read_version(payload, len, &canvas_version);
+  } else if (type == FRAME_PRESENCE) {
+    net_read_presence(payload, len);
+  } else if (type == FRAME_QUIT) {
+    logd("closing socket\n");
+    close(sockfd);
+    return 1;
+  }
+  return 0;
+}
+
+/* Apply a 1.0 line from the server to *canvas.
+ *
+ * Returns: 1 if the server is closing the connection, 0 otherwise
+ */
+static int net_handle_line(Canvas **canvas, char *line) {
+  logd("rec buffer: '%s'\n", line);
+  if (resyncing) {
+    // the canvas after a `cs rows cols`
+    resyncing = false;
+    if (resync_rows != (*canvas)->num_rows ||
+        resync_cols != (*canvas)->num_cols) {
+      canvas_resize(canvas, resync_rows, resync_cols);
+    }
+    canvas_deserialize(line, *canvas);
+    net_damage_all();
+    return 0;
+  }
+  const size_t len = strlen(line);
+  const char ch = len > 0 ? line[len - 1] : ' ';
+
+  char *command = strtok(line, " ");
+  if (command == NULL) {
+    return 0;
+  }
+  logd("\"%s\"\n", command);
+  if (!strcmp(command, "s")) {
+    int y = atoi(strtok(NULL, " "));
+    int x = atoi(strtok(NULL, " "));
+
+    if (canvas_isin_yx(*canvas, y, x)) {
+      canvas_scharyx(*canvas, y, x, ch);
+      net_damage(y, x, 1, 1);
+    }
+  }
   if (!strcmp(command, "cs")) {
+    // a fresh copy of the canvas, sent if we fell too far behind, on the next
+    // line
+    resync_rows = atoi(strtok(NULL, " "));
+    resync_cols = atoi(strtok(NULL, " "));
+    logd("resyncing %d x %d canvas\n", resync_rows, resync_cols);
+    resyncing = true;
+  }
+  if (!strcmp(command, "v")) {
+    // the canvas version so far
+    char *version = strtok(NULL, " ");
+    have_version = version != NULL &&
+                   sscanf(version, "%" SCNu64, &canvas_version) == 1;
+  }
+  if (!strcmp(command, "q")) {
+    logd("closing socket\n");
+    close(sockfd);
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Connects to server and returns its canvas
+ *
+ * in_hostname is a host name, or the path of a server's local socket (which
+ * starts with '/'). in_room names the room to join, or is "" for the server's
+ * main room.
+ */
+Canvas *net_init(char *in_hostname, char *in_port, char *in_room) {
+  Canvas *canvas;
+
+  room = strdup(in_room);
+
+  // Set port and hostname
+  if (strcmp(in_port, "")) {
+    logd("setting port to %s\n", in_port);
+    sscanf(in_port, "%i", &port);
+  }
+  hostname = strdup(in_hostname);
+  if (hostname[0] == '/') {
+    local = true;
+    local_address.sun_family = AF_UNIX;
+    if (strlen(hostname) >= sizeof(local_address.sun_path)) {
+      eprintf("Socket path too long: '%s'\n", hostname);
+      exit(1);
+    }
+    strcpy(local_address.sun_path, hostname);
+    logd("Trying to connect to %s\n", hostname);
+  } else {
+    hostinfo = gethostbyname(hostname);
+    address.sin_addr = *(struct in_addr *)*hostinfo->h_addr_list;
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    logd("Trying to connect to %s:%i\n", in_hostname, port);
+  }
+
+  // ask for the newest version first, falling back for older servers
+  int retry_ms, tries = 1, v = 0;
+  while ((retry_ms = net_connect(PROTOCOL_VERSIONS[v], false)) != 0) {
+    if (retry_ms < 0) {
+      if (++v == NUM_PROTOCOL_VERSIONS) {
+        eprintf("Failed to negotiate protocol version: the server says '%s'\n",
+                server_reply);
+        exit(1);
+      }
+      logd("falling back to protocol %s\n", PROTOCOL_VERSIONS[v]);
+      continue;
+    }
+    if (tries++ == MAX_JOIN_TRIES) {
+      eprintf("Failed to join: the server is too busy\n");
+      exit(1);
+    }
+    logd("server is busy, retrying in %d ms\n", retry_ms);
+    usleep(retry_ms * 1000);
+  }
+  protocol_version = PROTOCOL_VERSIONS[v];
+  protocol = atoi(protocol_version);
+
+  // receive canvas from server
+  if (protocol == 2) {
+    char type;
+    size_t len;
+    const char *payload;
+    // (after how to share cursors, if the server does)
+    while ((payload = net_read_frame(&type, &len)) != NULL &&
+           type == FRAME_PRESENCE) {
+      net_read_presence(payload, len);
+    }
+    canvas = NULL;
+    if (payload != NULL && type == FRAME_SHM) {
+      if (net_read_shm(&canvas, payload, len) < 0) {
+        eprintf("Failed to read the server's shared canvas\n");
+        exit(1);
+      }
+    } else if (payload != NULL && type == FRAME_TILES) {
+      // don't wait for the tiles: they're drawn as they come in
+      if (net_read_tiles(&canvas, payload, len) < 0) {
+        eprintf("Failed to get the canvas size from the server\n");
+        exit(1);
+      }
+    } else if (payload == NULL || type != FRAME_SNAPSHOT ||
+               (canvas = proto_read_snapshot(payload, len)) == NULL) {
+      eprintf("Failed to get the canvas from the server\n");
+      exit(1);
+    }
+    // what came with it won't wake up a poll on the socket, so handle it now
+    while (stream_next_frame(&in, &type, &payload, &len) == 1) {
+      net_handle_frame(&canvas, type, payload, len);
+    }
+    return canvas;
+  }
+  char *line = net_read_line();
+  char *command = line != NULL ? strtok(line, " ") : NULL;
+  if (command != NULL && !strcmp(command, "cs")) {
     int row = atoi(strtok(NULL, " "));
     int col = atoi(strtok(NULL, " "));
 
     canvas = canvas_new_blank(row, col);
   } else {
-    logd("failed to get canvas size\n");
+    eprintf("Failed to get the canvas size from the server\n");
     exit(1);
   }
 
   logd("reading canvas from server\n");
 
-  getline(&msg_buf, &msg_size, sockstream);
-  canvas_deserialize(msg_buf, canvas);
+  if ((line = net_read_line()) == NULL) {
+    eprintf("Failed to read the canvas from the server\n");
+    exit(1);
+  }
+  canvas_deserialize(line, canvas);
 
   logd("done reading\n");
 
+  // what came with it won't wake up a poll on the socket, so handle it now
+  while (stream_next_line(&in, &line)) {
+    net_handle_line(&canvas, line);
+  }
   return canvas;
 }
 
-/* Returns new Net_cfg object with current clientfds and sockfd
+/* Returns new Net_cfg object with the current sockfd and presence_fd
  *
  */
 Net_cfg *net_getcfg() {
   Net_cfg *config = malloc(sizeof(Net_cfg));
 
-  config->clientfds = clientfds;
   config->sockfd = sockfd;
+  config->presence_fd = presence_fd;
 
   return config;
 }
 
-/* Reads incoming packets and updates canvas.
- * Need to run redraw_canvas_win() after calling!
+/* Reads everything the server has sent so far and updates canvas, handling
+ * every message in it as one batch (and leaving any message cut off at the end
+ * for the next call). A burst of updates then costs one redraw instead of one
+ * each: run net_take_damage() after calling to find what to redraw.
+ *
+ * Reads at most MAX_HANDLER_READ bytes, so keys still get handled while the
+ * server sends more.
+ *
+ * Returns: 1 if the connection is gone for good, 0 otherwise
  */
 int net_handler(View *view) {
-  logd("receiving: ");
-  getline(&msg_buf, &msg_size, sockstream);
-  logd("[%li]", msg_size);
-  logd("rec buffer: '%s'", msg_buf);
-  char ch = msg_buf[strlen(msg_buf) - 2];  // -2 for '\n'
-
-  char *command = strtok(msg_buf, " \n");
-  logd("\"%s\"", command);
-  if (!strcmp(command, "s")) {
-    int y = atoi(strtok(NULL, " "));
-    int x = atoi(strtok(NULL, " "));
+  size_t read_so_far = 0;
+  int more;
+  do {
+    const ssize_t n = stream_read(&in, sockfd);
+    if (n == 0 || (n < 0 && errno != EINTR)) {
+      logd("lost the connection, reconnecting\n");
+      return net_reconnect();
+    }
+    read_so_far += n > 0 ? n : 0;
+    if (protocol == 2) {
+      char type;
+      const char *payload;
+      size_t len;
+      int res;
+      while ((res = stream_next_frame(&in, &type, &payload, &len)) == 1) {
+        if (net_handle_frame(&view->canvas, type, payload, len)) {
+          return 1;
+        }
+      }
+      if (res < 0) {
+        logd("malformed frame, reconnecting\n");
+        return net_reconnect();
+      }
+    } else {
+      char *line;
+      while (stream_next_line(&in, &line)) {
+        if (net_handle_line(&view->canvas, line)) {
+          return 1;
+        }
+      }
+    }
+    // (the rest of a burst is usually already here, if it didn't fit)
+  } while (read_so_far < MAX_HANDLER_READ &&
+           ioctl(sockfd, FIONREAD, &more) == 0 && more > 0);
+  return 0;
+}
 
-    canvas_scharyx(view->canvas, y, x, ch);
+/* Find the cells the server changed since the last call, to redraw them.
+ *
+ * The rectangle covering all of them is stored in *rect, which may reach past
+ * the canvas if it was replaced or resized.
+ *
+ * Returns: false if none changed
+ */
+bool net_take_damage(Rect *rect) {
+  if (!damaged) {
+    return false;
   }
-  if (!strcmp(command, "q")) {
-    logd("closing socket\n");
-    close(sockfd);
-    return 1;
+  *rect = damage;
+  damaged = false;
+  return true;
+}
+
+/* Start an ops frame at the end of what's waiting to be sent, if one isn't
+ * being written already.
+ */
+static void net_open_ops() {
+  if (!ops_open) {
+    proto_begin(&send_frames, FRAME_OPS);
+    ops_open = true;
   }
+}
 
-  return 0;
+/* Finish the ops frame being written, if there is one, so something else can
+ * go after it.
+ */
+static void net_close_ops() {
+  if (ops_open) {
+    proto_put_run(&send_frames, &send_run);
+    proto_end(&send_frames);
+    ops_open = false;
+  }
+}
+
+/* Sends everything waiting to be sent to the server, now, in one write.
+ *
+ * Edits and views wait to be sent until this is called, so the ones made at
+ * about the same time go out together: call it once net_flush_wait() says
+ * it's time, after handling everything that came in at once.
+ *
+ * Returns: 0 on success, -1 on write errors (which drop what was waiting)
+ */
+int net_flush() {
+  net_close_ops();
+  if (send_frames.len == 0) {
+    return 0;
+  }
+  size_t sent = 0;
+  while (sent < send_frames.len) {
+    const ssize_t n =
+        write(sockfd, send_frames.data + sent, send_frames.len - sent);
+    if (n < 0 && errno != EINTR) {
+      logd("write error: %s\n", strerror(errno));
+      break;
+    }
+    if (n > 0) {
+      sent += n;
+      flush_writes++;
+    }
+  }
+  const int res = sent < send_frames.len ? -1 : 0;
+  flushes++;
+  flush_bytes += sent;
+  flush_ops += res == 0 ? queued_ops : 0;
+  send_frames.len = 0;
+  queued_ops = 0;
+  flushed_ms = net_now_ms();
+  return res;
+}
+
+/* Logs (as debug) how many writes the edits sent so far took, and how much
+ * went in each, to see how well net_flush batches them.
+ */
+void net_log_stats() {
+  logd("sent %ld ops, %ld bytes in %ld writes (%ld flushes)\n", flush_ops,
+       flush_bytes, flush_writes, flushes);
+  if (flush_writes > 0) {
+    logd("%.1f ops, %.1f bytes a write\n", (double)flush_ops / flush_writes,
+         (double)flush_bytes / flush_writes);
+  }
+}
+
+/* Make sure what's been added to send isn't held back too long.
+ *
+ * Returns: 0 on success, -1 on write errors
+ */
+static int net_queued() {
+  return send_frames.len >= NET_FLUSH_BYTES ? net_flush() : 0;
+}
+
+/* Milliseconds until what's waiting to be sent should be: right away if
+ * nothing was sent in the last NET_FLUSH_MS, so a lone edit isn't held back,
+ * or else once that's passed, so a burst of them goes out together.
+ *
+ * Returns: the milliseconds, or -1 for nothing waiting
+ */
+int net_flush_wait() {
+  if (send_frames.len == 0) {
+    return -1;
+  }
+  const int64_t wait = flushed_ms + NET_FLUSH_MS - net_now_ms();
+  return wait > 0 ? wait : 0;
+}
+
+/* Sends an edit to the server, once net_flush() is called.
+ *
+ * Cells running along a row go as spans. Protocol 1.0 servers get a set char
+ * command for each cell.
+ *
+ * Returns: 0 on success, -1 on write errors
+ */
+int net_send_op(const Op *op) {
+  if (protocol != 2) {
+    const int h = op->type == OP_CELL || op->type == OP_SPAN ? 1 : op->h;
+    const int w = op->type == OP_CELL ? 1 : op->w;
+    for (int r = 0; r < h; r++) {
+      for (int c = 0; c < w; c++) {
+        const char ch = op->data ? op->data[r * op->stride + c] : op->ch;
+        if (net_send_char(op->y + r, op->x + c, ch) < 0) {
+          return -1;
+        }
+      }
+    }
+    return 0;
+  }
+  if (tiles != NULL) {
+    // keep it over its tile, if that's still to come and might not have it
+    Op clipped = *op;
+    if (proto_clip_op(&clipped, tiles->num_rows, tiles->num_cols)) {
+      tiles_op(tiles, &clipped);
+    }
+  }
+  net_open_ops();
+  if (op->type == OP_CELL) {
+    proto_put_cell(&send_frames, &send_run, op->y, op->x, op->ch);
+  } else {
+    proto_put_run(&send_frames, &send_run);
+    proto_put_op(&send_frames, op);
+  }
+  queued_ops++;
+  return net_queued();
 }
 
-/* Sends a set char command to the server
+/* Sends a set char command to the server, once net_flush() is called.
  *
+ * Returns: 0 on success, -1 on write errors
  */
 int net_send_char(int y, int x, char ch) {
+  if (protocol == 2) {
+    return net_send_op(&(Op){.type = OP_CELL, .y = y, .x = x, .ch = ch});
+  }
   char send_buf[50];
-  snprintf(send_buf, 50, "s %d %d %c\n", y, x, ch);
+  const int len = snprintf(send_buf, 50, "s %d %d %c\n", y, x, ch);
   logd("send buffer: '%s'\n", send_buf);
-  if (write(sockfd, send_buf, strlen(send_buf)) < 0) {
-    logd("write error");
+  proto_put(&send_frames, send_buf, len);
+  queued_ops++;
+  return net_queued();
+}
+
+/* Tell the server which part of the canvas is in view, so it only sends the
+ * edits around it (once net_flush() is called).
+ *
+ * Asks for half a view more on every side, so the view can move a little
+ * before the server hears about it, and only tells the server again once the
+ * view comes within a quarter view of the edge of that.
+ *
+ * Returns: 0 on success, -1 on write errors
+ */
+int net_send_view(View *view) {
+  const int h = view_max_y, w = view_max_x;
+  // (the edges of the canvas count as far enough)
+  if (view_sent && (view_sent_y == 0 || view->y - view_sent_y >= h / 4) &&
+      (view_sent_x == 0 || view->x - view_sent_x >= w / 4) &&
+      view_sent_y + view_sent_h - (view->y + h) >= h / 4 &&
+      view_sent_x + view_sent_w - (view->x + w) >= w / 4) {
+    return 0;
+  }
+  view_sent_y = view->y - h / 2 > 0 ? view->y - h / 2 : 0;
+  view_sent_x = view->x - w / 2 > 0 ? view->x - w / 2 : 0;
+  view_sent_h = view->y + h + h / 2 - view_sent_y;
+  view_sent_w = view->x + w + w / 2 - view_sent_x;
+  view_sent = true;
+  logd("sending view %d %d %d %d\n", view_sent_y, view_sent_x, view_sent_h,
+       view_sent_w);
+  // (with the edits waiting, if there are any)
+  if (protocol == 2) {
+    net_close_ops();
+    proto_view(&send_frames, view_sent_y, view_sent_x, view_sent_h,
+               view_sent_w);
+    return net_queued();
+  }
+  char send_buf[64];
+  const int len = snprintf(send_buf, sizeof(send_buf), "w %d %d %d %d\n",
+                           view_sent_y, view_sent_x, view_sent_h, view_sent_w);
+  proto_put(&send_frames, send_buf, len);
+  return net_queued();
+}
+
+/* Send the server our cursor (on the canvas) and mode, if they changed since
+ * they were last sent, at most every PRESENCE_SEND_MS. Call again once
+ * net_presence_wait() has passed to send a move that was too soon.
+ *
+ * Updates are sent again every PRESENCE_RESEND_MS even if nothing changed, in
+ * case the last was lost.
+ *
+ * Returns: 0 on success (or without cursor sharing), -1 on write errors
+ */
+int net_send_presence(int y, int x, int mode) {
+  if (presence_fd < 0) {
+    return 0;
+  }
+  const int64_t now = net_now_ms();
+  const Presence_cursor cursor = {
+      .uid = presence_uid, .y = y, .x = x, .mode = mode};
+  const bool moved = cursor.y != presence_sent.y ||
+                     cursor.x != presence_sent.x ||
+                     cursor.mode != presence_sent.mode;
+  if (!moved && now - presence_sent_ms < PRESENCE_RESEND_MS) {
+    presence_waiting = false;
+    return 0;
+  }
+  if (now - presence_sent_ms < PRESENCE_SEND_MS) {
+    presence_waiting = true;
+    return 0;
+  }
+  char buf[PRESENCE_UPDATE_SZ];
+  const size_t len =
+      presence_encode_update(buf, presence_token, ++presence_seq, &cursor);
+  presence_sent = cursor;
+  presence_sent_ms = now;
+  presence_waiting = false;
+  // a full socket buffer only loses a cursor that's sent again soon
+  if (send(presence_fd, buf, len, 0) < 0 && errno != EAGAIN &&
+      errno != ECONNREFUSED) {
+    logd("presence write error: %s\n", strerror(errno));
     return -1;
   }
+  return 0;
+}
 
-  logd("sending: s %d %d %c\n", y, x, ch);
-  // DON"T TRUST FPRINTF!!! It has failed me!
-  // fprintf(sockstream, "s %d %d %c\n", y, x, ch);
+/* Mark the cell of a cursor to be redrawn, where it was or where it's moved.
+ *
+ * Once there's no room left, the last rectangle grows to cover the rest.
+ */
+static void net_cursor_damage(const Presence_cursor *cursor) {
+  if (num_cursor_damage < 2 * MAX_CURSORS) {
+    cursor_damage[num_cursor_damage++] =
+        (Rect){.y = cursor->y, .x = cursor->x, .h = 1, .w = 1};
+    return;
+  }
+  Rect *last = &cursor_damage[num_cursor_damage - 1];
+  const int bottom =
+      cursor->y + 1 > last->y + last->h ? cursor->y + 1 : last->y + last->h;
+  const int right =
+      cursor->x + 1 > last->x + last->w ? cursor->x + 1 : last->x + last->w;
+  last->y = cursor->y < last->y ? cursor->y : last->y;
+  last->x = cursor->x < last->x ? cursor->x : last->x;
+  last->h = bottom - last->y;
+  last->w = right - last->x;
+}
 
-  return 0;
+/* Forget the cursor at index i of cursors. */
+static void net_forget_cursor(int i) {
+  net_cursor_damage(&cursors[i]);
+  num_cursors--;
+  cursors[i] = cursors[num_cursors];
+  cursors_heard_ms[i] = cursors_heard_ms[num_cursors];
+}
+
+/* Read the cursors the server sent, and forget the ones not heard of in
+ * PRESENCE_EXPIRE_MS. Doesn't block, so it can be called whenever.
+ *
+ * The cells to redraw, where the cursors that changed were and now are, are
+ * stored in *cells (in canvas coordinates), until the next call.
+ *
+ * Returns: the number of cells, or 0 if the cursors to draw didn't change
+ */
+int net_presence_handler(const Rect **cells) {
+  *cells = cursor_damage;
+  num_cursor_damage = 0;
+  if (presence_fd < 0) {
+    return 0;
+  }
+  const int64_t now = net_now_ms();
+  char data[PRESENCE_MAX_DATAGRAM];
+  Presence_cursor got[(PRESENCE_MAX_DATAGRAM - 1) / PRESENCE_CURSOR_SZ];
+  ssize_t len;
+  while ((len = recv(presence_fd, data, sizeof(data), 0)) >= 0 ||
+         errno == EINTR || errno == ECONNREFUSED) {
+    const int n =
+        len < 0 ? -1
+                : presence_decode_cursors(data, len, got,
+                                          sizeof(got) / sizeof(got[0]));
+    for (int i = 0; i < n; i++) {
+      if (got[i].uid == presence_uid) {
+        continue;
+      }
+      int j = 0;
+      while (j < num_cursors && cursors[j].uid != got[i].uid) {
+        j++;
+      }
+      if (got[i].mode == PRESENCE_GONE) {
+        if (j < num_cursors) {
+          net_forget_cursor(j);
+        }
+        continue;
+      }
+      if (j == num_cursors) {
+        if (num_cursors == MAX_CURSORS) {
+          continue;
+        }
+        num_cursors++;
+        net_cursor_damage(&got[i]);
+      } else if (cursors[j].y != got[i].y || cursors[j].x != got[i].x ||
+                 cursors[j].mode != got[i].mode) {
+        net_cursor_damage(&cursors[j]);
+        net_cursor_damage(&got[i]);
+      }
+      cursors[j] = got[i];
+      cursors_heard_ms[j] = now;
+    }
+  }
+  for (int i = num_cursors - 1; i >= 0; i--) {
+    if (now - cursors_heard_ms[i] >= PRESENCE_EXPIRE_MS) {
+      net_forget_cursor(i);
+    }
+  }
+  return num_cursor_damage;
+}
+
+/* Milliseconds until net_send_presence() or net_presence_handler() have
+ * something to do without being woken by a key or datagram.
+ *
+ * Returns: the milliseconds, or -1 for never
+ */
+int net_presence_wait() {
+  if (presence_fd < 0) {
+    return -1;
+  }
+  const int64_t now = net_now_ms();
+  int64_t next = presence_sent_ms +
+                 (presence_waiting ? PRESENCE_SEND_MS : PRESENCE_RESEND_MS);
+  for (int i = 0; i < num_cursors; i++) {
+    if (cursors_heard_ms[i] + PRESENCE_EXPIRE_MS < next) {
+      next = cursors_heard_ms[i] + PRESENCE_EXPIRE_MS;
+    }
+  }
+  return next > now ? next - now : 0;
+}
+
+/* Others' cursors in our room, to draw over the canvas.
+ *
+ * Returns: the number of them in *out
+ */
+int net_get_cursors(const Presence_cursor **out) {
+  *out = cursors;
+  return num_cursors;
 }
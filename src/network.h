@@ -3,20 +3,33 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
-#include <sys/select.h>
+#include <stdbool.h>
 #include <sys/types.h>
 
 #include "canvas.h"
+#include "interest.h"
+#include "presence.h"
+#include "proto.h"
 #include "view.h"
 
 typedef struct NET_CFG {
-  fd_set clientfds;
   int sockfd;
+  int presence_fd;  // for cursors, or -1 if the server doesn't share them
 } Net_cfg;
 
-Canvas *net_init(char *hostname, char *port);
+Canvas *net_init(char *hostname, char *port, char *room);
 Net_cfg *net_getcfg();
 int net_handler(View *view);
+bool net_take_damage(Rect *rect);
+int net_send_op(const Op *op);
 int net_send_char(int y, int x, char ch);
+int net_send_view(View *view);
+int net_flush();
+int net_flush_wait();
+void net_log_stats();
+int net_send_presence(int y, int x, int mode);
+int net_presence_handler(const Rect **cells);
+int net_presence_wait();
+int net_get_cursors(const Presence_cursor **out);
 
 #endif
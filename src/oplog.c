@@ -0,0 +1,111 @@
+/* Log of the most recent ops applied to a canvas
+ *
+ * Every op the server applies gets the next version number, and is kept
+ * encoded (like in an ops frame) in a fixed-size ring. When the ring fills up
+ * the oldest ops are dropped to make room.
+ *
+ * A client that knows the version its canvas is at can be sent just the ops
+ * after that, as long as they're all still in the log, instead of a snapshot
+ * of the whole canvas.
+ */
+#include "oplog.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "proto.h"
+
+#define MIN_OP_SZ 6  // bytes of the smallest op, a cell
+
+/* Make an empty log holding up to size bytes of ops, for a canvas that's at
+ * version.
+ *
+ * Returned pointer should be freed with oplog_free.
+ */
+Oplog *oplog_new(size_t size, uint64_t version) {
+  Oplog *log = malloc(sizeof(Oplog));
+  log->size = size;
+  log->data = malloc(size);
+  log->max_ops = size / MIN_OP_SZ + 1;
+  log->ends = malloc(log->max_ops * sizeof(uint64_t));
+  log->first = version + 1;
+  log->last = version;
+  log->start = log->end = 0;
+  log->scratch = (Frame_buf){0};
+  if (log->data == NULL || log->ends == NULL) {
+    perror("oplog malloc");
+    exit(1);
+  }
+  return log;
+}
+
+/* Add an op, which is given the next version after the newest op.
+ *
+ * Ops that don't fit in the log at all empty it, so clients older than them
+ * can tell they're too far behind.
+ */
+void oplog_add(Oplog *log, uint64_t version, const Op *op) {
+  log->scratch.len = 0;
+  proto_put_op(&log->scratch, op);
+  const size_t len = log->scratch.len;
+  if (len > log->size) {
+    log->first = version + 1;
+    log->last = version;
+    log->start = log->end;
+    return;
+  }
+  if (version != log->last + 1) {
+    // start over from this version
+    log->first = version;
+    log->last = version - 1;
+    log->start = log->end;
+  }
+  // drop the oldest ops to make room
+  while (log->end + len - log->start > log->size ||
+         log->last - log->first + 1 >= log->max_ops) {
+    log->start = log->ends[log->first % log->max_ops];
+    log->first++;
+  }
+  const size_t at = log->end % log->size;
+  const size_t n = len < log->size - at ? len : log->size - at;
+  memcpy(log->data + at, log->scratch.data, n);
+  memcpy(log->data, log->scratch.data + n, len - n);
+  log->end += len;
+  log->last = version;
+  log->ends[version % log->max_ops] = log->end;
+}
+
+/* Add the ops after a version to the frame being written to out.
+ *
+ * Returns: the number of ops added, or -1 if some of them have been dropped
+ * or they'd take more than max_len bytes
+ */
+long oplog_since(const Oplog *log, uint64_t version, size_t max_len,
+                 Frame_buf *out) {
+  if (version >= log->last) {
+    return 0;
+  }
+  if (version + 1 < log->first) {
+    return -1;
+  }
+  const uint64_t from =
+      version + 1 == log->first ? log->start : log->ends[version % log->max_ops];
+  const size_t len = log->end - from;
+  if (len > max_len) {
+    return -1;
+  }
+  const size_t at = from % log->size;
+  const size_t n = len < log->size - at ? len : log->size - at;
+  proto_put(out, log->data + at, n);
+  proto_put(out, log->data, len - n);
+  return log->last - version;
+}
+
+void oplog_free(Oplog *log) {
+  proto_buf_free(&log->scratch);
+  free(log->ends);
+  free(log->data);
+  free(log);
+}
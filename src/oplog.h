@@ -0,0 +1,27 @@
+#ifndef oplog_h
+#define oplog_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "proto.h"
+
+typedef struct {
+  char *data;          // ring of encoded ops
+  size_t size;         // bytes in the ring
+  uint64_t *ends;      // end offset of each op, by version
+  size_t max_ops;      // ops the ring can hold at most
+  uint64_t first;      // version of the oldest op kept
+  uint64_t last;       // version of the newest op (first - 1 if empty)
+  uint64_t start;      // offset of the oldest op, counting every byte added
+  uint64_t end;        // offset just past the newest op
+  Frame_buf scratch;   // an op being encoded
+} Oplog;
+
+Oplog *oplog_new(size_t size, uint64_t version);
+void oplog_add(Oplog *log, uint64_t version, const Op *op);
+long oplog_since(const Oplog *log, uint64_t version, size_t max_len,
+                 Frame_buf *out);
+void oplog_free(Oplog *log);
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lib/minunit.h"
+#include "oplog.h"
+#include "proto.h"
+
+static Oplog *oplog;
+static Frame_buf out;
+
+void test_setup(void) {
+  oplog = oplog_new(64, 0);
+  out.len = 0;
+}
+
+void test_teardown(void) { oplog_free(oplog); }
+
+static Op cell(int i) {
+  return (Op){.type = OP_CELL, .y = i, .x = i, .ch = 'a' + i % 26};
+}
+
+/* Check out holds cells first..last, as added by add_cells.
+ */
+static int holds_cells(int first, int last) {
+  const char *p = out.data;
+  Op op;
+  for (int i = first; i <= last; i++) {
+    if (proto_next_op(&p, out.data + out.len, &op) != 1 || op.y != i ||
+        op.ch != 'a' + i % 26) {
+      return 0;
+    }
+  }
+  return p == out.data + out.len;
+}
+
+static void add_cells(int first, int last) {
+  for (int i = first; i <= last; i++) {
+    Op op = cell(i);
+    oplog_add(oplog, i, &op);
+  }
+}
+
+MU_TEST(test_oplog_since) {
+  add_cells(1, 5);
+  mu_assert_int_eq(3, oplog_since(oplog, 2, 1000, &out));
+  mu_assert(holds_cells(3, 5), "Should hold the ops after version 2");
+  out.len = 0;
+  mu_assert_int_eq(5, oplog_since(oplog, 0, 1000, &out));
+  mu_assert(holds_cells(1, 5), "Should hold every op");
+  out.len = 0;
+  mu_assert_int_eq(0, oplog_since(oplog, 5, 1000, &out));
+  mu_assert_int_eq(0, oplog_since(oplog, 9, 1000, &out));
+  mu_assert_int_eq(0, out.len);
+}
+
+MU_TEST(test_oplog_wraps) {
+  // 64 bytes hold 10 cells, so the oldest are dropped
+  add_cells(1, 25);
+  mu_assert_int_eq(16, oplog->first);
+  mu_assert_int_eq(-1, oplog_since(oplog, 14, 1000, &out));
+  mu_assert_int_eq(10, oplog_since(oplog, 15, 1000, &out));
+  mu_assert(holds_cells(16, 25), "Should read across the end of the ring");
+}
+
+MU_TEST(test_oplog_max_len) {
+  add_cells(1, 5);
+  mu_assert_int_eq(-1, oplog_since(oplog, 0, 29, &out));
+  mu_assert_int_eq(5, oplog_since(oplog, 0, 30, &out));
+}
+
+MU_TEST(test_oplog_big_op) {
+  add_cells(1, 5);
+  char data[100] = {0};
+  Op span = {.type = OP_SPAN, .y = 0, .x = 0, .w = 100, .data = data};
+  oplog_add(oplog, 6, &span);
+  // too big to keep, so nobody older than it can catch up
+  mu_assert_int_eq(-1, oplog_since(oplog, 5, 1000, &out));
+  mu_assert_int_eq(0, oplog_since(oplog, 6, 1000, &out));
+  add_cells(7, 8);
+  mu_assert_int_eq(2, oplog_since(oplog, 6, 1000, &out));
+  mu_assert(holds_cells(7, 8), "Should keep ops after the big one");
+}
+
+MU_TEST(test_oplog_gap) {
+  add_cells(1, 5);
+  add_cells(10, 11);
+  // versions that were skipped can't be replayed
+  mu_assert_int_eq(-1, oplog_since(oplog, 5, 1000, &out));
+  mu_assert_int_eq(2, oplog_since(oplog, 9, 1000, &out));
+}
+
+MU_TEST_SUITE(oplog_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_oplog_since);
+  MU_RUN_TEST(test_oplog_wraps);
+  MU_RUN_TEST(test_oplog_max_len);
+  MU_RUN_TEST(test_oplog_big_op);
+  MU_RUN_TEST(test_oplog_gap);
+}
+
+int main(int argc, char const *argv[]) {
+  MU_RUN_SUITE(oplog_main);
+  MU_REPORT();
+  return minunit_status;
+}
@@ -0,0 +1,312 @@
+/* Where everyone's cursor is, shared over datagrams
+ *
+ * Cursors move far more often than anyone draws, and only the latest position
+ * matters, so they don't go through the ops stream: a lost or late cursor is
+ * replaced by the next one, where a queued one would hold up edits behind it.
+ * Clients send their cursor (position and mode) in a datagram whenever it
+ * changes, at most so often, along with the uid and token the server gave
+ * them over their connection:
+ *
+ *   'u' u32 uid, u64 token, u32 seq, u16 y, u16 x, u8 mode
+ *
+ * Integers are in network byte order. The server keeps only the newest
+ * update from each client (by seq, since datagrams can arrive out of order),
+ * drops ones over the client's rate, and every so often sends each room the
+ * cursors that changed since the last time, batched into as few datagrams as
+ * fit:
+ *
+ *   'p' (u32 uid, u16 y, u16 x, u8 mode)...
+ *
+ * so however fast a client moves, each other client in its room gets at most
+ * one update of its cursor per flush. Clients that leave are sent once more
+ * with mode PRESENCE_GONE, and every cursor is sent again now and then, so
+ * clients can forget ones they haven't heard about in a while (after a lost
+ * goodbye).
+ */
+#include "presence.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "admission.h"
+
+static void put_u16(char *p, int n) {
+  const uint16_t v = htons(n);
+  memcpy(p, &v, 2);
+}
+
+static void put_u32(char *p, uint32_t n) {
+  const uint32_t v = htonl(n);
+  memcpy(p, &v, 4);
+}
+
+static int get_u16(const char *p) {
+  uint16_t v;
+  memcpy(&v, p, 2);
+  return ntohs(v);
+}
+
+static uint32_t get_u32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return ntohl(v);
+}
+
+/* Make an empty set of cursors, taking at most rate updates per second (and
+ * burst at once) from each client.
+ *
+ * Returned pointer should be freed with presence_free.
+ */
+Presence *presence_new(double rate, double burst) {
+  Presence *p = calloc(1, sizeof(Presence));
+  p->rate = rate;
+  p->burst = burst;
+  return p;
+}
+
+/* Find where a uid is in the members, or would go.
+ */
+static int presence_find(const Presence *p, int uid) {
+  int lo = 0, hi = p->num_members;
+  while (lo < hi) {
+    const int mid = (lo + hi) / 2;
+    if (p->members[mid].uid < uid) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Share the cursor of client uid with the others in room, once it sends one
+ * with token.
+ */
+void presence_add(Presence *p, int uid, uint64_t token, const void *room,
+                  int64_t now_ms) {
+  const int i = presence_find(p, uid);
+  if (i < p->num_members && p->members[i].uid == uid) {
+    return;
+  }
+  if (p->num_members == p->cap) {
+    p->cap = p->cap ? p->cap * 2 : 16;
+    if ((p->members = realloc(p->members, p->cap * sizeof(Presence_member))) ==
+        NULL) {
+      perror("presence realloc");
+      exit(1);
+    }
+  }
+  // uids are handed out in order, so this is nearly always the end
+  memmove(p->members + i + 1, p->members + i,
+          (p->num_members - i) * sizeof(Presence_member));
+  p->num_members++;
+  p->members[i] = (Presence_member){
+      .uid = uid,
+      .token = token,
+      .room = room,
+      .cursor = {.uid = uid},
+      .limit = admission_new(p->rate, p->burst, now_ms),
+  };
+}
+
+static void presence_delete(Presence *p, int i) {
+  admission_free(p->members[i].limit);
+  memmove(p->members + i, p->members + i + 1,
+          (p->num_members - i - 1) * sizeof(Presence_member));
+  p->num_members--;
+}
+
+/* Stop sharing the cursor of client uid.
+ *
+ * If the others have been sent it, they're told it's gone at the next flush.
+ */
+void presence_remove(Presence *p, int uid) {
+  const int i = presence_find(p, uid);
+  if (i == p->num_members || p->members[i].uid != uid) {
+    return;
+  }
+  if (!p->members[i].has_addr) {
+    presence_delete(p, i);
+    return;
+  }
+  p->members[i].cursor.mode = PRESENCE_GONE;
+  p->members[i].dirty = true;
+}
+
+/* Take an update datagram from a client, if it's the newest from it and
+ * within its rate.
+ *
+ * Returns: 0 if it was taken, 1 if it was over the rate (or older than one
+ * taken), or -1 if it's malformed or not from a client we know
+ */
+int presence_update(Presence *p, const char *data, size_t len,
+                    const struct sockaddr_in *from, int64_t now_ms) {
+  if (len != PRESENCE_UPDATE_SZ || data[0] != PRESENCE_UPDATE) {
+    return -1;
+  }
+  const int uid = get_u32(data + 1);
+  const int i = presence_find(p, uid);
+  if (i == p->num_members || p->members[i].uid != uid) {
+    return -1;
+  }
+  Presence_member *m = &p->members[i];
+  const uint64_t token = (uint64_t)get_u32(data + 5) << 32 | get_u32(data + 9);
+  if (token != m->token || m->cursor.mode == PRESENCE_GONE) {
+    return -1;
+  }
+  const uint32_t seq = get_u32(data + 13);
+  if ((m->has_addr && seq <= m->seq) || admission_take(m->limit, now_ms) > 0) {
+    p->dropped++;
+    return 1;
+  }
+  p->taken++;
+  m->seq = seq;
+  m->addr = *from;
+  m->has_addr = true;
+  m->cursor.y = get_u16(data + 17);
+  m->cursor.x = get_u16(data + 19);
+  m->cursor.mode = (unsigned char)data[21];
+  if (m->cursor.mode == PRESENCE_GONE) {
+    m->cursor.mode = 0;
+  }
+  m->dirty = true;
+  return 0;
+}
+
+// members in the order they're flushed
+static __thread const Presence_member *order_members;
+
+static int compare_rooms(const void *a, const void *b) {
+  const Presence_member *ma = &order_members[*(const int *)a];
+  const Presence_member *mb = &order_members[*(const int *)b];
+  if (ma->room != mb->room) {
+    return ma->room < mb->room ? -1 : 1;
+  }
+  return ma->uid - mb->uid;
+}
+
+/* Send a datagram of cursors to every member of a room that can get it. */
+static void presence_send_room(const Presence *p, const int *order, int n,
+                               const char *data, size_t len,
+                               Presence_send send, void *arg) {
+  for (int i = 0; i < n; i++) {
+    const Presence_member *m = &p->members[order[i]];
+    if (m->has_addr && m->cursor.mode != PRESENCE_GONE) {
+      send(arg, &m->addr, data, len);
+    }
+  }
+}
+
+/* Send each room the cursors in it that changed since the last flush (or all
+ * of them), and forget the clients that left.
+ *
+ * Returns: the number of datagrams sent
+ */
+int presence_flush(Presence *p, bool all, Presence_send send, void *arg) {
+  static __thread int *order;
+  static __thread int order_cap;
+  static __thread char datagram[PRESENCE_MAX_DATAGRAM];
+  if (p->num_members > order_cap) {
+    order_cap = p->num_members;
+    if ((order = realloc(order, order_cap * sizeof(int))) == NULL) {
+      perror("presence realloc");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < p->num_members; i++) {
+    order[i] = i;
+  }
+  order_members = p->members;
+  qsort(order, p->num_members, sizeof(int), compare_rooms);
+
+  int sent = 0;
+  for (int start = 0, end; start < p->num_members; start = end) {
+    const void *room = p->members[order[start]].room;
+    for (end = start; end < p->num_members &&
+                      p->members[order[end]].room == room;
+         end++) {
+    }
+    size_t len = 1;
+    datagram[0] = PRESENCE_CURSORS;
+    for (int i = start; i < end; i++) {
+      Presence_member *m = &p->members[order[i]];
+      if (!m->has_addr || !(m->dirty || all)) {
+        continue;
+      }
+      if (len + PRESENCE_CURSOR_SZ > sizeof(datagram)) {
+        presence_send_room(p, order + start, end - start, datagram, len, send,
+                           arg);
+        sent++;
+        len = 1;
+      }
+      put_u32(datagram + len, m->uid);
+      put_u16(datagram + len + 4, m->cursor.y);
+      put_u16(datagram + len + 6, m->cursor.x);
+      datagram[len + 8] = m->cursor.mode;
+      len += PRESENCE_CURSOR_SZ;
+    }
+    if (len > 1) {
+      presence_send_room(p, order + start, end - start, datagram, len, send,
+                         arg);
+      sent++;
+    }
+  }
+
+  for (int i = p->num_members - 1; i >= 0; i--) {
+    if (p->members[i].cursor.mode == PRESENCE_GONE) {
+      presence_delete(p, i);
+    } else {
+      p->members[i].dirty = false;
+    }
+  }
+  return sent;
+}
+
+void presence_free(Presence *p) {
+  for (int i = 0; i < p->num_members; i++) {
+    admission_free(p->members[i].limit);
+  }
+  free(p->members);
+  free(p);
+}
+
+/* Encode an update of a client's cursor into buf, which must have room for
+ * PRESENCE_UPDATE_SZ bytes.
+ *
+ * Returns: the length of the datagram
+ */
+size_t presence_encode_update(char *buf, uint64_t token, uint32_t seq,
+                              const Presence_cursor *cursor) {
+  buf[0] = PRESENCE_UPDATE;
+  put_u32(buf + 1, cursor->uid);
+  put_u32(buf + 5, token >> 32);
+  put_u32(buf + 9, token);
+  put_u32(buf + 13, seq);
+  put_u16(buf + 17, cursor->y);
+  put_u16(buf + 19, cursor->x);
+  buf[21] = cursor->mode;
+  return PRESENCE_UPDATE_SZ;
+}
+
+/* Read up to max cursors from a datagram of cursors.
+ *
+ * Returns: the number read, or -1 if it's malformed
+ */
+int presence_decode_cursors(const char *data, size_t len,
+                            Presence_cursor *cursors, int max) {
+  if (len < 1 || data[0] != PRESENCE_CURSORS ||
+      (len - 1) % PRESENCE_CURSOR_SZ != 0) {
+    return -1;
+  }
+  int n = 0;
+  for (const char *p = data + 1; p < data + len && n < max;
+       p += PRESENCE_CURSOR_SZ) {
+    cursors[n++] = (Presence_cursor){.uid = get_u32(p),
+                                     .y = get_u16(p + 4),
+                                     .x = get_u16(p + 6),
+                                     .mode = (unsigned char)p[8]};
+  }
+  return n;
+}
@@ -0,0 +1,65 @@
+#ifndef presence_h
+#define presence_h
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "admission.h"
+
+#define PRESENCE_UPDATE 'u'   // datagram from a client: its cursor
+#define PRESENCE_CURSORS 'p'  // datagram to clients: cursors in their room
+#define PRESENCE_UPDATE_SZ 22  // u8 type, u32 uid, u64 token, u32 seq, cursor
+#define PRESENCE_CURSOR_SZ 9   // u32 uid, u16 y, u16 x, u8 mode
+#define PRESENCE_MAX_DATAGRAM (1 + 133 * PRESENCE_CURSOR_SZ)  // under an MTU
+#define PRESENCE_GONE 0xff     // mode of the cursor of a client that left
+
+/* Where someone's cursor is on the canvas, and the mode they're in */
+typedef struct {
+  int uid;
+  int y, x;
+  int mode;  // PRESENCE_GONE once they've left
+} Presence_cursor;
+
+/* A client whose cursor is shared with the rest of its room */
+typedef struct {
+  int uid;
+  uint64_t token;        // proof an update is from the client, not just its uid
+  const void *room;      // clients see the cursors of others in the same room
+  struct sockaddr_in addr;  // where its updates come from, and cursors go
+  bool has_addr;         // it's sent an update, so addr is known
+  uint32_t seq;          // of the newest update taken
+  Presence_cursor cursor;
+  bool dirty;            // changed since the last flush
+  Admission *limit;      // its updates per second
+} Presence_member;
+
+/* Latest cursor of every client, sent to their rooms in batches.
+ */
+typedef struct {
+  Presence_member *members;  // by uid
+  int num_members, cap;
+  double rate, burst;        // updates taken from each client
+  long taken, dropped;       // updates, and updates over the rate
+} Presence;
+
+/* Send len bytes of a datagram to an address */
+typedef void (*Presence_send)(void *arg, const struct sockaddr_in *to,
+                              const char *data, size_t len);
+
+Presence *presence_new(double rate, double burst);
+void presence_add(Presence *p, int uid, uint64_t token, const void *room,
+                  int64_t now_ms);
+void presence_remove(Presence *p, int uid);
+int presence_update(Presence *p, const char *data, size_t len,
+                    const struct sockaddr_in *from, int64_t now_ms);
+int presence_flush(Presence *p, bool all, Presence_send send, void *arg);
+void presence_free(Presence *p);
+
+size_t presence_encode_update(char *buf, uint64_t token, uint32_t seq,
+                              const Presence_cursor *cursor);
+int presence_decode_cursors(const char *data, size_t len,
+                            Presence_cursor *cursors, int max);
+
+#endif
@@ -0,0 +1,182 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/minunit.h"
+#include "presence.h"
+
+static Presence *p;
+static int room_a, room_b;  // rooms are only compared by address
+static uint32_t seq;
+
+// datagrams sent by a flush
+#define MAX_SENT 64
+static struct {
+  int port;
+  char data[PRESENCE_MAX_DATAGRAM];
+  size_t len;
+} sent[MAX_SENT];
+static int num_sent;
+
+static void record(void *arg, const struct sockaddr_in *to, const char *data,
+                   size_t len) {
+  if (num_sent == MAX_SENT) {
+    return;
+  }
+  sent[num_sent].port = ntohs(to->sin_port);
+  memcpy(sent[num_sent].data, data, len);
+  sent[num_sent++].len = len;
+}
+
+void test_setup(void) {
+  p = presence_new(100, 10);
+  num_sent = 0;
+  seq = 0;
+}
+
+void test_teardown(void) { presence_free(p); }
+
+/* Have uid (whose token and port are uid) send an update at time now. */
+static int update(int uid, int y, int x, int mode, int64_t now) {
+  char buf[PRESENCE_UPDATE_SZ];
+  const Presence_cursor c = {.uid = uid, .y = y, .x = x, .mode = mode};
+  const size_t len = presence_encode_update(buf, uid, ++seq, &c);
+  const struct sockaddr_in from = {.sin_family = AF_INET,
+                                   .sin_port = htons(uid)};
+  return presence_update(p, buf, len, &from, now);
+}
+
+/* Decode the nth datagram sent */
+static int sent_cursors(int n, Presence_cursor *cursors) {
+  return presence_decode_cursors(sent[n].data, sent[n].len, cursors, 200);
+}
+
+MU_TEST(test_presence_coalesce) {
+  presence_add(p, 1, 1, &room_a, 0);
+  presence_add(p, 2, 2, &room_a, 0);
+  mu_assert_int_eq(0, update(2, 0, 0, 1, 0));
+  // however often 1 moves, the others hear about the last place it got to
+  for (int i = 0; i < 5; i++) {
+    mu_assert_int_eq(0, update(1, 10 + i, 20 + i, 3, i));
+  }
+  mu_assert_int_eq(1, presence_flush(p, false, record, NULL));
+  // one datagram with both cursors, to each of them
+  mu_assert_int_eq(2, num_sent);
+  Presence_cursor c[200];
+  mu_assert_int_eq(2, sent_cursors(0, c));
+  mu_assert_int_eq(1, c[0].uid);
+  mu_assert_int_eq(14, c[0].y);
+  mu_assert_int_eq(24, c[0].x);
+  mu_assert_int_eq(3, c[0].mode);
+  mu_assert_int_eq(2, c[1].uid);
+  // nothing changed since, so nothing is sent unless everything is asked for
+  num_sent = 0;
+  mu_assert_int_eq(0, presence_flush(p, false, record, NULL));
+  mu_assert_int_eq(1, presence_flush(p, true, record, NULL));
+  mu_assert_int_eq(2, num_sent);
+}
+
+MU_TEST(test_presence_rooms) {
+  presence_add(p, 1, 1, &room_a, 0);
+  presence_add(p, 2, 2, &room_b, 0);
+  presence_add(p, 3, 3, &room_a, 0);
+  update(1, 1, 1, 0, 0);
+  update(2, 2, 2, 0, 0);
+  update(3, 3, 3, 0, 0);
+  mu_assert_int_eq(2, presence_flush(p, false, record, NULL));
+  mu_assert_int_eq(3, num_sent);
+  // everyone only hears about their own room
+  for (int i = 0; i < num_sent; i++) {
+    Presence_cursor c[200];
+    const int n = sent_cursors(i, c);
+    for (int j = 0; j < n; j++) {
+      mu_check((sent[i].port == 2) == (c[j].uid == 2));
+    }
+  }
+}
+
+MU_TEST(test_presence_rejects) {
+  presence_add(p, 1, 1, &room_a, 0);
+  // unknown clients and wrong tokens
+  mu_assert_int_eq(-1, update(5, 0, 0, 0, 0));
+  char buf[PRESENCE_UPDATE_SZ];
+  const Presence_cursor c = {.uid = 1};
+  const struct sockaddr_in from = {.sin_family = AF_INET};
+  presence_encode_update(buf, 99, 1, &c);
+  mu_assert_int_eq(-1, presence_update(p, buf, sizeof(buf), &from, 0));
+  mu_assert_int_eq(-1, presence_update(p, buf, sizeof(buf) - 1, &from, 0));
+  // updates older than one taken
+  presence_encode_update(buf, 1, 10, &c);
+  mu_assert_int_eq(0, presence_update(p, buf, sizeof(buf), &from, 0));
+  presence_encode_update(buf, 1, 9, &c);
+  mu_assert_int_eq(1, presence_update(p, buf, sizeof(buf), &from, 0));
+}
+
+MU_TEST(test_presence_rate) {
+  presence_add(p, 1, 1, &room_a, 0);
+  // a burst is taken, and then only the rate
+  int taken = 0;
+  for (int i = 0; i < 100; i++) {
+    taken += update(1, i, 0, 0, 0) == 0;
+  }
+  mu_assert_int_eq(10, taken);
+  mu_assert_int_eq(90, p->dropped);
+  mu_assert_int_eq(0, update(1, 0, 0, 0, 10));
+  mu_assert_int_eq(1, update(1, 0, 0, 0, 11));
+}
+
+MU_TEST(test_presence_gone) {
+  presence_add(p, 1, 1, &room_a, 0);
+  presence_add(p, 2, 2, &room_a, 0);
+  presence_add(p, 3, 3, &room_a, 0);
+  update(1, 1, 1, 0, 0);
+  update(2, 2, 2, 0, 0);
+  presence_flush(p, false, record, NULL);
+  // 3 never sent a cursor, so no one needs telling
+  presence_remove(p, 3);
+  mu_assert_int_eq(2, p->num_members);
+  // but 2 did
+  presence_remove(p, 2);
+  num_sent = 0;
+  mu_assert_int_eq(1, presence_flush(p, false, record, NULL));
+  mu_assert_int_eq(1, num_sent);
+  mu_assert_int_eq(1, sent[0].port);
+  Presence_cursor c[200];
+  mu_assert_int_eq(1, sent_cursors(0, c));
+  mu_assert_int_eq(2, c[0].uid);
+  mu_assert_int_eq(PRESENCE_GONE, c[0].mode);
+  mu_assert_int_eq(1, p->num_members);
+  mu_assert_int_eq(-1, update(2, 0, 0, 0, 1));
+}
+
+MU_TEST(test_presence_split) {
+  // more cursors than fit in a datagram
+  for (int uid = 1; uid <= 200; uid++) {
+    presence_add(p, uid, uid, &room_a, 0);
+    update(uid, uid, uid, 0, 0);
+  }
+  mu_assert_int_eq(2, presence_flush(p, false, record, NULL));
+  Presence_cursor c[200];
+  mu_assert_int_eq((PRESENCE_MAX_DATAGRAM - 1) / PRESENCE_CURSOR_SZ,
+                   sent_cursors(0, c));
+  mu_assert_int_eq(1, c[0].uid);
+  mu_assert_int_eq(-1, presence_decode_cursors(sent[0].data, 5, c, 200));
+}
+
+MU_TEST_SUITE(presence_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_presence_coalesce);
+  MU_RUN_TEST(test_presence_rooms);
+  MU_RUN_TEST(test_presence_rejects);
+  MU_RUN_TEST(test_presence_rate);
+  MU_RUN_TEST(test_presence_gone);
+  MU_RUN_TEST(test_presence_split);
+}
+
+int main(int argc, char const *argv[]) {
+  MU_RUN_SUITE(presence_main);
+  MU_REPORT();
+  return minunit_status;
+}
@@ -0,0 +1,538 @@
+/* Protocol 2.0: length-prefixed binary frames
+ *
+ * After a client asks for `v 2.0` and the server answers `vok`, both sides
+ * only send frames:
+ *
+ *   u32 length | u8 type | payload (length - 1 bytes)
+ *
+ * Integers are in network byte order. An ops frame holds any number of ops
+ * back to back, each a type byte followed by its fields:
+ *
+ *   'c' cell  u16 y, u16 x, u8 ch            (6 bytes)
+ *   's' span  u16 y, u16 x, u16 len, data    (7 + len bytes)
+ *   'r' rect  u16 y, u16 x, u16 h, u16 w, u8 ch  (10 bytes)
+ *   'b' blit  u16 y, u16 x, u16 h, u16 w, data   (9 + h * w bytes)
+ *
+ * so a batch of edits costs one frame header instead of a line per cell, and a
+ * run of typing or a pasted block is a single op.
+ *
+ * A snapshot frame holds u16 rows, u16 cols and the serialized canvas. Every
+ * op the server applies gets the next version number, and a version frame
+ * (u64) follows each batch of updates and snapshot it sends, saying which
+ * version the client's canvas is at after it. Canvas requests have an optional
+ * u64 version, to only be sent a snapshot if the canvas has changed since
+ * then, and quit frames have no payload.
+ *
+ * Clients can send a view frame (u16 y, x, h, w) with the part of the canvas
+ * they're looking at, to only be sent the updates around it.
+ *
+ * Clients on the same host as the server can be sent a shared memory frame in
+ * place of a snapshot, holding the name of a segment with the canvas in it
+ * (see shm.c).
+ *
+ * Clients that ask for presence are sent a presence frame (u32 uid, u64 token,
+ * u16 port) saying where to send their cursor over UDP, and how to sign it
+ * (see presence.c).
+ *
+ * Clients that ask for tiles are sent a tiles frame (u16 rows, u16 cols, u16
+ * tile size) in place of a snapshot, and then a tile frame (u16 y, x, h, w and
+ * the cells, like a blit) for each tile of the canvas, nearest their view
+ * first, with updates in between them (see tiles.c). The version frame comes
+ * after the last tile.
+ */
+#include "proto.h"
+
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "canvas.h"
+
+/* Make room for n more bytes at the end of a buffer.
+ */
+void proto_buf_reserve(Frame_buf *buf, size_t n) {
+  if (buf->len + n <= buf->cap) {
+    return;
+  }
+  size_t cap = buf->cap ? buf->cap : 256;
+  while (cap < buf->len + n) {
+    cap *= 2;
+  }
+  if ((buf->data = realloc(buf->data, cap)) == NULL) {
+    perror("proto realloc");
+    exit(1);
+  }
+  buf->cap = cap;
+}
+
+/* Free the contents of a buffer, leaving it empty.
+ */
+void proto_buf_free(Frame_buf *buf) {
+  free(buf->data);
+  buf->data = NULL;
+  buf->len = buf->cap = buf->start = 0;
+}
+
+static void put_u16(Frame_buf *buf, int n) {
+  uint16_t v = htons(n);
+  proto_put(buf, &v, 2);
+}
+
+static int get_u16(const char *p) {
+  uint16_t v;
+  memcpy(&v, p, 2);
+  return ntohs(v);
+}
+
+/* Start a frame of the given type at the end of a buffer.
+ *
+ * The length is filled in by proto_end.
+ */
+void proto_begin(Frame_buf *buf, char type) {
+  proto_buf_reserve(buf, PROTO_HEADER_SZ);
+  buf->start = buf->len;
+  buf->len += PROTO_HEADER_SZ;
+  buf->data[buf->start + 4] = type;
+}
+
+/* Add raw bytes to the frame being written.
+ */
+void proto_put(Frame_buf *buf, const void *bytes, size_t n) {
+  proto_buf_reserve(buf, n);
+  memcpy(buf->data + buf->len, bytes, n);
+  buf->len += n;
+}
+
+/* Add an op to the frame being written.
+ */
+void proto_put_op(Frame_buf *buf, const Op *op) {
+  proto_buf_reserve(buf, 9 + (size_t)op->h * op->w);
+  proto_put(buf, &op->type, 1);
+  put_u16(buf, op->y);
+  put_u16(buf, op->x);
+  switch (op->type) {
+    case OP_CELL:
+      proto_put(buf, &op->ch, 1);
+      break;
+    case OP_SPAN:
+      put_u16(buf, op->w);
+      proto_put(buf, op->data, op->w);
+      break;
+    case OP_RECT:
+      put_u16(buf, op->h);
+      put_u16(buf, op->w);
+      proto_put(buf, &op->ch, 1);
+      break;
+    case OP_BLIT:
+      put_u16(buf, op->h);
+      put_u16(buf, op->w);
+      for (int r = 0; r < op->h; r++) {
+        proto_put(buf, op->data + (size_t)r * op->stride, op->w);
+      }
+      break;
+  }
+}
+
+/* Add a cell to the frame being written, as part of a span with the cells
+ * before it if it carries on from them (or writes over the last of them).
+ *
+ * Cells are only put in buf once one comes along that doesn't carry on from
+ * them: call proto_put_run before finishing the frame.
+ */
+void proto_put_cell(Frame_buf *buf, Op_run *run, int y, int x, char ch) {
+  if (run->w > 0 && y == run->y && x == run->x + run->w - 1) {
+    run->data[run->w - 1] = ch;
+    return;
+  }
+  if (run->w == 0 || y != run->y || x != run->x + run->w ||
+      run->w == PROTO_RUN_MAX) {
+    proto_put_run(buf, run);
+    run->y = y;
+    run->x = x;
+  }
+  run->data[run->w++] = ch;
+}
+
+/* Add the cells of a run to the frame being written, as a cell or a span, and
+ * empty it.
+ */
+void proto_put_run(Frame_buf *buf, Op_run *run) {
+  if (run->w == 1) {
+    proto_put_op(buf, &(Op){.type = OP_CELL, .y = run->y, .x = run->x,
+                            .h = 1, .w = 1, .ch = run->data[0]});
+  } else if (run->w > 1) {
+    proto_put_op(buf, &(Op){.type = OP_SPAN, .y = run->y, .x = run->x,
+                            .h = 1, .w = run->w, .data = run->data});
+  }
+  run->w = 0;
+}
+
+/* Finish the frame being written.
+ *
+ * Returns: the length of the whole frame, including its header
+ */
+size_t proto_end(Frame_buf *buf) {
+  const uint32_t len = htonl(buf->len - buf->start - 4);
+  memcpy(buf->data + buf->start, &len, 4);
+  return buf->len - buf->start;
+}
+
+/* Add a snapshot frame of a canvas to a buffer.
+ *
+ * Returns: the length of the frame
+ */
+size_t proto_snapshot(Frame_buf *buf, Canvas *canvas) {
+  const size_t size = (size_t)canvas->num_rows * canvas->num_cols;
+  proto_begin(buf, FRAME_SNAPSHOT);
+  put_u16(buf, canvas->num_rows);
+  put_u16(buf, canvas->num_cols);
+  proto_buf_reserve(buf, size);
+  buf->len += canvas_serialize(canvas, buf->data + buf->len);
+  return proto_end(buf);
+}
+
+/* Add a version frame to a buffer.
+ *
+ * Returns: the length of the frame
+ */
+size_t proto_version(Frame_buf *buf, uint64_t version) {
+  const uint32_t v[2] = {htonl(version >> 32), htonl(version)};
+  proto_begin(buf, FRAME_VERSION);
+  proto_put(buf, v, sizeof(v));
+  return proto_end(buf);
+}
+
+/* Read the version from the payload of a version frame (or canvas request).
+ *
+ * Returns: false if the payload isn't a version
+ */
+bool proto_read_version(const char *payload, size_t len, uint64_t *version) {
+  uint32_t v[2];
+  if (len != sizeof(v)) {
+    return false;
+  }
+  memcpy(v, payload, sizeof(v));
+  *version = (uint64_t)ntohl(v[0]) << 32 | ntohl(v[1]);
+  return true;
+}
+
+/* Add a view frame to a buffer.
+ *
+ * Returns: the length of the frame
+ */
+size_t proto_view(Frame_buf *buf, int y, int x, int h, int w) {
+  proto_begin(buf, FRAME_VIEW);
+  put_u16(buf, y);
+  put_u16(buf, x);
+  put_u16(buf, h);
+  put_u16(buf, w);
+  return proto_end(buf);
+}
+
+/* Read the rectangle from the payload of a view frame.
+ *
+ * Returns: false if the payload isn't a view
+ */
+bool proto_read_view(const char *payload, size_t len, int *y, int *x, int *h,
+                     int *w) {
+  if (len != 8) {
+    return false;
+  }
+  *y = get_u16(payload);
+  *x = get_u16(payload + 2);
+  *h = get_u16(payload + 4);
+  *w = get_u16(payload + 6);
+  return true;
+}
+
+/* Add a shared memory frame, naming the segment with the canvas, to a buffer.
+ *
+ * Returns: the length of the frame
+ */
+size_t proto_shm(Frame_buf *buf, const char *name) {
+  proto_begin(buf, FRAME_SHM);
+  proto_put(buf, name, strlen(name));
+  return proto_end(buf);
+}
+
+/* Read the segment name from the payload of a shared memory frame into a
+ * buffer of n bytes.
+ *
+ * Returns: false if the payload isn't a name that fits
+ */
+bool proto_read_shm(const char *payload, size_t len, char *name, size_t n) {
+  if (len == 0 || len >= n || memchr(payload, '\0', len) != NULL) {
+    return false;
+  }
+  memcpy(name, payload, len);
+  name[len] = '\0';
+  return true;
+}
+
+/* Add a presence frame, with the uid and token a client signs its cursor
+ * updates with and the UDP port to send them to, to a buffer.
+ *
+ * Returns: the length of the frame
+ */
+size_t proto_presence(Frame_buf *buf, int uid, uint64_t token, int port) {
+  const uint32_t v[3] = {htonl(uid), htonl(token >> 32), htonl(token)};
+  proto_begin(buf, FRAME_PRESENCE);
+  proto_put(buf, v, sizeof(v));
+  put_u16(buf, port);
+  return proto_end(buf);
+}
+
+/* Read the uid, token and port from the payload of a presence frame.
+ *
+ * Returns: false if the payload isn't a presence frame's
+ */
+bool proto_read_presence(const char *payload, size_t len, int *uid,
+                         uint64_t *token, int *port) {
+  uint32_t v[3];
+  if (len != sizeof(v) + 2) {
+    return false;
+  }
+  memcpy(v, payload, sizeof(v));
+  *uid = ntohl(v[0]);
+  *token = (uint64_t)ntohl(v[1]) << 32 | ntohl(v[2]);
+  *port = get_u16(payload + sizeof(v));
+  return true;
+}
+
+/* Add a tiles frame, saying a canvas of rows x cols is coming in tiles of
+ * tile_sz x tile_sz cells, to a buffer.
+ *
+ * Returns: the length of the frame
+ */
+size_t proto_tiles(Frame_buf *buf, int rows, int cols, int tile_sz) {
+  proto_begin(buf, FRAME_TILES);
+  put_u16(buf, rows);
+  put_u16(buf, cols);
+  put_u16(buf, tile_sz);
+  return proto_end(buf);
+}
+
+/* Read the canvas and tile size from the payload of a tiles frame.
+ *
+ * Returns: false if the payload isn't a tiles frame's
+ */
+bool proto_read_tiles(const char *payload, size_t len, int *rows, int *cols,
+                      int *tile_sz) {
+  if (len != 6) {
+    return false;
+  }
+  *rows = get_u16(payload);
+  *cols = get_u16(payload + 2);
+  *tile_sz = get_u16(payload + 4);
+  return *rows > 0 && *cols > 0 && *tile_sz > 0;
+}
+
+/* Add a tile frame with the cells of a rectangle (inside the canvas) to a
+ * buffer.
+ *
+ * Returns: the length of the frame
+ */
+size_t proto_tile(Frame_buf *buf, Canvas *canvas, int y, int x, int h, int w) {
+  proto_begin(buf, FRAME_TILE);
+  proto_buf_reserve(buf, 8 + (size_t)h * w);
+  put_u16(buf, y);
+  put_u16(buf, x);
+  put_u16(buf, h);
+  put_u16(buf, w);
+  for (int r = 0; r < h; r++) {
+    proto_put(buf, canvas->rows[y + r] + x, w);
+  }
+  return proto_end(buf);
+}
+
+/* Read the payload of a tile frame as a blit, whose data points into the
+ * payload.
+ *
+ * Returns: false if it's malformed
+ */
+bool proto_read_tile(const char *payload, size_t len, Op *op) {
+  if (len < 8) {
+    return false;
+  }
+  op->type = OP_BLIT;
+  op->y = get_u16(payload);
+  op->x = get_u16(payload + 2);
+  op->h = get_u16(payload + 4);
+  op->w = op->stride = get_u16(payload + 6);
+  op->data = payload + 8;
+  return len - 8 == (size_t)op->h * op->w;
+}
+
+/* Find the first frame in buf.
+ *
+ * The type and payload length are filled in as soon as buf holds the header,
+ * so a reader can tell how much more it needs.
+ *
+ * Returns: the length of the frame, 0 if buf doesn't hold all of it yet, or -1
+ * if it's malformed
+ */
+long proto_parse(const char *buf, size_t len, char *type, const char **payload,
+                 size_t *payload_len) {
+  if (len < PROTO_HEADER_SZ) {
+    return 0;
+  }
+  uint32_t n;
+  memcpy(&n, buf, 4);
+  n = ntohl(n);
+  if (n < 1 || n > PROTO_MAX_FRAME) {
+    return -1;
+  }
+  *type = buf[4];
+  *payload = buf + PROTO_HEADER_SZ;
+  *payload_len = n - 1;
+  if (len < 4 + (size_t)n) {
+    return 0;
+  }
+  return 4 + n;
+}
+
+/* Read the op at *p from the payload of an ops frame ending at end, and move
+ * *p past it.
+ *
+ * Data of spans and blits points into the payload.
+ *
+ * Returns: 1 if an op was read, 0 at the end of the payload, or -1 if it's
+ * malformed
+ */
+int proto_next_op(const char **p, const char *end, Op *op) {
+  const char *s = *p;
+  if (s == end) {
+    return 0;
+  }
+  // every op has at least a type, y, x, and one more byte
+  if (end - s < 6) {
+    return -1;
+  }
+  op->type = s[0];
+  op->y = get_u16(s + 1);
+  op->x = get_u16(s + 3);
+  op->data = NULL;
+  s += 5;
+  switch (op->type) {
+    case OP_CELL:
+      op->h = op->w = 1;
+      op->ch = *s++;
+      break;
+    case OP_SPAN:
+      if (end - s < 2) {
+        return -1;
+      }
+      op->h = 1;
+      op->w = op->stride = get_u16(s);
+      s += 2;
+      if (end - s < op->w) {
+        return -1;
+      }
+      op->data = s;
+      s += op->w;
+      break;
+    case OP_RECT:
+    case OP_BLIT:
+      if (end - s < (op->type == OP_RECT ? 5 : 4)) {
+        return -1;
+      }
+      op->h = get_u16(s);
+      op->w = op->stride = get_u16(s + 2);
+      s += 4;
+      if (op->type == OP_RECT) {
+        op->ch = *s++;
+      } else {
+        if (end - s < (long)op->h * op->w) {
+          return -1;
+        }
+        op->data = s;
+        s += (size_t)op->h * op->w;
+      }
+      break;
+    default:
+      return -1;
+  }
+  *p = s;
+  return 1;
+}
+
+/* Make a canvas from the payload of a snapshot frame.
+ *
+ * Returns: the canvas, or NULL if the payload is malformed
+ */
+Canvas *proto_read_snapshot(const char *payload, size_t len) {
+  if (len < 4) {
+    return NULL;
+  }
+  const int rows = get_u16(payload), cols = get_u16(payload + 2);
+  if (rows < 1 || cols < 1 || len - 4 != (size_t)rows * cols) {
+    return NULL;
+  }
+  Canvas *canvas = canvas_new(rows, cols);
+  for (int y = 0; y < rows; y++) {
+    memcpy(canvas->rows[y], payload + 4 + (size_t)y * cols, cols);
+  }
+  return canvas;
+}
+
+/* Clip an op to the cells of a num_rows x num_cols canvas.
+ *
+ * Also fills in the height and width of cells and spans, so ops can be built
+ * with only the fields they're encoded with.
+ *
+ * Returns: false if no cells are left
+ */
+bool proto_clip_op(Op *op, int num_rows, int num_cols) {
+  if (op->type == OP_CELL) {
+    op->h = op->w = 1;
+  } else if (op->type == OP_SPAN) {
+    op->h = 1;
+  }
+  int top = 0, left = 0;
+  if (op->y < 0) {
+    top = -op->y;
+  }
+  if (op->x < 0) {
+    left = -op->x;
+  }
+  int h = op->h, w = op->w;
+  if (op->y + h > num_rows) {
+    h = num_rows - op->y;
+  }
+  if (op->x + w > num_cols) {
+    w = num_cols - op->x;
+  }
+  h -= top;
+  w -= left;
+  if (h <= 0 || w <= 0) {
+    return false;
+  }
+  if (op->data != NULL) {
+    op->data += (size_t)top * op->stride + left;
+  }
+  op->y += top;
+  op->x += left;
+  op->h = h;
+  op->w = w;
+  return true;
+}
+
+/* Write an op, which must be inside the canvas, to a canvas.
+ *
+ * Returns: the number of cells written
+ */
+int proto_apply_op(Canvas *canvas, const Op *op) {
+  for (int r = 0; r < op->h; r++) {
+    char *row = canvas->rows[op->y + r] + op->x;
+    if (op->data != NULL) {
+      memcpy(row, op->data + (size_t)r * op->stride, op->w);
+    } else {
+      memset(row, op->ch, op->w);
+    }
+    canvas_mark_dirty_y(canvas, op->y + r);
+  }
+  return op->h * op->w;
+}
@@ -0,0 +1,96 @@
+#ifndef proto_h
+#define proto_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "canvas.h"
+
+#define PROTO_HEADER_SZ 5           // u32 length + u8 type
+#define PROTO_MAX_FRAME (1 << 24)   // longest frame accepted
+
+// frame types
+#define FRAME_OPS 'o'       // batch of ops
+#define FRAME_SNAPSHOT 'S'  // u16 rows, u16 cols, serialized canvas
+#define FRAME_CANVAS 'c'    // request for a snapshot
+#define FRAME_QUIT 'q'      // closing the connection
+#define FRAME_VERSION 'V'   // u64 version of the canvas so far
+#define FRAME_VIEW 'w'      // u16 y, x, h, w of the part of the canvas in view
+#define FRAME_SHM 'm'       // name of a shared memory segment with the canvas
+#define FRAME_PRESENCE 'p'  // u32 uid, u64 token, u16 port to send cursors to
+#define FRAME_TILES 'T'     // u16 rows, u16 cols, u16 tile size: tiles follow
+#define FRAME_TILE 't'      // u16 y, u16 x, u16 h, u16 w, cells of one tile
+
+// op types
+#define OP_CELL 'c'  // y x ch
+#define OP_SPAN 's'  // y x len data
+#define OP_RECT 'r'  // y x h w ch
+#define OP_BLIT 'b'  // y x h w data
+
+/* A change to a rectangle of cells: filled with ch, or copied from data.
+ *
+ * Cells and spans are 1 row high, and cells are 1 column wide.
+ */
+typedef struct {
+  char type;
+  int y, x;
+  int h, w;
+  char ch;           // fill of cells and rects
+  const char *data;  // contents of spans and blits, row by row
+  int stride;        // bytes between rows of data
+} Op;
+
+/* Growable buffer of encoded frames.
+ */
+typedef struct {
+  char *data;
+  size_t len, cap;
+  size_t start;  // offset of the frame being written
+} Frame_buf;
+
+#define PROTO_RUN_MAX 256  // most cells merged into one span
+
+/* Cells written one at a time and not put in a frame yet, merged into a span
+ * while they run left to right along a row.
+ */
+typedef struct {
+  int y, x, w;  // cells so far (none if w is 0)
+  char data[PROTO_RUN_MAX];
+} Op_run;
+
+void proto_buf_reserve(Frame_buf *buf, size_t n);
+void proto_buf_free(Frame_buf *buf);
+
+void proto_begin(Frame_buf *buf, char type);
+void proto_put(Frame_buf *buf, const void *bytes, size_t n);
+void proto_put_op(Frame_buf *buf, const Op *op);
+void proto_put_cell(Frame_buf *buf, Op_run *run, int y, int x, char ch);
+void proto_put_run(Frame_buf *buf, Op_run *run);
+size_t proto_end(Frame_buf *buf);
+size_t proto_snapshot(Frame_buf *buf, Canvas *canvas);
+size_t proto_version(Frame_buf *buf, uint64_t version);
+size_t proto_view(Frame_buf *buf, int y, int x, int h, int w);
+size_t proto_shm(Frame_buf *buf, const char *name);
+size_t proto_presence(Frame_buf *buf, int uid, uint64_t token, int port);
+size_t proto_tiles(Frame_buf *buf, int rows, int cols, int tile_sz);
+size_t proto_tile(Frame_buf *buf, Canvas *canvas, int y, int x, int h, int w);
+
+long proto_parse(const char *buf, size_t len, char *type, const char **payload,
+                 size_t *payload_len);
+int proto_next_op(const char **p, const char *end, Op *op);
+Canvas *proto_read_snapshot(const char *payload, size_t len);
+bool proto_read_version(const char *payload, size_t len, uint64_t *version);
+bool proto_read_view(const char *payload, size_t len, int *y, int *x, int *h,
+                     int *w);
+bool proto_read_shm(const char *payload, size_t len, char *name, size_t n);
+bool proto_read_presence(const char *payload, size_t len, int *uid,
+                         uint64_t *token, int *port);
+bool proto_read_tiles(const char *payload, size_t len, int *rows, int *cols,
+                      int *tile_sz);
+bool proto_read_tile(const char *payload, size_t len, Op *op);
+
+bool proto_clip_op(Op *op, int num_rows, int num_cols);
+int proto_apply_op(Canvas *canvas, const Op *op);
+
+#endif
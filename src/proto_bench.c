@@ -0,0 +1,247 @@
+/* Benchmark of protocol 1.0 against 2.0
+ *
+ * Sends 1,000 edits in a few shapes (typing, scattered cells, filled
+ * rectangles, a pasted block) over a socketpair and applies them on the other
+ * side, the way a client's edits reach the server. Edits are sent:
+ *
+ * - v1: a `s y x c` line and a write per cell, like net_send_char
+ * - v2 cells: a frame with a single cell op and a write per cell
+ * - v2 batch: one frame holding the edits as the fewest ops, and one write
+ *
+ * and each prints its bytes and write syscalls per 1,000 edits, and the time
+ * per edit to send, receive, parse and apply it.
+ *
+ * Run with `make .run-proto_bench.c`, or `make bench` for all benchmarks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "canvas.h"
+#include "proto.h"
+
+#define NUM_EDITS 1000
+#define ROUNDS 200
+#define CANVAS_SZ 100
+
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// the edits of a workload, as ops and as the cells they cover
+static Op ops[NUM_EDITS];
+static int num_ops;
+static Op cells[NUM_EDITS];
+static char blit_data[NUM_EDITS];
+static char span_data[NUM_EDITS];
+
+static void add_op(Op op) {
+  ops[num_ops++] = op;
+  const int h = op.type == OP_CELL || op.type == OP_SPAN ? 1 : op.h;
+  const int w = op.type == OP_CELL ? 1 : op.w;
+  static int num_cells;
+  if (num_ops == 1) {
+    num_cells = 0;
+  }
+  for (int r = 0; r < h; r++) {
+    for (int c = 0; c < w; c++) {
+      cells[num_cells++] = (Op){
+          .type = OP_CELL,
+          .y = op.y + r,
+          .x = op.x + c,
+          .ch = op.data ? op.data[r * op.stride + c] : op.ch,
+      };
+    }
+  }
+}
+
+/* Typing: ten lines of 100 characters
+ */
+static void workload_typing() {
+  num_ops = 0;
+  for (int i = 0; i < NUM_EDITS; i++) {
+    span_data[i] = 'a' + i % 26;
+  }
+  for (int y = 0; y < 10; y++) {
+    add_op((Op){.type = OP_SPAN, .y = y, .x = 0, .w = 100,
+                .data = span_data + y * 100, .stride = 100});
+  }
+}
+
+/* Scattered: 1,000 cells at random spots
+ */
+static void workload_scattered() {
+  num_ops = 0;
+  srand(1);
+  for (int i = 0; i < NUM_EDITS; i++) {
+    add_op((Op){.type = OP_CELL, .y = rand() % CANVAS_SZ,
+                .x = rand() % CANVAS_SZ, .ch = '#'});
+  }
+}
+
+/* Fill: ten 10x10 rectangles
+ */
+static void workload_fill() {
+  num_ops = 0;
+  for (int i = 0; i < 10; i++) {
+    add_op((Op){.type = OP_RECT, .y = i * 5, .x = i * 8, .h = 10, .w = 10,
+                .ch = '-'});
+  }
+}
+
+/* Paste: one 25x40 block
+ */
+static void workload_paste() {
+  num_ops = 0;
+  for (int i = 0; i < NUM_EDITS; i++) {
+    blit_data[i] = (i % 40) % 3 ? '|' : ' ';
+  }
+  add_op((Op){.type = OP_BLIT, .y = 30, .x = 20, .h = 25, .w = 40,
+              .data = blit_data, .stride = 40});
+}
+
+typedef struct {
+  long bytes, writes;
+  double seconds;
+} result_t;
+
+/* Apply 1.0 lines the way the server does.
+ */
+static size_t recv_v1(Canvas *canvas, char *buf, size_t len) {
+  size_t start = 0;
+  char *nl;
+  while ((nl = memchr(buf + start, '\n', len - start)) != NULL) {
+    *nl = '\0';
+    char *line = buf + start;
+    const char c = line[strlen(line) - 1];
+    char *command = strtok(line, " ");
+    if (command != NULL && !strcmp(command, "s")) {
+      int y = atoi(strtok(NULL, " "));
+      int x = atoi(strtok(NULL, " "));
+      if (canvas_isin_yx(canvas, y, x)) {
+        canvas_scharyx(canvas, y, x, c);
+      }
+    }
+    start = nl - buf + 1;
+  }
+  return start;
+}
+
+/* Apply 2.0 frames the way the server does.
+ */
+static size_t recv_v2(Canvas *canvas, char *buf, size_t len) {
+  size_t start = 0;
+  char type;
+  const char *payload;
+  size_t payload_len;
+  long n;
+  while ((n = proto_parse(buf + start, len - start, &type, &payload,
+                          &payload_len)) > 0) {
+    const char *p = payload;
+    Op op;
+    while (proto_next_op(&p, payload + payload_len, &op) == 1) {
+      if (proto_clip_op(&op, canvas->num_rows, canvas->num_cols)) {
+        proto_apply_op(canvas, &op);
+      }
+    }
+    start += n;
+  }
+  return start;
+}
+
+/* Send the current workload as v1 lines, v2 single-cell frames, or one v2
+ * batch, and receive and apply it.
+ */
+static result_t run(int mode, Canvas *canvas) {
+  int fds[2];
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  int sz = 1 << 20;
+  setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+  setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+
+  Frame_buf out = {0};
+  static char in[1 << 20];
+  result_t res = {0};
+  const double start = now();
+  for (int round = 0; round < ROUNDS; round++) {
+    size_t expected = 0;
+    if (mode == 2) {
+      out.len = 0;
+      proto_begin(&out, FRAME_OPS);
+      for (int i = 0; i < num_ops; i++) {
+        proto_put_op(&out, &ops[i]);
+      }
+      proto_end(&out);
+      expected += write(fds[0], out.data, out.len);
+      res.writes++;
+    } else {
+      for (int i = 0; i < NUM_EDITS; i++) {
+        const Op *c = &cells[i];
+        char line[32];
+        if (mode == 0) {
+          int n = sprintf(line, "s %d %d %c\n", c->y, c->x, c->ch);
+          expected += write(fds[0], line, n);
+        } else {
+          out.len = 0;
+          proto_begin(&out, FRAME_OPS);
+          proto_put_op(&out, c);
+          proto_end(&out);
+          expected += write(fds[0], out.data, out.len);
+        }
+        res.writes++;
+      }
+    }
+    res.bytes += expected;
+
+    size_t got = 0;
+    while (got < expected) {
+      got += read(fds[1], in + got, sizeof(in) - got);
+    }
+    if (mode == 0) {
+      recv_v1(canvas, in, got);
+    } else {
+      recv_v2(canvas, in, got);
+    }
+  }
+  res.seconds = now() - start;
+  proto_buf_free(&out);
+  close(fds[0]);
+  close(fds[1]);
+  return res;
+}
+
+int main(int argc, char const *argv[]) {
+  void (*workloads[])() = {workload_typing, workload_scattered, workload_fill,
+                           workload_paste};
+  const char *names[] = {"typing", "scattered", "fill", "paste"};
+  const char *modes[] = {"v1", "v2 cells", "v2 batch"};
+  Canvas *expected = canvas_new(CANVAS_SZ, CANVAS_SZ);
+  Canvas *canvas = canvas_new(CANVAS_SZ, CANVAS_SZ);
+
+  printf("%-10s %-9s %12s %12s %10s\n", "per 1000", "protocol", "bytes",
+         "writes", "ns/edit");
+  for (int w = 0; w < 4; w++) {
+    workloads[w]();
+    for (int m = 0; m < 3; m++) {
+      canvas_fill(canvas, ' ');
+      result_t res = run(m, canvas);
+      if (m == 0) {
+        canvas_free(expected);
+        expected = canvas_cpy(canvas);
+      } else if (!canvas_eq(canvas, expected)) {
+        printf("(%s %s differs from v1)\n", names[w], modes[m]);
+      }
+      printf("%-10s %-9s %12.0f %12.0f %10.1f\n", names[w], modes[m],
+             (double)res.bytes / ROUNDS, (double)res.writes / ROUNDS,
+             res.seconds * 1e9 / ((long)ROUNDS * NUM_EDITS));
+    }
+  }
+  canvas_free(expected);
+  canvas_free(canvas);
+  return 0;
+}
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "canvas.h"
+#include "lib/minunit.h"
+#include "proto.h"
+
+static Frame_buf buf;
+static Canvas *c1;
+
+void test_setup(void) {
+  memset(&buf, 0, sizeof(buf));
+  c1 = canvas_new(10, 20);
+}
+
+void test_teardown(void) {
+  proto_buf_free(&buf);
+  canvas_free(c1);
+}
+
+/* Decode every op in the only frame of buf and apply it to canvas.
+ *
+ * Returns: the number of ops, or -1 if anything is malformed
+ */
+static int apply_frame(Canvas *canvas) {
+  char type;
+  const char *payload;
+  size_t len;
+  if (proto_parse(buf.data, buf.len, &type, &payload, &len) != (long)buf.len ||
+      type != FRAME_OPS) {
+    return -1;
+  }
+  const char *p = payload;
+  Op op;
+  int res, num_ops = 0;
+  while ((res = proto_next_op(&p, payload + len, &op)) == 1) {
+    if (proto_clip_op(&op, canvas->num_rows, canvas->num_cols)) {
+      proto_apply_op(canvas, &op);
+    }
+    num_ops++;
+  }
+  return res < 0 ? -1 : num_ops;
+}
+
+MU_TEST(test_proto_ops) {
+  char blit[] = "abc"
+                "def";
+  proto_begin(&buf, FRAME_OPS);
+  proto_put_op(&buf, &(Op){.type = OP_CELL, .y = 1, .x = 2, .ch = 'x'});
+  proto_put_op(&buf, &(Op){.type = OP_SPAN, .y = 2, .x = 0, .w = 5,
+                           .data = "hello"});
+  proto_put_op(&buf, &(Op){.type = OP_RECT, .y = 4, .x = 4, .h = 2, .w = 3,
+                           .ch = '#'});
+  proto_put_op(&buf, &(Op){.type = OP_BLIT, .y = 7, .x = 1, .h = 2, .w = 3,
+                           .data = blit, .stride = 3});
+  mu_assert_int_eq(PROTO_HEADER_SZ + 6 + 12 + 10 + 15, proto_end(&buf));
+  mu_assert_int_eq(4, apply_frame(c1));
+
+  Canvas *expected = canvas_new(10, 20);
+  canvas_ldstryx(expected, "x", 1, 2);
+  canvas_ldstryx(expected, "hello", 2, 0);
+  canvas_ldstryx(expected, "###\n###", 4, 4);
+  canvas_ldstryx(expected, "abc\ndef", 7, 1);
+  mu_check(canvas_eq(expected, c1));
+  canvas_free(expected);
+}
+
+MU_TEST(test_proto_clip) {
+  char blit[] = "abcd"
+                "efgh"
+                "ijkl";
+  Op op = {.type = OP_BLIT, .y = 8, .x = 18, .h = 3, .w = 4, .data = blit,
+           .stride = 4};
+  mu_check(proto_clip_op(&op, 10, 20));
+  mu_assert_int_eq(2, op.h);
+  mu_assert_int_eq(2, op.w);
+  proto_apply_op(c1, &op);
+  mu_assert_int_eq('a', canvas_gcharyx(c1, 8, 18));
+  mu_assert_int_eq('f', canvas_gcharyx(c1, 9, 19));
+
+  // clipped blits are encoded without the cut-off columns
+  proto_begin(&buf, FRAME_OPS);
+  proto_put_op(&buf, &op);
+  mu_assert_int_eq(PROTO_HEADER_SZ + 9 + 4, proto_end(&buf));
+
+  Op off = {.type = OP_RECT, .y = 10, .x = 0, .h = 1, .w = 1, .ch = '#'};
+  mu_check(!proto_clip_op(&off, 10, 20));
+}
+
+MU_TEST(test_proto_parse_partial) {
+  proto_begin(&buf, FRAME_OPS);
+  proto_put_op(&buf, &(Op){.type = OP_CELL, .y = 1, .x = 2, .ch = 'x'});
+  proto_end(&buf);
+  proto_begin(&buf, FRAME_QUIT);
+  proto_end(&buf);
+
+  char type;
+  const char *payload;
+  size_t len;
+  // nothing until the whole frame is there
+  for (size_t i = 0; i < 11; i++) {
+    mu_assert_int_eq(0, proto_parse(buf.data, i, &type, &payload, &len));
+  }
+  // but the header says how long it is
+  len = 0;
+  mu_assert_int_eq(0, proto_parse(buf.data, 5, &type, &payload, &len));
+  mu_assert_int_eq(6, len);
+  mu_assert_int_eq(11, proto_parse(buf.data, buf.len, &type, &payload, &len));
+  mu_assert_int_eq(FRAME_OPS, type);
+  mu_assert_int_eq(6, len);
+  mu_assert_int_eq(PROTO_HEADER_SZ, proto_parse(buf.data + 11, buf.len - 11,
+                                                &type, &payload, &len));
+  mu_assert_int_eq(FRAME_QUIT, type);
+  mu_assert_int_eq(0, len);
+}
+
+MU_TEST(test_proto_malformed) {
+  char type;
+  const char *payload;
+  size_t len;
+  // zero and oversized lengths
+  mu_assert_int_eq(-1, proto_parse("\0\0\0\0o", 5, &type, &payload, &len));
+  mu_assert_int_eq(-1, proto_parse("\x7f\0\0\0o", 5, &type, &payload, &len));
+
+  // truncated span and unknown op
+  const char span[] = {OP_SPAN, 0, 1, 0, 1, 0, 5, 'a', 'b'};
+  const char *p = span;
+  Op op;
+  mu_assert_int_eq(-1, proto_next_op(&p, span + sizeof(span), &op));
+  const char unknown[] = {'?', 0, 1, 0, 1, 'a'};
+  p = unknown;
+  mu_assert_int_eq(-1, proto_next_op(&p, unknown + sizeof(unknown), &op));
+}
+
+MU_TEST(test_proto_snapshot) {
+  canvas_ldstryx(c1, "hello\nworld", 3, 5);
+  proto_snapshot(&buf, c1);
+
+  char type;
+  const char *payload;
+  size_t len;
+  mu_assert_int_eq(buf.len, proto_parse(buf.data, buf.len, &type, &payload,
+                                         &len));
+  mu_assert_int_eq(FRAME_SNAPSHOT, type);
+  Canvas *read = proto_read_snapshot(payload, len);
+  mu_check(canvas_eq(c1, read));
+  canvas_free(read);
+  mu_check(proto_read_snapshot(payload, len - 1) == NULL);
+}
+
+MU_TEST(test_proto_version) {
+  proto_version(&buf, 0x123456789aULL);
+
+  char type;
+  const char *payload;
+  size_t len;
+  mu_assert_int_eq(13, proto_parse(buf.data, buf.len, &type, &payload, &len));
+  mu_assert_int_eq(FRAME_VERSION, type);
+  uint64_t version;
+  mu_check(proto_read_version(payload, len, &version));
+  mu_check(version == 0x123456789aULL);
+  mu_check(!proto_read_version(payload, len - 1, &version));
+}
+
+MU_TEST(test_proto_view) {
+  proto_view(&buf, 120, 4000, 50, 200);
+
+  char type;
+  const char *payload;
+  size_t len;
+  mu_assert_int_eq(13, proto_parse(buf.data, buf.len, &type, &payload, &len));
+  mu_assert_int_eq(FRAME_VIEW, type);
+  int y, x, h, w;
+  mu_check(proto_read_view(payload, len, &y, &x, &h, &w));
+  mu_assert_int_eq(120, y);
+  mu_assert_int_eq(4000, x);
+  mu_assert_int_eq(50, h);
+  mu_assert_int_eq(200, w);
+  mu_check(!proto_read_view(payload, len + 1, &y, &x, &h, &w));
+}
+
+MU_TEST(test_proto_shm) {
+  proto_shm(&buf, "/collascii-1");
+
+  char type;
+  const char *payload;
+  size_t len;
+  mu_assert_int_eq(17, proto_parse(buf.data, buf.len, &type, &payload, &len));
+  mu_assert_int_eq(FRAME_SHM, type);
+  char name[16];
+  mu_check(proto_read_shm(payload, len, name, sizeof(name)));
+  mu_assert_string_eq("/collascii-1", name);
+  // too long for the buffer
+  mu_check(!proto_read_shm(payload, len, name, 12));
+}
+
+MU_TEST(test_proto_presence) {
+  proto_presence(&buf, 42, 0x0123456789abcdefULL, 5000);
+
+  char type;
+  const char *payload;
+  size_t len;
+  mu_assert_int_eq(19, proto_parse(buf.data, buf.len, &type, &payload, &len));
+  mu_assert_int_eq(FRAME_PRESENCE, type);
+  int uid, port;
+  uint64_t token;
+  mu_check(proto_read_presence(payload, len, &uid, &token, &port));
+  mu_assert_int_eq(42, uid);
+  mu_check(token == 0x0123456789abcdefULL);
+  mu_assert_int_eq(5000, port);
+  mu_check(!proto_read_presence(payload, len - 1, &uid, &token, &port));
+}
+
+MU_TEST(test_proto_tiles) {
+  canvas_ldstryx(c1, "hello\nworld", 3, 5);
+  proto_tiles(&buf, 100, 300, 64);
+  proto_tile(&buf, c1, 3, 6, 2, 3);
+
+  char type;
+  const char *payload;
+  size_t len;
+  long n = proto_parse(buf.data, buf.len, &type, &payload, &len);
+  mu_assert_int_eq(11, n);
+  mu_assert_int_eq(FRAME_TILES, type);
+  int rows, cols, tile_sz;
+  mu_check(proto_read_tiles(payload, len, &rows, &cols, &tile_sz));
+  mu_assert_int_eq(100, rows);
+  mu_assert_int_eq(300, cols);
+  mu_assert_int_eq(64, tile_sz);
+
+  mu_assert_int_eq(19, proto_parse(buf.data + n, buf.len - n, &type, &payload,
+                                   &len));
+  mu_assert_int_eq(FRAME_TILE, type);
+  Op op;
+  mu_check(proto_read_tile(payload, len, &op));
+  mu_assert_int_eq(OP_BLIT, op.type);
+  mu_assert_int_eq(3, op.y);
+  mu_assert_int_eq(6, op.x);
+  mu_assert_int_eq(2, op.h);
+  mu_assert_int_eq(3, op.w);
+  mu_check(strncmp(op.data, "ellorl", 6) == 0);
+  mu_check(!proto_read_tile(payload, len - 1, &op));
+}
+
+MU_TEST(test_proto_run) {
+  Op_run run = {0};
+  proto_begin(&buf, FRAME_OPS);
+  // typed along a row, with the last cell typed over
+  proto_put_cell(&buf, &run, 2, 3, 'a');
+  proto_put_cell(&buf, &run, 2, 4, 'b');
+  proto_put_cell(&buf, &run, 2, 5, 'c');
+  proto_put_cell(&buf, &run, 2, 5, 'd');
+  mu_assert_int_eq(PROTO_HEADER_SZ, buf.len);
+  // then somewhere else
+  proto_put_cell(&buf, &run, 4, 0, 'e');
+  proto_put_cell(&buf, &run, 3, 1, 'f');
+  proto_put_run(&buf, &run);
+  proto_put_run(&buf, &run);
+  proto_end(&buf);
+
+  canvas_fill(c1, ' ');
+  mu_assert_int_eq(3, apply_frame(c1));
+  mu_assert_int_eq(PROTO_HEADER_SZ + 10 + 6 + 6, buf.len);
+  mu_assert_int_eq('a', canvas_gcharyx(c1, 2, 3));
+  mu_assert_int_eq('b', canvas_gcharyx(c1, 2, 4));
+  mu_assert_int_eq('d', canvas_gcharyx(c1, 2, 5));
+  mu_assert_int_eq('e', canvas_gcharyx(c1, 4, 0));
+  mu_assert_int_eq('f', canvas_gcharyx(c1, 3, 1));
+
+  // long runs are cut into spans of PROTO_RUN_MAX
+  buf.len = 0;
+  proto_begin(&buf, FRAME_OPS);
+  for (int x = 0; x < PROTO_RUN_MAX + 1; x++) {
+    proto_put_cell(&buf, &run, 0, x, 'g');
+  }
+  proto_put_run(&buf, &run);
+  proto_end(&buf);
+  mu_assert_int_eq(PROTO_HEADER_SZ + 7 + PROTO_RUN_MAX + 6, buf.len);
+}
+
+MU_TEST_SUITE(proto_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_proto_ops);
+  MU_RUN_TEST(test_proto_clip);
+  MU_RUN_TEST(test_proto_parse_partial);
+  MU_RUN_TEST(test_proto_malformed);
+  MU_RUN_TEST(test_proto_snapshot);
+  MU_RUN_TEST(test_proto_version);
+  MU_RUN_TEST(test_proto_view);
+  MU_RUN_TEST(test_proto_shm);
+  MU_RUN_TEST(test_proto_presence);
+  MU_RUN_TEST(test_proto_tiles);
+  MU_RUN_TEST(test_proto_run);
+}
+
+int main(int argc, char const *argv[]) {
+  MU_RUN_SUITE(proto_main);
+  MU_REPORT();
+  return minunit_status;
+}
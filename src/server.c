@@ -1,351 +1,3621 @@
 /*
  * Server for Collascii
  *
- * mostly copied from:
+ * Connections are handled by one reactor thread per core. Each reactor has its
+ * own listening socket (all bound to the same port with SO_REUSEPORT, so the
+ * kernel spreads new connections between them) and its own epoll instance.
+ * Sockets are non-blocking, and every client has a read buffer that incoming
+ * bytes are split into lines from.
+ *
+ * Outgoing messages go into a per-client queue of chunks. Any reactor can add
+ * to any client's queue; the first message into an empty queue asks the owning
+ * reactor (through its epoll instance) to drain it, which it does with
+ * `writev` once the socket is writable, sending everything queued by then in
+ * one call. Only the owning reactor writes to, reads from, or closes a client.
+ * Messages for many clients (like ticks) are encoded once into a refcounted
+ * frame that every recipient's queue points to, so sending one to a room costs
+ * a small chunk per client instead of a copy.
+ *
+ * Clients are refcounted, and freed when the last reference is dropped: the
+ * reactor that owns the socket holds one, and so does the room the client is
+ * in, along with each request in flight about it.
+ *
+ * Queues are bounded. A client that falls more than `--max-queue` bytes behind
+ * has its queued updates dropped and is sent a fresh copy of the canvas
+ * instead (`cs rows cols` followed by the serialized canvas), so one slow
+ * consumer can't grow the server without bound or hold up anyone else.
+ *
+ * Clients speak either protocol 1.0 (a text line per command) or 2.0 (binary
+ * frames of batched ops, see proto.c), picked by the version they ask for.
+ *
+ * A server hosts any number of rooms, each with its own canvas, clients, tick
+ * map, interest index and op log. Clients pick one by adding `#name` to the
+ * version line (`v 2.0 #name`); without one they join the main room, which
+ * holds the canvas the server was started with.
+ *
+ * Each room is owned by one thread of the worker pool (`--workers`, one per
+ * core by default), and only that thread touches its state. New rooms go to
+ * the worker with the fewest, so a busy room only slows down the rooms that
+ * share its worker. Reactors don't apply the edits they read: they encode each
+ * read's edits into one request and push it onto the room's worker's
+ * lock-free queue (see mpsc.c), along with requests for the canvas (joins,
+ * `c`, leaving). The worker takes requests off the queue in order, applies
+ * edits, and sends snapshots, so writes never race and a snapshot always
+ * matches the version it's sent with. Once ROOM_BACKLOG_SZ bytes of edits are
+ * queued for a room, reactors stop reading from its clients until the worker
+ * catches up, and a worker flooded with requests still stops for its ticks,
+ * so a room drawing faster than it can be applied doesn't hold up the rest.
+ *
+ * With `--rooms <dir>`, a room's canvas is loaded from `<dir>/<name>.txt` the
+ * first time someone joins it, and saved back and unloaded once it's been
+ * empty for `--room-idle` seconds (and when the server quits). Without it,
+ * rooms other than the main one are thrown away once empty.
+ *
+ * With `--wal <dir>`, every op applied to a room is also appended to its
+ * write-ahead log there (see wal.c), which is synced with group commit: once
+ * `--wal-batch` ops are waiting, or the oldest has waited `--wal-sync`
+ * milliseconds, so a crash loses at most that much. Every `--checkpoint`
+ * seconds (or sooner once the log gets big, and when a room is unloaded or
+ * the server quits) the room's canvas is written as a checkpoint and its log
+ * emptied. A room is recovered from its checkpoint and the ops logged after
+ * it when it's loaded, so after a crash it comes back as it was, main canvas
+ * included.
+ *
+ * Applied edits are noted in the tick map with who wrote them last. Every
+ * `--tick` milliseconds each worker broadcasts the cells written in each of
+ * its rooms since the last tick as a single message, encoded once for each
+ * protocol: one ops frame for 2.0 clients, and `s y x c` lines for 1.0
+ * clients. A cell written many times in a tick (like under a brush being
+ * dragged around) is only sent once, with its latest contents.
+ *
+ * Clients aren't sent back cells they were the last to write: each writer in
+ * a tick gets a copy of the message without its own cells (up to
+ * MAX_TICK_WRITERS of them; any more get everything).
+ *
+ * Clients can also say which part of the canvas they're looking at (`w y x h
+ * w`, or a view frame), and from then on are only sent the edits in and
+ * around it. The canvas is split into buckets of BUCKET_SZ x BUCKET_SZ cells,
+ * and an index of who is looking at each bucket (see interest.c) picks who
+ * hears about a tick's touched buckets, so on a big canvas each client only
+ * pays for the edits near it. When its view moves, a client is sent the cells
+ * that came into it, since it hasn't been kept up to date on them.
+ *
+ * Every op applied gets the next version number and goes in a ring buffer of
+ * recent ops (see oplog.c), and updates and snapshots are followed by the
+ * version they bring the canvas to. A client reconnecting with `v <protocol>
+ * <version>` (or asking for the canvas with `c <version>`) is sent just the
+ * ops since then, and only gets a whole snapshot if they've left the log or
+ * would be bigger than one.
+ *
+ * New connections go through admission control: a reactor accepts at most
+ * ACCEPT_BATCH connections per wakeup so joins can't starve clients already
+ * connected, and a token bucket shared by all reactors caps how many are let
+ * in per second. A connection over the cap gets a `busy <ms>` line, asking
+ * it to retry after that many milliseconds, and is closed.
+ *
+ * With `--metrics <socket>`, a metrics thread listens on a UNIX socket and
+ * answers each connection with a report of the server's counters, gauges and
+ * histograms (see metrics.c): in the Prometheus text format, or as JSON if the
+ * request mentions "json". A request starting with `GET ` gets an HTTP
+ * response, so `curl --unix-socket` works. Counters' rates are sampled every
+ * second.
+ *
+ * With `--io uring`, reactors use io_uring (see uring.c) instead of epoll: each
+ * has one ring with a multishot accept on its listening socket and a multishot
+ * recv on each client, which the kernel fills from a ring of provided buffers
+ * without a system call per read. Instead of arming EPOLLOUT, queueing output
+ * puts the client on its reactor's list of clients to flush and wakes the
+ * reactor through an eventfd; every loop, the reactor prepares one sendmsg of
+ * everything queued for each client on the list and submits them all, along
+ * with waiting for completions, in a single `io_uring_enter`. Chunks being
+ * sent are pinned until their send completes, so a resync can't free them out
+ * from under the kernel. If the kernel doesn't support io_uring, the server
+ * says so and falls back to epoll.
+ *
+ * With `--local <socket>`, the first reactor also accepts clients on a UNIX
+ * socket, and each room keeps a copy of its canvas in a POSIX shared memory
+ * segment (see shm.c), updated along with the canvas for every request of
+ * edits. A 2.0 client on the local socket that adds `shm` to its version line
+ * is sent a shared memory frame naming the segment wherever others get a
+ * snapshot, on joining and on falling behind, and copies the canvas out of it
+ * itself, so a snapshot is never encoded, queued or written for it. Its edits
+ * and updates still go over the socket.
+ *
+ * Cursors are shared over UDP on the same port (see presence.c), outside the
+ * ops stream, since only the latest position matters and a lost one is
+ * replaced by the next. A 2.0 client that adds `presence` to its version line
+ * is sent a presence frame with its uid, a random token to sign its updates
+ * with, and the port. A presence thread takes their updates (up to
+ * PRESENCE_RATE a second from each), and every PRESENCE_MS sends each room the
+ * cursors in it that moved since, batched into as few datagrams as fit, with
+ * every cursor sent again each PRESENCE_REFRESH_MS. Cursors never touch the
+ * canvas, its version or the workers.
+ *
+ * A 2.0 client that adds `tiles=y,x,h,w` to its version line (with where it's
+ * looking as it joins) is sent the canvas in tiles of TILE_SZ x TILE_SZ cells
+ * instead of a snapshot, nearest that view first (see tiles.c), so it can start
+ * drawing before a big canvas has all arrived. Its worker queues up to
+ * STREAM_WINDOW bytes of tiles at a time, and its reactor asks for more once
+ * they're mostly written, so tiles go out as fast as the client takes them
+ * and updates to the whole canvas get through in between.
+ *
+ * Nothing is printed from the threads serving clients: they log through
+ * log.c, which formats each line into a ring buffer of the thread's own and
+ * has a background thread write them out, so a burst of joins or errors never
+ * waits on the terminal or disk. `--log-level` picks what's logged.
+ *
+ * originally based on:
  * https://github.com/yorickdewid/Chat-Server/blob/master/chat_server.c
  */
 
+#define _GNU_SOURCE  // accept4
+
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "lib/argtable3.h"
+
+#include "admission.h"
 #include "canvas.h"
+#include "interest.h"
+#include "log.h"
+#include "metrics.h"
+#include "mpsc.h"
+#include "oplog.h"
+#include "presence.h"
+#include "proto.h"
+#include "shm.h"
+#include "stream.h"
+#include "tiles.h"
+#include "uring.h"
+#include "wal.h"
 
 static _Atomic unsigned int cli_count = 0;
-static int uid = 10;
+static _Atomic int uid = 10;
 
-const char* PROTOCOL_VERSION = "1.0";
+// protocol versions, newest first
+const char *PROTOCOL_VERSIONS[] = {"2.0", "1.0"};
+#define NUM_PROTOCOL_VERSIONS 2
 
-#define MAX_CLIENTS 100
 #define BUFFER_SZ 2048
+#define MAX_LINE_SZ (BUFFER_SZ * 4)  // clients sending longer lines are dropped
+#define MAX_EVENTS 64                // epoll events handled per wakeup
+#define ACCEPT_BATCH 64              // connections accepted per wakeup
+#define CHUNK_SZ 512                 // smallest chunk of an outgoing queue
+#define MAX_IOV 64                   // chunks written per writev
+#define MAX_TICK_WRITERS 16          // writers sent a tick without their cells
+#define BUCKET_SZ 32                 // rows and columns of an interest bucket
+#define MAX_ROOM_NAME 31
+#define ROOM_CHECK_MS 1000           // how often workers look for idle rooms
+#define DRAIN_CHECK 64               // requests handled between tick checks
+#define ROOM_BACKLOG_SZ (256 << 10)  // edits queued for a room before its
+                                     // clients stop being read from
+#define URING_ENTRIES 4096           // submissions an io_uring reactor batches
+#define URING_BUFS 512               // receive buffers of an io_uring reactor
+#define URING_BUF_SZ 4096
+#define WAL_CHECKPOINT_SZ (64 << 20) // log size that brings a checkpoint early
+#define PRESENCE_MS 50               // how often moved cursors are sent
+#define PRESENCE_REFRESH_MS 1000     // how often every cursor is sent again
+#define PRESENCE_RATE 60             // cursor updates taken per client per second
+#define PRESENCE_BURST 10            // cursor updates taken from a client at once
+#define PRESENCE_BATCH 64            // datagrams per recvmmsg or sendmmsg
+#define TILE_SZ 64                   // rows and columns of a streamed tile
+#define STREAM_WINDOW (64 << 10)     // bytes of tiles queued for a client at
+                                     // once
 
-/* Client structure */
+// if version isn't defined by the Makefile
+#ifndef VERSION
+#define VERSION "unknown"
+#endif
+
+const char *program_name = "server.out";
+const char *program_version = VERSION;
+
+/* Growable byte buffer */
+typedef struct {
+  char *data;
+  size_t len, cap;
+} buffer_t;
+
+/* Message encoded once and queued for any number of clients, freed once the
+ * last of them has written it.
+ */
+typedef struct {
+  _Atomic int refs;
+  size_t len;
+  char data[];
+} frame_t;
+
+/* Piece of an outgoing queue: bytes of its own, or (the first len bytes of)
+ * a shared frame
+ */
+typedef struct chunk {
+  struct chunk *next;
+  size_t len, cap;
+  size_t off;      // bytes already written
+  bool droppable;  // holds updates that a snapshot replaces
+  frame_t *frame;  // shared bytes it sends instead of data, or NULL
+  char data[];
+} chunk_t;
+
+/* Outgoing queue */
 typedef struct {
+  chunk_t *head, *tail;
+  size_t len;  // bytes queued and not yet written
+} queue_t;
+
+struct reactor;
+
+/* Client structure */
+typedef struct client {
   struct sockaddr_in addr; /* Client remote address */
   int connfd;              /* Connection file descriptor */
   int uid;                 /* Client unique identifier */
   char name[32];           /* Client name */
+  struct reactor *reactor; /* Reactor that owns the connection */
+  struct room *room;       /* Room it joined, once negotiated */
+  bool negotiated;         /* Protocol version has been agreed on */
+  bool synced;             /* Sent the canvas, so it gets updates */
+  int version;             /* Major protocol version (1 or 2) */
+  bool versioned;          /* Told the canvas version after updates */
+  bool closing;            /* Close once its output is written (out_mutex) */
+  bool rejected;           /* Turned away by admission control */
+  bool closed;             /* Closed by its reactor */
+  bool paused;             /* Not read from until it catches up (out_mutex) */
+  bool local;              /* Connected through the local socket */
+  bool shm;                /* Sent the shared canvas instead of snapshots */
+  bool presence;           /* Its cursor is shared with its room */
+  bool tiles;              /* Sent the canvas in tiles instead of snapshots */
+  Rect join_view;          /* Where it's looking as it joins, for its tiles */
+  _Atomic int refs;        /* References held by the room and requests */
+  Stream in;               /* Bytes read but not yet parsed into lines */
+  queue_t out;             /* Messages waiting to be written */
+  long resyncs;            /* Times updates were dropped for a snapshot */
+  bool has_view;           /* Only sent updates around its view (worker) */
+  Rect view;               /* Buckets it's sent updates for (worker) */
+  uint64_t tick_stamp;     /* Last tick it was picked for (worker) */
+  Tiles *stream;           /* Tiles of the canvas being sent, or NULL (worker) */
+  int *stream_order;       /* Those tiles, nearest its view first (worker) */
+  int stream_next;         /* Next of them to send (worker) */
+  _Atomic bool streaming;  /* Has tiles left to be sent */
+  _Atomic bool tiles_asked; /* Its worker has been asked for more of them */
+  pthread_mutex_t out_mutex; /* Guards out, closed, closing and paused */
+  struct client *prev, *next; /* Links in its room's clients (worker) */
+  struct client *next_paused; /* In its reactor's paused clients (reactor) */
+  /* with io_uring (see reactor_run_uring) */
+  Mpsc_node flush_node;    /* In its reactor's clients with output to send */
+  bool flush_queued;       /* In that queue (out_mutex) */
+  bool sending;            /* Has a send in flight (out_mutex) */
+  bool recv_armed;         /* Has a multishot recv in flight (reactor) */
+  struct msghdr msg;       /* Of the send in flight */
+  struct iovec *iov;
 } client_t;
 
-client_t *clients[MAX_CLIENTS];
+/* A message encoded for each protocol version */
+typedef struct {
+  frame_t *v1, *v2;  // NULL if there's nothing to send
+  size_t v1_len, v2_len;
+  size_t v1_version_len;  // `v <version>` line after v1, for versioned clients
+  int ops;                // ops in it, for metrics
+} message_t;
 
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Cells written since the last broadcast, and who wrote them last */
+typedef struct {
+  int **tiles;        /* uid of the last writer of each cell of a bucket (0 if
+                         none), or NULL for buckets with no written cells */
+  int *touched;       /* buckets with written cells */
+  int num_touched;
+  int **spare;        /* cleared tiles to reuse */
+  int num_spare;
+  uint64_t stamp;     /* count of ticks flushed */
+  int writers[MAX_TICK_WRITERS]; /* writers that get their own copy */
+  int num_writers;
+  uint64_t version;      /* version of the last op applied to the canvas */
+  Oplog *log;            /* recent ops, to catch up reconnecting clients */
+  int64_t oldest_read;   /* when the oldest edit of the tick was read (ns) */
+} tick_t;
 
-Canvas *canvas;
-char *canvas_buf;
+/* A tick's cells encoded for each protocol version */
+typedef struct {
+  buffer_t v1;   /* `s y x c` lines, then a `v <version>` line */
+  size_t v1_version_len;
+  Frame_buf v2;  /* one ops frame, then a version frame */
+  int ops;       /* ops in the frame */
+} update_t;
 
-/* Add client to queue */
-void queue_add(client_t *cl) {
-  pthread_mutex_lock(&clients_mutex);
-  for (int i = 0; i < MAX_CLIENTS; ++i) {
-    if (!clients[i]) {
-      clients[i] = cl;
-      break;
-    }
+/* Reactor: one event loop thread */
+typedef struct reactor {
+  int id;
+  int epfd;
+  int listenfd;
+  int localfd;       /* local socket, on the first reactor with --local, or -1 */
+  client_t *paused;  /* clients waiting for their room to catch up */
+  pthread_t thread;
+  /* with io_uring (see reactor_run_uring) */
+  Uring ring;
+  Mpsc flushes;         /* clients with output to send */
+  int wakefd;           /* eventfd written when flushes gets clients */
+  _Atomic bool woken;   /* wakefd has been written since the last wakeup */
+  uint64_t wake_count;  /* read from wakefd */
+} reactor_t;
+
+/* Worker: a thread that owns some rooms */
+typedef struct worker {
+  int id;
+  Mpsc requests;      /* work for its rooms, from the reactors */
+  sem_t ready;        /* count of requests to wake it for */
+  struct room *rooms; /* the rooms it has loaded (worker) */
+  int num_rooms;      /* rooms given to it (rooms_mutex) */
+  pthread_t thread;
+} worker_t;
+
+/* A canvas and the clients drawing on it */
+typedef struct room {
+  char name[MAX_ROOM_NAME + 1]; /* "" for the main canvas */
+  worker_t *worker;    /* worker that owns it */
+  int members;         /* clients that joined and haven't left (rooms_mutex) */
+  int64_t idle_since;  /* when the last member left (rooms_mutex) */
+  _Atomic size_t backlog; /* bytes of edits queued for its worker */
+  bool loaded;         /* the fields below are set up (worker) */
+  Canvas *canvas;
+  tick_t tick;
+  Interest *interest;  /* clients with a view, by the buckets around it */
+  Wal *wal;            /* log of its applied ops, with wal_dir */
+  Shm_canvas *shm;     /* copy of the canvas for local clients, with --local */
+  int64_t checkpointed_at; /* when it was last checkpointed */
+  client_t *clients;   /* synced clients, that get updates */
+  int num_clients;
+  int num_v1;          /* of them speaking 1.0 */
+  struct room *next;        /* in the list of all rooms (rooms_mutex) */
+  struct room *next_loaded; /* in its worker's list (worker) */
+} room_t;
+
+// all rooms, loaded or waiting for their worker to load them
+room_t *rooms = NULL;
+pthread_mutex_t rooms_mutex = PTHREAD_MUTEX_INITIALIZER;
+room_t *main_room;
+const char *rooms_dir;  // where rooms are loaded from and saved to, or NULL
+int room_idle_ms;       // time a room is kept loaded with no one in it
+
+const char *wal_dir;  // where rooms' logs and checkpoints are kept, or NULL
+int wal_sync_ms;      // longest an applied op waits to be synced
+int wal_sync_ops;     // most applied ops waiting to be synced
+int checkpoint_ms;    // time between checkpoints of a room
+
+worker_t *workers;
+int num_workers;
+
+// bytes of updates queued for a client before it is sent a snapshot instead
+size_t max_queue;
+
+// reactors use io_uring instead of epoll
+bool use_uring;
+
+/* Work for a worker */
+typedef struct {
+  Mpsc_node node;
+  enum {
+    REQ_OPS,     /* apply edits */
+    REQ_SYNC,    /* send a client the canvas, or what it missed */
+    REQ_CANVAS,  /* send a 1.0 client the serialized canvas */
+    REQ_VIEW,    /* only send a client updates around its view */
+    REQ_TILES,   /* send a client more tiles of the canvas */
+    REQ_LEAVE,   /* take a closed client out of its room */
+    REQ_QUIT,    /* tell everyone the server is going down, and stop */
+  } type;
+  room_t *room;     /* room it's for */
+  int uid;          /* who the edits are from */
+  client_t *cli;    /* client to send to, with a reference held */
+  bool resume;      /* catch up from since instead of a snapshot */
+  uint64_t since;
+  Rect view;        /* part of the canvas in view */
+  int64_t read_at;  /* when the edits were read (ns) */
+  size_t len;
+  char ops[];       /* edits, encoded like in an ops frame */
+} request_t;
+
+int tick_ms;  // milliseconds between broadcasts, 0 to send after every read
+size_t log_size;  // bytes of recent ops each room keeps
+
+// shared by all reactors
+Admission *admission;
+pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// socket for clients on this host, who can be sent the canvas through shared
+// memory, or NULL
+const char *local_path;
+static _Atomic int num_segments;
+
+// cursors shared over UDP, or NULL if the port couldn't be bound for it
+Presence *presence;
+pthread_mutex_t presence_mutex = PTHREAD_MUTEX_INITIALIZER;
+int presence_fd;
+int presence_port;
+
+// reported on the metrics socket, if there is one (see metrics.c)
+const char *metrics_path;
+Counter connections = {"collascii_connections_total", "Connections accepted"};
+Counter rejected = {"collascii_rejected_total",
+                    "Connections turned away by admission control"};
+Counter ops_in = {"collascii_ops_in_total", "Ops applied to canvases"};
+Counter ops_out = {"collascii_ops_out_total", "Ops queued for clients"};
+Counter bytes_in = {"collascii_bytes_in_total", "Bytes read from clients"};
+Counter bytes_out = {"collascii_bytes_out_total", "Bytes written to clients"};
+Counter reads_in = {"collascii_reads_total",
+                    "Reads from clients that got data (about a packet each)"};
+Counter op_bytes_in = {"collascii_op_bytes_in_total",
+                       "Bytes of the edits read from clients"};
+Counter resyncs = {"collascii_resyncs_total",
+                   "Snapshots sent to clients that fell behind"};
+Gauge clients = {"collascii_clients", "Clients connected"};
+Gauge rooms_loaded = {"collascii_rooms_loaded", "Rooms loaded by workers"};
+Gauge canvas_bytes = {"collascii_canvas_bytes",
+                      "Memory taken by the canvases of loaded rooms"};
+Counter cursors_in = {"collascii_cursor_updates_total",
+                      "Cursor updates taken from clients"};
+Counter cursors_dropped = {
+    "collascii_cursor_updates_dropped_total",
+    "Cursor updates dropped for being over a client's rate or out of order"};
+Counter cursors_out = {"collascii_cursor_datagrams_total",
+                       "Datagrams of cursors sent to clients"};
+Counter tiles_out = {"collascii_tiles_total",
+                     "Tiles of canvases sent to joining clients"};
+Histogram queued_bytes = {
+    "collascii_client_queue_bytes",
+    "Bytes waiting to be written to each client, sampled every second", 512,
+    1};
+Histogram broadcast_latency = {
+    "collascii_broadcast_latency_seconds",
+    "Time from reading the oldest edit of a tick to queueing it for clients",
+    16000, 1e-9};
+Histogram fanout_time = {"collascii_fanout_seconds",
+                         "Time to encode and queue a tick for a room", 16000,
+                         1e-9};
+Histogram snapshot_time = {"collascii_snapshot_seconds",
+                           "Time to encode and queue a snapshot", 16000, 1e-9};
+Counter *all_counters[] = {&connections, &rejected,        &ops_in,
+                           &ops_out,     &bytes_in,        &bytes_out,
+                           &reads_in,    &op_bytes_in,     &resyncs,
+                           &cursors_in,  &cursors_dropped, &cursors_out,
+                           &tiles_out};
+Gauge *all_gauges[] = {&clients, &rooms_loaded, &canvas_bytes};
+Histogram *all_histograms[] = {&queued_bytes, &broadcast_latency, &fanout_time,
+                               &snapshot_time};
+Metrics metrics = {all_counters, 13, all_gauges, 3, all_histograms, 4};
+
+/* Nanoseconds on the monotonic clock */
+int64_t now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* Milliseconds on the monotonic clock */
+int64_t now_ms() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/* Make room for n more bytes at the end of a buffer */
+void buffer_reserve(buffer_t *buf, size_t n) {
+  if (buf->len + n <= buf->cap) {
+    return;
+  }
+  size_t cap = buf->cap ? buf->cap : BUFFER_SZ;
+  while (cap < buf->len + n) {
+    cap *= 2;
   }
-  pthread_mutex_unlock(&clients_mutex);
+  if ((buf->data = realloc(buf->data, cap)) == NULL) {
+    perror("buffer realloc");
+    exit(1);
+  }
+  buf->cap = cap;
 }
 
-/* Delete client from queue */
-void queue_delete(int uid) {
-  pthread_mutex_lock(&clients_mutex);
-  for (int i = 0; i < MAX_CLIENTS; ++i) {
-    if (clients[i]) {
-      if (clients[i]->uid == uid) {
-        clients[i] = NULL;
-        break;
-      }
+/* Add n bytes to the end of a buffer */
+void buffer_append(buffer_t *buf, const char *s, size_t n) {
+  buffer_reserve(buf, n);
+  memcpy(buf->data + buf->len, s, n);
+  buf->len += n;
+}
+
+// the reactor running on this thread, if any
+static __thread reactor_t *this_reactor;
+
+// what an io_uring completion is for, in the low bits of its user_data (the
+// rest is the client it's for, if any)
+enum { UD_ACCEPT, UD_ACCEPT_LOCAL, UD_RECV, UD_SEND, UD_WAKE, UD_IGNORE };
+#define UD_MASK 7
+
+static uint64_t uring_data(client_t *cli, int type) {
+  return (uint64_t)(uintptr_t)cli | type;
+}
+
+/* Have a client's reactor send its queued output, waking it up unless it's
+ * the caller (it looks at its queue before it next waits).
+ */
+void reactor_wake(reactor_t *r, client_t *cli) {
+  mpsc_push(&r->flushes, &cli->flush_node);
+  if (r != this_reactor && !atomic_exchange(&r->woken, true)) {
+    const uint64_t one = 1;
+    if (write(r->wakefd, &one, sizeof(one)) < 0) {
+      log_error("wake reactor: %s", strerror(errno));
     }
   }
-  pthread_mutex_unlock(&clients_mutex);
 }
 
-/* Send message to all clients but the sender */
-void send_message(char *s, int uid) {
-  pthread_mutex_lock(&clients_mutex);
-  for (int i = 0; i < MAX_CLIENTS; ++i) {
-    if (clients[i]) {
-      if (clients[i]->uid != uid) {
-        if (write(clients[i]->connfd, s, strlen(s)) < 0) {
-          perror("Write to descriptor failed");
-          break;
-        }
-      }
+/* Watch a client for reads (unless it is closing or paused), and for writes if
+ * it has queued output.
+ *
+ * With io_uring, reads are always armed, so this just hands queued output to
+ * the reactor to send. Call with out_mutex held, except when adding it.
+ */
+void client_watch(client_t *cli, int op) {
+  if (use_uring) {
+    if (cli->out.len > 0 && !cli->sending && !cli->flush_queued &&
+        !cli->closed) {
+      cli->flush_queued = true;
+      cli->refs++;  // held by the queue
+      reactor_wake(cli->reactor, cli);
     }
+    return;
+  }
+  struct epoll_event ev = {
+      .events = (cli->closing || cli->paused ? 0 : EPOLLIN) |
+                (cli->out.len > 0 ? EPOLLOUT : 0),
+      .data.ptr = cli,
+  };
+  if (epoll_ctl(cli->reactor->epfd, op, cli->connfd, &ev) < 0) {
+    log_error("epoll_ctl: %s", strerror(errno));
   }
-  pthread_mutex_unlock(&clients_mutex);
 }
 
-/* Send a message to all clients */
-void broadcast_message(char *s) {
-  pthread_mutex_lock(&clients_mutex);
-  for (int i = 0; i < MAX_CLIENTS; ++i) {
-    if (clients[i]) {
-      if (write(clients[i]->connfd, s, strlen(s)) < 0) {
-        perror("Write to descriptor failed");
-        break;
-      }
-    }
+/* Copy an encoded message into a frame, with a reference for the caller. */
+frame_t *frame_new(const char *data, size_t len) {
+  frame_t *f = malloc(sizeof(frame_t) + len);
+  if (f == NULL) {
+    perror("frame malloc");
+    exit(1);
   }
-  pthread_mutex_unlock(&clients_mutex);
+  f->refs = 1;
+  f->len = len;
+  memcpy(f->data, data, len);
+  return f;
 }
 
-/* Send message to sender */
-void send_message_self(const char *s, int connfd) {
-  if (write(connfd, s, strlen(s)) < 0) {
-    perror("Write to descriptor failed");
-    exit(-1);
+/* Drop a reference to a frame, freeing it if it was the last. */
+void frame_release(frame_t *f) {
+  if (f != NULL && --f->refs == 0) {
+    free(f);
   }
 }
 
-/* Send message to client */
-void send_message_client(char *s, int uid) {
-  pthread_mutex_lock(&clients_mutex);
-  for (int i = 0; i < MAX_CLIENTS; ++i) {
-    if (clients[i]) {
-      if (clients[i]->uid == uid) {
-        if (write(clients[i]->connfd, s, strlen(s)) < 0) {
-          perror("Write to descriptor failed");
-          break;
-        }
-      }
-    }
+/* The bytes a chunk sends */
+static inline char *chunk_bytes(chunk_t *c) {
+  return c->frame != NULL ? c->frame->data : c->data;
+}
+
+static void chunk_free(chunk_t *c) {
+  frame_release(c->frame);
+  free(c);
+}
+
+/* Drop a reference to a client, freeing it if it was the last */
+void client_release(client_t *cli) {
+  if (--cli->refs > 0) {
+    return;
   }
-  pthread_mutex_unlock(&clients_mutex);
+  close(cli->connfd);
+  for (chunk_t *c = cli->out.head, *next; c; c = next) {
+    next = c->next;
+    chunk_free(c);
+  }
+  pthread_mutex_destroy(&cli->out_mutex);
+  stream_free(&cli->in);
+  free(cli->iov);
+  free(cli);
 }
 
-/* Strip CRLF */
-void strip_newline(char *s) {
-  while (*s != '\0') {
-    if (*s == '\r' || *s == '\n') {
-      *s = '\0';
-    }
-    s++;
+/* Have a client's reactor read from it until it closes, with a multishot recv
+ * that holds a reference to it.
+ */
+void client_recv(client_t *cli) {
+  cli->refs++;
+  cli->recv_armed = true;
+  uring_prep_recv(uring_sqe(&cli->reactor->ring), cli->connfd, 0,
+                  uring_data(cli, UD_RECV));
+}
+
+/* Add a chunk to the end of a queue */
+static void queue_push(queue_t *q, chunk_t *c) {
+  if (q->tail) {
+    q->tail->next = c;
+  } else {
+    q->head = c;
   }
+  q->tail = c;
 }
 
-/* Print ip address */
-void print_client_addr(struct sockaddr_in addr) {
-  printf("%d.%d.%d.%d", addr.sin_addr.s_addr & 0xff,
-         (addr.sin_addr.s_addr & 0xff00) >> 8,
-         (addr.sin_addr.s_addr & 0xff0000) >> 16,
-         (addr.sin_addr.s_addr & 0xff000000) >> 24);
+/* Get room for n bytes at the end of a client's queue.
+ *
+ * Small messages share chunks with the ones before them, as long as they can
+ * be dropped (or kept) together. The caller fills in the bytes and adds them
+ * to the lengths. Call with out_mutex held.
+ */
+chunk_t *queue_reserve(client_t *cli, size_t n, bool droppable) {
+  queue_t *q = &cli->out;
+  chunk_t *tail = q->tail;
+  if (tail && tail->frame == NULL && tail->droppable == droppable &&
+      tail->cap - tail->len >= n) {
+    return tail;
+  }
+  const size_t cap = n > CHUNK_SZ ? n : CHUNK_SZ;
+  chunk_t *c = malloc(sizeof(chunk_t) + cap);
+  if (c == NULL) {
+    perror("queue malloc");
+    exit(1);
+  }
+  *c = (chunk_t){.cap = cap, .droppable = droppable};
+  queue_push(q, c);
+  return c;
 }
 
-/* Handle all communication with the client */
-void *handle_client(void *arg) {
-  char buff_out[BUFFER_SZ];
-  char buff_in[BUFFER_SZ / 2];
-  int rlen;
+/* Queue the first n bytes of a frame, taking a reference to it.
+ *
+ * Call with out_mutex held.
+ */
+void queue_frame(client_t *cli, frame_t *f, size_t n, bool droppable) {
+  chunk_t *c = malloc(sizeof(chunk_t));
+  if (c == NULL) {
+    perror("queue malloc");
+    exit(1);
+  }
+  f->refs++;
+  *c = (chunk_t){.len = n, .cap = n, .droppable = droppable, .frame = f};
+  queue_push(&cli->out, c);
+  cli->out.len += n;
+}
 
-  cli_count++;
-  client_t *cli = (client_t *)arg;
+/* Remove the queued updates that haven't started being written.
+ *
+ * Call with out_mutex held.
+ */
+void queue_drop(client_t *cli) {
+  queue_t *q = &cli->out;
+  chunk_t **link = &q->head;
+  q->tail = NULL;
+  while (*link) {
+    chunk_t *c = *link;
+    if (c->droppable && c->off == 0) {
+      q->len -= c->len;
+      *link = c->next;
+      chunk_free(c);
+    } else {
+      q->tail = c;
+      link = &c->next;
+    }
+  }
+}
 
-  printf("<< accept ");
-  print_client_addr(cli->addr);
-  printf(" referenced by %d\n", cli->uid);
+/* Stop sending a client tiles, once it has them all or is sent the canvas
+ * some other way.
+ *
+ * Call from the room's worker.
+ */
+void stream_stop(client_t *cli) {
+  if (cli->stream == NULL) {
+    return;
+  }
+  tiles_free(cli->stream);
+  free(cli->stream_order);
+  cli->stream = NULL;
+  cli->stream_order = NULL;
+  cli->streaming = false;
+}
 
-  // protocol negotiation
-  if ((rlen = read(cli->connfd, buff_in, sizeof(buff_in) - 1)) < 0) {
-    printf("version negotation: error reading from socket\n");
-    goto CLIENT_CLOSE;
+/* Queue the next tiles of a client's canvas, nearest its view first, until
+ * STREAM_WINDOW bytes are waiting for it, so a slow connection is only sent as
+ * much as it takes and updates get through in between.
+ *
+ * After the last tile, the client is told the version it's at if the tick has
+ * nothing more for it (and if it does, the tick's version frame tells it).
+ * Tiles can be dropped for a snapshot like updates. Call from the room's
+ * worker, with out_mutex held.
+ */
+void queue_tiles(client_t *cli) {
+  room_t *room = cli->room;
+  Tiles *t = cli->stream;
+  const int n = tiles_count(t);
+  while (cli->stream_next < n && cli->out.len < STREAM_WINDOW) {
+    const Rect r = tiles_rect(t, cli->stream_order[cli->stream_next++]);
+    chunk_t *c =
+        queue_reserve(cli, PROTO_HEADER_SZ + 8 + (size_t)r.h * r.w, true);
+    Frame_buf frame = {.data = c->data, .len = c->len, .cap = c->cap};
+    const size_t len = proto_tile(&frame, room->canvas, r.y, r.x, r.h, r.w);
+    c->len += len;
+    cli->out.len += len;
+    metrics_add(&tiles_out, 1);
   }
-  buff_in[rlen] = '\0';
-  strip_newline(buff_in);
-  char* cmd = strtok(buff_in, " ");
-  if (cmd == NULL || cmd[0] != 'v') {
-    printf("version negotiation: client command not 'v'\n");
+  if (cli->stream_next == n) {
+    if (room->tick.num_touched == 0) {
+      chunk_t *c = queue_reserve(cli, PROTO_HEADER_SZ + 8, true);
+      Frame_buf frame = {.data = c->data, .len = c->len, .cap = c->cap};
+      const size_t len = proto_version(&frame, room->tick.version);
+      c->len += len;
+      cli->out.len += len;
+    }
+    log_debug("sent %d all %d tiles", cli->uid, n);
+    stream_stop(cli);
+  }
+}
+
+/* Start sending a client the canvas in tiles: its size, and then as many
+ * tiles as fit in its window, the ones in view first.
+ *
+ * Call from the room's worker, with out_mutex held.
+ */
+void queue_stream(client_t *cli) {
+  room_t *room = cli->room;
+  stream_stop(cli);
+  cli->stream =
+      tiles_new(room->canvas->num_rows, room->canvas->num_cols, TILE_SZ);
+  if ((cli->stream_order = malloc(tiles_count(cli->stream) * sizeof(int))) ==
+      NULL) {
+    perror("stream malloc");
+    exit(1);
+  }
+  tiles_order(cli->stream, cli->join_view, cli->stream_order);
+  cli->stream_next = 0;
+  cli->streaming = true;
+  chunk_t *c = queue_reserve(cli, PROTO_HEADER_SZ + 6, true);
+  Frame_buf frame = {.data = c->data, .len = c->len, .cap = c->cap};
+  const size_t len = proto_tiles(&frame, room->canvas->num_rows,
+                                 room->canvas->num_cols, TILE_SZ);
+  c->len += len;
+  cli->out.len += len;
+  queue_tiles(cli);
+}
 
-    goto CLIENT_CLOSE;
+/* Send a client the next tiles of its canvas, if it's still being sent them.
+ *
+ * Call from the room's worker.
+ */
+void send_tiles(client_t *cli) {
+  cli->tiles_asked = false;
+  if (cli->stream == NULL) {
+    return;
   }
-  char* client_version = strtok(NULL, " ");
-  if (client_version == NULL) {
-    printf("version negotiation: unable to parse client version\n");
-    send_message_self("can't parse version\n", cli->connfd);
-    goto CLIENT_CLOSE;
-  }
-  if (strcmp(client_version, PROTOCOL_VERSION) != 0) {
-    printf("version negotiation: unknown client protocol version: '%s'\n", client_version);
-    send_message_self("unknown protocol - supported protocol versions: ", cli->connfd);
-    send_message_self(PROTOCOL_VERSION, cli->connfd);
-    send_message_self("\n", cli->connfd);
-    goto CLIENT_CLOSE;
-  }
-  send_message_self("vok\n", cli->connfd);
-  
-  // send canvas
-  sprintf(buff_out, "cs %d %d\n", canvas->num_rows, canvas->num_cols);
-  send_message_self(buff_out, cli->connfd);
-  printf("sent canvas size\n");
-  canvas_serialize(canvas, canvas_buf);
-  send_message_self(canvas_buf, cli->connfd);
-  sprintf(buff_out, "\n");
-  send_message_self(buff_out, cli->connfd);
-  printf("sent serialized canvas\n");
-
-  /* Receive input from client */
-  while ((rlen = read(cli->connfd, buff_in, sizeof(buff_in) - 1)) > 0) {
-    buff_in[rlen] = '\0';
-    buff_out[0] = '\0';
-    strip_newline(buff_in);
-
-    /* Ignore empty buffer */
-    if (!strlen(buff_in)) {
-      continue;
+  pthread_mutex_lock(&cli->out_mutex);
+  if (!cli->closed) {
+    const bool was_empty = cli->out.len == 0;
+    queue_tiles(cli);
+    if (was_empty && cli->out.len > 0) {
+      client_watch(cli, EPOLL_CTL_MOD);
     }
+  }
+  pthread_mutex_unlock(&cli->out_mutex);
+}
 
-    /* Process Command */
-    char c = buff_in[strlen(buff_in) - 1];
-    char *command;
-    command = strtok(buff_in, " ");
-    if (!strcmp(command, "q")) {
-      break;
+/* Queue the canvas size and serialized canvas, and its version.
+ *
+ * Local clients that asked for it are sent the name of the room's shared copy
+ * of the canvas instead, which is kept up to date with every request.
+ *
+ * This is a full resync, so it can replace queued updates (and an older
+ * snapshot, or tiles) if the client falls behind. Call from the room's worker,
+ * with out_mutex held.
+ */
+void queue_snapshot(client_t *cli) {
+  room_t *room = cli->room;
+  stream_stop(cli);
+  const size_t size = room->canvas->num_rows * room->canvas->num_cols;
+  const int64_t start = now_ns();
+  if (cli->shm && room->shm != NULL) {
+    const size_t name_len = strlen(room->shm->name);
+    chunk_t *c = queue_reserve(cli, 2 * PROTO_HEADER_SZ + name_len + 8, true);
+    Frame_buf frame = {.data = c->data, .len = c->len, .cap = c->cap};
+    size_t n = proto_shm(&frame, room->shm->name);
+    n += proto_version(&frame, room->tick.version);
+    c->len += n;
+    cli->out.len += n;
+    metrics_observe(&snapshot_time, now_ns() - start);
+    return;
+  }
+  if (cli->version == 2) {
+    // encode in place: the chunk is big enough that the buffer never grows
+    chunk_t *c =
+        queue_reserve(cli, 2 * PROTO_HEADER_SZ + 4 + size + 8, true);
+    Frame_buf frame = {.data = c->data, .len = c->len, .cap = c->cap};
+    size_t n = proto_snapshot(&frame, room->canvas);
+    n += proto_version(&frame, room->tick.version);
+    c->len += n;
+    cli->out.len += n;
+    metrics_observe(&snapshot_time, now_ns() - start);
+    return;
+  }
+  char header[BUFFER_SZ];
+  const int n =
+      sprintf(header, "cs %d %d\n", room->canvas->num_rows, room->canvas->num_cols);
+  chunk_t *c = queue_reserve(cli, n + size + 1 + 32, true);
+  const size_t first = c->len;
+  memcpy(c->data + c->len, header, n);
+  c->len += n;
+  c->len += canvas_serialize(room->canvas, c->data + c->len);
+  c->data[c->len++] = '\n';
+  if (cli->versioned) {
+    c->len += sprintf(c->data + c->len, "v %" PRIu64 "\n", room->tick.version);
+  }
+  cli->out.len += c->len - first;
+  metrics_observe(&snapshot_time, now_ns() - start);
+}
+
+/* Add `s y x c` lines for each cell of an op */
+void put_v1_op(buffer_t *buf, const Op *op) {
+  char line[32];
+  for (int r = 0; r < op->h; r++) {
+    for (int c = 0; c < op->w; c++) {
+      const char ch = op->data ? op->data[r * op->stride + c] : op->ch;
+      buffer_append(buf, line,
+                    sprintf(line, "s %d %d %c\n", op->y + r, op->x + c, ch));
     }
-    if (!strcmp(command, "s")) {
-      int y = atoi(strtok(NULL, " "));
-      int x = atoi(strtok(NULL, " "));
+  }
+}
 
-      if (x > canvas->num_cols || y > canvas->num_rows) {
-        printf("set out of bounds: (%d,%d)\n", x, y);
-      } else {
-        printf("setting (%d,%d) to '%c'\n", x, y, c);
-        canvas_scharyx(canvas, y, x, c);
+/* Queue the ops after version since, and the version they bring the client
+ * to, if they're all still in the log and are smaller than a snapshot.
+ *
+ * Returns: false if the client needs a snapshot instead. Call from the room's
+ * worker, with out_mutex held.
+ */
+bool queue_delta(client_t *cli, uint64_t since) {
+  static __thread Frame_buf ops;
+  static __thread buffer_t lines;
+  room_t *room = cli->room;
+  const size_t size = room->canvas->num_rows * room->canvas->num_cols;
+  ops.len = 0;
+  proto_begin(&ops, FRAME_OPS);
+  const uint64_t version = room->tick.version;
+  // 1.0 lines take about 8 bytes a cell
+  const long n =
+      since > version ? -1
+                      : oplog_since(room->tick.log, since,
+                                    cli->version == 2 ? size : size / 8, &ops);
+  if (n < 0) {
+    return false;
+  }
+  if (n == 0) {
+    ops.len = 0;
+  } else {
+    proto_end(&ops);
+  }
 
-        sprintf(buff_out, "s %d %d %c\n", y, x, c);
-        send_message(buff_out, cli->uid);
-      }
-    } else if (!strcmp(command, "c")) {
-      canvas_serialize(canvas, canvas_buf);
-      send_message_self(canvas_buf, cli->connfd);
+  const char *data;
+  size_t len;
+  if (cli->version == 2) {
+    len = ops.len + proto_version(&ops, version);
+    data = ops.data;
+  } else {
+    lines.len = 0;
+    const char *p = ops.data + PROTO_HEADER_SZ;
+    Op op;
+    while (n > 0 && proto_next_op(&p, ops.data + ops.len, &op) == 1) {
+      put_v1_op(&lines, &op);
     }
+    char line[32];
+    buffer_append(&lines, line, sprintf(line, "v %" PRIu64 "\n", version));
+    data = lines.data;
+    len = lines.len;
   }
-  CLIENT_CLOSE:
+  chunk_t *c = queue_reserve(cli, len, true);
+  memcpy(c->data + c->len, data, len);
+  c->len += len;
+  cli->out.len += len;
+  return true;
+}
 
-  /* Close connection */
-  close(cli->connfd);
+/* Queue n bytes for a client: copied from s, or (with a frame) the start of
+ * the frame, which is shared instead of copied.
+ *
+ * Safe to call from any reactor. Droppable messages are updates to the canvas:
+ * if the client is too far behind they (and everything like them queued
+ * before) are dropped and replaced by a snapshot.
+ */
+static void client_queue(client_t *cli, const char *s, frame_t *frame,
+                         size_t n, bool droppable) {
+  pthread_mutex_lock(&cli->out_mutex);
+  if (cli->closed) {
+    pthread_mutex_unlock(&cli->out_mutex);
+    return;
+  }
+  const bool was_empty = cli->out.len == 0;
+  if (droppable && cli->out.len + n > max_queue) {
+    queue_drop(cli);
+    queue_snapshot(cli);
+    cli->resyncs++;
+    metrics_add(&resyncs, 1);
+    log_info("client %d fell behind, resyncing (%ld times)", cli->uid,
+             cli->resyncs);
+  } else if (frame != NULL) {
+    queue_frame(cli, frame, n, droppable);
+  } else {
+    chunk_t *c = queue_reserve(cli, n, droppable);
+    memcpy(c->data + c->len, s, n);
+    c->len += n;
+    cli->out.len += n;
+  }
+  if (was_empty) {
+    client_watch(cli, EPOLL_CTL_MOD);
+  }
+  pthread_mutex_unlock(&cli->out_mutex);
+}
 
-  /* Delete client from queue and yield thread */
-  queue_delete(cli->uid);
-  printf("<< quit ");
-  print_client_addr(cli->addr);
-  printf(" referenced by %d\n", cli->uid);
-  free(cli);
-  cli_count--;
-  pthread_detach(pthread_self());
+/* Queue a copy of n bytes for a client (see client_queue). */
+void client_send(client_t *cli, const char *s, size_t n, bool droppable) {
+  client_queue(cli, s, NULL, n, droppable);
+}
 
-  return NULL;
+/* Queue the first n bytes of a frame for a client (see client_queue). */
+void client_send_frame(client_t *cli, frame_t *f, size_t n, bool droppable) {
+  client_queue(cli, NULL, f, n, droppable);
 }
 
-/* send quit command to all clients */
-void finish(int sig) {
-  broadcast_message("q\n");
-  exit(sig);
+/* Take n written bytes off the front of a queue.
+ *
+ * Call with out_mutex held.
+ */
+void queue_consume(queue_t *q, size_t n) {
+  q->len -= n;
+  metrics_add(&bytes_out, n);
+  while (n > 0) {
+    chunk_t *c = q->head;
+    const size_t left = c->len - c->off;
+    if (n < left) {
+      c->off += n;
+      break;
+    }
+    n -= left;
+    q->head = c->next;
+    if (q->head == NULL) {
+      q->tail = NULL;
+    }
+    chunk_free(c);
+  }
 }
 
-int main(int argc, char *argv[]) {
-  (void)signal(SIGINT, finish); /* arrange interrupts to terminate */
+void request_tiles(client_t *cli);
 
-  if (argc > 1) {
-    if (strcmp(argv[1], "-") == 0) {
-      // read from stdin if specified
-      printf("Reading from stdin\n");
-      canvas = canvas_readf_norewind(stdin);
-      // reopen stdin b/c EOF has been sent
-      // `/dev/tty` points to current terminal
-      // note that this is NOT portable
-      freopen("/dev/tty", "rw", stdin);
+/* Write as much queued output as the socket takes.
+ *
+ * With io_uring, clients with a send in flight are left to it.
+ *
+ * Returns: 1 if the client should be closed, 0 otherwise
+ */
+int client_flush(client_t *cli) {
+  queue_t *q = &cli->out;
+  pthread_mutex_lock(&cli->out_mutex);
+  if (cli->sending) {
+    pthread_mutex_unlock(&cli->out_mutex);
+    return 0;
+  }
+  while (q->len > 0) {
+    struct iovec iov[MAX_IOV];
+    int iovcnt = 0;
+    for (chunk_t *c = q->head; c && iovcnt < MAX_IOV; c = c->next) {
+      iov[iovcnt].iov_base = chunk_bytes(c) + c->off;
+      iov[iovcnt].iov_len = c->len - c->off;
+      iovcnt++;
+    }
+    ssize_t w = writev(cli->connfd, iov, iovcnt);
+    if (w < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      log_warn("write to %d failed: %s", cli->uid, strerror(errno));
+      pthread_mutex_unlock(&cli->out_mutex);
+      return 1;
+    }
+    queue_consume(q, w);
+  }
+  client_watch(cli, EPOLL_CTL_MOD);
+  int done = cli->closing && q->len == 0;
+  const bool more_tiles = cli->streaming && q->len < STREAM_WINDOW / 2;
+  pthread_mutex_unlock(&cli->out_mutex);
+  if (more_tiles && !done) {
+    request_tiles(cli);
+  }
+  return done;
+}
 
-      /* If reading from file */
+/* Picks the message for a client */
+typedef const message_t *pick_message_t(client_t *cli, const void *arg);
+
+/* Queue a message for every client in a room, in the version each client
+ * speaks. The clients share the message's frames, so each one costs a
+ * reference instead of a copy.
+ *
+ * Call from the room's worker, which owns its list of clients.
+ */
+void send_filtered(room_t *room, pick_message_t *pick, const void *arg,
+                   bool droppable) {
+  for (client_t *cli = room->clients; cli; cli = cli->next) {
+    const message_t *msg = pick(cli, arg);
+    metrics_add(&ops_out, msg->ops);
+    if (cli->version == 2) {
+      if (msg->v2_len > 0) {
+        client_send_frame(cli, msg->v2, msg->v2_len, droppable);
+      }
     } else {
-      char *in_filename = argv[1];
-      FILE *f = fopen(in_filename, "r");
-      printf("Reading from '%s'\n", in_filename);
-      if (f == NULL) {
-        perror("savefile read");
-        exit(1);
+      const size_t n =
+          msg->v1_len + (cli->versioned ? msg->v1_version_len : 0);
+      if (n > 0) {
+        client_send_frame(cli, msg->v1, n, droppable);
       }
-      canvas = canvas_readf(f);
-      fclose(f);
     }
-  } else {
-    printf("making blank canvas\n");
-    canvas = canvas_new_blank(100, 100);
   }
+}
 
-  canvas_buf = malloc((sizeof(char) * canvas->num_cols * canvas->num_rows) + 1);
-  canvas_serialize(canvas, canvas_buf);
-  canvas_buf[(canvas->num_cols * canvas->num_rows) + 1] = 0;
+static const message_t *pick_same(client_t *cli, const void *msg) {
+  return msg;
+}
 
-  int listenfd = 0, connfd = 0;
-  struct sockaddr_in serv_addr;
-  struct sockaddr_in cli_addr;
-  pthread_t tid;
+/* Send a message to all clients in a room */
+void broadcast_message(room_t *room, const message_t *msg) {
+  send_filtered(room, pick_same, msg, false);
+}
 
-  /* Socket settings */
-  int port = 45011;
-  listenfd = socket(AF_INET, SOCK_STREAM, 0);
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  serv_addr.sin_port = htons(port);
+/* Set up an empty tick map for a room's canvas, an index of views, and a log
+ * of log_size bytes, for a canvas that's recovered up to version.
+ */
+void tick_init(room_t *room, uint64_t version) {
+  // versions start from the time, so clients of an earlier run of the server
+  // are too far behind to catch up instead of looking up to date (but never
+  // go back, so the write-ahead log can tell what its checkpoint has)
+  room->tick.version = (uint64_t)time(NULL) << 32;
+  if (room->tick.version < version) {
+    room->tick.version = version;
+  }
+  room->tick.log = oplog_new(log_size, room->tick.version);
+  room->interest = interest_new(room->canvas->num_rows, room->canvas->num_cols, BUCKET_SZ);
+  const size_t num_buckets = (size_t)room->interest->rows * room->interest->cols;
+  room->tick.tiles = calloc(num_buckets, sizeof(int *));
+  room->tick.touched = malloc(num_buckets * sizeof(int));
+  room->tick.spare = malloc(num_buckets * sizeof(int *));
+  room->tick.num_touched = 0;
+  room->tick.num_spare = 0;
+  room->tick.num_writers = 0;
+}
 
-  /* Ignore pipe signals */
-  signal(SIGPIPE, SIG_IGN);
+/* Free a room's tick map, index and log.
+ */
+void tick_free(room_t *room) {
+  const int num_buckets = room->interest->rows * room->interest->cols;
+  for (int i = 0; i < num_buckets; i++) {
+    free(room->tick.tiles[i]);
+  }
+  for (int i = 0; i < room->tick.num_spare; i++) {
+    free(room->tick.spare[i]);
+  }
+  free(room->tick.tiles);
+  free(room->tick.touched);
+  free(room->tick.spare);
+  oplog_free(room->tick.log);
+  interest_free(room->interest);
+}
 
-  /* Bind */
-  while (bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-    perror("Socket binding failed");
-    serv_addr.sin_port = htons(++port);
+/* Get the writers of a bucket's cells, starting a tile for it if it has none
+ * yet this tick.
+ */
+static int *tick_tile(room_t *room, int bucket) {
+  if (room->tick.tiles[bucket] == NULL) {
+    int *tile = room->tick.num_spare > 0
+                    ? room->tick.spare[--room->tick.num_spare]
+                    : calloc(BUCKET_SZ * BUCKET_SZ, sizeof(int));
+    if (tile == NULL) {
+      perror("tick malloc");
+      exit(1);
+    }
+    room->tick.tiles[bucket] = tile;
+    room->tick.touched[room->tick.num_touched++] = bucket;
   }
-  printf("connected to port %d", port);
+  return room->tick.tiles[bucket];
+}
 
-  /* Listen */
-  if (listen(listenfd, 10) < 0) {
-    perror("Socket listening failed");
-    return EXIT_FAILURE;
+/* Note that uid wrote the cells of an op, and log it as the next version.
+ *
+ * Call from the room's worker.
+ */
+void tick_add(room_t *room, const Op *op, int uid) {
+  oplog_add(room->tick.log, ++room->tick.version, op);
+  for (int r = 0; r < op->h; r++) {
+    const int y = op->y + r;
+    for (int x = op->x; x < op->x + op->w;) {
+      int *writer = tick_tile(room, interest_bucket(room->interest, y, x)) +
+                    y % BUCKET_SZ * BUCKET_SZ;
+      // to the end of the op or the bucket, whichever is first
+      const int end = (x / BUCKET_SZ + 1) * BUCKET_SZ;
+      for (; x < op->x + op->w && x < end; x++) {
+        writer[x % BUCKET_SZ] = uid;
+      }
+    }
+  }
+  for (int i = 0; i < room->tick.num_writers; i++) {
+    if (room->tick.writers[i] == uid) {
+      return;
+    }
   }
+  if (room->tick.num_writers < MAX_TICK_WRITERS) {
+    room->tick.writers[room->tick.num_writers++] = uid;
+  }
+}
 
-  printf("<[ SERVER STARTED ]>\n");
+static int compare_ints(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
 
-  /* Accept clients */
-  while (1) {
-    socklen_t clilen = sizeof(cli_addr);
-    connfd = accept(listenfd, (struct sockaddr *)&cli_addr, &clilen);
-
-    /* Check if max clients is reached */
-    if ((cli_count + 1) == MAX_CLIENTS) {
-      printf("<< max clients reached\n");
-      printf("<< reject ");
-      print_client_addr(cli_addr);
-      printf("\n");
-      close(connfd);
+/* Encode the cells of the tick that weren't last written by skip_uid, as
+ * spans of the canvas's current contents, followed by the version.
+ *
+ * With a region, only the cells in its buckets are encoded. 1.0 lines are
+ * only written with v1, since they cost a sprintf a cell and most rooms have
+ * no 1.0 clients. Call from the room's worker, with the touched buckets
+ * sorted.
+ */
+void tick_encode(room_t *room, update_t *update, int skip_uid,
+                 const Rect *region, bool v1) {
+  char line[32];
+  update->v1.len = 0;
+  update->v1_version_len = 0;
+  update->v2.len = 0;
+  update->ops = 0;
+  proto_begin(&update->v2, FRAME_OPS);
+  for (int i = 0; i < room->tick.num_touched; i++) {
+    const int bucket = room->tick.touched[i];
+    if (region != NULL && !interest_covers(room->interest, *region, bucket)) {
       continue;
     }
+    const int y0 = bucket / room->interest->cols * BUCKET_SZ;
+    const int x0 = bucket % room->interest->cols * BUCKET_SZ;
+    const int y1 = y0 + BUCKET_SZ < room->canvas->num_rows ? y0 + BUCKET_SZ
+                                                      : room->canvas->num_rows;
+    const int cols = x0 + BUCKET_SZ < room->canvas->num_cols ? BUCKET_SZ
+                                                       : room->canvas->num_cols - x0;
+    for (int y = y0; y < y1; y++) {
+      const int *writer = room->tick.tiles[bucket] + (y - y0) * BUCKET_SZ;
+      const char *row = room->canvas->rows[y] + x0;
+      for (int x = 0; x < cols; x++) {
+        if (writer[x] == 0 || writer[x] == skip_uid) {
+          continue;
+        }
+        int end = x + 1;
+        while (end < cols && writer[end] != 0 && writer[end] != skip_uid) {
+          end++;
+        }
+        update->ops++;
+        if (end - x == 1) {
+          proto_put_op(&update->v2, &(Op){.type = OP_CELL, .y = y,
+                                          .x = x0 + x, .ch = row[x]});
+        } else {
+          proto_put_op(&update->v2, &(Op){.type = OP_SPAN, .y = y,
+                                          .x = x0 + x, .w = end - x,
+                                          .data = row + x});
+        }
+        for (int i = x; v1 && i < end; i++) {
+          const int n = sprintf(line, "s %d %d %c\n", y, x0 + i, row[i]);
+          buffer_append(&update->v1, line, n);
+        }
+        x = end;
+      }
+    }
+  }
+  if (update->ops == 0) {
+    update->v2.len = 0;  // no cells, just the version
+  } else {
+    proto_end(&update->v2);
+  }
+  proto_version(&update->v2, room->tick.version);
+  if (!v1) {
+    return;
+  }
+  const size_t v1_len = update->v1.len;
+  buffer_reserve(&update->v1, 32);
+  update->v1.len += sprintf(update->v1.data + update->v1.len, "v %" PRIu64 "\n",
+                            room->tick.version);
+  update->v1_version_len = update->v1.len - v1_len;
+}
 
-    /* Client settings */
-    client_t *cli = (client_t *)malloc(sizeof(client_t));
-    cli->addr = cli_addr;
-    cli->connfd = connfd;
-    cli->uid = uid++;
-    sprintf(cli->name, "%d", cli->uid);
-
-    /* Add client to the queue and fork thread */
-    queue_add(cli);
-    pthread_create(&tid, NULL, &handle_client, (void *)cli);
+/* What a tick sends: everything, and copies without each writer's cells */
+typedef struct {
+  message_t all;
+  message_t others[MAX_TICK_WRITERS];
+  int writers[MAX_TICK_WRITERS];
+  int num_writers;
+} tick_messages_t;
 
-    /* Reduce CPU usage */
-    sleep(1);
+static const message_t *pick_tick(client_t *cli, const void *arg) {
+  static const message_t nothing = {0};
+  const tick_messages_t *msgs = arg;
+  if (cli->has_view) {
+    return &nothing;  // sent its own by tick_send_views
   }
+  for (int i = 0; i < msgs->num_writers; i++) {
+    if (msgs->writers[i] == cli->uid) {
+      return &msgs->others[i];
+    }
+  }
+  return &msgs->all;
+}
+
+/* A message of an update's frames, to share between its recipients.
+ *
+ * Release it with message_release once it's been queued for them.
+ */
+static message_t update_message(const update_t *update) {
+  return (message_t){
+      .v1 = update->v1.len > 0 ? frame_new(update->v1.data, update->v1.len)
+                               : NULL,
+      .v1_len = update->v1.len - update->v1_version_len,
+      .v1_version_len = update->v1_version_len,
+      .v2 = frame_new(update->v2.data, update->v2.len),
+      .v2_len = update->v2.len,
+      .ops = update->ops,
+  };
+}
+
+/* Drop the sender's references to a message's frames */
+static void message_release(message_t *msg) {
+  frame_release(msg->v1);
+  frame_release(msg->v2);
+}
+
+/* Send each client with a view in a touched bucket the tick's cells around
+ * its view (without its own).
+ *
+ * Call from the room's worker, with the touched buckets sorted.
+ */
+void tick_send_views(room_t *room) {
+  static __thread update_t update;
+  room->tick.stamp++;
+  for (int i = 0; i < room->tick.num_touched; i++) {
+    int n;
+    void *const *subs = interest_subscribers(room->interest, room->tick.touched[i], &n);
+    for (int j = 0; j < n; j++) {
+      client_t *cli = subs[j];
+      if (cli->tick_stamp == room->tick.stamp || !cli->synced) {
+        continue;
+      }
+      cli->tick_stamp = room->tick.stamp;
+      // encoded for this client alone, so copied instead of shared
+      tick_encode(room, &update, cli->uid, &cli->view, cli->version == 1);
+      metrics_add(&ops_out, update.ops);
+      if (cli->version == 2) {
+        client_send(cli, update.v2.data, update.v2.len, true);
+      } else {
+        client_send(cli, update.v1.data,
+                    update.v1.len - (cli->versioned ? 0 : update.v1_version_len),
+                    true);
+      }
+    }
+  }
+}
+
+/* Broadcast the cells written since the last tick.
+ *
+ * Call from the room's worker.
+ */
+void tick_flush(room_t *room) {
+  static __thread update_t all, others[MAX_TICK_WRITERS];
+  tick_messages_t msgs;
+
+  if (room->tick.num_touched == 0) {
+    room->tick.oldest_read = 0;
+    return;
+  }
+  const int64_t start = now_ns();
+  qsort(room->tick.touched, room->tick.num_touched, sizeof(int), compare_ints);
+  const bool v1 = room->num_v1 > 0;
+  tick_encode(room, &all, 0, NULL, v1);
+  msgs.all = update_message(&all);
+  msgs.num_writers = room->tick.num_writers;
+  for (int i = 0; i < room->tick.num_writers; i++) {
+    tick_encode(room, &others[i], room->tick.writers[i], NULL, v1);
+    msgs.others[i] = update_message(&others[i]);
+    msgs.writers[i] = room->tick.writers[i];
+  }
+  tick_send_views(room);
+  // start the next tick
+  for (int i = 0; i < room->tick.num_touched; i++) {
+    int **tile = &room->tick.tiles[room->tick.touched[i]];
+    memset(*tile, 0, BUCKET_SZ * BUCKET_SZ * sizeof(int));
+    room->tick.spare[room->tick.num_spare++] = *tile;
+    *tile = NULL;
+  }
+  room->tick.num_touched = 0;
+  room->tick.num_writers = 0;
+
+  send_filtered(room, pick_tick, &msgs, true);
+  message_release(&msgs.all);
+  for (int i = 0; i < msgs.num_writers; i++) {
+    message_release(&msgs.others[i]);
+  }
+  const int64_t end = now_ns();
+  metrics_observe(&fanout_time, end - start);
+  if (room->tick.oldest_read != 0) {
+    metrics_observe(&broadcast_latency, end - room->tick.oldest_read);
+    room->tick.oldest_read = 0;
+  }
+}
+
+/* Replace characters that can't be drawn (or would break a 1.0 line or the
+ * serialized canvas, like newlines) with spaces.
+ */
+static inline char printable(char ch) { return ch < ' ' || ch > '~' ? ' ' : ch; }
+
+/* Apply an edit from client uid to the canvas (and its shared copy, between
+ * shm_canvas_begin and shm_canvas_end), and add it to the tick and log.
+ *
+ * Parts outside of the canvas are dropped. The contents of spans and blits are
+ * cleaned up in place, so they must point into a buffer of the server's own.
+ * Call from the room's worker.
+ */
+void apply_op(room_t *room, Op *op, int uid) {
+  if (!proto_clip_op(op, room->canvas->num_rows, room->canvas->num_cols)) {
+    return;
+  }
+  if (op->data != NULL) {
+    for (int r = 0; r < op->h; r++) {
+      char *row = (char *)op->data + r * op->stride;
+      for (int c = 0; c < op->w; c++) {
+        row[c] = printable(row[c]);
+      }
+    }
+  } else {
+    op->ch = printable(op->ch);
+  }
+  proto_apply_op(room->canvas, op);
+  if (room->shm != NULL) {
+    proto_apply_op(&room->shm->canvas, op);
+  }
+  tick_add(room, op, uid);
+  metrics_add(&ops_in, 1);
+  if (room->wal != NULL) {
+    wal_append(room->wal, room->tick.version, op);
+  }
+}
+
+/* Send message to sender */
+void send_message_self(const char *s, client_t *cli) {
+  client_send(cli, s, strlen(s), false);
+}
+
+/* Strip CRLF */
+void strip_newline(char *s) {
+  while (*s != '\0') {
+    if (*s == '\r' || *s == '\n') {
+      *s = '\0';
+    }
+    s++;
+  }
+}
+
+/* Write a client's ip address, or "local" for the local socket, into buf.
+ *
+ * Returns: buf
+ */
+const char *client_addr(const client_t *cli, char buf[INET_ADDRSTRLEN]) {
+  if (cli->local) {
+    return strcpy(buf, "local");
+  }
+  return inet_ntop(AF_INET, &cli->addr.sin_addr, buf, INET_ADDRSTRLEN);
+}
+
+/* Catch a client up from a version it has, if resume is set and the ops
+ * since are still in the log, or else send it the whole canvas.
+ *
+ * Call from the room's worker.
+ */
+void send_sync(client_t *cli, bool resume, uint64_t since) {
+  pthread_mutex_lock(&cli->out_mutex);
+  if (cli->closed) {
+    pthread_mutex_unlock(&cli->out_mutex);
+    return;
+  }
+  const bool was_empty = cli->out.len == 0;
+  if (resume && queue_delta(cli, since)) {
+    // caught up
+  } else if (cli->tiles) {
+    queue_stream(cli);
+  } else {
+    queue_snapshot(cli);
+  }
+  if (was_empty) {
+    client_watch(cli, EPOLL_CTL_MOD);
+  }
+  pthread_mutex_unlock(&cli->out_mutex);
+}
+
+/* Send a 1.0 client the serialized canvas, without the size header.
+ *
+ * Call from the room's worker.
+ */
+void send_serialized(client_t *cli) {
+  room_t *room = cli->room;
+  const size_t size = room->canvas->num_rows * room->canvas->num_cols;
+  pthread_mutex_lock(&cli->out_mutex);
+  if (cli->closed) {
+    pthread_mutex_unlock(&cli->out_mutex);
+    return;
+  }
+  const bool was_empty = cli->out.len == 0;
+  chunk_t *c = queue_reserve(cli, size, false);
+  c->len += canvas_serialize(room->canvas, c->data + c->len);
+  cli->out.len += size;
+  if (was_empty) {
+    client_watch(cli, EPOLL_CTL_MOD);
+  }
+  pthread_mutex_unlock(&cli->out_mutex);
+}
+
+/* Send a client the current contents of some rectangles of the canvas.
+ *
+ * Call from the room's worker.
+ */
+void send_rects(client_t *cli, const Rect *rects, int n) {
+  room_t *room = cli->room;
+  static __thread update_t update;
+  update.v1.len = 0;
+  update.v2.len = 0;
+  proto_begin(&update.v2, FRAME_OPS);
+  for (int i = 0; i < n; i++) {
+    const Rect r = rects[i];
+    for (int y = r.y; y < r.y + r.h; y++) {
+      const Op op = {.type = OP_SPAN, .y = y, .x = r.x, .h = 1, .w = r.w,
+                     .data = room->canvas->rows[y] + r.x};
+      if (cli->version == 2) {
+        proto_put_op(&update.v2, &op);
+      } else {
+        put_v1_op(&update.v1, &op);
+      }
+    }
+  }
+  proto_end(&update.v2);
+  // it's as big as the view, so it isn't worth dropping for a snapshot
+  if (cli->version == 2) {
+    client_send(cli, update.v2.data, update.v2.len, false);
+  } else {
+    client_send(cli, update.v1.data, update.v1.len, false);
+  }
+}
+
+/* Only send a client the updates in the buckets around rect from now on, and
+ * send it what's in the ones it wasn't being sent updates for.
+ *
+ * Clients without a view are sent everything, so they're up to date on the
+ * whole canvas. Call from the room's worker.
+ */
+void view_set(client_t *cli, Rect rect) {
+  room_t *room = cli->room;
+  const Rect region = interest_region(room->interest, rect);
+  Rect old = {.h = room->canvas->num_rows, .w = room->canvas->num_cols};
+  if (cli->has_view) {
+    old = cli->view;
+    interest_remove(room->interest, cli, old);
+  } else {
+    cli->refs++;  // held by the index
+  }
+  interest_add(room->interest, cli, region);
+  cli->view = region;
+  cli->has_view = true;
+  Rect parts[4];
+  const int n = interest_subtract(region, old, parts);
+  if (n > 0) {
+    send_rects(cli, parts, n);
+  }
+}
+
+/* Take a closed client out of the index of views.
+ *
+ * Call from the room's worker.
+ */
+void view_clear(client_t *cli) {
+  if (!cli->has_view) {
+    return;
+  }
+  interest_remove(cli->room->interest, cli, cli->view);
+  cli->has_view = false;
+  client_release(cli);
+}
+
+/* Check a room name: up to MAX_ROOM_NAME letters, digits, `-` and `_`, so it
+ * can be used as a file name.
+ */
+bool room_name_ok(const char *name) {
+  const size_t len = strlen(name);
+  if (len == 0 || len > MAX_ROOM_NAME) {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    const char c = name[i];
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+          (c >= '0' && c <= '9') || c == '-' || c == '_')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Make a room and give it to the worker with the fewest rooms. Its worker
+ * loads it when it gets the first request for it.
+ *
+ * Call with rooms_mutex held.
+ */
+room_t *room_new(const char *name) {
+  room_t *room = calloc(1, sizeof(room_t));
+  if (room == NULL) {
+    perror("room malloc");
+    exit(1);
+  }
+  strcpy(room->name, name);
+  worker_t *w = &workers[0];
+  for (int i = 1; i < num_workers; i++) {
+    if (workers[i].num_rooms < w->num_rooms) {
+      w = &workers[i];
+    }
+  }
+  room->worker = w;
+  w->num_rooms++;
+  room->idle_since = now_ms();
+  room->next = rooms;
+  rooms = room;
+  return room;
+}
+
+/* Join a room, making it if it doesn't exist.
+ *
+ * The room is kept until the client leaves (REQ_LEAVE).
+ */
+room_t *room_join(const char *name) {
+  pthread_mutex_lock(&rooms_mutex);
+  room_t *room = rooms;
+  while (room && strcmp(room->name, name) != 0) {
+    room = room->next;
+  }
+  if (room == NULL) {
+    room = room_new(name);
+  }
+  room->members++;
+  pthread_mutex_unlock(&rooms_mutex);
+  return room;
+}
+
+/* Bytes of memory a canvas takes */
+static int64_t canvas_size(const Canvas *canvas) {
+  return sizeof(Canvas) +
+         (int64_t)canvas->num_rows *
+             (canvas->num_cols + sizeof(char *) + sizeof(bool));
+}
+
+/* Path of a room's file in wal_dir with the given extension.
+ *
+ * The main canvas is `main`, and other rooms `room-<name>`, so they can't
+ * clash.
+ */
+static void room_wal_path(const room_t *room, const char *ext, char *path,
+                          size_t n) {
+  if (room->name[0] == '\0') {
+    snprintf(path, n, "%s/main.%s", wal_dir, ext);
+  } else {
+    snprintf(path, n, "%s/room-%s.%s", wal_dir, room->name, ext);
+  }
+}
+
+/* Bring a room's canvas up to date from its checkpoint and log in wal_dir, if
+ * it has them, and open the log to add to.
+ *
+ * If the log can't be opened or read, the room carries on without one (and
+ * its edits aren't kept) rather than taking the server down with it.
+ *
+ * Returns: the version of the newest op recovered, or 0
+ */
+static uint64_t room_recover(room_t *room) {
+  if (wal_dir == NULL) {
+    return 0;
+  }
+  const int64_t start = now_ms();
+  char path[PATH_MAX];
+  uint64_t version = 0;
+  room_wal_path(room, "ckpt", path, sizeof(path));
+  Canvas *checkpoint = checkpoint_read(path, &version);
+  if (checkpoint != NULL) {
+    canvas_free(room->canvas);
+    room->canvas = checkpoint;
+  } else if (errno != ENOENT) {
+    log_warn("room '%s': can't use checkpoint '%s': %s", room->name, path,
+             strerror(errno));
+  }
+  const uint64_t checkpoint_version = version;
+  room_wal_path(room, "wal", path, sizeof(path));
+  room->wal = wal_open(path, wal_sync_ms, wal_sync_ops);
+  long replayed = 0;
+  if (room->wal == NULL) {
+    log_error("room '%s': can't open log '%s', running without it: %s",
+              room->name, path, strerror(errno));
+  } else if ((replayed = wal_recover(room->wal, version, room->canvas,
+                                     &version)) < 0) {
+    log_error("room '%s': can't recover log '%s', running without it: %s",
+              room->name, path, strerror(errno));
+    wal_close(room->wal);
+    room->wal = NULL;
+    replayed = 0;
+  }
+  room->checkpointed_at = now_ms();
+  if (checkpoint != NULL || replayed > 0) {
+    log_info("recovered room '%s' from version %" PRIu64 " and %ld ops in %" PRId64
+             " ms",
+             room->name, checkpoint_version, replayed,
+             room->checkpointed_at - start);
+  }
+  return version;
+}
+
+/* Put a copy of a room's canvas in shared memory for local clients.
+ *
+ * If it can't be made, they're sent snapshots like everyone else.
+ */
+void room_share(room_t *room) {
+  char name[SHM_NAME_SZ];
+  snprintf(name, sizeof(name), "/collascii-%d-%d", (int)getpid(),
+           num_segments++);
+  room->shm = malloc(sizeof(Shm_canvas));
+  if (shm_canvas_create(room->shm, name, room->canvas, room->tick.version) <
+      0) {
+    log_error("shared canvas: %s", strerror(errno));
+    free(room->shm);
+    room->shm = NULL;
+  }
+}
+
+/* Remove a room's shared copy of its canvas, if it has one */
+void room_unshare(room_t *room) {
+  if (room->shm != NULL) {
+    shm_canvas_destroy(room->shm);
+    free(room->shm);
+    room->shm = NULL;
+  }
+}
+
+/* Start using a room's canvas, once its worker has it.
+ *
+ * Call from the room's worker (or before it starts).
+ */
+void room_start(room_t *room) {
+  tick_init(room, room_recover(room));
+  if (local_path != NULL) {
+    room_share(room);
+  }
+  metrics_add_gauge(&rooms_loaded, 1);
+  metrics_add_gauge(&canvas_bytes, canvas_size(room->canvas));
+  room->next_loaded = room->worker->rooms;
+  room->worker->rooms = room;
+  room->loaded = true;
+}
+
+/* Path a room is saved at in rooms_dir */
+static void room_path(const room_t *room, char *path, size_t n) {
+  snprintf(path, n, "%s/%s.txt", rooms_dir, room->name);
+}
+
+/* Load a room's canvas from rooms_dir, or start it blank.
+ *
+ * Call from the room's worker.
+ */
+void room_load(room_t *room) {
+  char path[PATH_MAX];
+  FILE *f = NULL;
+  if (rooms_dir != NULL) {
+    room_path(room, path, sizeof(path));
+    f = fopen(path, "r");
+  }
+  if (f != NULL) {
+    room->canvas = canvas_readf_norewind(f);
+    fclose(f);
+    log_info("loaded room '%s' from '%s'", room->name, path);
+  } else {
+    room->canvas = canvas_new_blank(100, 100);
+    log_info("made room '%s'", room->name);
+  }
+  room_start(room);
+}
+
+/* Save a room's canvas to rooms_dir, if there is one.
+ *
+ * It's written next to the old copy and moved over it, so a crash while
+ * saving doesn't lose both. Call from the room's worker.
+ */
+void room_save(room_t *room) {
+  if (rooms_dir == NULL || room->name[0] == '\0') {
+    return;
+  }
+  char path[PATH_MAX], tmp[PATH_MAX + 4];
+  room_path(room, path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL || canvas_fprint(f, room->canvas) < 0) {
+    log_error("room save: %s", strerror(errno));
+    if (f != NULL) {
+      fclose(f);
+    }
+    return;
+  }
+  if (fclose(f) != 0 || rename(tmp, path) != 0) {
+    log_error("room save: %s", strerror(errno));
+  }
+}
+
+/* Save a checkpoint of a room's canvas in wal_dir, and empty its log.
+ *
+ * Call from the room's worker.
+ */
+void room_checkpoint(room_t *room) {
+  if (room->wal == NULL) {
+    return;
+  }
+  room->checkpointed_at = now_ms();
+  if (room->wal->size == 0) {
+    return;  // nothing new since the last one
+  }
+  char path[PATH_MAX];
+  room_wal_path(room, "ckpt", path, sizeof(path));
+  if (checkpoint_write(path, room->canvas, room->tick.version) < 0) {
+    log_error("checkpoint: %s", strerror(errno));
+    return;
+  }
+  if (wal_truncate(room->wal) < 0) {
+    log_error("wal truncate: %s", strerror(errno));
+  }
+}
+
+/* Add a client that's been sent the canvas to its room's clients, so it gets
+ * updates.
+ *
+ * Call from the room's worker.
+ */
+void room_add_client(client_t *cli) {
+  room_t *room = cli->room;
+  cli->refs++;  // held by the room
+  cli->prev = NULL;
+  cli->next = room->clients;
+  if (room->clients) {
+    room->clients->prev = cli;
+  }
+  room->clients = cli;
+  room->num_clients++;
+  room->num_v1 += cli->version == 1;
+}
+
+/* Take a closed client out of its room.
+ *
+ * Call from the room's worker.
+ */
+void room_leave(client_t *cli) {
+  room_t *room = cli->room;
+  view_clear(cli);
+  stream_stop(cli);
+  if (cli->synced) {
+    if (cli->prev) {
+      cli->prev->next = cli->next;
+    } else {
+      room->clients = cli->next;
+    }
+    if (cli->next) {
+      cli->next->prev = cli->prev;
+    }
+    room->num_clients--;
+    room->num_v1 -= cli->version == 1;
+    client_release(cli);
+  }
+  pthread_mutex_lock(&rooms_mutex);
+  if (--room->members == 0) {
+    room->idle_since = now_ms();
+  }
+  pthread_mutex_unlock(&rooms_mutex);
+}
+
+/* Save and free the rooms of a worker that no one has been in for
+ * room_idle_ms. The main canvas is always kept.
+ *
+ * Call from the worker.
+ */
+void worker_unload_idle(worker_t *w) {
+  const int64_t now = now_ms();
+  room_t **link = &w->rooms;
+  while (*link) {
+    room_t *room = *link;
+    pthread_mutex_lock(&rooms_mutex);
+    bool idle = room != main_room && room->members == 0 &&
+                now - room->idle_since >= room_idle_ms;
+    pthread_mutex_unlock(&rooms_mutex);
+    if (!idle) {
+      link = &room->next_loaded;
+      continue;
+    }
+    tick_flush(room);
+    room_save(room);
+    room_checkpoint(room);
+    // someone may have joined while it was being saved; if not, no one can
+    // find it once it's out of the list, so there are no requests left for it
+    pthread_mutex_lock(&rooms_mutex);
+    idle = room->members == 0;
+    if (idle) {
+      room_t **r = &rooms;
+      while (*r != room) {
+        r = &(*r)->next;
+      }
+      *r = room->next;
+      w->num_rooms--;
+    }
+    pthread_mutex_unlock(&rooms_mutex);
+    if (!idle) {
+      link = &room->next_loaded;
+      continue;
+    }
+    log_info("unloaded room '%s'", room->name);
+    *link = room->next_loaded;
+    if (room->wal != NULL) {
+      wal_close(room->wal);
+    }
+    metrics_add_gauge(&rooms_loaded, -1);
+    metrics_add_gauge(&canvas_bytes, -canvas_size(room->canvas));
+    room_unshare(room);
+    tick_free(room);
+    canvas_free(room->canvas);
+    free(room);
+  }
+}
+
+/* Tell every client of a worker's rooms the server is going down, and save
+ * the rooms.
+ *
+ * Call from the worker.
+ */
+void worker_quit(worker_t *w) {
+  static const char quit_frame[] = {0, 0, 0, 1, FRAME_QUIT};
+  message_t quit = {.v1 = frame_new("q\n", 2),
+                    .v1_len = 2,
+                    .v2 = frame_new(quit_frame, sizeof(quit_frame)),
+                    .v2_len = sizeof(quit_frame)};
+  for (room_t *room = w->rooms; room; room = room->next_loaded) {
+    tick_flush(room);
+    broadcast_message(room, &quit);
+    // write it now instead of waiting for the reactors
+    for (client_t *cli = room->clients; cli; cli = cli->next) {
+      client_flush(cli);
+    }
+    room_save(room);
+    room_checkpoint(room);
+    room_unshare(room);
+  }
+  message_release(&quit);
+}
+
+/* Carry out a request from a reactor, and free it.
+ *
+ * Call from the room's worker.
+ */
+void handle_request(worker_t *w, request_t *req) {
+  room_t *room = req->room;
+  if (room != NULL && !room->loaded) {
+    room_load(room);
+  }
+  switch (req->type) {
+    case REQ_OPS: {
+      if (room->tick.oldest_read == 0 || req->read_at < room->tick.oldest_read) {
+        room->tick.oldest_read = req->read_at;
+      }
+      const char *p = req->ops;
+      Op op;
+      if (room->shm != NULL) {
+        shm_canvas_begin(room->shm);
+      }
+      while (proto_next_op(&p, req->ops + req->len, &op) == 1) {
+        apply_op(room, &op, req->uid);
+      }
+      if (room->shm != NULL) {
+        shm_canvas_end(room->shm, room->tick.version);
+      }
+      room->backlog -= req->len;
+      break;
+    }
+    case REQ_SYNC:
+      send_sync(req->cli, req->resume, req->since);
+      if (!req->cli->synced) {
+        // from here on it gets updates, which come after the canvas
+        req->cli->synced = true;
+        room_add_client(req->cli);
+        log_debug("sent %d %s", req->cli->uid,
+                  req->resume ? "updates since reconnecting"
+                              : "serialized canvas");
+      }
+      break;
+    case REQ_CANVAS:
+      send_serialized(req->cli);
+      break;
+    case REQ_VIEW:
+      view_set(req->cli, req->view);
+      break;
+    case REQ_TILES:
+      send_tiles(req->cli);
+      break;
+    case REQ_LEAVE:
+      room_leave(req->cli);
+      break;
+    case REQ_QUIT:
+      worker_quit(w);
+      break;
+  }
+  if (req->cli != NULL) {
+    client_release(req->cli);
+  }
+  free(req);
+}
+
+/* Broadcast the ticks of all of a worker's rooms */
+void worker_flush(worker_t *w) {
+  for (room_t *room = w->rooms; room; room = room->next_loaded) {
+    tick_flush(room);
+  }
+}
+
+/* Sync the logs of a worker's rooms whose ops have waited long enough.
+ *
+ * Returns: whether any ops are still waiting
+ */
+bool worker_commit(worker_t *w) {
+  bool waiting = false;
+  const int64_t now = now_ms();
+  for (room_t *room = w->rooms; room; room = room->next_loaded) {
+    if (room->wal != NULL && wal_commit(room->wal, now)) {
+      waiting = true;
+    }
+  }
+  return waiting;
+}
+
+/* Note how many bytes are queued for each client of a worker's rooms.
+ *
+ * Call from the worker.
+ */
+void worker_sample_queues(worker_t *w) {
+  for (room_t *room = w->rooms; room; room = room->next_loaded) {
+    for (client_t *cli = room->clients; cli; cli = cli->next) {
+      pthread_mutex_lock(&cli->out_mutex);
+      const size_t len = cli->out.len;
+      pthread_mutex_unlock(&cli->out_mutex);
+      metrics_observe(&queued_bytes, len);
+    }
+  }
+}
+
+/* Checkpoint a worker's rooms that are due, by time or the size of their log.
+ */
+void worker_checkpoint(worker_t *w) {
+  const int64_t now = now_ms();
+  for (room_t *room = w->rooms; room; room = room->next_loaded) {
+    if (room->wal != NULL && (now - room->checkpointed_at >= checkpoint_ms ||
+                              room->wal->size >= WAL_CHECKPOINT_SZ)) {
+      room_checkpoint(room);
+    }
+  }
+}
+
+static void timespec_add_ms(struct timespec *t, long ms) {
+  t->tv_nsec += ms * 1000000L;
+  if (t->tv_nsec >= 1000000000L) {
+    t->tv_sec += t->tv_nsec / 1000000000L;
+    t->tv_nsec %= 1000000000L;
+  }
+}
+
+static bool timespec_before(const struct timespec *a,
+                            const struct timespec *b) {
+  return a->tv_sec < b->tv_sec ||
+         (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Worker thread: apply requests for its rooms as they come in, flush their
+ * ticks every tick_ms (or after every batch of requests, without ticks), sync
+ * their logs, and checkpoint and unload rooms.
+ */
+void *worker_run(void *arg) {
+  worker_t *w = arg;
+  struct timespec next, check, sync;
+  bool waiting = false;  // applied ops waiting to be synced to a log
+  bool more = false;     // requests left in the queue
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  check = next;
+  timespec_add_ms(&check, ROOM_CHECK_MS);
+  while (1) {
+    struct timespec now;
+    // without ticks, still wake up to sync logs and look for idle rooms
+    const struct timespec *until = &next;
+    if (more) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      until = &now;
+    } else if (tick_ms == 0) {
+      until = waiting && timespec_before(&sync, &check) ? &sync : &check;
+    }
+    sem_clockwait(&w->ready, CLOCK_MONOTONIC, until);
+    // under a flood the queue never runs dry, so stop now and then to see if
+    // a tick is due (or to flush, without ticks) instead of starving clients
+    // of broadcasts
+    Mpsc_node *n;
+    int handled = 0;
+    more = false;
+    while ((n = mpsc_pop(&w->requests)) != NULL) {
+      request_t *req = (request_t *)n;
+      if (req->type == REQ_QUIT) {
+        handle_request(w, req);
+        return NULL;
+      }
+      handle_request(w, req);
+      if (++handled % DRAIN_CHECK == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (tick_ms == 0 || !timespec_before(&now, &next)) {
+          more = true;
+          break;
+        }
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (tick_ms == 0) {
+      worker_flush(w);
+    } else if (!timespec_before(&now, &next)) {
+      worker_flush(w);
+      timespec_add_ms(&next, tick_ms);
+      // don't try to catch up after falling behind
+      if (timespec_before(&next, &now)) {
+        next = now;
+      }
+    }
+    // after the broadcast, so it doesn't wait for the disk
+    if ((waiting = worker_commit(w))) {
+      sync = now;
+      timespec_add_ms(&sync, wal_sync_ms);
+    }
+    if (!timespec_before(&now, &check)) {
+      if (metrics_path != NULL) {
+        worker_sample_queues(w);
+      }
+      worker_checkpoint(w);
+      worker_unload_idle(w);
+      check = now;
+      timespec_add_ms(&check, ROOM_CHECK_MS);
+    }
+  }
+  return NULL;
+}
+
+/* Pass a request to a worker.
+ *
+ * Edits only wake it up when there are no ticks; otherwise they wait for the
+ * next one.
+ */
+void request_push(worker_t *w, request_t *req) {
+  mpsc_push(&w->requests, &req->node);
+  if (req->type != REQ_OPS || tick_ms == 0) {
+    sem_post(&w->ready);
+  }
+}
+
+static request_t *request_new(int type, client_t *cli, size_t len) {
+  request_t *req = malloc(sizeof(request_t) + len);
+  if (req == NULL) {
+    perror("request malloc");
+    exit(1);
+  }
+  req->type = type;
+  req->room = cli ? cli->room : NULL;
+  req->uid = cli ? cli->uid : 0;
+  req->cli = NULL;
+  req->resume = false;
+  req->len = len;
+  return req;
+}
+
+// edits read by this reactor for the room's worker, encoded like in an ops
+// frame
+static __thread Frame_buf batch;
+
+/* Pass the edits read from a client so far to its room's worker.
+ */
+void request_ops(client_t *cli) {
+  if (batch.len == 0) {
+    return;
+  }
+  request_t *req = request_new(REQ_OPS, cli, batch.len);
+  req->read_at = now_ns();
+  memcpy(req->ops, batch.data, batch.len);
+  cli->room->backlog += batch.len;
+  batch.len = 0;
+  request_push(cli->room->worker, req);
+}
+
+/* Ask the room's worker to do something for a client (REQ_SYNC, REQ_CANVAS,
+ * REQ_VIEW or REQ_LEAVE), holding a reference to it until it's done.
+ *
+ * Edits the client sent before this are applied first.
+ */
+static request_t *request_for(client_t *cli, int type) {
+  request_ops(cli);
+  request_t *req = request_new(type, cli, 0);
+  cli->refs++;
+  req->cli = cli;
+  return req;
+}
+
+/* Ask the room's worker to send a client the canvas (REQ_SYNC, catching up
+ * from since if resume is set, or REQ_CANVAS).
+ */
+void request_sync(client_t *cli, int type, bool resume, uint64_t since) {
+  request_t *req = request_for(cli, type);
+  req->resume = resume;
+  req->since = since;
+  request_push(cli->room->worker, req);
+}
+
+/* Ask the room's worker to only send a client the updates around its view.
+ */
+void request_view(client_t *cli, Rect view) {
+  request_t *req = request_for(cli, REQ_VIEW);
+  req->view = view;
+  request_push(cli->room->worker, req);
+}
+
+/* Ask a client's worker for more tiles, once per batch.
+ *
+ * Call from the client's reactor, once what's queued for it is mostly written.
+ */
+void request_tiles(client_t *cli) {
+  if (!atomic_exchange(&cli->tiles_asked, true)) {
+    request_push(cli->room->worker, request_for(cli, REQ_TILES));
+  }
+}
+
+/* Tell the room's worker a client has closed.
+ */
+void request_leave(client_t *cli) {
+  request_push(cli->room->worker, request_for(cli, REQ_LEAVE));
+}
+
+/* Read a version sent by a client.
+ *
+ * Returns: false if s isn't a version
+ */
+bool parse_version(const char *s, uint64_t *version) {
+  char *end;
+  if (s == NULL || *s < '0' || *s > '9') {
+    return false;
+  }
+  errno = 0;
+  *version = strtoull(s, &end, 10);
+  return *end == '\0' && errno == 0;
+}
+
+/* Share a client's cursor with its room, and send it the token to sign its
+ * updates with.
+ */
+void presence_join(client_t *cli) {
+  uint64_t token;
+  if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+    log_error("getrandom: %s", strerror(errno));
+    cli->presence = false;
+    return;
+  }
+  pthread_mutex_lock(&presence_mutex);
+  presence_add(presence, cli->uid, token, cli->room, now_ms());
+  pthread_mutex_unlock(&presence_mutex);
+  Frame_buf buf = {0};
+  proto_presence(&buf, cli->uid, token, presence_port);
+  client_send(cli, buf.data, buf.len, false);
+  proto_buf_free(&buf);
+}
+
+/* Handle protocol negotiation, the first line sent by a client.
+ *
+ * This is `v <protocol>`, optionally followed by the last canvas version the
+ * client saw if it's reconnecting, `#<room>` to join a room other than the
+ * main canvas, `shm` to be sent the canvas through shared memory (only
+ * 2.0 clients on the local socket are), `presence` to share cursors over
+ * UDP (only 2.0 clients can), and `tiles=y,x,h,w` to be sent the canvas in
+ * tiles nearest that view first (2.0 clients without `shm`). Clients that
+ * send a version (and all 2.0 clients) are told the version after every
+ * update.
+ *
+ * Returns: 1 if the client should be closed, 0 otherwise
+ */
+int handle_version(client_t *cli, char *buff_in) {
+  char *cmd = strtok(buff_in, " ");
+  if (cmd == NULL || cmd[0] != 'v') {
+    log_info("version negotiation: client command not 'v'");
+    return 1;
+  }
+  char *client_version = strtok(NULL, " ");
+  if (client_version == NULL) {
+    log_info("version negotiation: unable to parse client version");
+    send_message_self("can't parse version\n", cli);
+    return 1;
+  }
+  for (int i = 0; i < NUM_PROTOCOL_VERSIONS; i++) {
+    if (strcmp(client_version, PROTOCOL_VERSIONS[i]) == 0) {
+      cli->version = atoi(PROTOCOL_VERSIONS[i]);
+    }
+  }
+  if (cli->version == 0) {
+    log_info("version negotiation: unknown client protocol version: '%s'",
+             client_version);
+    send_message_self("unknown protocol - supported protocol versions:", cli);
+    for (int i = 0; i < NUM_PROTOCOL_VERSIONS; i++) {
+      send_message_self(" ", cli);
+      send_message_self(PROTOCOL_VERSIONS[i], cli);
+    }
+    send_message_self("\n", cli);
+    return 1;
+  }
+  uint64_t since;
+  bool resume = false;
+  const char *room = "";
+  bool tiles = false;
+  Rect view = {0};
+  for (char *arg; (arg = strtok(NULL, " ")) != NULL;) {
+    if (sscanf(arg, "tiles=%d,%d,%d,%d", &view.y, &view.x, &view.h,
+               &view.w) == 4) {
+      tiles = true;
+    } else if (arg[0] == '#') {
+      room = arg + 1;
+    } else if (strcmp(arg, "shm") == 0) {
+      cli->shm = cli->local && cli->version == 2;
+    } else if (strcmp(arg, "presence") == 0) {
+      cli->presence = presence != NULL && cli->version == 2;
+    } else {
+      resume = parse_version(arg, &since);
+    }
+  }
+  if (room[0] != '\0' && !room_name_ok(room)) {
+    log_info("version negotiation: bad room name '%s'", room);
+    send_message_self("bad room name\n", cli);
+    return 1;
+  }
+  cli->room = room_join(room);
+  cli->versioned = resume || cli->version == 2;
+  // (the shared canvas is quicker still)
+  cli->tiles = tiles && cli->version == 2 && !cli->shm;
+  cli->join_view = view;
+  send_message_self("vok\n", cli);
+  if (cli->presence) {
+    presence_join(cli);
+  }
+  cli->negotiated = true;
+  request_sync(cli, REQ_SYNC, resume, since);
+  return 0;
+}
+
+/* Handle a single line (without newline) sent by a client.
+ *
+ * Returns: 1 if the client should be closed, 0 otherwise
+ */
+int handle_line(client_t *cli, char *buff_in) {
+  if (!cli->negotiated) {
+    return handle_version(cli, buff_in);
+  }
+
+  /* Ignore empty buffer */
+  if (!strlen(buff_in)) {
+    return 0;
+  }
+
+  /* Process Command */
+  const size_t len = strlen(buff_in);
+  char c = buff_in[len - 1];
+  char *command;
+  command = strtok(buff_in, " ");
+  if (!strcmp(command, "q")) {
+    return 1;
+  }
+  if (!strcmp(command, "s")) {
+    char *ys = strtok(NULL, " ");
+    char *xs = strtok(NULL, " ");
+    if (ys == NULL || xs == NULL) {
+      return 0;
+    }
+    int y = atoi(ys);
+    int x = atoi(xs);
+
+    // the room's worker clips it to the canvas, once it fits in an op
+    if (y < 0 || x < 0 || y > UINT16_MAX || x > UINT16_MAX) {
+      log_debug("set out of bounds: (%d,%d)", x, y);
+    } else {
+      proto_put_op(&batch, &(Op){.type = OP_CELL, .y = y, .x = x, .ch = c});
+      metrics_add(&op_bytes_in, len + 1);  // (and its newline)
+    }
+  } else if (!strcmp(command, "c")) {
+    uint64_t since;
+    if (parse_version(strtok(NULL, " "), &since)) {
+      // `c <version>`: only what changed since then, like when reconnecting
+      cli->versioned = true;
+      request_sync(cli, REQ_SYNC, true, since);
+      return 0;
+    }
+    request_sync(cli, REQ_CANVAS, false, 0);
+  } else if (!strcmp(command, "w")) {
+    // `w y x h w`: the part of the canvas in view
+    Rect view;
+    char *fields[4];
+    for (int i = 0; i < 4; i++) {
+      fields[i] = strtok(NULL, " ");
+      if (fields[i] == NULL) {
+        return 0;
+      }
+    }
+    view.y = atoi(fields[0]);
+    view.x = atoi(fields[1]);
+    view.h = atoi(fields[2]);
+    view.w = atoi(fields[3]);
+    request_view(cli, view);
+  }
+  return 0;
+}
+
+/* Handle a single frame sent by a 2.0 client.
+ *
+ * Returns: 1 if the client should be closed, 0 otherwise
+ */
+int handle_frame(client_t *cli, char type, const char *payload, size_t len) {
+  switch (type) {
+    case FRAME_OPS: {
+      // check the whole batch before applying any of it
+      const char *p = payload;
+      Op op;
+      int res;
+      while ((res = proto_next_op(&p, payload + len, &op)) == 1) {
+      }
+      if (res < 0) {
+        log_info("malformed ops from %d", cli->uid);
+        return 1;
+      }
+      proto_put(&batch, payload, len);
+      metrics_add(&op_bytes_in, PROTO_HEADER_SZ + len);
+      break;
+    }
+    case FRAME_CANVAS: {
+      // with a version, only what changed since then
+      uint64_t since;
+      const bool resume = proto_read_version(payload, len, &since);
+      request_sync(cli, REQ_SYNC, resume, since);
+      break;
+    }
+    case FRAME_VIEW: {
+      Rect view;
+      if (proto_read_view(payload, len, &view.y, &view.x, &view.h, &view.w)) {
+        request_view(cli, view);
+      }
+      break;
+    }
+    case FRAME_QUIT:
+      return 1;
+  }
+  return 0;
+}
+
+/* Handle every complete line (or frame, for 2.0 clients) read so far.
+ *
+ * Returns: 1 if the client should be closed, 0 otherwise
+ */
+int client_parse(client_t *cli) {
+  Stream *in = &cli->in;
+  while (1) {
+    if (cli->version == 2) {
+      char type;
+      const char *payload;
+      size_t len;
+      const int res = stream_next_frame(in, &type, &payload, &len);
+      if (res < 0) {
+        log_info("malformed frame from %d", cli->uid);
+        return 1;
+      }
+      if (res == 0) {
+        return 0;
+      }
+      if (handle_frame(cli, type, payload, len)) {
+        return 1;
+      }
+    } else {
+      char *line;
+      if (!stream_next_line(in, &line)) {
+        return 0;
+      }
+      strip_newline(line);
+      // the version line switches 2.0 clients to frames for the rest
+      if (handle_line(cli, line)) {
+        return 1;
+      }
+    }
+  }
+}
+
+int client_received(client_t *cli);
+
+/* Read from a client and handle everything complete in it.
+ *
+ * Returns: 1 if the client should be closed, 0 otherwise
+ */
+int client_read(client_t *cli) {
+  ssize_t rlen = stream_read(&cli->in, cli->connfd);
+  if (rlen == 0) {
+    return 1;
+  }
+  if (rlen < 0) {
+    return (errno != EAGAIN && errno != EWOULDBLOCK);
+  }
+  metrics_add(&bytes_in, rlen);
+  metrics_add(&reads_in, 1);
+  return client_received(cli);
+}
+
+/* Handle everything complete in what's been read from a client.
+ *
+ * Returns: 1 if the client should be closed, 0 otherwise
+ */
+int client_received(client_t *cli) {
+  Stream *in = &cli->in;
+  // a read can hold several lines or frames, or part of one; the edits in all
+  // of them go to the room's worker together
+  const int res = client_parse(cli);
+  request_ops(cli);
+  if (res) {
+    return 1;
+  }
+  if (stream_pending(in) == 0) {
+    // give the memory back, so idle clients stay small
+    stream_free(in);
+  } else if (stream_pending(in) >
+             (cli->version == 2 ? PROTO_MAX_FRAME + 4 : MAX_LINE_SZ)) {
+    log_info("message too long from %d", cli->uid);
+    return 1;
+  }
+  return 0;
+}
+
+/* Turn a connection away, telling it when to come back.
+ *
+ * The connection is only half-closed: it's kept until the client hangs up, so
+ * whatever it sent in the meantime (like its version request) can be read and
+ * thrown away instead of resetting the connection before `busy` is read.
+ */
+void client_reject(client_t *cli, int retry_ms) {
+  char msg[32];
+  int n = sprintf(msg, "busy %d\n", retry_ms);
+  // a new socket's buffer always has room for this
+  if (write(cli->connfd, msg, n) < 0) {
+    log_warn("write to %d failed: %s", cli->uid, strerror(errno));
+  }
+  shutdown(cli->connfd, SHUT_WR);
+  cli->rejected = true;
+  if (use_uring) {
+    client_recv(cli);
+  } else {
+    client_watch(cli, EPOLL_CTL_ADD);
+  }
+}
+
+/* Throw away whatever a rejected client sends.
+ *
+ * Returns: 1 once the client has hung up, 0 otherwise
+ */
+int client_discard(client_t *cli) {
+  char buf[BUFFER_SZ];
+  ssize_t rlen;
+  while ((rlen = read(cli->connfd, buf, sizeof(buf))) > 0) {
+  }
+  return rlen == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+/* Take on a connection a reactor accepted (on the local socket, or from
+ * cli_addr), unless admission control turns it away.
+ */
+void client_accept(reactor_t *r, int connfd, struct sockaddr_in cli_addr,
+                   bool local) {
+  /* Client settings */
+  client_t *cli = calloc(1, sizeof(client_t));
+  cli->addr = cli_addr;
+  cli->local = local;
+  cli->connfd = connfd;
+  cli->uid = uid++;
+  sprintf(cli->name, "%d", cli->uid);
+  cli->reactor = r;
+  cli->refs = 1;
+  pthread_mutex_init(&cli->out_mutex, NULL);
+
+  pthread_mutex_lock(&admission_mutex);
+  int retry_ms = admission_take(admission, now_ms());
+  pthread_mutex_unlock(&admission_mutex);
+  metrics_add(&connections, 1);
+  if (retry_ms > 0) {
+    metrics_add(&rejected, 1);
+    client_reject(cli, retry_ms);
+    return;
+  }
+
+  cli_count++;
+  char addr[INET_ADDRSTRLEN];
+  log_info("<< accept %s referenced by %d", client_addr(cli, addr), cli->uid);
+
+  /* Start watching the client; it joins a room once it's negotiated */
+  if (use_uring) {
+    client_recv(cli);
+  } else {
+    client_watch(cli, EPOLL_CTL_ADD);
+  }
+}
+
+/* Accept a batch of pending connections on a listening socket of a reactor.
+ *
+ * Anything left over is picked up on the next wakeup, after the events of
+ * connected clients have had a turn.
+ */
+void reactor_accept(reactor_t *r, int listenfd) {
+  for (int i = 0; i < ACCEPT_BATCH; i++) {
+    struct sockaddr_in cli_addr = {0};
+    socklen_t clilen = sizeof(cli_addr);
+    int connfd = accept4(listenfd, (struct sockaddr *)&cli_addr, &clilen,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connfd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        log_error("accept: %s", strerror(errno));
+      }
+      return;
+    }
+    client_accept(r, connfd, cli_addr, listenfd == r->localfd);
+  }
+}
+
+/* Close a client connection.
+ *
+ * It is freed once any senders still holding it are done.
+ */
+void client_close(client_t *cli) {
+  /* Take it out of its room so no one else sends to it */
+  if (!cli->rejected) {
+    cli_count--;
+    char addr[INET_ADDRSTRLEN];
+    log_info("<< quit %s referenced by %d", client_addr(cli, addr), cli->uid);
+  }
+  if (cli->room != NULL) {
+    request_leave(cli);
+  }
+  if (cli->presence) {
+    pthread_mutex_lock(&presence_mutex);
+    presence_remove(presence, cli->uid);
+    pthread_mutex_unlock(&presence_mutex);
+  }
+  pthread_mutex_lock(&cli->out_mutex);
+  cli->closed = true;
+  if (!use_uring) {
+    epoll_ctl(cli->reactor->epfd, EPOLL_CTL_DEL, cli->connfd, NULL);
+  } else if (cli->recv_armed) {
+    // its recv lets go of it once cancelled
+    uring_prep_cancel(uring_sqe(&cli->reactor->ring), uring_data(cli, UD_RECV),
+                      UD_IGNORE);
+  }
+  pthread_mutex_unlock(&cli->out_mutex);
+  client_release(cli);
+}
+
+/* Close a client with io_uring once what's queued for it (like a version error)
+ * has been sent.
+ */
+void client_finish(client_t *cli) {
+  pthread_mutex_lock(&cli->out_mutex);
+  cli->closing = true;
+  const bool done = cli->out.len == 0 && !cli->sending;
+  pthread_mutex_unlock(&cli->out_mutex);
+  if (done) {
+    client_close(cli);
+  }
+}
+
+/* Stop reading from a client until its room's worker catches up on the edits
+ * already queued for it.
+ *
+ * A worker can't apply edits as fast as reactors can read them, so without
+ * this a room flooded with edits queues them without bound, and every room on
+ * the same worker waits behind them.
+ */
+void client_pause(client_t *cli) {
+  reactor_t *r = cli->reactor;
+  pthread_mutex_lock(&cli->out_mutex);
+  cli->paused = true;
+  if (!use_uring) {
+    client_watch(cli, EPOLL_CTL_MOD);
+  } else if (cli->recv_armed) {
+    uring_prep_cancel(uring_sqe(&r->ring), uring_data(cli, UD_RECV),
+                      UD_IGNORE);
+  }
+  pthread_mutex_unlock(&cli->out_mutex);
+  cli->refs++;  // held by the paused list
+  cli->next_paused = r->paused;
+  r->paused = cli;
+}
+
+/* Read from paused clients again once their rooms have caught up.
+ */
+void reactor_resume(reactor_t *r) {
+  client_t **link = &r->paused;
+  while (*link != NULL) {
+    client_t *cli = *link;
+    if (!cli->closed && cli->room->backlog > ROOM_BACKLOG_SZ) {
+      link = &cli->next_paused;
+      continue;
+    }
+    *link = cli->next_paused;
+    pthread_mutex_lock(&cli->out_mutex);
+    cli->paused = false;
+    if (!cli->closed && !use_uring) {
+      client_watch(cli, EPOLL_CTL_MOD);
+    }
+    pthread_mutex_unlock(&cli->out_mutex);
+    if (!cli->closed && use_uring) {
+      // handle what was read before the recv was cancelled, and read again
+      if (client_received(cli)) {
+        client_finish(cli);
+      } else if (!cli->recv_armed) {
+        client_recv(cli);
+      }
+    }
+    client_release(cli);
+  }
+}
+
+/* Event loop for a reactor thread */
+void *reactor_run(void *arg) {
+  reactor_t *r = (reactor_t *)arg;
+  struct epoll_event events[MAX_EVENTS];
+  while (1) {
+    // look in on paused clients every millisecond
+    int n = epoll_wait(r->epfd, events, MAX_EVENTS, r->paused ? 1 : -1);
+    if (r->paused != NULL) {
+      reactor_resume(r);
+    }
+    if (n < 0) {
+      if (errno != EINTR) {
+        log_error("epoll_wait: %s", strerror(errno));
+      }
+      continue;
+    }
+    for (int i = 0; i < n; i++) {
+      client_t *cli = events[i].data.ptr;
+      if (cli == NULL) {
+        // one of the listening sockets
+        reactor_accept(r, r->listenfd);
+        if (r->localfd >= 0) {
+          reactor_accept(r, r->localfd);
+        }
+        continue;
+      }
+      int close_client = 0;
+      if (cli->rejected) {
+        close_client = client_discard(cli);
+      } else if (events[i].events & EPOLLOUT) {
+        close_client = client_flush(cli);
+      }
+      if (!close_client && !cli->closing && !cli->rejected &&
+          !cli->paused && (events[i].events & EPOLLIN)) {
+        if (cli->room != NULL && cli->room->backlog > ROOM_BACKLOG_SZ) {
+          client_pause(cli);
+        } else if (client_read(cli)) {
+          // write any goodbye (e.g. a version error) before closing
+          pthread_mutex_lock(&cli->out_mutex);
+          cli->closing = true;
+          pthread_mutex_unlock(&cli->out_mutex);
+          close_client = client_flush(cli);
+        }
+      }
+      if (close_client || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+        client_close(cli);
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Send as much of a client's queued output as one sendmsg takes, holding a
+ * reference to it until it completes.
+ *
+ * The chunks being sent can't be dropped for a snapshot (which only drops
+ * chunks that haven't started being written) until it's done. Call from its
+ * reactor, with out_mutex held.
+ */
+void client_send_queued(client_t *cli) {
+  if (cli->iov == NULL && (cli->iov = malloc(MAX_IOV * sizeof(struct iovec))) ==
+                              NULL) {
+    perror("iov malloc");
+    exit(1);
+  }
+  int iovcnt = 0;
+  for (chunk_t *c = cli->out.head; c && iovcnt < MAX_IOV; c = c->next) {
+    cli->iov[iovcnt].iov_base = chunk_bytes(c) + c->off;
+    cli->iov[iovcnt].iov_len = c->len - c->off;
+    c->droppable = false;
+    iovcnt++;
+  }
+  cli->msg = (struct msghdr){.msg_iov = cli->iov, .msg_iovlen = iovcnt};
+  cli->sending = true;
+  cli->refs++;
+  uring_prep_sendmsg(uring_sqe(&cli->reactor->ring), cli->connfd, &cli->msg,
+                     uring_data(cli, UD_SEND));
+}
+
+/* Start sends to every client with output queued since the last look.
+ *
+ * They all go to the kernel together with the next uring_wait, so a broadcast
+ * to every client of a reactor costs one system call instead of a write (and
+ * an epoll_ctl or two) each.
+ */
+void reactor_send_queued(reactor_t *r) {
+  Mpsc_node *n;
+  while ((n = mpsc_pop(&r->flushes)) != NULL) {
+    client_t *cli = (client_t *)((char *)n - offsetof(client_t, flush_node));
+    pthread_mutex_lock(&cli->out_mutex);
+    cli->flush_queued = false;
+    if (!cli->closed && !cli->sending && cli->out.len > 0) {
+      client_send_queued(cli);
+    }
+    pthread_mutex_unlock(&cli->out_mutex);
+    client_release(cli);
+  }
+}
+
+/* Handle a send to a client completing, sending more if more was queued.
+ */
+void client_sent(client_t *cli, int res) {
+  pthread_mutex_lock(&cli->out_mutex);
+  cli->sending = false;
+  if (res > 0) {
+    queue_consume(&cli->out, res);
+  }
+  bool close_client = false, more_tiles = false;
+  if (!cli->closed) {
+    if (res < 0) {
+      log_warn("write to %d failed: %s", cli->uid, strerror(-res));
+      close_client = true;
+    } else if (cli->out.len > 0) {
+      client_send_queued(cli);
+    } else {
+      close_client = cli->closing;
+    }
+    more_tiles = cli->streaming && cli->out.len < STREAM_WINDOW / 2;
+  }
+  pthread_mutex_unlock(&cli->out_mutex);
+  if (more_tiles && !close_client) {
+    request_tiles(cli);
+  }
+  if (close_client) {
+    client_close(cli);
+  }
+  client_release(cli);
+}
+
+/* Handle data (or the end of it) from a client's multishot recv.
+ */
+void client_recv_done(client_t *cli, int res, unsigned flags) {
+  reactor_t *r = cli->reactor;
+  const bool more = flags & IORING_CQE_F_MORE;
+  if (!more) {
+    cli->recv_armed = false;
+  }
+  if (res > 0) {
+    const unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+    // rejected clients' data is thrown away
+    if (!cli->closed && !cli->closing && !cli->rejected) {
+      stream_append(&cli->in, uring_buffer(&r->ring, id), res);
+      metrics_add(&bytes_in, res);
+      metrics_add(&reads_in, 1);
+    }
+    uring_buffer_done(&r->ring, id);
+  }
+  if (!cli->closed && !cli->closing && !cli->rejected && res > 0 &&
+      !cli->paused) {
+    // what's read while paused waits for it to be resumed
+    if (cli->room != NULL && cli->room->backlog > ROOM_BACKLOG_SZ) {
+      client_pause(cli);
+    } else if (client_received(cli)) {
+      client_finish(cli);
+    }
+  }
+  if (!more) {
+    if (!cli->closed && (res == 0 || (res < 0 && res != -ENOBUFS &&
+                                      res != -ECANCELED))) {
+      // hung up
+      client_close(cli);
+    } else if (!cli->closed && !cli->paused && !cli->closing) {
+      // ran out of buffers, or stopped for some other reason
+      client_recv(cli);
+    }
+    client_release(cli);
+  }
+}
+
+/* Event loop for a reactor thread using io_uring.
+ *
+ * Connections are accepted and read with multishot accepts and recvs, armed
+ * once, that fill buffers from a ring registered with the kernel. Workers
+ * don't write to clients: they queue output and push the client onto the
+ * reactor's flushes queue, waking it with an eventfd, and the reactor starts
+ * a sendmsg for each client on it at once. Submitting and waiting for
+ * completions is a single io_uring_enter.
+ */
+void *reactor_run_uring(void *arg) {
+  reactor_t *r = (reactor_t *)arg;
+  this_reactor = r;
+  // the ring belongs to the thread that sets it up
+  if (uring_init(&r->ring, URING_ENTRIES) < 0 ||
+      uring_setup_buffers(&r->ring, 0, URING_BUFS, URING_BUF_SZ) < 0) {
+    perror("io_uring");
+    exit(1);
+  }
+  uring_prep_accept(uring_sqe(&r->ring), r->listenfd, UD_ACCEPT);
+  if (r->localfd >= 0) {
+    uring_prep_accept(uring_sqe(&r->ring), r->localfd, UD_ACCEPT_LOCAL);
+  }
+  uring_prep_read(uring_sqe(&r->ring), r->wakefd, &r->wake_count,
+                  sizeof(r->wake_count), UD_WAKE);
+  while (1) {
+    reactor_send_queued(r);
+    // look in on paused clients every millisecond
+    if (uring_wait(&r->ring, r->paused ? 1 : -1) < 0 && errno != ETIME &&
+        errno != EINTR) {
+      log_error("io_uring_enter: %s", strerror(errno));
+    }
+    if (r->paused != NULL) {
+      reactor_resume(r);
+    }
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_cqe(&r->ring)) != NULL) {
+      const uint64_t data = cqe->user_data;
+      const int res = cqe->res;
+      const unsigned flags = cqe->flags;
+      uring_cqe_done(&r->ring);
+      client_t *cli = (client_t *)(uintptr_t)(data & ~(uint64_t)UD_MASK);
+      switch (data & UD_MASK) {
+        case UD_ACCEPT:
+        case UD_ACCEPT_LOCAL: {
+          const bool local = (data & UD_MASK) == UD_ACCEPT_LOCAL;
+          if (res >= 0) {
+            struct sockaddr_in cli_addr = {0};
+            socklen_t clilen = sizeof(cli_addr);
+            if (!local) {
+              getpeername(res, (struct sockaddr *)&cli_addr, &clilen);
+            }
+            client_accept(r, res, cli_addr, local);
+          } else {
+            log_error("accept: %s", strerror(-res));
+          }
+          if (!(flags & IORING_CQE_F_MORE)) {
+            uring_prep_accept(uring_sqe(&r->ring),
+                              local ? r->localfd : r->listenfd, data & UD_MASK);
+          }
+          break;
+        }
+        case UD_RECV:
+          client_recv_done(cli, res, flags);
+          break;
+        case UD_SEND:
+          client_sent(cli, res);
+          break;
+        case UD_WAKE:
+          // clear it before looking at the queue, so pushes after that wake
+          // it again
+          r->woken = false;
+          uring_prep_read(uring_sqe(&r->ring), r->wakefd, &r->wake_count,
+                          sizeof(r->wake_count), UD_WAKE);
+          break;
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Create a non-blocking listening socket on port, shared with SO_REUSEPORT.
+ *
+ * Returns: the socket, or -1 if it couldn't be bound
+ */
+int listen_on(int port, int backlog) {
+  int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int one = 1;
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+  struct sockaddr_in serv_addr = {
+      .sin_family = AF_INET,
+      .sin_addr.s_addr = htonl(INADDR_ANY),
+      .sin_port = htons(port),
+  };
+  if (bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+    close(listenfd);
+    return -1;
+  }
+  if (listen(listenfd, backlog) < 0) {
+    perror("Socket listening failed");
+    exit(EXIT_FAILURE);
+  }
+  return listenfd;
+}
+
+/* Write a report of the metrics to a connection on the metrics socket, and
+ * close it.
+ *
+ * The report is in the Prometheus text format, or JSON if the first line asks
+ * for `json`. HTTP requests (like `curl --unix-socket <path>
+ * http://localhost/metrics`) get an HTTP response, in JSON for paths with
+ * `json` in them.
+ */
+void metrics_serve(int fd) {
+  // an admin asking, so don't wait long for them
+  struct timeval timeout = {.tv_sec = 1};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  char req[1024];
+  size_t len = 0;
+  ssize_t n;
+  while (len < sizeof(req) - 1 &&
+         (n = read(fd, req + len, sizeof(req) - 1 - len)) > 0) {
+    len += n;
+    if (memchr(req, '\n', len) != NULL) {
+      break;
+    }
+  }
+  req[len] = '\0';
+  char *nl = strchr(req, '\n');
+  if (nl != NULL) {
+    *nl = '\0';
+  }
+  const bool http = strncmp(req, "GET ", 4) == 0;
+  const bool json = strstr(req, "json") != NULL;
+
+  metrics_set(&clients, cli_count);
+  char *body = NULL;
+  size_t body_len = 0;
+  FILE *f = open_memstream(&body, &body_len);
+  if (json) {
+    metrics_json(f, &metrics);
+  } else {
+    metrics_prometheus(f, &metrics);
+  }
+  fclose(f);
+  if (http) {
+    dprintf(fd,
+            "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+            json ? "application/json" : "text/plain; version=0.0.4", body_len);
+  }
+  for (size_t off = 0; off < body_len; off += n) {
+    if ((n = write(fd, body + off, body_len - off)) <= 0) {
+      break;
+    }
+  }
+  free(body);
+  close(fd);
+}
+
+/* Metrics thread: answer connections on the metrics socket, and work out
+ * rates every second.
+ */
+void *metrics_run(void *arg) {
+  const int listenfd = (long)arg;
+  int64_t sampled = now_ms();
+  while (1) {
+    struct pollfd pfd = {.fd = listenfd, .events = POLLIN};
+    const int64_t wait = sampled + 1000 - now_ms();
+    if (poll(&pfd, 1, wait > 0 ? wait : 0) > 0) {
+      int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd >= 0) {
+        metrics_serve(fd);
+      }
+    }
+    const int64_t now = now_ms();
+    if (now - sampled >= 1000) {
+      metrics_sample(&metrics, (now - sampled) / 1000.0);
+      sampled = now;
+    }
+  }
+  return NULL;
+}
+
+/* Datagrams of cursors waiting to be sent with one sendmmsg */
+typedef struct {
+  struct mmsghdr msgs[PRESENCE_BATCH];
+  struct iovec iov[PRESENCE_BATCH];
+  struct sockaddr_in to[PRESENCE_BATCH];
+  char data[PRESENCE_BATCH][PRESENCE_MAX_DATAGRAM];
+  int n;
+} presence_out_t;
+
+/* Send the datagrams waiting in out. Ones the socket has no room for are
+ * dropped: cursors are sent again soon enough anyway.
+ */
+void presence_send_out(presence_out_t *out) {
+  for (int i = 0; i < out->n;) {
+    const int sent = sendmmsg(presence_fd, out->msgs + i, out->n - i, 0);
+    i += sent > 0 ? sent : 1;
+  }
+  out->n = 0;
+}
+
+/* Queue a datagram of cursors to send, for presence_flush. */
+void presence_queue(void *arg, const struct sockaddr_in *to, const char *data,
+                    size_t len) {
+  presence_out_t *out = arg;
+  if (out->n == PRESENCE_BATCH) {
+    presence_send_out(out);
+  }
+  const int i = out->n++;
+  memcpy(out->data[i], data, len);
+  out->to[i] = *to;
+  out->iov[i] = (struct iovec){.iov_base = out->data[i], .iov_len = len};
+  out->msgs[i] = (struct mmsghdr){.msg_hdr = {.msg_name = &out->to[i],
+                                              .msg_namelen = sizeof(*to),
+                                              .msg_iov = &out->iov[i],
+                                              .msg_iovlen = 1}};
+  metrics_add(&cursors_out, 1);
+}
+
+/* Presence thread: take cursor updates off the presence socket a batch at a
+ * time, and send rooms their cursors every PRESENCE_MS.
+ */
+void *presence_run(void *arg) {
+  static presence_out_t out;
+  struct mmsghdr msgs[PRESENCE_BATCH];
+  struct iovec iov[PRESENCE_BATCH];
+  struct sockaddr_in from[PRESENCE_BATCH];
+  // one byte over, so longer datagrams don't pass for updates cut short
+  char data[PRESENCE_BATCH][PRESENCE_UPDATE_SZ + 1];
+  int64_t flushed = now_ms(), refreshed = flushed;
+  while (1) {
+    struct pollfd pfd = {.fd = presence_fd, .events = POLLIN};
+    const int64_t wait = flushed + PRESENCE_MS - now_ms();
+    if (poll(&pfd, 1, wait > 0 ? wait : 0) > 0) {
+      for (int i = 0; i < PRESENCE_BATCH; i++) {
+        iov[i] = (struct iovec){.iov_base = data[i], .iov_len = sizeof(data[i])};
+        msgs[i] = (struct mmsghdr){.msg_hdr = {.msg_name = &from[i],
+                                               .msg_namelen = sizeof(from[i]),
+                                               .msg_iov = &iov[i],
+                                               .msg_iovlen = 1}};
+      }
+      const int n =
+          recvmmsg(presence_fd, msgs, PRESENCE_BATCH, MSG_DONTWAIT, NULL);
+      const int64_t now = now_ms();
+      pthread_mutex_lock(&presence_mutex);
+      for (int i = 0; i < n; i++) {
+        const int res = presence_update(presence, data[i], msgs[i].msg_len,
+                                        &from[i], now);
+        if (res == 0) {
+          metrics_add(&cursors_in, 1);
+        } else if (res > 0) {
+          metrics_add(&cursors_dropped, 1);
+        }
+      }
+      pthread_mutex_unlock(&presence_mutex);
+    }
+    const int64_t now = now_ms();
+    if (now - flushed >= PRESENCE_MS) {
+      const bool all = now - refreshed >= PRESENCE_REFRESH_MS;
+      pthread_mutex_lock(&presence_mutex);
+      presence_flush(presence, all, presence_queue, &out);
+      pthread_mutex_unlock(&presence_mutex);
+      presence_send_out(&out);
+      flushed = now;
+      if (all) {
+        refreshed = now;
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Bind a UDP socket to port on every address, for cursors.
+ *
+ * Returns: the socket, or -1 if it couldn't be bound
+ */
+int bind_udp(int port) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_addr.s_addr = htonl(INADDR_ANY),
+      .sin_port = htons(port),
+  };
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Listen on a UNIX socket at path, replacing whatever was there.
+ *
+ * Returns: the socket, or -1 on errors
+ */
+int listen_unix(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 16) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* send quit command to all clients, once the workers are done with the
+ * requests before, and exit */
+void finish(int sig) {
+  for (int i = 0; i < num_workers; i++) {
+    request_push(&workers[i], request_new(REQ_QUIT, NULL, 0));
+  }
+  for (int i = 0; i < num_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  if (metrics_path != NULL) {
+    unlink(metrics_path);
+  }
+  if (local_path != NULL) {
+    unlink(local_path);
+  }
+  log_stop();
+  exit(sig);
+}
+
+// server settings from the cmdline, see `main` for the defaults
+typedef struct {
+  char *filename;    // file to load the canvas from (NULL for a blank canvas)
+  int port;          // first port to try
+  bool fixed_port;   // fail instead of trying later ports if it's taken
+  int backlog;       // pending connections the kernel queues per socket
+  int accept_rate;   // new connections admitted per second (0 for no limit)
+  int accept_burst;  // new connections admitted at once
+  int max_queue;     // bytes queued for a client before it gets a snapshot
+  int tick;          // milliseconds between broadcasts of edits
+  int log_size;      // bytes of recent ops kept for reconnecting clients
+  int workers;       // threads rooms are spread over (0 for one per core)
+  char *rooms_dir;   // where rooms are loaded from and saved to, or NULL
+  int room_idle;     // seconds an empty room is kept loaded
+  char *wal_dir;     // where rooms' logs and checkpoints are kept, or NULL
+  int wal_sync;      // milliseconds an applied op waits to be synced at most
+  int wal_batch;     // applied ops waiting to be synced at most
+  int checkpoint;    // seconds between checkpoints
+  char *metrics;     // UNIX socket to report metrics on, or NULL
+  char *local;       // UNIX socket for clients on this host, or NULL
+  bool uring;        // use io_uring instead of epoll, where there is one
+  int log_level;     // least severe level of messages logged
+} arguments_t;
+
+void parse_args(int argc, char *argv[], arguments_t *arguments) {
+  struct arg_lit *help, *version;
+  struct arg_int *port, *backlog, *accept_rate, *accept_burst, *max_queue;
+  struct arg_int *tick, *log_size, *workers, *room_idle;
+  struct arg_int *wal_sync, *wal_batch, *checkpoint;
+  struct arg_file *file, *rooms, *wal, *metrics_socket, *local;
+  struct arg_str *io, *log;
+  struct arg_end *end;
+
+  void *argtable[] = {
+      help = arg_litn(NULL, "help", 0, 1, "display this help and exit"),
+      version =
+          arg_litn(NULL, "version", 0, 1, "display version info and exit"),
+      port = arg_intn("p", "port", "<PORT>", 0, 1,
+                      "port to listen on (default 45011, or the next free)"),
+      backlog = arg_intn("b", "backlog", "<n>", 0, 1,
+                         "pending connections queued per socket "
+                         "(default SOMAXCONN)"),
+      accept_rate = arg_intn("r", "accept-rate", "<n>", 0, 1,
+                             "new connections admitted per second "
+                             "(default 1000, 0 for no limit)"),
+      accept_burst = arg_intn(NULL, "accept-burst", "<n>", 0, 1,
+                              "new connections admitted at once "
+                              "(default 1000)"),
+      max_queue = arg_intn("q", "max-queue", "<bytes>", 0, 1,
+                           "updates queued for a client before it is sent "
+                           "the whole canvas instead (default 262144)"),
+      tick = arg_intn("t", "tick", "<ms>", 0, 1,
+                      "milliseconds between broadcasts of edits (default "
+                      "10, 0 to send them right away)"),
+      log_size = arg_intn("l", "log-size", "<bytes>", 0, 1,
+                          "recent edits kept to catch up reconnecting "
+                          "clients (default 1048576)"),
+      workers = arg_intn("w", "workers", "<n>", 0, 1,
+                         "threads rooms are spread over (default one per "
+                         "core)"),
+      rooms = arg_filen("R", "rooms", "<dir>", 0, 1,
+                        "directory rooms are loaded from, and saved to when "
+                        "no one is in them (without it or --wal, empty rooms "
+                        "are dropped)"),
+      room_idle = arg_intn(NULL, "room-idle", "<s>", 0, 1,
+                           "seconds an empty room is kept loaded (default "
+                           "60)"),
+      wal = arg_filen(NULL, "wal", "<dir>", 0, 1,
+                      "directory to log edits and checkpoint rooms in, to "
+                      "recover them after a crash"),
+      wal_sync = arg_intn(NULL, "wal-sync", "<ms>", 0, 1,
+                          "longest an edit waits to be synced to the log "
+                          "(default 10)"),
+      wal_batch = arg_intn(NULL, "wal-batch", "<n>", 0, 1,
+                           "most edits waiting to be synced to the log "
+                           "(default 4096)"),
+      checkpoint = arg_intn(NULL, "checkpoint", "<s>", 0, 1,
+                            "seconds between checkpoints of a room (default "
+                            "300)"),
+      metrics_socket = arg_filen(NULL, "metrics", "<socket>", 0, 1,
+                                 "UNIX socket to report metrics on, in the "
+                                 "Prometheus text format or JSON"),
+      local = arg_filen(NULL, "local", "<socket>", 0, 1,
+                        "UNIX socket to also listen on, whose clients can be "
+                        "sent the canvas through shared memory"),
+      io = arg_strn(NULL, "io", "<epoll|uring>", 0, 1,
+                    "how reactors do socket I/O: epoll (default), or "
+                    "io_uring where the kernel has it"),
+      log = arg_strn(NULL, "log-level", "<level>", 0, 1,
+                     "least severe messages logged: debug, info (default), "
+                     "warn, error or off"),
+      file = arg_filen(NULL, NULL, "[FILE]", 0, 1,
+                       "file to load the canvas from ('-' for stdin)"),
+      end = arg_end(20),
+  };
+
+  int nerrors = arg_parse(argc, argv, argtable);
+
+  if (help->count > 0) {
+    printf("Usage: %s", program_name);
+    arg_print_syntax(stdout, argtable, "\n");
+    arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+    exit(0);
+  }
+
+  if (version->count > 0) {
+    printf("%s-%s\n", program_name, program_version);
+    exit(0);
+  }
+
+  if (nerrors > 0) {
+    arg_print_errors(stdout, end, program_name);
+    printf("Try '%s --help' for more information.\n", program_name);
+    exit(1);
+  }
+
+  if (port->count > 0) {
+    arguments->port = port->ival[0];
+    arguments->fixed_port = true;
+  }
+  if (backlog->count > 0) {
+    arguments->backlog = backlog->ival[0];
+  }
+  if (accept_rate->count > 0) {
+    arguments->accept_rate = accept_rate->ival[0];
+  }
+  if (accept_burst->count > 0) {
+    arguments->accept_burst = accept_burst->ival[0];
+  }
+  if (max_queue->count > 0) {
+    arguments->max_queue = max_queue->ival[0];
+  }
+  if (tick->count > 0) {
+    arguments->tick = tick->ival[0];
+  }
+  if (log_size->count > 0) {
+    arguments->log_size = log_size->ival[0];
+  }
+  if (workers->count > 0) {
+    arguments->workers = workers->ival[0];
+  }
+  if (rooms->count > 0) {
+    arguments->rooms_dir = strdup(rooms->filename[0]);
+  }
+  if (room_idle->count > 0) {
+    arguments->room_idle = room_idle->ival[0];
+  }
+  if (wal->count > 0) {
+    arguments->wal_dir = strdup(wal->filename[0]);
+  }
+  if (wal_sync->count > 0) {
+    arguments->wal_sync = wal_sync->ival[0];
+  }
+  if (wal_batch->count > 0) {
+    arguments->wal_batch = wal_batch->ival[0];
+  }
+  if (checkpoint->count > 0) {
+    arguments->checkpoint = checkpoint->ival[0];
+  }
+  if (metrics_socket->count > 0) {
+    arguments->metrics = strdup(metrics_socket->filename[0]);
+  }
+  if (local->count > 0) {
+    arguments->local = strdup(local->filename[0]);
+  }
+  if (io->count > 0) {
+    arguments->uring = strcmp(io->sval[0], "uring") == 0;
+  }
+  if (log->count > 0) {
+    arguments->log_level = log_parse_level(log->sval[0]);
+  }
+  if (file->count > 0) {
+    arguments->filename = strdup(file->filename[0]);
+  }
+
+  char *errmsg = NULL;
+  if (arguments->backlog < 1) {
+    errmsg = "backlog must be positive";
+  }
+  if (arguments->accept_rate < 0 || arguments->accept_burst < 1) {
+    errmsg = "accept rate and burst must be positive";
+  }
+  if (arguments->max_queue < 1) {
+    errmsg = "max queue must be positive";
+  }
+  if (arguments->tick < 0) {
+    errmsg = "tick must be positive";
+  }
+  if (arguments->log_size < 1) {
+    errmsg = "log size must be positive";
+  }
+  if (arguments->workers < 0 || arguments->room_idle < 0) {
+    errmsg = "workers and room idle time must be positive";
+  }
+  if (arguments->wal_sync < 0 || arguments->wal_batch < 1 ||
+      arguments->checkpoint < 1) {
+    errmsg = "wal sync, wal batch and checkpoint must be positive";
+  }
+  if (io->count > 0 && !arguments->uring && strcmp(io->sval[0], "epoll")) {
+    errmsg = "io must be epoll or uring";
+  }
+  if (arguments->log_level < 0) {
+    errmsg = "log level must be debug, info, warn, error or off";
+  }
+  if (errmsg != NULL) {
+    fprintf(stderr, "%s: %s\n", program_name, errmsg);
+    exit(1);
+  }
+
+  arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+}
+
+int main(int argc, char *argv[]) {
+  arguments_t arguments = {
+      .filename = NULL,
+      .port = 45011,
+      .fixed_port = false,
+      .backlog = SOMAXCONN,
+      .accept_rate = 1000,
+      .accept_burst = 1000,
+      .max_queue = 256 * 1024,
+      .tick = 10,
+      .log_size = 1024 * 1024,
+      .workers = 0,
+      .rooms_dir = NULL,
+      .room_idle = 60,
+      .wal_dir = NULL,
+      .wal_sync = 10,
+      .wal_batch = 4096,
+      .checkpoint = 300,
+      .metrics = NULL,
+      .local = NULL,
+      .uring = false,
+      .log_level = LOG_LEVEL,
+  };
+  parse_args(argc, argv, &arguments);
+
+  /* Log from a background thread, so no one waits on the terminal or disk */
+  log_level = arguments.log_level;
+  log_start(stdout);
+
+  Canvas *canvas;
+  if (arguments.filename != NULL) {
+    if (strcmp(arguments.filename, "-") == 0) {
+      // read from stdin if specified
+      log_info("Reading from stdin");
+      canvas = canvas_readf_norewind(stdin);
+      // reopen stdin b/c EOF has been sent
+      // `/dev/tty` points to current terminal
+      // note that this is NOT portable
+      freopen("/dev/tty", "rw", stdin);
+
+      /* If reading from file */
+    } else {
+      char *in_filename = arguments.filename;
+      FILE *f = fopen(in_filename, "r");
+      log_info("Reading from '%s'", in_filename);
+      if (f == NULL) {
+        perror("savefile read");
+        exit(1);
+      }
+      canvas = canvas_readf(f);
+      fclose(f);
+    }
+  } else {
+    log_info("making blank canvas");
+    canvas = canvas_new_blank(100, 100);
+  }
+
+  /* Ignore pipe signals */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* Allow as many connections as the hard file limit */
+  struct rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+
+  /* Handle interrupts in this thread only, with sigwait below */
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  max_queue = arguments.max_queue;
+  tick_ms = arguments.tick;
+  log_size = arguments.log_size;
+  rooms_dir = arguments.rooms_dir;
+  room_idle_ms = arguments.room_idle * 1000;
+  wal_dir = arguments.wal_dir;
+  wal_sync_ms = arguments.wal_sync;
+  wal_sync_ops = arguments.wal_batch;
+  checkpoint_ms = arguments.checkpoint * 1000;
+  admission = admission_new(arguments.accept_rate, arguments.accept_burst,
+                            now_ms());
+
+  /* Socket settings */
+  int port = arguments.port;
+  int num_reactors = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_reactors < 1) {
+    num_reactors = 1;
+  }
+  num_workers = arguments.workers > 0 ? arguments.workers : num_reactors;
+  reactor_t *reactors = calloc(num_reactors, sizeof(reactor_t));
+
+  /* Bind, trying later ports if the first is taken */
+  while ((reactors[0].listenfd = listen_on(port, arguments.backlog)) < 0) {
+    perror("Socket binding failed");
+    if (arguments.fixed_port) {
+      return EXIT_FAILURE;
+    }
+    port++;
+  }
+  for (int i = 1; i < num_reactors; i++) {
+    if ((reactors[i].listenfd = listen_on(port, arguments.backlog)) < 0) {
+      perror("Socket binding failed");
+      return EXIT_FAILURE;
+    }
+  }
+  log_info("connected to port %d", port);
+  for (int i = 0; i < num_reactors; i++) {
+    reactors[i].localfd = -1;
+  }
+  if (arguments.local != NULL) {
+    if ((reactors[0].localfd = listen_unix(arguments.local)) < 0) {
+      perror("local socket");
+      return EXIT_FAILURE;
+    }
+    fcntl(reactors[0].localfd, F_SETFL, O_NONBLOCK);
+    local_path = arguments.local;
+    log_info("listening for local clients on '%s'", local_path);
+  }
+
+  if (arguments.uring && !(use_uring = uring_supported())) {
+    log_warn("io_uring isn't available, using epoll");
+  }
+
+  /* Start the workers, with the main canvas (recovered, if there's a log of
+   * it) on the first, before any client can join it */
+  workers = calloc(num_workers, sizeof(worker_t));
+  for (int i = 0; i < num_workers; i++) {
+    workers[i].id = i;
+    mpsc_init(&workers[i].requests);
+    sem_init(&workers[i].ready, 0, 0);
+  }
+  main_room = room_new("");
+  main_room->canvas = canvas;
+  room_start(main_room);
+  for (int i = 0; i < num_workers; i++) {
+    pthread_create(&workers[i].thread, NULL, &worker_run, &workers[i]);
+  }
+
+  /* Share cursors over UDP on the same port, if it's free, before any client
+   * can be told to */
+  if ((presence_fd = bind_udp(port)) < 0) {
+    log_warn("presence socket: %s; cursors won't be shared", strerror(errno));
+  } else {
+    presence = presence_new(PRESENCE_RATE, PRESENCE_BURST);
+    presence_port = port;
+    pthread_t thread;
+    pthread_create(&thread, NULL, &presence_run, NULL);
+  }
+
+  /* Start a reactor per core */
+  for (int i = 0; i < num_reactors; i++) {
+    reactor_t *r = &reactors[i];
+    r->id = i;
+    if (use_uring) {
+      mpsc_init(&r->flushes);
+      if ((r->wakefd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        return EXIT_FAILURE;
+      }
+      pthread_create(&r->thread, NULL, &reactor_run_uring, r);
+      continue;
+    }
+    if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+      perror("epoll_create1");
+      return EXIT_FAILURE;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listenfd, &ev);
+    if (r->localfd >= 0) {
+      epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->localfd, &ev);
+    }
+    pthread_create(&r->thread, NULL, &reactor_run, r);
+  }
+
+  /* Report metrics on a UNIX socket */
+  if (arguments.metrics != NULL) {
+    const int fd = listen_unix(arguments.metrics);
+    if (fd < 0) {
+      perror("metrics socket");
+      return EXIT_FAILURE;
+    }
+    metrics_path = arguments.metrics;
+    pthread_t thread;
+    pthread_create(&thread, NULL, &metrics_run, (void *)(long)fd);
+    log_info("reporting metrics on '%s'", metrics_path);
+  }
+
+  log_info("<[ SERVER STARTED ]> (%d %s reactors, %d workers)", num_reactors,
+           use_uring ? "io_uring" : "epoll", num_workers);
+
+  /* Wait for an interrupt */
+  int sig;
+  sigwait(&sigs, &sig);
+  finish(sig);
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,184 @@
+/* Canvases shared with clients on the same host
+ *
+ * A local client doesn't need the canvas sent over its socket: the server
+ * keeps a copy of each room's canvas in a shared memory segment, and tells
+ * the client its name instead of sending a snapshot. The client maps it
+ * read-only and copies the canvas out, with no transfer or parsing.
+ *
+ * The writer brackets each batch of changes with shm_canvas_begin and
+ * shm_canvas_end, which make the sequence count odd and then even again, with
+ * the canvas version stored in between. A reader copies the cells between two
+ * loads of the count, and keeps the copy only if the count was even and the
+ * same both times. Copies torn by a write are rare and cheap to retry, and
+ * the writer never waits for readers, who can't write to the segment at all.
+ */
+#include "shm.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_MAGIC "CLSHM001"
+#define SHM_READ_TRIES 10000  // torn copies a reader gives up after
+
+struct shm_header {
+  char magic[8];
+  uint32_t rows, cols;
+  _Atomic uint64_t seq;      // odd while the cells are being written
+  _Atomic uint64_t version;  // of the canvas in the cells
+  char cells[];              // rows * cols, row by row
+};
+
+/* Map a segment of size bytes from fd */
+static struct shm_header *shm_map(int fd, size_t size, bool writable) {
+  void *map = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                   MAP_SHARED, fd, 0);
+  return map == MAP_FAILED ? NULL : map;
+}
+
+/* Create a segment called name (like "/collascii-1") holding a copy of a
+ * canvas at a version, replacing any segment left with that name.
+ *
+ * Returns: 0 on success, -1 on errors (with errno set)
+ */
+int shm_canvas_create(Shm_canvas *shm, const char *name, Canvas *canvas,
+                      uint64_t version) {
+  const size_t cells = (size_t)canvas->num_rows * canvas->num_cols;
+  *shm = (Shm_canvas){.size = sizeof(struct shm_header) + cells,
+                      .num_rows = canvas->num_rows,
+                      .num_cols = canvas->num_cols};
+  snprintf(shm->name, sizeof(shm->name), "%s", name);
+  shm_unlink(name);
+  // readable by anyone who could connect to read the canvas anyway
+  const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, shm->size) < 0 ||
+      (shm->header = shm_map(fd, shm->size, true)) == NULL) {
+    close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+  close(fd);
+
+  struct shm_header *h = shm->header;
+  h->rows = canvas->num_rows;
+  h->cols = canvas->num_cols;
+  atomic_store_explicit(&h->seq, 0, memory_order_relaxed);
+  atomic_store_explicit(&h->version, version, memory_order_relaxed);
+  shm->canvas = (Canvas){.num_rows = canvas->num_rows,
+                         .num_cols = canvas->num_cols,
+                         .rows = malloc(canvas->num_rows * sizeof(char *)),
+                         .dirty = calloc(canvas->num_rows, sizeof(bool))};
+  for (int y = 0; y < canvas->num_rows; y++) {
+    shm->canvas.rows[y] = h->cells + (size_t)y * canvas->num_cols;
+    memcpy(shm->canvas.rows[y], canvas->rows[y], canvas->num_cols);
+  }
+  // the magic goes last, so a reader can't take a half-made segment
+  atomic_thread_fence(memory_order_release);
+  memcpy(h->magic, SHM_MAGIC, sizeof(h->magic));
+  return 0;
+}
+
+/* Start changing the cells of a segment, through shm->canvas. */
+void shm_canvas_begin(Shm_canvas *shm) {
+  struct shm_header *h = shm->header;
+  const uint64_t seq = atomic_load_explicit(&h->seq, memory_order_relaxed);
+  atomic_store_explicit(&h->seq, seq + 1, memory_order_relaxed);
+  // readers mustn't see the cells change before the count does
+  atomic_thread_fence(memory_order_release);
+}
+
+/* Finish changing the cells of a segment, which are now at version. */
+void shm_canvas_end(Shm_canvas *shm, uint64_t version) {
+  struct shm_header *h = shm->header;
+  atomic_store_explicit(&h->version, version, memory_order_relaxed);
+  const uint64_t seq = atomic_load_explicit(&h->seq, memory_order_relaxed);
+  atomic_store_explicit(&h->seq, seq + 1, memory_order_release);
+}
+
+/* Unmap and remove a segment the caller created.
+ *
+ * Readers that have it mapped keep their mapping, but it won't change again.
+ */
+void shm_canvas_destroy(Shm_canvas *shm) {
+  munmap(shm->header, shm->size);
+  shm_unlink(shm->name);
+  free(shm->canvas.rows);
+  free(shm->canvas.dirty);
+  *shm = (Shm_canvas){0};
+}
+
+/* Map the segment called name read-only.
+ *
+ * Returns: 0 on success, -1 if it can't be opened or isn't a canvas
+ */
+int shm_canvas_attach(Shm_canvas *shm, const char *name) {
+  *shm = (Shm_canvas){0};
+  snprintf(shm->name, sizeof(shm->name), "%s", name);
+  const int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct shm_header) ||
+      (shm->header = shm_map(fd, st.st_size, false)) == NULL) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  shm->size = st.st_size;
+  const struct shm_header *h = shm->header;
+  if (memcmp(h->magic, SHM_MAGIC, sizeof(h->magic)) != 0 ||
+      shm->size - sizeof(*h) != (size_t)h->rows * h->cols) {
+    shm_canvas_detach(shm);
+    return -1;
+  }
+  atomic_thread_fence(memory_order_acquire);
+  shm->num_rows = h->rows;
+  shm->num_cols = h->cols;
+  return 0;
+}
+
+/* Copy the cells of an attached segment into a canvas of the same size, and
+ * the version they're at.
+ *
+ * Returns: false if every copy was torn by the writer (see SHM_READ_TRIES)
+ */
+bool shm_canvas_read(Shm_canvas *shm, Canvas *canvas, uint64_t *version) {
+  struct shm_header *h = shm->header;
+  for (int tries = 0; tries < SHM_READ_TRIES; tries++) {
+    const uint64_t seq = atomic_load_explicit(&h->seq, memory_order_acquire);
+    if (seq % 2 == 1) {
+      sched_yield();
+      continue;
+    }
+    for (int y = 0; y < shm->num_rows; y++) {
+      memcpy(canvas->rows[y], h->cells + (size_t)y * shm->num_cols,
+             shm->num_cols);
+    }
+    *version = atomic_load_explicit(&h->version, memory_order_relaxed);
+    // the copies have to be done before the count is looked at again
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&h->seq, memory_order_relaxed) == seq) {
+      for (int y = 0; y < shm->num_rows; y++) {
+        canvas_mark_dirty_y(canvas, y);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Unmap a segment mapped with shm_canvas_attach. */
+void shm_canvas_detach(Shm_canvas *shm) {
+  munmap(shm->header, shm->size);
+  *shm = (Shm_canvas){0};
+}
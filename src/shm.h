@@ -0,0 +1,41 @@
+#ifndef shm_h
+#define shm_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "canvas.h"
+
+#define SHM_NAME_SZ 64  // longest segment name, with its '\0'
+
+struct shm_header;
+
+/* A canvas in a POSIX shared memory segment, that the server writes and local
+ * clients map read-only.
+ *
+ * The segment is a header with the canvas size, a sequence count and the
+ * canvas version, followed by the cells row by row. The writer makes the count
+ * odd while it changes cells, so a reader that sees it odd, or changed by the
+ * time it's done copying, knows its copy may be torn and tries again (a
+ * seqlock): readers never block the writer or each other.
+ */
+typedef struct {
+  char name[SHM_NAME_SZ];
+  struct shm_header *header;
+  size_t size;    // bytes mapped
+  int num_rows, num_cols;
+  Canvas canvas;  // the writer's view of the cells, to apply ops to
+} Shm_canvas;
+
+int shm_canvas_create(Shm_canvas *shm, const char *name, Canvas *canvas,
+                      uint64_t version);
+void shm_canvas_begin(Shm_canvas *shm);
+void shm_canvas_end(Shm_canvas *shm, uint64_t version);
+void shm_canvas_destroy(Shm_canvas *shm);
+
+int shm_canvas_attach(Shm_canvas *shm, const char *name);
+bool shm_canvas_read(Shm_canvas *shm, Canvas *canvas, uint64_t *version);
+void shm_canvas_detach(Shm_canvas *shm);
+
+#endif
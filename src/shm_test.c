@@ -0,0 +1,133 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "canvas.h"
+#include "lib/minunit.h"
+#include "proto.h"
+#include "shm.h"
+
+static const char name[] = "/collascii_shm_test";
+static Shm_canvas writer, reader;
+static Canvas *canvas, *copy;
+
+void test_setup(void) {
+  canvas = canvas_new_blank(20, 30);
+  canvas_ldstryx(canvas, "hello", 3, 4);
+  copy = canvas_new_blank(20, 30);
+  shm_canvas_create(&writer, name, canvas, 7);
+}
+
+void test_teardown(void) {
+  if (reader.header != NULL) {
+    shm_canvas_detach(&reader);
+  }
+  if (writer.header != NULL) {
+    shm_canvas_destroy(&writer);
+  }
+  canvas_free(canvas);
+  canvas_free(copy);
+}
+
+MU_TEST(test_shm_read) {
+  mu_assert_int_eq(0, shm_canvas_attach(&reader, name));
+  mu_assert_int_eq(20, reader.num_rows);
+  mu_assert_int_eq(30, reader.num_cols);
+  uint64_t version;
+  mu_check(shm_canvas_read(&reader, copy, &version));
+  mu_check(version == 7);
+  mu_check(canvas_eq(canvas, copy));
+}
+
+MU_TEST(test_shm_write) {
+  mu_assert_int_eq(0, shm_canvas_attach(&reader, name));
+  // ops applied to the writer's view show up for readers, with the version
+  const Op op = {.type = OP_RECT, .y = 2, .x = 3, .h = 4, .w = 5, .ch = '#'};
+  shm_canvas_begin(&writer);
+  proto_apply_op(&writer.canvas, &op);
+  proto_apply_op(canvas, &op);
+  shm_canvas_end(&writer, 8);
+  uint64_t version;
+  mu_check(shm_canvas_read(&reader, copy, &version));
+  mu_check(version == 8);
+  mu_check(canvas_eq(canvas, copy));
+}
+
+MU_TEST(test_shm_torn) {
+  mu_assert_int_eq(0, shm_canvas_attach(&reader, name));
+  // a writer that never finishes leaves nothing safe to copy
+  shm_canvas_begin(&writer);
+  uint64_t version;
+  mu_check(!shm_canvas_read(&reader, copy, &version));
+  shm_canvas_end(&writer, 8);
+  mu_check(shm_canvas_read(&reader, copy, &version));
+}
+
+MU_TEST(test_shm_attach_errors) {
+  mu_assert_int_eq(-1, shm_canvas_attach(&reader, "/collascii_shm_missing"));
+  // removed once the writer is done with it
+  shm_canvas_destroy(&writer);
+  mu_assert_int_eq(-1, shm_canvas_attach(&reader, name));
+}
+
+static _Atomic bool done;
+
+/* Fill the whole canvas with a letter per version, over and over */
+static void *fill(void *arg) {
+  for (uint64_t v = 1; !done; v++) {
+    shm_canvas_begin(&writer);
+    canvas_fill(&writer.canvas, 'a' + v % 26);
+    shm_canvas_end(&writer, v);
+  }
+  return NULL;
+}
+
+MU_TEST(test_shm_concurrent) {
+  mu_assert_int_eq(0, shm_canvas_attach(&reader, name));
+  shm_canvas_begin(&writer);
+  canvas_fill(&writer.canvas, 'a');
+  shm_canvas_end(&writer, 0);
+  done = false;
+  pthread_t thread;
+  pthread_create(&thread, NULL, fill, NULL);
+  // every copy is of one whole version, never parts of two
+  int reads = 0;
+  for (int i = 0; i < 2000; i++) {
+    uint64_t version;
+    if (!shm_canvas_read(&reader, copy, &version)) {
+      continue;
+    }
+    reads++;
+    const char ch = 'a' + version % 26;
+    for (int y = 0; y < copy->num_rows; y++) {
+      for (int x = 0; x < copy->num_cols; x++) {
+        if (copy->rows[y][x] != ch) {
+          done = true;
+          pthread_join(thread, NULL);
+          mu_fail("copy mixes versions");
+        }
+      }
+    }
+  }
+  done = true;
+  pthread_join(thread, NULL);
+  mu_check(reads > 0);
+}
+
+MU_TEST_SUITE(shm_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_shm_read);
+  MU_RUN_TEST(test_shm_write);
+  MU_RUN_TEST(test_shm_torn);
+  MU_RUN_TEST(test_shm_attach_errors);
+  MU_RUN_TEST(test_shm_concurrent);
+}
+
+int main(int argc, char const *argv[]) {
+  MU_RUN_SUITE(shm_main);
+  MU_REPORT();
+  return minunit_status;
+}
@@ -0,0 +1,126 @@
+/* Incremental parsing of what's read from a connection
+ *
+ * TCP doesn't keep message boundaries: one read can hold many lines or
+ * frames, and a message can be split over any number of reads. A Stream
+ * keeps what's been read but not parsed, and parsing only takes messages
+ * that are complete, leaving the rest for once more has been read.
+ *
+ * The buffer is used like a ring that never wraps: reads go after the
+ * unparsed bytes, and parsing moves the start of them forward. Once the start
+ * catches up with the end both go back to the front, which is what usually
+ * happens after a read of whole messages. Otherwise, a partial message is
+ * only moved to the front when a read needs the room, and the buffer only
+ * grows when the message doesn't fit in it, so a client can pipeline any
+ * number of messages per read without any of them being copied.
+ */
+#include "stream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "proto.h"
+
+/* Make room for at least n more bytes after the end of a stream.
+ *
+ * Returns: where they go
+ */
+static char *stream_space(Stream *s, size_t n) {
+  if (s->cap - s->end >= n) {
+    return s->data + s->end;
+  }
+  const size_t pending = stream_pending(s);
+  if (s->start > 0 && s->cap - pending >= n) {
+    memmove(s->data, s->data + s->start, pending);
+    s->start = 0;
+    s->end = pending;
+    return s->data + s->end;
+  }
+  // twice a read, so a partial message can be moved to make room for one
+  size_t cap = s->cap ? s->cap : 2 * STREAM_READ_SZ;
+  while (cap - s->end < n) {
+    cap *= 2;
+  }
+  if ((s->data = realloc(s->data, cap)) == NULL) {
+    perror("stream realloc");
+    exit(1);
+  }
+  s->cap = cap;
+  return s->data + s->end;
+}
+
+/* Read what's waiting on fd into a stream, as much as there's room for after
+ * making room for STREAM_READ_SZ bytes.
+ *
+ * Returns: what read() did
+ */
+ssize_t stream_read(Stream *s, int fd) {
+  char *space = stream_space(s, STREAM_READ_SZ);
+  const ssize_t n = read(fd, space, s->cap - s->end);
+  if (n > 0) {
+    s->end += n;
+  }
+  return n;
+}
+
+/* Add bytes that were read some other way to the end of a stream. */
+void stream_append(Stream *s, const char *bytes, size_t n) {
+  memcpy(stream_space(s, n), bytes, n);
+  s->end += n;
+}
+
+/* Take what's been parsed off the front of a stream.
+ */
+static void stream_consume(Stream *s, size_t n) {
+  s->start += n;
+  if (s->start == s->end) {
+    s->start = s->end = 0;
+  }
+}
+
+/* Take the next complete line from a stream.
+ *
+ * The newline is replaced with '\0', so *line is a string.
+ *
+ * Returns: 1 if there was one, 0 if there's only part of one so far
+ */
+int stream_next_line(Stream *s, char **line) {
+  if (stream_pending(s) == 0) {
+    return 0;
+  }
+  char *start = s->data + s->start;
+  char *nl = memchr(start, '\n', stream_pending(s));
+  if (nl == NULL) {
+    return 0;
+  }
+  *nl = '\0';
+  *line = start;
+  stream_consume(s, nl - start + 1);
+  return 1;
+}
+
+/* Take the next complete 2.0 frame from a stream (see proto_parse).
+ *
+ * Returns: 1 if there was one, 0 if there's only part of one so far, or -1 if
+ * it's malformed
+ */
+int stream_next_frame(Stream *s, char *type, const char **payload,
+                      size_t *len) {
+  const long n =
+      proto_parse(s->data + s->start, stream_pending(s), type, payload, len);
+  if (n <= 0) {
+    return n < 0 ? -1 : 0;
+  }
+  stream_consume(s, n);
+  return 1;
+}
+
+/* Throw away what's in a stream and give back its memory.
+ *
+ * The stream can be used again.
+ */
+void stream_free(Stream *s) {
+  free(s->data);
+  *s = (Stream){0};
+}
@@ -0,0 +1,40 @@
+#ifndef stream_h
+#define stream_h
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define STREAM_READ_SZ 4096  // least room made for each read
+
+/* Bytes read from a connection, split into lines or frames where they lie.
+ *
+ * Reads go into the free space after the bytes not parsed yet, and every
+ * complete message in them is handed out as a pointer into the buffer, so
+ * however many messages a read brings (or however few bytes of one), none of
+ * them is copied. Only a message cut off by the end of the buffer is moved,
+ * to the front, once there's no more room after it.
+ *
+ * Messages handed out stay valid until the next read into the stream. An
+ * empty Stream ({0}) is ready to use.
+ */
+typedef struct {
+  char *data;
+  size_t cap;
+  size_t start, end;  // bytes not parsed yet are data[start..end)
+} Stream;
+
+ssize_t stream_read(Stream *s, int fd);
+void stream_append(Stream *s, const char *bytes, size_t n);
+
+int stream_next_line(Stream *s, char **line);
+int stream_next_frame(Stream *s, char *type, const char **payload,
+                      size_t *len);
+
+void stream_free(Stream *s);
+
+/* Bytes read but not parsed yet, like the start of a message. */
+static inline size_t stream_pending(const Stream *s) {
+  return s->end - s->start;
+}
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "lib/minunit.h"
+#include "proto.h"
+#include "stream.h"
+
+static Stream s;
+static int fds[2];
+static Frame_buf frames;
+
+void test_setup(void) {
+  s = (Stream){0};
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+}
+
+void test_teardown(void) {
+  stream_free(&s);
+  proto_buf_free(&frames);
+  frames = (Frame_buf){0};
+  close(fds[0]);
+  close(fds[1]);
+}
+
+/* Send bytes and read them into the stream in one read */
+static void receive(const char *bytes, size_t n) {
+  write(fds[1], bytes, n);
+  mu_assert_int_eq(n, stream_read(&s, fds[0]));
+}
+
+MU_TEST(test_stream_coalesced_lines) {
+  // every command in a read is handled, not just the first
+  const char cmds[] = "s 1 2 a\ns 3 4 b\ns 5 6 c\n";
+  receive(cmds, strlen(cmds));
+  char *line;
+  mu_check(stream_next_line(&s, &line));
+  mu_assert_string_eq("s 1 2 a", line);
+  mu_check(stream_next_line(&s, &line));
+  mu_assert_string_eq("s 3 4 b", line);
+  mu_check(stream_next_line(&s, &line));
+  mu_assert_string_eq("s 5 6 c", line);
+  mu_check(!stream_next_line(&s, &line));
+  mu_assert_int_eq(0, stream_pending(&s));
+}
+
+MU_TEST(test_stream_split_line) {
+  char *line;
+  receive("s 1", 3);
+  mu_check(!stream_next_line(&s, &line));
+  receive("0 2", 3);
+  mu_check(!stream_next_line(&s, &line));
+  receive("0 x\ns 4", 7);
+  mu_check(stream_next_line(&s, &line));
+  mu_assert_string_eq("s 10 20 x", line);
+  mu_check(!stream_next_line(&s, &line));
+  mu_assert_int_eq(3, stream_pending(&s));
+}
+
+MU_TEST(test_stream_frames_byte_by_byte) {
+  for (int i = 0; i < 3; i++) {
+    proto_begin(&frames, FRAME_OPS);
+    proto_put_op(&frames, &(Op){.type = OP_CELL, .y = i, .x = 2 * i,
+                                .ch = 'a' + i});
+    proto_end(&frames);
+  }
+  // however the frames are cut up, each comes out whole, once
+  int got = 0;
+  for (size_t i = 0; i < frames.len; i++) {
+    receive(frames.data + i, 1);
+    char type;
+    const char *payload;
+    size_t len;
+    int res;
+    while ((res = stream_next_frame(&s, &type, &payload, &len)) == 1) {
+      mu_assert_int_eq(FRAME_OPS, type);
+      Op op;
+      const char *p = payload;
+      mu_assert_int_eq(1, proto_next_op(&p, payload + len, &op));
+      mu_assert_int_eq(got, op.y);
+      mu_assert_int_eq(2 * got, op.x);
+      mu_assert_int_eq('a' + got, op.ch);
+      got++;
+    }
+    mu_assert_int_eq(0, res);
+  }
+  mu_assert_int_eq(3, got);
+  mu_assert_int_eq(0, stream_pending(&s));
+}
+
+MU_TEST(test_stream_malformed_frame) {
+  receive("\0\0\0\0o", 5);
+  char type;
+  const char *payload;
+  size_t len;
+  mu_assert_int_eq(-1, stream_next_frame(&s, &type, &payload, &len));
+}
+
+MU_TEST(test_stream_no_copies) {
+  // a read that fills the buffer, ending partway through a line
+  char bytes[2 * STREAM_READ_SZ];
+  memset(bytes, 'x', sizeof(bytes));
+  memcpy(bytes, "one\ntwo\n", 8);
+  memcpy(bytes + sizeof(bytes) - 4, "\nthr", 4);
+  receive(bytes, sizeof(bytes));
+  const size_t cap = s.cap;
+  // messages are handed out where they were read
+  char *line;
+  mu_check(stream_next_line(&s, &line));
+  mu_check(line == s.data);
+  mu_check(stream_next_line(&s, &line));
+  mu_check(line == s.data + 4);
+  mu_check(stream_next_line(&s, &line));
+  mu_check(line == s.data + 8);
+  mu_check(!stream_next_line(&s, &line));
+  // and only what's left of the last one is moved, to make room for the next
+  // read without growing
+  receive("ee\n", 3);
+  mu_assert_int_eq(cap, s.cap);
+  mu_check(stream_next_line(&s, &line));
+  mu_check(line == s.data);
+  mu_assert_string_eq("three", line);
+}
+
+MU_TEST(test_stream_grows) {
+  // a message bigger than the buffer makes it grow instead
+  proto_begin(&frames, FRAME_OPS);
+  char data[3 * STREAM_READ_SZ];
+  memset(data, 'x', sizeof(data));
+  proto_put_op(&frames, &(Op){.type = OP_SPAN, .y = 1, .x = 0, .h = 1,
+                              .w = sizeof(data), .data = data,
+                              .stride = sizeof(data)});
+  proto_end(&frames);
+  write(fds[1], frames.data, frames.len);
+  size_t got = 0;
+  while (got < frames.len) {
+    got += stream_read(&s, fds[0]);
+  }
+  char type;
+  const char *payload;
+  size_t len;
+  mu_assert_int_eq(1, stream_next_frame(&s, &type, &payload, &len));
+  mu_assert_int_eq(frames.len - PROTO_HEADER_SZ, len);
+  mu_check(s.cap >= frames.len);
+}
+
+MU_TEST_SUITE(stream_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_stream_coalesced_lines);
+  MU_RUN_TEST(test_stream_split_line);
+  MU_RUN_TEST(test_stream_frames_byte_by_byte);
+  MU_RUN_TEST(test_stream_malformed_frame);
+  MU_RUN_TEST(test_stream_no_copies);
+  MU_RUN_TEST(test_stream_grows);
+}
+
+int main(int argc, char const *argv[]) {
+  MU_RUN_SUITE(stream_main);
+  MU_REPORT();
+  return minunit_status;
+}
@@ -0,0 +1,196 @@
+/* A canvas sent in tiles, nearest the joiner's view first
+ *
+ * Sending a big canvas as one snapshot leaves a joining client with nothing to
+ * show until the last byte of it arrives. Instead the server can split it into
+ * square tiles and send them one at a time, starting with the ones in the
+ * client's view and working outwards, so the client has what it's looking at
+ * after the first few and can start drawing while the rest trickle in.
+ *
+ * Each tile is the contents of its cells when it's sent, and updates keep
+ * going to the client the whole time, so an update to a tile the client
+ * doesn't have yet can arrive before the tile does. Those updates are applied
+ * (to the blank cells) and also kept, and replayed over the tile once it
+ * arrives: the tile already has every update sent before it, so replaying
+ * them in order leaves each cell as the tile or the newest of them has it,
+ * and nothing that came first is lost under a tile that came later. The same
+ * goes for the client's own edits, which are kept until the server has them.
+ */
+#include "tiles.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "canvas.h"
+#include "interest.h"
+#include "proto.h"
+
+/* Split a num_rows x num_cols canvas into tiles of tile_sz x tile_sz cells,
+ * none of them received.
+ *
+ * Returned pointer should be freed with tiles_free.
+ */
+Tiles *tiles_new(int num_rows, int num_cols, int tile_sz) {
+  Tiles *t = calloc(1, sizeof(Tiles));
+  t->tile_sz = tile_sz;
+  t->num_rows = num_rows;
+  t->num_cols = num_cols;
+  t->rows = (num_rows + tile_sz - 1) / tile_sz;
+  t->cols = (num_cols + tile_sz - 1) / tile_sz;
+  t->left = t->rows * t->cols;
+  if ((t->have = calloc(t->left, sizeof(bool))) == NULL) {
+    perror("tiles malloc");
+    exit(1);
+  }
+  return t;
+}
+
+int tiles_count(const Tiles *t) { return t->rows * t->cols; }
+
+/* Returns: the cells of a tile (smaller than tile_sz at the bottom and right
+ * edges of the canvas)
+ */
+Rect tiles_rect(const Tiles *t, int tile) {
+  Rect r = {.y = tile / t->cols * t->tile_sz,
+            .x = tile % t->cols * t->tile_sz,
+            .h = t->tile_sz,
+            .w = t->tile_sz};
+  if (r.y + r.h > t->num_rows) {
+    r.h = t->num_rows - r.y;
+  }
+  if (r.x + r.w > t->num_cols) {
+    r.w = t->num_cols - r.x;
+  }
+  return r;
+}
+
+/* Cells between two rectangles, across or down, whichever is more (0 if they
+ * overlap) */
+static long rect_distance(Rect a, Rect b) {
+  long dy = 0, dx = 0;
+  if (a.y + a.h <= b.y) {
+    dy = b.y - (a.y + a.h) + 1;
+  } else if (b.y + b.h <= a.y) {
+    dy = a.y - (b.y + b.h) + 1;
+  }
+  if (a.x + a.w <= b.x) {
+    dx = b.x - (a.x + a.w) + 1;
+  } else if (b.x + b.w <= a.x) {
+    dx = a.x - (b.x + b.w) + 1;
+  }
+  return dy > dx ? dy : dx;
+}
+
+static int compare_keys(const void *a, const void *b) {
+  const uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+  return ka < kb ? -1 : ka > kb;
+}
+
+/* Fill order (with room for tiles_count) with every tile, the ones in view
+ * first and then by how far they are from it, top to bottom and left to right
+ * among tiles as far.
+ */
+void tiles_order(const Tiles *t, Rect view, int *order) {
+  const int n = tiles_count(t);
+  uint64_t *keys = malloc(n * sizeof(uint64_t));
+  if (keys == NULL) {
+    perror("tiles malloc");
+    exit(1);
+  }
+  for (int i = 0; i < n; i++) {
+    keys[i] = (uint64_t)rect_distance(tiles_rect(t, i), view) << 32 | i;
+  }
+  qsort(keys, n, sizeof(uint64_t), compare_keys);
+  for (int i = 0; i < n; i++) {
+    order[i] = (uint32_t)keys[i];
+  }
+  free(keys);
+}
+
+/* Returns: whether an op (inside the canvas) writes to a tile that hasn't been
+ * received
+ */
+static bool tiles_missing(const Tiles *t, const Op *op) {
+  const int sz = t->tile_sz;
+  for (int ty = op->y / sz; ty <= (op->y + op->h - 1) / sz; ty++) {
+    for (int tx = op->x / sz; tx <= (op->x + op->w - 1) / sz; tx++) {
+      if (!t->have[ty * t->cols + tx]) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/* Keep an op (clipped to the canvas) that was just applied, if it writes to
+ * tiles that haven't been received, to apply again over them once they are.
+ */
+void tiles_op(Tiles *t, const Op *op) {
+  if (t->left > 0 && tiles_missing(t, op)) {
+    proto_put_op(&t->pending, op);
+  }
+}
+
+/* Clip an op to a rectangle of the canvas. */
+static bool clip_to(Op *op, Rect r) {
+  op->y -= r.y;
+  op->x -= r.x;
+  const bool in = proto_clip_op(op, r.h, r.w);
+  op->y += r.y;
+  op->x += r.x;
+  return in;
+}
+
+/* Write a tile (a blit of exactly its cells) to the canvas, and the ops kept
+ * for it over it.
+ *
+ * Returns: the number of tiles left, or -1 if it isn't one of the tiles
+ */
+int tiles_receive(Tiles *t, Canvas *canvas, const Op *tile) {
+  if (tile->type != OP_BLIT || tile->y % t->tile_sz != 0 ||
+      tile->x % t->tile_sz != 0 || tile->y >= t->num_rows ||
+      tile->x >= t->num_cols) {
+    return -1;
+  }
+  const int i = tile->y / t->tile_sz * t->cols + tile->x / t->tile_sz;
+  const Rect r = tiles_rect(t, i);
+  if (tile->h != r.h || tile->w != r.w) {
+    return -1;
+  }
+  proto_apply_op(canvas, tile);
+  if (t->have[i]) {
+    return t->left;
+  }
+  t->have[i] = true;
+  t->left--;
+
+  // replay what came before it, and keep what's still needed for the rest
+  Frame_buf ops = t->pending;
+  t->pending = t->spare;
+  t->pending.len = 0;
+  const char *p = ops.data;
+  Op op;
+  while (ops.len > 0 && proto_next_op(&p, ops.data + ops.len, &op) == 1) {
+    Op in_tile = op;
+    if (clip_to(&in_tile, r)) {
+      proto_apply_op(canvas, &in_tile);
+    }
+    if (t->left > 0 && tiles_missing(t, &op)) {
+      proto_put_op(&t->pending, &op);
+    }
+  }
+  t->spare = ops;
+  if (t->left == 0) {
+    proto_buf_free(&t->pending);
+    proto_buf_free(&t->spare);
+  }
+  return t->left;
+}
+
+void tiles_free(Tiles *t) {
+  free(t->have);
+  proto_buf_free(&t->pending);
+  proto_buf_free(&t->spare);
+  free(t);
+}
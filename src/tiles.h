@@ -0,0 +1,31 @@
+#ifndef tiles_h
+#define tiles_h
+
+#include <stdbool.h>
+
+#include "canvas.h"
+#include "interest.h"
+#include "proto.h"
+
+/* A canvas split into square tiles, sent one at a time to a joining client,
+ * and which of them it has so far
+ */
+typedef struct {
+  int tile_sz;             // rows and columns of cells in a tile
+  int rows, cols;          // tiles down and across
+  int num_rows, num_cols;  // cells down and across
+  bool *have;              // by tile, received
+  int left;                // tiles not received yet
+  Frame_buf pending;       // ops touching tiles not received yet, encoded
+  Frame_buf spare;         // (swapped with pending while it's replayed)
+} Tiles;
+
+Tiles *tiles_new(int num_rows, int num_cols, int tile_sz);
+int tiles_count(const Tiles *t);
+Rect tiles_rect(const Tiles *t, int tile);
+void tiles_order(const Tiles *t, Rect view, int *order);
+void tiles_op(Tiles *t, const Op *op);
+int tiles_receive(Tiles *t, Canvas *canvas, const Op *tile);
+void tiles_free(Tiles *t);
+
+#endif
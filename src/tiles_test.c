@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "canvas.h"
+#include "lib/minunit.h"
+#include "proto.h"
+#include "tiles.h"
+
+static Tiles *tiles;
+static Canvas *server, *client;
+static Frame_buf buf;
+
+void test_setup(void) {
+  tiles = tiles_new(100, 250, 32);
+  server = canvas_new(100, 250);
+  client = canvas_new(100, 250);
+  memset(&buf, 0, sizeof(buf));
+}
+
+void test_teardown(void) {
+  tiles_free(tiles);
+  canvas_free(server);
+  canvas_free(client);
+  proto_buf_free(&buf);
+}
+
+/* Send the client tile i of the server's canvas as it is now.
+ *
+ * Returns: what tiles_receive does
+ */
+static int send_tile(int i) {
+  const Rect r = tiles_rect(tiles, i);
+  buf.len = 0;
+  proto_tile(&buf, server, r.y, r.x, r.h, r.w);
+  Op op;
+  if (!proto_read_tile(buf.data + PROTO_HEADER_SZ, buf.len - PROTO_HEADER_SZ,
+                       &op)) {
+    return -2;
+  }
+  return tiles_receive(tiles, client, &op);
+}
+
+/* Apply an op on the server, and send it to the client. */
+static void send_op(Op op) {
+  proto_clip_op(&op, server->num_rows, server->num_cols);
+  proto_apply_op(server, &op);
+  proto_apply_op(client, &op);
+  tiles_op(tiles, &op);
+}
+
+MU_TEST(test_tiles_layout) {
+  mu_assert_int_eq(4, tiles->rows);
+  mu_assert_int_eq(8, tiles->cols);
+  mu_assert_int_eq(32, tiles_count(tiles));
+  // the last row and column of tiles are cut short by the edges
+  const Rect r = tiles_rect(tiles, 31);
+  mu_assert_int_eq(96, r.y);
+  mu_assert_int_eq(224, r.x);
+  mu_assert_int_eq(4, r.h);
+  mu_assert_int_eq(26, r.w);
+}
+
+MU_TEST(test_tiles_order) {
+  int order[32];
+  // in view: the 2 x 2 tiles from (1, 2)
+  tiles_order(tiles, (Rect){.y = 40, .x = 70, .h = 40, .w = 40}, order);
+  const int in_view[] = {10, 11, 18, 19};
+  for (int i = 0; i < 4; i++) {
+    mu_assert_int_eq(in_view[i], order[i]);
+  }
+  // then the ring around them, and the far column last
+  mu_assert_int_eq(9, order[4]);
+  mu_assert_int_eq(31, order[31]);
+  // every tile once
+  int seen[32] = {0};
+  for (int i = 0; i < 32; i++) {
+    seen[order[i]]++;
+  }
+  for (int i = 0; i < 32; i++) {
+    mu_assert_int_eq(1, seen[i]);
+  }
+}
+
+MU_TEST(test_tiles_buffered) {
+  canvas_fill(server, '.');
+  canvas_fill(client, ' ');
+  mu_assert_int_eq(31, send_tile(0));
+  // updates to tile 1 before it arrives, one also writing to tile 0
+  send_op((Op){.type = OP_SPAN, .y = 5, .x = 30, .w = 4, .data = "abcd"});
+  send_op((Op){.type = OP_CELL, .y = 5, .x = 33, .ch = 'x'});
+  send_op((Op){.type = OP_CELL, .y = 5, .x = 30, .ch = 'y'});
+  // and one the client made, that the server hasn't seen yet when it sends it
+  const Op mine = {.type = OP_CELL, .y = 6, .x = 40, .h = 1, .w = 1,
+                   .ch = 'm'};
+  proto_apply_op(client, &mine);
+  tiles_op(tiles, &mine);
+  mu_assert_int_eq(30, send_tile(1));
+  mu_assert_int_eq('y', canvas_gcharyx(client, 5, 30));
+  mu_assert_int_eq('b', canvas_gcharyx(client, 5, 31));
+  mu_assert_int_eq('c', canvas_gcharyx(client, 5, 32));
+  mu_assert_int_eq('x', canvas_gcharyx(client, 5, 33));
+  mu_assert_int_eq('.', canvas_gcharyx(client, 5, 34));
+  mu_assert_int_eq('m', canvas_gcharyx(client, 6, 40));
+  // nothing in the rest is kept any more
+  mu_assert_int_eq(0, tiles->pending.len);
+  for (int i = 2; i < 32; i++) {
+    send_tile(i);
+  }
+  proto_apply_op(server, &mine);
+  mu_check(canvas_eq(server, client));
+}
+
+MU_TEST(test_tiles_done) {
+  send_op((Op){.type = OP_RECT, .y = 0, .x = 0, .h = 100, .w = 250, .ch = 'a'});
+  for (int i = 31; i >= 0; i--) {
+    mu_assert_int_eq(i, send_tile(i));
+  }
+  mu_check(canvas_eq(server, client));
+  // once the client has everything, nothing is kept
+  mu_assert_int_eq(0, tiles->left);
+  mu_check(tiles->pending.data == NULL);
+  send_op((Op){.type = OP_CELL, .y = 1, .x = 1, .ch = 'b'});
+  mu_check(tiles->pending.data == NULL);
+  // tiles again are still applied, but not counted
+  mu_assert_int_eq(0, send_tile(3));
+}
+
+MU_TEST(test_tiles_malformed) {
+  Op op = {.type = OP_BLIT, .y = 32, .x = 33, .h = 32, .w = 32,
+           .data = server->rows[0], .stride = 250};
+  mu_assert_int_eq(-1, tiles_receive(tiles, client, &op));
+  op.x = 32;
+  op.w = 31;
+  mu_assert_int_eq(-1, tiles_receive(tiles, client, &op));
+  op.y = 128;
+  op.w = 32;
+  mu_assert_int_eq(-1, tiles_receive(tiles, client, &op));
+  mu_assert_int_eq(32, tiles->left);
+}
+
+MU_TEST_SUITE(tiles_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_tiles_layout);
+  MU_RUN_TEST(test_tiles_order);
+  MU_RUN_TEST(test_tiles_buffered);
+  MU_RUN_TEST(test_tiles_done);
+  MU_RUN_TEST(test_tiles_malformed);
+}
+
+int main(int argc, char const *argv[]) {
+  MU_RUN_SUITE(tiles_main);
+  MU_REPORT();
+  return minunit_status;
+}
@@ -0,0 +1,301 @@
+/* io_uring without liburing
+ *
+ * The rings are set up with the io_uring_setup and io_uring_enter system
+ * calls and mapped into memory: submissions are written to the submission
+ * ring and handed to the kernel with one io_uring_enter, however many there
+ * are, and completions are read off the completion ring without any system
+ * call at all. Only what the server needs is here:
+ *
+ * - multishot accept and recv, which keep completing (with IORING_CQE_F_MORE
+ *   set) until they fail or are cancelled, so a connection is armed once
+ *   instead of once per read
+ * - a registered ring of buffers (IORING_REGISTER_PBUF_RING) that recvs pick
+ *   from as data arrives, so idle connections don't each hold one
+ * - sendmsg, read and cancel
+ *
+ * Rings are set up with IORING_SETUP_SINGLE_ISSUER and
+ * IORING_SETUP_DEFER_TASKRUN (Linux 6.1), which lets the kernel skip locking
+ * and only run completion work when the owner waits. Those are newer than
+ * multishot recv (6.0), so if a ring can be set up at all everything here
+ * works; uring_supported checks that once, for falling back to epoll.
+ */
+#include "uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SETUP_FLAGS (IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN)
+
+static int enter(Uring *u, unsigned to_submit, unsigned min_complete,
+                 unsigned flags, void *arg, size_t arg_sz) {
+  u->enters++;
+  return syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete, flags,
+                 arg, arg_sz);
+}
+
+/* Check whether rings (and buffer rings) can be set up here, which can't be
+ * on older kernels, or where io_uring is disabled or filtered out.
+ */
+bool uring_supported() {
+  Uring u;
+  if (uring_init(&u, 4) < 0) {
+    return false;
+  }
+  const bool ok = uring_setup_buffers(&u, 0, 2, 64) == 0;
+  uring_free(&u);
+  return ok;
+}
+
+/* Set up a ring with room for entries submissions (a power of 2).
+ *
+ * Call from the thread that will use it.
+ *
+ * Returns: 0 on success, -1 (with errno set) otherwise
+ */
+int uring_init(Uring *u, unsigned entries) {
+  memset(u, 0, sizeof(Uring));
+  struct io_uring_params p = {.flags = SETUP_FLAGS};
+  u->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (u->fd < 0) {
+    return -1;
+  }
+  u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  // both rings are usually in one mapping
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_ring_sz > u->sq_ring_sz) {
+      u->sq_ring_sz = u->cq_ring_sz;
+    }
+    u->cq_ring_sz = 0;
+  }
+  u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  u->cq_ring = u->sq_ring;
+  if (u->sq_ring != MAP_FAILED && u->cq_ring_sz > 0) {
+    u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+  }
+  u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED ||
+      u->sqes == MAP_FAILED) {
+    const int err = errno;
+    uring_free(u);
+    errno = err;
+    return -1;
+  }
+  char *sq = u->sq_ring, *cq = u->cq_ring;
+  u->sq_head = (_Atomic unsigned *)(sq + p.sq_off.head);
+  u->sq_tail = (_Atomic unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_entries = p.sq_entries;
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+  u->cq_head = (_Atomic unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (_Atomic unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+}
+
+/* Register count buffers of size bytes (count a power of 2) as buffer group
+ * group, for recvs to pick from.
+ *
+ * Returns: 0 on success, -1 (with errno set) otherwise
+ */
+int uring_setup_buffers(Uring *u, uint16_t group, unsigned count,
+                        unsigned size) {
+  const size_t ring_sz = count * sizeof(struct io_uring_buf);
+  u->bufs_sz = ring_sz + (size_t)count * size;
+  void *mem = mmap(NULL, u->bufs_sz, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    u->bufs_sz = 0;
+    return -1;
+  }
+  u->bufs = mem;
+  u->buf_data = (char *)mem + ring_sz;
+  u->buf_count = count;
+  u->buf_sz = size;
+  struct io_uring_buf_reg reg = {
+      .ring_addr = (uint64_t)(uintptr_t)mem,
+      .ring_entries = count,
+      .bgid = group,
+  };
+  if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg,
+              1) < 0) {
+    return -1;
+  }
+  for (unsigned i = 0; i < count; i++) {
+    uring_buffer_done(u, i);
+  }
+  return 0;
+}
+
+/* Tear down a ring, cancelling anything still in flight.
+ */
+void uring_free(Uring *u) {
+  if (u->bufs_sz > 0) {
+    munmap(u->bufs, u->bufs_sz);
+  }
+  if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+    munmap(u->sqes, u->sqes_sz);
+  }
+  if (u->cq_ring_sz > 0 && u->cq_ring != NULL && u->cq_ring != MAP_FAILED) {
+    munmap(u->cq_ring, u->cq_ring_sz);
+  }
+  if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED) {
+    munmap(u->sq_ring, u->sq_ring_sz);
+  }
+  if (u->fd >= 0) {
+    close(u->fd);
+  }
+  memset(u, 0, sizeof(Uring));
+  u->fd = -1;
+}
+
+/* Get a cleared submission to fill in, submitting the ones before it first if
+ * the ring is full.
+ *
+ * It's submitted by the next uring_wait.
+ */
+struct io_uring_sqe *uring_sqe(Uring *u) {
+  unsigned tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+  if (tail - atomic_load_explicit(u->sq_head, memory_order_acquire) ==
+      u->sq_entries) {
+    enter(u, u->sq_queued, 0, 0, NULL, 0);
+    u->sq_queued = 0;
+  }
+  const unsigned i = tail & u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[i] = i;
+  atomic_store_explicit(u->sq_tail, tail + 1, memory_order_release);
+  u->sq_queued++;
+  return sqe;
+}
+
+/* Submit everything prepared so far and wait for at least one completion, or
+ * for timeout_ms (forever if negative), all in one system call.
+ *
+ * Returns: 0, or -1 (with errno set) if interrupted or timed out
+ */
+int uring_wait(Uring *u, int timeout_ms) {
+  struct __kernel_timespec ts = {
+      .tv_sec = timeout_ms / 1000,
+      .tv_nsec = (timeout_ms % 1000) * 1000000L,
+  };
+  struct io_uring_getevents_arg arg = {.ts = (uint64_t)(uintptr_t)&ts};
+  const unsigned to_submit = u->sq_queued;
+  u->sq_queued = 0;
+  const int res =
+      timeout_ms < 0
+          ? enter(u, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, _NSIG / 8)
+          : enter(u, to_submit, 1,
+                  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                  sizeof(arg));
+  return res < 0 ? -1 : 0;
+}
+
+/* Get the next completion, or NULL if there are none waiting.
+ *
+ * Mark it handled with uring_cqe_done.
+ */
+struct io_uring_cqe *uring_cqe(Uring *u) {
+  const unsigned head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+  if (head == atomic_load_explicit(u->cq_tail, memory_order_acquire)) {
+    return NULL;
+  }
+  return &u->cqes[head & u->cq_mask];
+}
+
+void uring_cqe_done(Uring *u) {
+  const unsigned head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+  atomic_store_explicit(u->cq_head, head + 1, memory_order_release);
+}
+
+/* Get the buffer a recv completion picked (its flags >>
+ * IORING_CQE_BUFFER_SHIFT).
+ */
+char *uring_buffer(Uring *u, unsigned id) {
+  return u->buf_data + (size_t)id * u->buf_sz;
+}
+
+/* Give a buffer back for recvs to use again.
+ */
+void uring_buffer_done(Uring *u, unsigned id) {
+  struct io_uring_buf *buf = &u->bufs->bufs[u->buf_tail & (u->buf_count - 1)];
+  buf->addr = (uint64_t)(uintptr_t)uring_buffer(u, id);
+  buf->len = u->buf_sz;
+  buf->bid = id;
+  u->buf_tail++;
+  atomic_store_explicit((_Atomic uint16_t *)&u->bufs->tail, u->buf_tail,
+                        memory_order_release);
+}
+
+/* Accept connections on a listening socket until cancelled, each as
+ * non-blocking.
+ */
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t data) {
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = data;
+}
+
+/* Receive from a socket into buffers from group until it closes, fails or is
+ * cancelled.
+ */
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, uint16_t group,
+                     uint64_t data) {
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = group;
+  sqe->user_data = data;
+}
+
+/* Send the iovecs of msg, which must stay put until it completes.
+ */
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                        const struct msghdr *msg, uint64_t data) {
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = data;
+}
+
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf,
+                     unsigned len, uint64_t data) {
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = -1;  // the current position, for things that aren't files
+  sqe->user_data = data;
+}
+
+/* Cancel the submission with user_data target (all of a multishot one's
+ * completions).
+ */
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target,
+                       uint64_t data) {
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = data;
+}
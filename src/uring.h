@@ -0,0 +1,63 @@
+#ifndef uring_h
+#define uring_h
+
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* An io_uring: a ring of submissions and a ring of completions shared with
+ * the kernel, plus a ring of buffers it fills with received data.
+ *
+ * Only touch one from a single thread (it's set up with
+ * IORING_SETUP_SINGLE_ISSUER).
+ */
+typedef struct {
+  int fd;
+  // submissions
+  _Atomic unsigned *sq_head, *sq_tail;
+  unsigned sq_mask, sq_entries;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_queued;  // prepared but not yet submitted
+  // completions
+  _Atomic unsigned *cq_head, *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  // buffers for multishot recvs
+  struct io_uring_buf_ring *bufs;
+  char *buf_data;
+  unsigned buf_count, buf_sz;
+  uint16_t buf_tail;
+  // mappings, to undo them
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_sz, cq_ring_sz, sqes_sz, bufs_sz;
+  long enters;  // io_uring_enter calls made
+} Uring;
+
+bool uring_supported();
+int uring_init(Uring *u, unsigned entries);
+int uring_setup_buffers(Uring *u, uint16_t group, unsigned count, unsigned size);
+void uring_free(Uring *u);
+
+struct io_uring_sqe *uring_sqe(Uring *u);
+int uring_wait(Uring *u, int timeout_ms);
+struct io_uring_cqe *uring_cqe(Uring *u);
+void uring_cqe_done(Uring *u);
+
+char *uring_buffer(Uring *u, unsigned id);
+void uring_buffer_done(Uring *u, unsigned id);
+
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t data);
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, uint16_t group,
+                     uint64_t data);
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                        const struct msghdr *msg, uint64_t data);
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf,
+                     unsigned len, uint64_t data);
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target,
+                       uint64_t data);
+
+#endif
@@ -0,0 +1,193 @@
+/* Benchmark of broadcasting a frame to many sockets: what the io_uring reactor
+ * saves over the epoll one
+ *
+ * A FRAME_SZ byte frame is sent to N loopback TCP connections over and over
+ * for a second, the way a worker's tick goes out to everyone in a room, with
+ * another thread reading the other ends. Each way of sending prints its
+ * broadcasts per second, system calls per broadcast and CPU time (user +
+ * system, of the sending thread) per broadcast:
+ *
+ * - write: one write() per socket, as the epoll reactor flushes
+ * - uring: one sendmsg per socket prepared and submitted with one
+ *   io_uring_enter, as the io_uring reactor flushes
+ *
+ * Run with `make .run-uring_bench.c`, or `make bench` for all benchmarks.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define FRAME_SZ 64
+#define MAX_CONNS 256
+
+static int senders[MAX_CONNS], receivers[MAX_CONNS];
+static _Atomic bool done;
+
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* CPU time the calling thread has used, in seconds */
+static double cpu() {
+  struct rusage r;
+  getrusage(RUSAGE_THREAD, &r);
+  return r.ru_utime.tv_sec + r.ru_utime.tv_usec * 1e-6 + r.ru_stime.tv_sec +
+         r.ru_stime.tv_usec * 1e-6;
+}
+
+/* Connect n pairs of loopback sockets.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int connect_pairs(int n) {
+  int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  socklen_t len = sizeof(addr);
+  if (listenfd == -1 ||
+      bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listenfd, n) == -1 ||
+      getsockname(listenfd, (struct sockaddr *)&addr, &len) == -1) {
+    perror("listen");
+    return -1;
+  }
+  const int one = 1;
+  for (int i = 0; i < n; i++) {
+    receivers[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (connect(receivers[i], (struct sockaddr *)&addr, sizeof(addr)) == -1 &&
+        errno != EINPROGRESS) {
+      perror("connect");
+      return -1;
+    }
+    if ((senders[i] = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) == -1) {
+      perror("accept");
+      return -1;
+    }
+    setsockopt(senders[i], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  close(listenfd);
+  return 0;
+}
+
+static void close_pairs(int n) {
+  for (int i = 0; i < n; i++) {
+    close(senders[i]);
+    close(receivers[i]);
+  }
+}
+
+/* Read everything the receivers get until done is set */
+static void *drain(void *arg) {
+  const int n = *(int *)arg;
+  const int epollfd = epoll_create1(0);
+  for (int i = 0; i < n; i++) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = receivers[i]};
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, receivers[i], &ev);
+  }
+  char buf[1 << 16];
+  struct epoll_event events[64];
+  while (!done) {
+    const int ready = epoll_wait(epollfd, events, 64, 10);
+    for (int i = 0; i < ready; i++) {
+      while (read(events[i].data.fd, buf, sizeof(buf)) > 0) {
+      }
+    }
+  }
+  close(epollfd);
+  return NULL;
+}
+
+/* Print what sending broadcasts frames cost. */
+static void report(const char *name, int n, long broadcasts, long calls,
+                   double seconds, double cpu_seconds) {
+  printf("%-6s %4d sockets: %9.0f broadcasts/s, %7.2f syscalls and %6.2f "
+         "us CPU per broadcast\n",
+         name, n, broadcasts / seconds, (double)calls / broadcasts,
+         cpu_seconds * 1e6 / broadcasts);
+}
+
+static void run_write(int n) {
+  char frame[FRAME_SZ];
+  memset(frame, 'x', sizeof(frame));
+  long broadcasts = 0, calls = 0;
+  const double start = now(), start_cpu = cpu();
+  while (now() - start < 1.0) {
+    for (int i = 0; i < n; i++) {
+      write(senders[i], frame, sizeof(frame));
+      calls++;
+    }
+    broadcasts++;
+  }
+  report("write", n, broadcasts, calls, now() - start, cpu() - start_cpu);
+}
+
+static void run_uring(int n) {
+  Uring u;
+  if (uring_init(&u, MAX_CONNS * 2) == -1) {
+    perror("io_uring_setup");
+    return;
+  }
+  char frame[FRAME_SZ];
+  memset(frame, 'x', sizeof(frame));
+  struct iovec iov = {frame, sizeof(frame)};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  long broadcasts = 0;
+  const double start = now(), start_cpu = cpu();
+  while (now() - start < 1.0) {
+    for (int i = 0; i < n; i++) {
+      uring_prep_sendmsg(uring_sqe(&u), senders[i], &msg, i);
+    }
+    // every send has to finish before the frame could be reused
+    for (int left = n; left > 0;) {
+      if (uring_cqe(&u) == NULL) {
+        uring_wait(&u, -1);
+        continue;
+      }
+      uring_cqe_done(&u);
+      left--;
+    }
+    broadcasts++;
+  }
+  report("uring", n, broadcasts, u.enters, now() - start, cpu() - start_cpu);
+  uring_free(&u);
+}
+
+int main(int argc, char const *argv[]) {
+  if (!uring_supported()) {
+    printf("io_uring isn't available here, only timing write()\n");
+  }
+  const int sizes[] = {1, 16, 256};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    int n = sizes[i];
+    if (connect_pairs(n) == -1) {
+      return 1;
+    }
+    done = false;
+    pthread_t drainer;
+    pthread_create(&drainer, NULL, drain, &n);
+    run_write(n);
+    if (uring_supported()) {
+      run_uring(n);
+    }
+    done = true;
+    pthread_join(drainer, NULL);
+    close_pairs(n);
+  }
+  return 0;
+}
@@ -0,0 +1,175 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "lib/minunit.h"
+#include "uring.h"
+
+#define NUM_PAIRS 8
+
+static Uring u;
+static int pairs[NUM_PAIRS][2];
+// what completions said, copied out of the ring
+static struct {
+  uint64_t user_data;
+  int32_t res;
+  uint32_t flags;
+} cqes[16];
+
+void test_setup(void) {
+  if (uring_init(&u, 16) == 0) {
+    uring_setup_buffers(&u, 1, 4, 64);
+  }
+  for (int i = 0; i < NUM_PAIRS; i++) {
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]);
+  }
+}
+
+void test_teardown(void) {
+  uring_free(&u);
+  for (int i = 0; i < NUM_PAIRS; i++) {
+    close(pairs[i][0]);
+    close(pairs[i][1]);
+  }
+}
+
+/* Submit what's prepared and copy out the next n completions.
+ */
+static void collect(int n) {
+  for (int got = 0; got < n;) {
+    struct io_uring_cqe *cqe;
+    if ((cqe = uring_cqe(&u)) == NULL) {
+      mu_check(uring_wait(&u, 1000) == 0);
+      continue;
+    }
+    cqes[got].user_data = cqe->user_data;
+    cqes[got].res = cqe->res;
+    cqes[got++].flags = cqe->flags;
+    uring_cqe_done(&u);
+  }
+}
+
+MU_TEST(test_uring_recv_multishot) {
+  if (!uring_supported()) {
+    return;
+  }
+  uring_prep_recv(uring_sqe(&u), pairs[0][0], 1, 42);
+  write(pairs[0][1], "hello", 5);
+  collect(1);
+  mu_assert_int_eq(42, cqes[0].user_data);
+  mu_assert_int_eq(5, cqes[0].res);
+  mu_check(cqes[0].flags & IORING_CQE_F_MORE);
+  mu_check(cqes[0].flags & IORING_CQE_F_BUFFER);
+  unsigned id = cqes[0].flags >> IORING_CQE_BUFFER_SHIFT;
+  mu_check(memcmp(uring_buffer(&u, id), "hello", 5) == 0);
+  uring_buffer_done(&u, id);
+
+  // the same recv keeps going, through more reads than there are buffers
+  for (int i = 0; i < 6; i++) {
+    write(pairs[0][1], "world", 5);
+    collect(1);
+    mu_assert_int_eq(5, cqes[0].res);
+    mu_check(cqes[0].flags & IORING_CQE_F_MORE);
+    id = cqes[0].flags >> IORING_CQE_BUFFER_SHIFT;
+    mu_check(memcmp(uring_buffer(&u, id), "world", 5) == 0);
+    uring_buffer_done(&u, id);
+  }
+
+  // until the other end hangs up
+  close(pairs[0][1]);
+  pairs[0][1] = -1;
+  collect(1);
+  mu_assert_int_eq(0, cqes[0].res);
+  mu_check(!(cqes[0].flags & IORING_CQE_F_MORE));
+}
+
+MU_TEST(test_uring_cancel) {
+  if (!uring_supported()) {
+    return;
+  }
+  uring_prep_recv(uring_sqe(&u), pairs[0][0], 1, 7);
+  uring_prep_cancel(uring_sqe(&u), 7, 8);
+  collect(2);
+  for (int i = 0; i < 2; i++) {
+    if (cqes[i].user_data == 7) {
+      mu_assert_int_eq(-ECANCELED, cqes[i].res);
+      mu_check(!(cqes[i].flags & IORING_CQE_F_MORE));
+    } else {
+      mu_assert_int_eq(0, cqes[i].res);
+    }
+  }
+}
+
+MU_TEST(test_uring_send_batch) {
+  if (!uring_supported()) {
+    return;
+  }
+  // one frame to many sockets, with one system call
+  char frame[] = "broadcast";
+  struct iovec iov = {frame, sizeof(frame)};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  for (int i = 0; i < NUM_PAIRS; i++) {
+    uring_prep_sendmsg(uring_sqe(&u), pairs[i][0], &msg, i);
+  }
+  const long enters = u.enters;
+  collect(NUM_PAIRS);
+  mu_assert_int_eq(1, u.enters - enters);
+  for (int i = 0; i < NUM_PAIRS; i++) {
+    mu_assert_int_eq(sizeof(frame), cqes[i].res);
+    char buf[32];
+    mu_assert_int_eq(sizeof(frame), read(pairs[i][1], buf, sizeof(buf)));
+    mu_assert_string_eq(frame, buf);
+  }
+}
+
+MU_TEST(test_uring_accept_multishot) {
+  if (!uring_supported()) {
+    return;
+  }
+  int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  socklen_t len = sizeof(addr);
+  bind(listenfd, (struct sockaddr *)&addr, sizeof(addr));
+  listen(listenfd, 8);
+  getsockname(listenfd, (struct sockaddr *)&addr, &len);
+  uring_prep_accept(uring_sqe(&u), listenfd, 3);
+  int conns[3];
+  for (int i = 0; i < 3; i++) {
+    conns[i] = socket(AF_INET, SOCK_STREAM, 0);
+    mu_check(connect(conns[i], (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  }
+  collect(3);
+  for (int i = 0; i < 3; i++) {
+    mu_assert_int_eq(3, cqes[i].user_data);
+    mu_check(cqes[i].res >= 0);
+    mu_check(cqes[i].flags & IORING_CQE_F_MORE);
+    close(cqes[i].res);
+    close(conns[i]);
+  }
+  close(listenfd);
+}
+
+MU_TEST_SUITE(uring_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_uring_recv_multishot);
+  MU_RUN_TEST(test_uring_cancel);
+  MU_RUN_TEST(test_uring_send_batch);
+  MU_RUN_TEST(test_uring_accept_multishot);
+}
+
+int main(int argc, char const *argv[]) {
+  if (!uring_supported()) {
+    printf("io_uring isn't available here, skipping its tests\n");
+  }
+  MU_RUN_SUITE(uring_main);
+  MU_REPORT();
+  return minunit_status;
+}
@@ -5,41 +5,15 @@
 
 #include <ncurses.h>
 
+#include "log.h"
+
 // printf to stderr
 #define eprintf(...) fprintf(stderr, __VA_ARGS__)
 
 // LOGGING
-// techniques for preventing unused variables/function warnings based on zf_log:
-// https://github.com/wonder-mice/zf_log/
-
-/* Dummy function that does nothing with variadic args.
- *
- * Static b/c it shouldn't be used directly anywhere outside of this header.
- * Inline b/c it fixes the "defined but not used" warning, and it will be called
- * many times to do nothing.
- * https://stackoverflow.com/a/2765211
- * https://stackoverflow.com/q/2845748
- * https://stackoverflow.com/a/1932371
- * https://stackoverflow.com/q/7762731
- */
-static inline void _log_unused(const int dummy, ...) {
-  (void)dummy;
-}
-
-#ifdef DEBUG
-// log to stderr if DEBUG is defined
-#define logd(...) eprintf(__VA_ARGS__)
-#else
-// empty macro to "trick" compiler into thinking the arguments to logd are used
-// even when it is ignored, preventing "unused variable" warning
-#define _LOG_UNUSED(...)         \
-  do {                           \
-    _log_unused(0, __VA_ARGS__); \
-  } while (0)
-
-// print nothing if DEBUG isn't defined
-#define logd(...) _LOG_UNUSED(__VA_ARGS__)
-#endif
+// through log.c: written out by a background thread, and compiled out unless
+// DEBUG is defined (or LOG_LEVEL is set to LOG_DEBUG)
+#define logd(...) log_debug(__VA_ARGS__)
 
 // min/max macros
 // from https://stackoverflow.com/questions/3437404/min-and-max-in-c
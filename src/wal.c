@@ -0,0 +1,414 @@
+/* Write-ahead log and checkpoints of a canvas
+ *
+ * Every op applied to the canvas is appended to the log as a record:
+ *
+ *   u32 length | u32 crc32 | u64 version | op
+ *
+ * where the length and checksum cover the version and op, and the op is
+ * encoded like in an ops frame (see proto.c). Integers are in network byte
+ * order.
+ *
+ * Records are collected in memory and written and synced to disk together
+ * (group commit): once sync_ops of them are waiting, or the oldest has waited
+ * sync_ms, so a sync is shared by every op in between instead of paid for
+ * each one. A crash loses at most the ops that were waiting.
+ *
+ * A checkpoint is the whole canvas at some version, stored as its raw cells:
+ *
+ *   "CLCKPT01" | u64 version | u32 rows | u32 cols | u32 crc32 | cells
+ *
+ * which loads with a read per row. Once a checkpoint is safely on disk the
+ * log can be emptied, since it holds nothing newer. Recovering a canvas is
+ * loading its latest checkpoint, and replaying the records in the log that
+ * came after it.
+ *
+ * A record or checkpoint that was only partly written when the machine went
+ * down fails its length or checksum, and is ignored: the log is cut back to
+ * the last whole record.
+ */
+#include "wal.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "canvas.h"
+#include "proto.h"
+
+#define RECORD_HEADER_SZ 16  // length, checksum and version
+#define MIN_OP_SZ 6          // bytes of the smallest op, a cell
+#define CHECKPOINT_MAGIC "CLCKPT01"
+#define CHECKPOINT_HEADER_SZ 28
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+/* Continue a CRC-32 over n more bytes, starting from 0.
+ */
+static uint32_t crc32(uint32_t crc, const void *bytes, size_t n) {
+  pthread_once(&crc_once, crc_init);
+  const unsigned char *p = bytes;
+  crc = ~crc;
+  for (size_t i = 0; i < n; i++) {
+    crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static void write_u32(char *p, uint32_t n) {
+  n = htonl(n);
+  memcpy(p, &n, 4);
+}
+
+static uint32_t read_u32(const char *p) {
+  uint32_t n;
+  memcpy(&n, p, 4);
+  return ntohl(n);
+}
+
+static void write_u64(char *p, uint64_t n) {
+  write_u32(p, n >> 32);
+  write_u32(p + 4, n);
+}
+
+static uint64_t read_u64(const char *p) {
+  return (uint64_t)read_u32(p) << 32 | read_u32(p + 4);
+}
+
+/* Write all n bytes, retrying short writes.
+ *
+ * Returns: 0 on success, -1 on errors
+ */
+static int write_all(int fd, const char *bytes, size_t n) {
+  while (n > 0) {
+    ssize_t written = write(fd, bytes, n);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    bytes += written;
+    n -= written;
+  }
+  return 0;
+}
+
+/* Open the log at path for appending, making it if it doesn't exist.
+ *
+ * Ops are synced once sync_ops are waiting, or when wal_commit finds the
+ * oldest has waited sync_ms.
+ *
+ * Returns: the log, to be freed with wal_close, or NULL on errors
+ */
+Wal *wal_open(const char *path, int sync_ms, int sync_ops) {
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || lseek(fd, 0, SEEK_END) < 0) {
+    close(fd);
+    return NULL;
+  }
+  Wal *wal = malloc(sizeof(Wal));
+  if (wal == NULL) {
+    perror("wal malloc");
+    exit(1);
+  }
+  wal->fd = fd;
+  wal->pending = (Frame_buf){0};
+  wal->size = st.st_size;
+  wal->sync_ms = sync_ms;
+  wal->sync_ops = sync_ops;
+  wal->unsynced = 0;
+  wal->unsynced_since = -1;
+  wal->syncs = 0;
+  return wal;
+}
+
+/* Replay the records of a freshly opened log that are newer than version
+ * after onto a canvas, and cut off anything after the last whole record.
+ *
+ * *version is raised to the version of the newest record replayed.
+ *
+ * Returns: the number of ops replayed, or -1 if the log couldn't be read
+ */
+long wal_recover(Wal *wal, uint64_t after, Canvas *canvas, uint64_t *version) {
+  char *data = malloc(wal->size + 1);
+  if (data == NULL) {
+    perror("wal malloc");
+    exit(1);
+  }
+  size_t len = 0;
+  while (len < wal->size) {
+    ssize_t n = pread(wal->fd, data + len, wal->size - len, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      free(data);
+      return -1;
+    }
+    len += n;
+  }
+
+  long replayed = 0;
+  size_t off = 0;
+  while (off + RECORD_HEADER_SZ <= len) {
+    const char *rec = data + off;
+    const uint32_t rec_len = read_u32(rec);
+    if (rec_len < RECORD_HEADER_SZ - 8 + MIN_OP_SZ ||
+        rec_len > len - off - 8 ||
+        crc32(0, rec + 8, rec_len) != read_u32(rec + 4)) {
+      break;  // torn or damaged: nothing after it can be trusted
+    }
+    const uint64_t v = read_u64(rec + 8);
+    const char *p = rec + RECORD_HEADER_SZ;
+    const char *end = rec + 8 + rec_len;
+    Op op;
+    if (proto_next_op(&p, end, &op) != 1 || p != end) {
+      break;
+    }
+    if (v > after &&
+        proto_clip_op(&op, canvas->num_rows, canvas->num_cols)) {
+      proto_apply_op(canvas, &op);
+      replayed++;
+    }
+    if (v > *version) {
+      *version = v;
+    }
+    off += 8 + rec_len;
+  }
+  free(data);
+
+  if (off < wal->size) {
+    if (ftruncate(wal->fd, off) < 0) {
+      return -1;
+    }
+    wal->size = off;
+  }
+  if (lseek(wal->fd, off, SEEK_SET) < 0) {
+    return -1;
+  }
+  return replayed;
+}
+
+/* Add an op that brought the canvas to version to the log.
+ *
+ * It's written with the next sync, which happens right away if it makes
+ * sync_ops waiting.
+ */
+void wal_append(Wal *wal, uint64_t version, const Op *op) {
+  Frame_buf *buf = &wal->pending;
+  const size_t start = buf->len;
+  proto_buf_reserve(buf, RECORD_HEADER_SZ);
+  buf->len += RECORD_HEADER_SZ;
+  proto_put_op(buf, op);
+  char *rec = buf->data + start;
+  const size_t rec_len = buf->len - start - 8;
+  write_u32(rec, rec_len);
+  write_u64(rec + 8, version);
+  write_u32(rec + 4, crc32(0, rec + 8, rec_len));
+  wal->size += buf->len - start;
+  if (++wal->unsynced >= wal->sync_ops) {
+    wal_sync(wal);
+  }
+}
+
+/* Sync the log if the ops waiting have waited sync_ms, counting from the
+ * first call that saw them.
+ *
+ * Returns: whether there are still ops waiting
+ */
+bool wal_commit(Wal *wal, int64_t now_ms) {
+  if (wal->unsynced == 0) {
+    return false;
+  }
+  if (wal->unsynced_since < 0) {
+    wal->unsynced_since = now_ms;
+  }
+  if (now_ms - wal->unsynced_since < wal->sync_ms) {
+    return true;
+  }
+  wal_sync(wal);
+  return false;
+}
+
+/* Write the ops waiting to the log and wait for them to reach the disk.
+ *
+ * A write that fails partway is cut off again, so the retry doesn't land after
+ * a torn record that recovery would stop at.
+ *
+ * Returns: 0 on success, -1 on errors (the ops are kept to try again)
+ */
+int wal_sync(Wal *wal) {
+  if (wal->pending.len > 0) {
+    const off_t start = wal->size - wal->pending.len;
+    if (lseek(wal->fd, start, SEEK_SET) < 0 ||
+        write_all(wal->fd, wal->pending.data, wal->pending.len) < 0) {
+      perror("wal write");
+      if (ftruncate(wal->fd, start) < 0) {
+        perror("wal truncate");
+      }
+      return -1;
+    }
+    wal->pending.len = 0;
+  }
+  if (fdatasync(wal->fd) < 0) {
+    perror("wal sync");
+    return -1;
+  }
+  wal->unsynced = 0;
+  wal->unsynced_since = -1;
+  wal->syncs++;
+  return 0;
+}
+
+/* Empty the log, once a checkpoint holds everything in it, including the ops
+ * still waiting.
+ *
+ * Returns: 0 on success, -1 on errors
+ */
+int wal_truncate(Wal *wal) {
+  wal->pending.len = 0;
+  wal->unsynced = 0;
+  wal->unsynced_since = -1;
+  if (ftruncate(wal->fd, 0) < 0 || lseek(wal->fd, 0, SEEK_SET) < 0) {
+    return -1;
+  }
+  wal->size = 0;
+  return 0;
+}
+
+/* Sync and close a log.
+ */
+void wal_close(Wal *wal) {
+  if (wal->unsynced > 0) {
+    wal_sync(wal);
+  }
+  close(wal->fd);
+  proto_buf_free(&wal->pending);
+  free(wal);
+}
+
+/* Wait for a file's directory entry to reach the disk.
+ */
+static int sync_dir(const char *path) {
+  char copy[PATH_MAX];
+  snprintf(copy, sizeof(copy), "%s", path);
+  int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  int res = fsync(fd);
+  close(fd);
+  return res;
+}
+
+/* Save a canvas at version as a checkpoint at path.
+ *
+ * It's written and synced next to the old checkpoint and then moved over it,
+ * so there's always a whole one on disk.
+ *
+ * Returns: 0 on success, -1 on errors (with errno set)
+ */
+int checkpoint_write(const char *path, Canvas *canvas, uint64_t version) {
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL) {
+    return -1;
+  }
+  uint32_t crc = 0;
+  for (int y = 0; y < canvas->num_rows; y++) {
+    crc = crc32(crc, canvas->rows[y], canvas->num_cols);
+  }
+  char header[CHECKPOINT_HEADER_SZ];
+  memcpy(header, CHECKPOINT_MAGIC, 8);
+  write_u64(header + 8, version);
+  write_u32(header + 16, canvas->num_rows);
+  write_u32(header + 20, canvas->num_cols);
+  write_u32(header + 24, crc);
+  bool ok = fwrite(header, sizeof(header), 1, f) == 1;
+  for (int y = 0; ok && y < canvas->num_rows; y++) {
+    ok = fwrite(canvas->rows[y], canvas->num_cols, 1, f) == 1;
+  }
+  ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp, path) < 0) {
+    int err = errno;
+    unlink(tmp);
+    errno = err;
+    return -1;
+  }
+  return sync_dir(path);
+}
+
+/* Read a checkpoint's header and cells from f.
+ *
+ * Returns: the canvas, or NULL if it's damaged
+ */
+static Canvas *read_checkpoint(FILE *f, uint64_t *version) {
+  char header[CHECKPOINT_HEADER_SZ];
+  if (fread(header, sizeof(header), 1, f) != 1 ||
+      memcmp(header, CHECKPOINT_MAGIC, 8) != 0) {
+    return NULL;
+  }
+  const uint32_t rows = read_u32(header + 16), cols = read_u32(header + 20);
+  if (rows == 0 || cols == 0 || rows > UINT16_MAX || cols > UINT16_MAX) {
+    return NULL;
+  }
+  Canvas *canvas = canvas_new(rows, cols);
+  uint32_t crc = 0;
+  for (uint32_t y = 0; y < rows; y++) {
+    if (fread(canvas->rows[y], cols, 1, f) != 1) {
+      canvas_free(canvas);
+      return NULL;
+    }
+    crc = crc32(crc, canvas->rows[y], cols);
+  }
+  if (crc != read_u32(header + 24)) {
+    canvas_free(canvas);
+    return NULL;
+  }
+  *version = read_u64(header + 8);
+  return canvas;
+}
+
+/* Load the checkpoint at path.
+ *
+ * Returns: the canvas, to be freed with canvas_free, or NULL if there is none
+ * (errno is ENOENT) or it can't be read or is damaged
+ */
+Canvas *checkpoint_read(const char *path, uint64_t *version) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return NULL;
+  }
+  Canvas *canvas = read_checkpoint(f, version);
+  fclose(f);
+  if (canvas == NULL) {
+    errno = EINVAL;
+  }
+  return canvas;
+}
@@ -0,0 +1,35 @@
+#ifndef wal_h
+#define wal_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "canvas.h"
+#include "proto.h"
+
+/* Write-ahead log of the ops applied to a canvas, synced in groups
+ */
+typedef struct {
+  int fd;
+  Frame_buf pending;      // records appended but not yet written to the file
+  size_t size;            // bytes in the log, written or not
+  int sync_ms;            // longest an op waits to be synced
+  int sync_ops;           // most ops waiting to be synced
+  int unsynced;           // ops appended since the last sync
+  int64_t unsynced_since; // when wal_commit first saw them waiting
+  long syncs;             // syncs done
+} Wal;
+
+Wal *wal_open(const char *path, int sync_ms, int sync_ops);
+long wal_recover(Wal *wal, uint64_t after, Canvas *canvas, uint64_t *version);
+void wal_append(Wal *wal, uint64_t version, const Op *op);
+bool wal_commit(Wal *wal, int64_t now_ms);
+int wal_sync(Wal *wal);
+int wal_truncate(Wal *wal);
+void wal_close(Wal *wal);
+
+int checkpoint_write(const char *path, Canvas *canvas, uint64_t version);
+Canvas *checkpoint_read(const char *path, uint64_t *version);
+
+#endif
@@ -0,0 +1,183 @@
+/* Benchmark of the write-ahead log: what durability costs and how fast a
+ * canvas comes back
+ *
+ * Throughput: random cells are applied to a canvas in batches of BATCH, the
+ * way a server worker applies a read's edits, for a second each:
+ *
+ * - no log: only applied
+ * - sync each: logged and synced after every op
+ * - group: logged with group commit, synced every 10 ms or 4096 ops
+ *
+ * and each prints its ops per second and syncs.
+ *
+ * Recovery: a 1000x1000 canvas is brought back from
+ *
+ * - text: the canvas saved as text (canvas_fprint), with no ops after it
+ * - checkpoint: a checkpoint, with no ops after it
+ * - ckpt + log: a checkpoint and a log tail of LOG_TAIL ops
+ * - log only: a log of every op since a blank canvas (LOG_ALL ops)
+ *
+ * Files are written to the directory given as the first argument (default the
+ * current one), since syncs on a tmpfs cost nothing.
+ *
+ * Run with `make .run-wal_bench.c`, or `make bench` for all benchmarks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "canvas.h"
+#include "proto.h"
+#include "wal.h"
+
+#define CANVAS_SZ 1000
+#define BATCH 64
+#define LOG_TAIL 100000
+#define LOG_ALL 1000000
+
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static char wal_path[4096], ckpt_path[4096], text_path[4096];
+
+static Op random_cell() {
+  return (Op){.type = OP_CELL,
+              .y = rand() % CANVAS_SZ,
+              .x = rand() % CANVAS_SZ,
+              .h = 1,
+              .w = 1,
+              .ch = '!' + rand() % 90};
+}
+
+/* Apply and log batches of cells for a second.
+ *
+ * Returns: ops applied per second
+ */
+static double run_throughput(Canvas *canvas, Wal *wal) {
+  uint64_t version = 0;
+  const double start = now();
+  double t;
+  while ((t = now()) - start < 1.0) {
+    for (int i = 0; i < BATCH; i++) {
+      Op op = random_cell();
+      proto_apply_op(canvas, &op);
+      if (wal != NULL) {
+        wal_append(wal, ++version, &op);
+      }
+    }
+    if (wal != NULL) {
+      wal_commit(wal, t * 1000);
+    } else {
+      version += BATCH;
+    }
+  }
+  return version / (now() - start);
+}
+
+static void throughput() {
+  const char *names[] = {"no log", "sync each", "group"};
+  const int sync_ops[] = {0, 1, 4096};
+  Canvas *canvas = canvas_new(CANVAS_SZ, CANVAS_SZ);
+  printf("%-12s %12s %10s\n", "throughput", "ops/s", "syncs");
+  for (int m = 0; m < 3; m++) {
+    unlink(wal_path);
+    Wal *wal = m == 0 ? NULL : wal_open(wal_path, 10, sync_ops[m]);
+    const double rate = run_throughput(canvas, wal);
+    printf("%-12s %12.0f %10ld\n", names[m], rate, wal ? wal->syncs : 0);
+    if (wal != NULL) {
+      wal_close(wal);
+    }
+  }
+  canvas_free(canvas);
+}
+
+/* Log n random cells applied to canvas, starting after version first.
+ */
+static void log_ops(Canvas *canvas, uint64_t first, int n) {
+  Wal *wal = wal_open(wal_path, 1000, n + 1);
+  for (int i = 1; i <= n; i++) {
+    Op op = random_cell();
+    proto_apply_op(canvas, &op);
+    wal_append(wal, first + i, &op);
+  }
+  wal_close(wal);
+}
+
+/* Recover a canvas from the checkpoint (if with_checkpoint) and the log.
+ *
+ * Returns: the seconds it took
+ */
+static double run_recovery(Canvas *expected, bool with_checkpoint) {
+  const double start = now();
+  uint64_t version = 0;
+  Canvas *canvas = with_checkpoint ? checkpoint_read(ckpt_path, &version)
+                                   : canvas_new(CANVAS_SZ, CANVAS_SZ);
+  Wal *wal = wal_open(wal_path, 1000, 1000);
+  wal_recover(wal, version, canvas, &version);
+  wal_close(wal);
+  const double seconds = now() - start;
+  if (!canvas_eq(canvas, expected)) {
+    printf("(recovered canvas differs)\n");
+  }
+  canvas_free(canvas);
+  return seconds;
+}
+
+static void recovery() {
+  srand(2);
+  Canvas *canvas = canvas_new(CANVAS_SZ, CANVAS_SZ);
+  for (int i = 0; i < CANVAS_SZ * CANVAS_SZ / 2; i++) {
+    Op op = random_cell();
+    proto_apply_op(canvas, &op);
+  }
+  printf("\n%-12s %12s %10s\n", "recovery", "ops", "ms");
+
+  FILE *f = fopen(text_path, "w");
+  canvas_fprint(f, canvas);
+  fclose(f);
+  double start = now();
+  f = fopen(text_path, "r");
+  Canvas *text = canvas_readf(f);
+  fclose(f);
+  printf("%-12s %12d %10.1f\n", "text", 0, (now() - start) * 1000);
+  if (!canvas_eq(canvas, text)) {
+    printf("(text canvas differs)\n");
+  }
+  canvas_free(text);
+
+  checkpoint_write(ckpt_path, canvas, 1);
+  unlink(wal_path);
+  printf("%-12s %12d %10.1f\n", "checkpoint", 0,
+         run_recovery(canvas, true) * 1000);
+
+  log_ops(canvas, 1, LOG_TAIL);
+  printf("%-12s %12d %10.1f\n", "ckpt + log", LOG_TAIL,
+         run_recovery(canvas, true) * 1000);
+
+  canvas_fill(canvas, ' ');
+  unlink(wal_path);
+  log_ops(canvas, 0, LOG_ALL);
+  printf("%-12s %12d %10.1f\n", "log only", LOG_ALL,
+         run_recovery(canvas, false) * 1000);
+  canvas_free(canvas);
+}
+
+int main(int argc, char const *argv[]) {
+  const char *dir = argc > 1 ? argv[1] : ".";
+  snprintf(wal_path, sizeof(wal_path), "%s/wal_bench.wal", dir);
+  snprintf(ckpt_path, sizeof(ckpt_path), "%s/wal_bench.ckpt", dir);
+  snprintf(text_path, sizeof(text_path), "%s/wal_bench.txt", dir);
+
+  throughput();
+  recovery();
+
+  unlink(wal_path);
+  unlink(ckpt_path);
+  unlink(text_path);
+  return 0;
+}
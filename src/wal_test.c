@@ -0,0 +1,244 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "canvas.h"
+#include "lib/minunit.h"
+#include "proto.h"
+#include "wal.h"
+
+static char wal_path[] = "/tmp/collascii_wal_test.wal";
+static char ckpt_path[] = "/tmp/collascii_wal_test.ckpt";
+static Wal *wal;
+static Canvas *canvas;
+
+void test_setup(void) {
+  unlink(wal_path);
+  wal = wal_open(wal_path, 1000, 1000);
+  canvas = canvas_new_blank(20, 30);
+}
+
+void test_teardown(void) {
+  if (wal != NULL) {
+    wal_close(wal);
+  }
+  unlink(wal_path);
+  unlink(ckpt_path);
+  canvas_free(canvas);
+}
+
+/* Apply a few ops of each type to canvas and log them as versions
+ * first..first+3.
+ */
+static void apply_ops(uint64_t first) {
+  static const char data[] = "abcdef";
+  Op ops[] = {
+      {.type = OP_CELL, .y = 1, .x = 2, .ch = 'x'},
+      {.type = OP_SPAN, .y = 3, .x = 4, .h = 1, .w = 6, .data = data,
+       .stride = 6},
+      {.type = OP_RECT, .y = 5, .x = 5, .h = 3, .w = 4, .ch = '#'},
+      {.type = OP_BLIT, .y = 10, .x = 20, .h = 2, .w = 3, .data = data,
+       .stride = 3},
+  };
+  for (int i = 0; i < 4; i++) {
+    if (ops[i].type == OP_CELL) {
+      ops[i].h = ops[i].w = 1;
+    }
+    ops[i].y += first % 7;
+    proto_apply_op(canvas, &ops[i]);
+    wal_append(wal, first + i, &ops[i]);
+  }
+}
+
+/* Open the log again, like after a restart, and replay it onto a blank canvas
+ * from version after.
+ */
+static Canvas *recover(uint64_t after, long *replayed, uint64_t *version) {
+  wal_close(wal);
+  wal = wal_open(wal_path, 1000, 1000);
+  Canvas *out = canvas_new_blank(20, 30);
+  *version = after;
+  *replayed = wal_recover(wal, after, out, version);
+  return out;
+}
+
+static long file_size(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+MU_TEST(test_wal_recover) {
+  apply_ops(1);
+  apply_ops(5);
+  long replayed;
+  uint64_t version;
+  Canvas *out = recover(0, &replayed, &version);
+  mu_assert_int_eq(8, replayed);
+  mu_assert_int_eq(8, version);
+  mu_check(canvas_eq(canvas, out));
+  canvas_free(out);
+
+  // and again, with the log just replayed left alone
+  out = recover(0, &replayed, &version);
+  mu_assert_int_eq(8, replayed);
+  mu_check(canvas_eq(canvas, out));
+  canvas_free(out);
+}
+
+MU_TEST(test_wal_recover_after_checkpoint) {
+  apply_ops(1);
+  mu_assert_int_eq(0, checkpoint_write(ckpt_path, canvas, 4));
+  apply_ops(5);
+
+  uint64_t version = 0;
+  Canvas *out = checkpoint_read(ckpt_path, &version);
+  mu_check(out != NULL);
+  mu_assert_int_eq(4, version);
+  wal_close(wal);
+  wal = wal_open(wal_path, 1000, 1000);
+  // the ops the checkpoint already has aren't replayed
+  mu_assert_int_eq(4, wal_recover(wal, version, out, &version));
+  mu_assert_int_eq(8, version);
+  mu_check(canvas_eq(canvas, out));
+  canvas_free(out);
+}
+
+MU_TEST(test_wal_torn_tail) {
+  apply_ops(1);
+  wal_sync(wal);
+  const long whole = file_size(wal_path);
+  Canvas *before = canvas_cpy(canvas);
+  apply_ops(5);
+  wal_sync(wal);
+  // lose the end of the last record
+  mu_assert_int_eq(0, truncate(wal_path, file_size(wal_path) - 3));
+
+  long replayed;
+  uint64_t version;
+  Canvas *out = recover(0, &replayed, &version);
+  // the half-written record and everything after it are dropped
+  mu_assert_int_eq(7, replayed);
+  mu_assert_int_eq(7, version);
+  canvas_free(out);
+
+  // a damaged record is treated the same
+  wal_truncate(wal);
+  canvas_free(canvas);
+  canvas = canvas_new_blank(20, 30);
+  apply_ops(1);
+  apply_ops(5);
+  wal_sync(wal);
+  FILE *f = fopen(wal_path, "r+");
+  fseek(f, whole + 20, SEEK_SET);
+  fputc('!', f);
+  fclose(f);
+  out = recover(0, &replayed, &version);
+  mu_assert_int_eq(4, replayed);
+  mu_check(canvas_eq(before, out));
+  mu_assert_int_eq(whole, file_size(wal_path));
+  canvas_free(out);
+
+  // ops logged after recovering aren't lost behind the damage
+  apply_ops(9);
+  out = recover(0, &replayed, &version);
+  mu_assert_int_eq(8, replayed);
+  mu_assert_int_eq(12, version);
+  canvas_free(out);
+  canvas_free(before);
+}
+
+MU_TEST(test_wal_short_write) {
+  apply_ops(1);
+  mu_assert_int_eq(0, wal_sync(wal));
+  const long whole = file_size(wal_path);
+
+  // the next write only gets partway, like on a disk that's filling up
+  struct rlimit old, lim;
+  getrlimit(RLIMIT_FSIZE, &old);
+  lim = old;
+  lim.rlim_cur = whole + 10;
+  signal(SIGXFSZ, SIG_IGN);
+  mu_assert_int_eq(0, setrlimit(RLIMIT_FSIZE, &lim));
+  apply_ops(5);
+  mu_assert_int_eq(-1, wal_sync(wal));
+  setrlimit(RLIMIT_FSIZE, &old);
+  // what did get written is cut off again
+  mu_assert_int_eq(whole, file_size(wal_path));
+
+  // so the retry, and everything after it, is recovered
+  mu_assert_int_eq(0, wal_sync(wal));
+  apply_ops(9);
+  mu_assert_int_eq(0, wal_sync(wal));
+  long replayed;
+  uint64_t version;
+  Canvas *out = recover(0, &replayed, &version);
+  mu_assert_int_eq(12, replayed);
+  mu_assert_int_eq(12, version);
+  mu_check(canvas_eq(canvas, out));
+  canvas_free(out);
+}
+
+MU_TEST(test_wal_group_commit) {
+  wal_close(wal);
+  wal = wal_open(wal_path, 10, 6);
+  apply_ops(1);
+  // nothing is written until a sync
+  mu_assert_int_eq(0, wal->syncs);
+  mu_assert_int_eq(0, file_size(wal_path));
+
+  // ops wait sync_ms from the first commit that sees them
+  mu_check(wal_commit(wal, 100));
+  mu_check(wal_commit(wal, 109));
+  mu_check(!wal_commit(wal, 110));
+  mu_assert_int_eq(1, wal->syncs);
+  mu_assert_int_eq(wal->size, file_size(wal_path));
+  mu_check(!wal_commit(wal, 200));
+  mu_assert_int_eq(1, wal->syncs);
+
+  // or until sync_ops are waiting
+  apply_ops(5);
+  apply_ops(9);
+  mu_assert_int_eq(2, wal->syncs);
+  mu_assert_int_eq(2, wal->unsynced);
+}
+
+MU_TEST(test_checkpoint) {
+  apply_ops(1);
+  mu_assert_int_eq(0, checkpoint_write(ckpt_path, canvas, 1234567890123ULL));
+  uint64_t version = 0;
+  Canvas *out = checkpoint_read(ckpt_path, &version);
+  mu_check(out != NULL);
+  mu_check(version == 1234567890123ULL);
+  mu_check(canvas_eq(canvas, out));
+  canvas_free(out);
+
+  // damaged cells are caught
+  FILE *f = fopen(ckpt_path, "r+");
+  fseek(f, 100, SEEK_SET);
+  fputc('!', f);
+  fclose(f);
+  mu_check(checkpoint_read(ckpt_path, &version) == NULL);
+
+  unlink(ckpt_path);
+  mu_check(checkpoint_read(ckpt_path, &version) == NULL);
+}
+
+MU_TEST_SUITE(wal_main) {
+  MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+  MU_RUN_TEST(test_wal_recover);
+  MU_RUN_TEST(test_wal_recover_after_checkpoint);
+  MU_RUN_TEST(test_wal_torn_tail);
+  MU_RUN_TEST(test_wal_short_write);
+  MU_RUN_TEST(test_wal_group_commit);
+  MU_RUN_TEST(test_checkpoint);
+}
+
+int main(int argc, char const *argv[]) {
+  MU_RUN_SUITE(wal_main);
+  MU_REPORT();
+  return minunit_status;
+}